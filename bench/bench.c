@@ -0,0 +1,1234 @@
+
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <png.h>
+#include <SDL2/SDL.h>
+
+#include "../src/include/main.h"
+#include "../src/include/util.h"
+#include "../src/include/image.h"
+#include "../src/include/convert.h"
+#include "../src/include/fastpng.h"
+#include "../src/include/source.h"
+#include "../src/include/diskcache.h"
+#include "../src/include/tiles.h"
+#include "../src/include/view.h"
+#include "../src/include/drawing.h"
+#include "../src/include/strokes.h"
+
+/* Default number of measured iterations of each benchmark, after a warm-up
+ * iteration that is not measured. */
+#define BENCH_ITERATIONS 20
+
+/* Benchmarks stop early, with at least BENCH_MIN_ITERATIONS samples, once they
+ * have run for this many seconds. Keeps the slow cases (e.g. drawing a million
+ * points with the software renderer) from taking minutes. */
+#define BENCH_TIME_LIMIT     5.0
+#define BENCH_MIN_ITERATIONS 3
+
+/* Default width and height of the generated PNG images */
+#define BENCH_IMAGE_SIZE 1024
+
+/* Width and height of the images decoded by the pipeline of `fastpng', about
+ * 56 megapixels */
+#define BENCH_LARGE_SIZE 7500
+
+/* Size of the reads of the stdio input benchmarks, like the ones of libpng
+ * for the image data when using `png_init_io' */
+#define BENCH_STDIO_READ_SIZE 8192
+
+/* Size of the image uploaded to textures; a few tiles of TILE_SIZE */
+#define BENCH_TEXTURE_W 4096
+#define BENCH_TEXTURE_H 2048
+
+/* Size of the window used by the render benchmarks */
+#define BENCH_WINDOW_W 1280
+#define BENCH_WINDOW_H 720
+
+/* Number of points received by `drawing_push' in its benchmark, and number of
+ * points of each line in all the generated drawings. */
+#define BENCH_PUSH_POINTS (1000 * 1000)
+#define BENCH_LINE_POINTS 250
+
+#define BENCH_MAX_RESULTS 64
+
+/* Sizes of the images generated by the check, besides the one of `-s'. Odd
+ * and small widths leave a few bytes after the last vector of each row. */
+static const int g_check_sizes[] = { 1, 2, 3, 5, 7, 16, 17, 31, 33, 100 };
+
+/* Size of the big images generated by the check. Bigger than
+ * FASTPNG_PIPELINE_PIXELS, so they are decoded by the pipeline. */
+#define BENCH_CHECK_LARGE_SIZE 3000
+
+/* Number of threads of the pipeline used by the check. With 1, the image is
+ * decoded in the calling thread; with 2, the unfiltering thread also converts
+ * the rows; with more, the rest convert them; and with 0, there is one for
+ * each processor. */
+static const int g_check_threads[] = { 1, 2, 3, 4, 0 };
+
+SDL_Window* g_window     = NULL;
+SDL_Renderer* g_renderer = NULL;
+int g_draw_calls         = 0;
+
+/* Summary of the samples of a benchmark. Times are in milliseconds. */
+typedef struct BenchResult {
+    const char* name;
+    char param[32];
+    int iterations;
+    double median, p90, p99, min, max;
+
+    /* Number of `unit's processed per second in the median iteration */
+    double throughput;
+    const char* unit;
+} BenchResult;
+
+typedef struct BenchCase {
+    const char* name;
+    int color_type;
+    int bit_depth;
+    bool trns;
+    bool interlaced;
+} BenchCase;
+
+/* Generated images; one for each of the transformations applied by
+ * `image_read_file'. */
+static const BenchCase g_cases[] = {
+    { "palette8", PNG_COLOR_TYPE_PALETTE, 8, false, false },
+    { "palette4", PNG_COLOR_TYPE_PALETTE, 4, false, false },
+    { "palette8-trns", PNG_COLOR_TYPE_PALETTE, 8, true, false },
+    { "gray1", PNG_COLOR_TYPE_GRAY, 1, false, false },
+    { "gray2", PNG_COLOR_TYPE_GRAY, 2, false, false },
+    { "gray4", PNG_COLOR_TYPE_GRAY, 4, false, false },
+    { "gray8", PNG_COLOR_TYPE_GRAY, 8, false, false },
+    { "gray8-trns", PNG_COLOR_TYPE_GRAY, 8, true, false },
+    { "gray16", PNG_COLOR_TYPE_GRAY, 16, false, false },
+    { "gray-alpha8", PNG_COLOR_TYPE_GRAY_ALPHA, 8, false, false },
+    { "rgb8", PNG_COLOR_TYPE_RGB, 8, false, false },
+    { "rgb8-trns", PNG_COLOR_TYPE_RGB, 8, true, false },
+    { "rgb16", PNG_COLOR_TYPE_RGB, 16, false, false },
+    { "rgba8", PNG_COLOR_TYPE_RGBA, 8, false, false },
+    { "rgba16", PNG_COLOR_TYPE_RGBA, 16, false, false },
+    { "rgba8-interlaced", PNG_COLOR_TYPE_RGBA, 8, false, true },
+};
+
+/* Number of points of the drawings rendered by the render benchmarks */
+static const int g_render_points[] = { 1000, 10000, 100000, 1000000 };
+
+static BenchResult g_results[BENCH_MAX_RESULTS];
+static int g_result_count = 0;
+
+static int g_iterations = BENCH_ITERATIONS;
+
+/* State of the pseudo-random generator, so all runs use the same data */
+static uint32_t g_random = 0x12345678;
+
+/*----------------------------------------------------------------------------*/
+
+static uint32_t random_next(void) {
+    /* Xorshift32 */
+    g_random ^= g_random << 13;
+    g_random ^= g_random >> 17;
+    g_random ^= g_random << 5;
+    return g_random;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    const double x = *(const double*)a;
+    const double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/* Get the percentile P of COUNT sorted samples, with the nearest-rank
+ * method. */
+static double percentile(const double* sorted, int count, double p) {
+    int rank = (int)ceil(p / 100.0 * count);
+    if (rank < 1)
+        rank = 1;
+    return sorted[rank - 1];
+}
+
+/* Run FUNC with ARG once for warming up, and then up to `g_iterations' more
+ * times, measuring each of them. AMOUNT is the number of `unit's processed by
+ * each call, for the throughput. */
+static void bench_run(const char* name, const char* param,
+                      void (*func)(void*), void* arg, double amount,
+                      const char* unit) {
+    if (g_result_count >= BENCH_MAX_RESULTS)
+        DIE("Too many benchmarks.");
+
+    fprintf(stderr, "%s %s...\n", name, param);
+
+    func(arg);
+
+    double* samples = malloc(g_iterations * sizeof(double));
+    if (samples == NULL)
+        DIE("Failed to allocate the samples.");
+
+    const double start = util_wall_time();
+    int count          = 0;
+    while (count < g_iterations) {
+        const double before = util_wall_time();
+        func(arg);
+        const double after = util_wall_time();
+
+        samples[count++] = (after - before) * 1000.0;
+        if (count >= BENCH_MIN_ITERATIONS &&
+            after - start > BENCH_TIME_LIMIT)
+            break;
+    }
+
+    qsort(samples, count, sizeof(double), compare_doubles);
+
+    BenchResult* result = &g_results[g_result_count++];
+    result->name        = name;
+    snprintf(result->param, sizeof(result->param), "%s", param);
+    result->iterations = count;
+    result->median     = percentile(samples, count, 50.0);
+    result->p90        = percentile(samples, count, 90.0);
+    result->p99        = percentile(samples, count, 99.0);
+    result->min        = samples[0];
+    result->max        = samples[count - 1];
+    result->throughput = amount / (result->median / 1000.0);
+    result->unit       = unit;
+
+    free(samples);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Write a PNG image for a BenchCase, with a mix of gradients and noise so the
+ * rows use different filters. Returns false on error. */
+static bool write_case(const char* filename, const BenchCase* bench_case,
+                       int size) {
+    /* Samples per pixel of each color type */
+    static const int channels[] = {
+        [PNG_COLOR_TYPE_GRAY]       = 1,
+        [PNG_COLOR_TYPE_RGB]        = 3,
+        [PNG_COLOR_TYPE_PALETTE]    = 1,
+        [PNG_COLOR_TYPE_GRAY_ALPHA] = 2,
+        [PNG_COLOR_TYPE_RGB_ALPHA]  = 4,
+    };
+
+    const size_t row_bits =
+      (size_t)size * channels[bench_case->color_type] * bench_case->bit_depth;
+    const size_t row_bytes = (row_bits + 7) / 8;
+    png_bytep row = malloc(row_bytes);
+    if (row == NULL)
+        return false;
+
+    FILE* fp = fopen(filename, "wb");
+    if (fp == NULL) {
+        free(row);
+        return false;
+    }
+
+    png_structp png =
+      png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = png_create_info_struct(png);
+
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_write_struct(&png, &info);
+        free(row);
+        fclose(fp);
+        return false;
+    }
+
+    png_init_io(png, fp);
+    png_set_IHDR(png, info, size, size, bench_case->bit_depth,
+                 bench_case->color_type,
+                 bench_case->interlaced ? PNG_INTERLACE_ADAM7
+                                        : PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+
+    if (bench_case->color_type == PNG_COLOR_TYPE_PALETTE) {
+        const int entries = 1 << bench_case->bit_depth;
+        png_color palette[256];
+        png_byte alpha[256];
+        for (int i = 0; i < entries; i++) {
+            palette[i].red   = i * 255 / (entries - 1);
+            palette[i].green = 255 - palette[i].red;
+            palette[i].blue  = (i * 37) & 0xFF;
+            alpha[i]         = (i % 4 == 0) ? 0 : 255 - i / 2;
+        }
+
+        png_set_PLTE(png, info, palette, entries);
+        if (bench_case->trns)
+            png_set_tRNS(png, info, alpha, entries, NULL);
+    } else if (bench_case->trns) {
+        png_color_16 color = { 0 };
+        color.gray         = 0x10;
+        color.red          = 0x10;
+        color.green        = 0x20;
+        color.blue         = 0x30;
+        png_set_tRNS(png, info, NULL, 0, &color);
+    }
+
+    png_write_info(png, info);
+
+    const int passes = png_set_interlace_handling(png);
+    for (int pass = 0; pass < passes; pass++) {
+        for (int y = 0; y < size; y++) {
+            for (size_t x = 0; x < row_bytes; x++)
+                row[x] = ((x + y) >> 2) + (random_next() & 7);
+            png_write_row(png, row);
+        }
+    }
+
+    png_write_end(png, NULL);
+    png_destroy_write_struct(&png, &info);
+    free(row);
+
+    return fclose(fp) == 0;
+}
+
+static void bench_decode(void* arg) {
+    Image* image = image_read_file(arg);
+    if (image == NULL)
+        DIE("Failed to decode \"%s\".", (const char*)arg);
+    image_free(image);
+}
+
+/* Decode each of the generated images with `image_read_file', using
+ * `fastpng_decode' and `convert_row' when possible, and only with libpng and
+ * its transformations */
+static void run_decode(const char* dir, int size) {
+    const int count = sizeof(g_cases) / sizeof(g_cases[0]);
+    for (int i = 0; i < count; i++) {
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s.png", dir, g_cases[i].name);
+        if (!write_case(path, &g_cases[i], size))
+            DIE("Failed to write \"%s\".", path);
+
+        bench_run("decode", g_cases[i].name, bench_decode, path,
+                  (double)size * size / 1e6, "Mpx/s");
+
+        g_image_convert = false;
+        g_image_fastpng = false;
+        bench_run("decode-libpng", g_cases[i].name, bench_decode, path,
+                  (double)size * size / 1e6, "Mpx/s");
+        g_image_convert = true;
+        g_image_fastpng = true;
+
+        unlink(path);
+    }
+}
+
+/* Decode big RGB and RGBA images with the pipeline of `fastpng', and only in
+ * the calling thread */
+static void run_decode_large(const char* dir) {
+    static const BenchCase large_cases[] = {
+        { "rgb8", PNG_COLOR_TYPE_RGB, 8, false, false },
+        { "rgba8", PNG_COLOR_TYPE_RGBA, 8, false, false },
+    };
+
+    const int count = sizeof(large_cases) / sizeof(large_cases[0]);
+    const double megapixels =
+      (double)BENCH_LARGE_SIZE * BENCH_LARGE_SIZE / 1e6;
+
+    for (int i = 0; i < count; i++) {
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/large-%s.png", dir,
+                 large_cases[i].name);
+        if (!write_case(path, &large_cases[i], BENCH_LARGE_SIZE))
+            DIE("Failed to write \"%s\".", path);
+
+        bench_run("decode-large", large_cases[i].name, bench_decode, path,
+                  megapixels, "Mpx/s");
+
+        g_fastpng_threads = 1;
+        bench_run("decode-large-serial", large_cases[i].name, bench_decode,
+                  path, megapixels, "Mpx/s");
+        g_fastpng_threads = 0;
+
+        unlink(path);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* File read by the input benchmarks, also kept in memory for writing it into
+ * a pipe */
+typedef struct InputArgs {
+    const char* path;
+    const uint8_t* data;
+    size_t size;
+} InputArgs;
+
+/* Thread writing the file into a pipe, like `maim | hl-png -' */
+typedef struct PipeWriter {
+    const InputArgs* args;
+    pthread_t thread;
+    int fd;
+} PipeWriter;
+
+/* Prevents the compiler from removing the reads of the benchmarks */
+static volatile uint32_t g_input_sink;
+
+static void* pipe_writer_thread(void* arg) {
+    PipeWriter* writer = arg;
+
+    size_t pos = 0;
+    while (pos < writer->args->size) {
+        const ssize_t written = write(writer->fd, &writer->args->data[pos],
+                                      writer->args->size - pos);
+        if (written <= 0)
+            break;
+        pos += written;
+    }
+
+    close(writer->fd);
+    return NULL;
+}
+
+/* Start writing the file into a pipe, and return the reading end. Has to be
+ * closed after `pipe_writer_join'. */
+static int pipe_writer_start(PipeWriter* writer, const InputArgs* args) {
+    int fds[2];
+    if (pipe(fds) != 0)
+        DIE("Failed to create a pipe.");
+
+    writer->args = args;
+    writer->fd   = fds[1];
+    if (pthread_create(&writer->thread, NULL, pipe_writer_thread, writer) != 0)
+        DIE("Failed to create the pipe writer thread.");
+
+    return fds[0];
+}
+
+static void pipe_writer_join(PipeWriter* writer) {
+    pthread_join(writer->thread, NULL);
+}
+
+static uint32_t sum_bytes(const uint8_t* data, size_t len) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i < len; i++)
+        sum += data[i];
+    return sum;
+}
+
+static void bench_read_stdio(void* arg) {
+    const InputArgs* args = arg;
+    FILE* fp              = fopen(args->path, "rb");
+    if (fp == NULL)
+        DIE("Failed to open \"%s\".", args->path);
+
+    uint8_t buf[BENCH_STDIO_READ_SIZE];
+    uint32_t sum = 0;
+    size_t len;
+    while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+        sum += sum_bytes(buf, len);
+
+    fclose(fp);
+    g_input_sink = sum;
+}
+
+/* Read all the bytes of a source, as the progressive loader does */
+static void read_source(Source* source) {
+    uint32_t sum = 0;
+    const uint8_t* data;
+    size_t len;
+    while ((len = source_next(source, SOURCE_READ_SIZE, &data)) > 0)
+        sum += sum_bytes(data, len);
+
+    g_input_sink = sum;
+}
+
+static void bench_read_mmap(void* arg) {
+    const InputArgs* args = arg;
+    Source* source        = source_open(args->path);
+    if (source == NULL)
+        DIE("Failed to open \"%s\".", args->path);
+
+    read_source(source);
+    source_close(source);
+}
+
+static void bench_read_pipe(void* arg) {
+    PipeWriter writer;
+    const int fd   = pipe_writer_start(&writer, arg);
+    Source* source = source_open_fd(fd);
+    if (source == NULL)
+        DIE("Failed to allocate the source.");
+
+    read_source(source);
+    source_close(source);
+    pipe_writer_join(&writer);
+    close(fd);
+}
+
+/* Decode the rows of a PNG with libpng, without transformations, reading it
+ * with stdio from FP if it's not NULL, or from SOURCE otherwise */
+static void decode_rows(FILE* fp, Source* source) {
+    png_structp png =
+      png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = png_create_info_struct(png);
+    if (png == NULL || info == NULL)
+        DIE("Failed to create the libpng structures.");
+
+    if (setjmp(png_jmpbuf(png)))
+        DIE("Failed to decode the input benchmark image.");
+
+    if (fp != NULL)
+        png_init_io(png, fp);
+    else
+        source_set_png(source, png);
+
+    png_read_info(png, info);
+
+    png_bytep row = malloc(png_get_rowbytes(png, info));
+    if (row == NULL)
+        DIE("Failed to allocate a row.");
+
+    const int h = png_get_image_height(png, info);
+    for (int y = 0; y < h; y++)
+        png_read_row(png, row, NULL);
+
+    free(row);
+    png_destroy_read_struct(&png, &info, NULL);
+}
+
+static void bench_decode_stdio(void* arg) {
+    const InputArgs* args = arg;
+    FILE* fp              = fopen(args->path, "rb");
+    if (fp == NULL)
+        DIE("Failed to open \"%s\".", args->path);
+
+    decode_rows(fp, NULL);
+    fclose(fp);
+}
+
+static void bench_decode_mmap(void* arg) {
+    const InputArgs* args = arg;
+    Source* source        = source_open(args->path);
+    if (source == NULL)
+        DIE("Failed to open \"%s\".", args->path);
+
+    decode_rows(NULL, source);
+    source_close(source);
+}
+
+static void bench_decode_pipe(void* arg) {
+    PipeWriter writer;
+    const int fd   = pipe_writer_start(&writer, arg);
+    Source* source = source_open_fd(fd);
+    if (source == NULL)
+        DIE("Failed to allocate the source.");
+
+    decode_rows(NULL, source);
+
+    /* Consume the bytes after the last row, so the writer doesn't get
+     * SIGPIPE */
+    read_source(source);
+
+    source_close(source);
+    pipe_writer_join(&writer);
+    close(fd);
+}
+
+/* Read a big PNG file with stdio, like libpng does with `png_init_io', mapped
+ * in memory, and from a pipe, both with `Source'. Only the input is measured,
+ * and then the whole decoding with libpng. */
+static void run_input(const char* dir) {
+    static const BenchCase input_case = {
+        "rgb8", PNG_COLOR_TYPE_RGB, 8, false, false,
+    };
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/input.png", dir);
+    if (!write_case(path, &input_case, BENCH_LARGE_SIZE))
+        DIE("Failed to write \"%s\".", path);
+
+    /* The file is already in the page cache after writing it, so the
+     * benchmarks measure the cost of the system calls and copies */
+    Source* source = source_open(path);
+    size_t size;
+    const uint8_t* data = source ? source_contents(source, &size) : NULL;
+    if (data == NULL)
+        DIE("Failed to read \"%s\".", path);
+
+    InputArgs args = { path, data, size };
+    const double megabytes = size / 1e6;
+
+    bench_run("input-read", "stdio", bench_read_stdio, &args, megabytes,
+              "MB/s");
+    bench_run("input-read", "mmap", bench_read_mmap, &args, megabytes,
+              "MB/s");
+    bench_run("input-read", "pipe", bench_read_pipe, &args, megabytes,
+              "MB/s");
+
+    bench_run("input-decode", "stdio", bench_decode_stdio, &args, megabytes,
+              "MB/s");
+    bench_run("input-decode", "mmap", bench_decode_mmap, &args, megabytes,
+              "MB/s");
+    bench_run("input-decode", "pipe", bench_decode_pipe, &args, megabytes,
+              "MB/s");
+
+    source_close(source);
+    unlink(path);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Open an image from the disk cache, and read all of its pixels, as the
+ * upload of the textures does */
+static void bench_diskcache_load(void* arg) {
+    DiskCacheKey key;
+    if (!diskcache_key(arg, &key))
+        DIE("Failed to read the key of \"%s\".", (const char*)arg);
+
+    Image* image = diskcache_load(arg, &key);
+    if (image == NULL)
+        DIE("The image is not in the disk cache: %s", (const char*)arg);
+
+    g_input_sink = sum_bytes(image->data, (size_t)image->h * image->byte_pitch);
+    image_free(image);
+}
+
+/* Remove the files of the disk cache of the benchmarks, and its
+ * directories */
+static void remove_cache_dir(const char* cache_home) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/hl-png", cache_home);
+
+    DIR* dp = opendir(path);
+    if (dp != NULL) {
+        struct dirent* ent;
+        while ((ent = readdir(dp)) != NULL)
+            if (ent->d_name[0] != '.')
+                unlinkat(dirfd(dp), ent->d_name, 0);
+        closedir(dp);
+    }
+
+    rmdir(path);
+    rmdir(cache_home);
+}
+
+/* Open a big image from the disk cache, compared with decoding it. Opening it
+ * includes hashing the PNG file, for checking that it didn't change. */
+static void run_diskcache(const char* dir) {
+    static const BenchCase cache_case = {
+        "rgb8", PNG_COLOR_TYPE_RGB, 8, false, false,
+    };
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/cached.png", dir);
+    if (!write_case(path, &cache_case, BENCH_LARGE_SIZE))
+        DIE("Failed to write \"%s\".", path);
+
+    /* Use a cache inside of the temporary directory, big enough for the
+     * image */
+    char cache_home[1024];
+    snprintf(cache_home, sizeof(cache_home), "%s/cache", dir);
+    setenv("XDG_CACHE_HOME", cache_home, 1);
+
+    const size_t bytes = (size_t)BENCH_LARGE_SIZE * BENCH_LARGE_SIZE * 4;
+    if (!diskcache_init(2 * bytes))
+        DIE("Failed to create the disk cache in \"%s\".", cache_home);
+
+    DiskCacheKey key;
+    Image* image = image_read_file(path);
+    if (image == NULL || !diskcache_key(path, &key))
+        DIE("Failed to decode \"%s\".", path);
+    diskcache_store(path, &key, image);
+    image_free(image);
+
+    const double megapixels =
+      (double)BENCH_LARGE_SIZE * BENCH_LARGE_SIZE / 1e6;
+    bench_run("diskcache-open", "decode", bench_decode, path, megapixels,
+              "Mpx/s");
+    bench_run("diskcache-open", "cached", bench_diskcache_load, path,
+              megapixels, "Mpx/s");
+
+    remove_cache_dir(cache_home);
+    unlink(path);
+}
+
+/*----------------------------------------------------------------------------*/
+
+typedef struct SwizzleArgs {
+    const uint8_t* src;
+    uint8_t* dst;
+} SwizzleArgs;
+
+static void bench_swizzle(void* arg) {
+    const SwizzleArgs* args = arg;
+    for (int y = 0; y < BENCH_TEXTURE_H; y++)
+        convert_swap_rb(&args->src[(size_t)y * BENCH_TEXTURE_W * 4],
+                        &args->dst[(size_t)y * BENCH_TEXTURE_W * 4],
+                        BENCH_TEXTURE_W);
+}
+
+static void bench_swizzle_sdl(void* arg) {
+    const SwizzleArgs* args = arg;
+    SDL_ConvertPixels(BENCH_TEXTURE_W, BENCH_TEXTURE_H, SDL_PIXELFORMAT_RGBA32,
+                      args->src, BENCH_TEXTURE_W * 4, SDL_PIXELFORMAT_BGRA32,
+                      args->dst, BENCH_TEXTURE_W * 4);
+}
+
+/* Convert the RGBA pixels of an image into BGRA, the format used when the
+ * renderer doesn't support RGBA textures (see `tiles_new'), with
+ * `convert_swap_rb' and with the conversion of SDL */
+static void run_swizzle(void) {
+    const size_t bytes = (size_t)BENCH_TEXTURE_W * BENCH_TEXTURE_H * 4;
+
+    uint8_t* src = malloc(bytes);
+    uint8_t* dst = malloc(bytes);
+    if (src == NULL || dst == NULL)
+        DIE("Failed to allocate the swizzled images.");
+
+    for (size_t i = 0; i < bytes; i++)
+        src[i] = random_next();
+
+    SwizzleArgs args = { src, dst };
+    bench_run("swizzle", "convert", bench_swizzle, &args, bytes / 1e6,
+              "MB/s");
+    bench_run("swizzle", "SDL_ConvertPixels", bench_swizzle_sdl, &args,
+              bytes / 1e6, "MB/s");
+
+    free(src);
+    free(dst);
+}
+
+/*----------------------------------------------------------------------------*/
+
+static void bench_upload(void* arg) {
+    TiledImage* tiled = tiles_new(arg);
+    if (!tiles_upload_all(tiled))
+        DIE("Failed to upload the tiles: %s", SDL_GetError());
+    tiles_free(tiled);
+}
+
+/* Create and fill the textures of all the tiles of an image */
+static void run_upload(void) {
+    Image image = {
+        .w          = BENCH_TEXTURE_W,
+        .h          = BENCH_TEXTURE_H,
+        .color_type = PNG_COLOR_TYPE_RGBA,
+        .bit_depth  = 8,
+        .byte_pitch = BENCH_TEXTURE_W * 4,
+    };
+
+    const size_t bytes = (size_t)image.byte_pitch * image.h;
+    image.data         = malloc(bytes);
+    if (image.data == NULL)
+        DIE("Failed to allocate the texture image.");
+
+    uint8_t* data = image.data;
+    for (size_t i = 0; i < bytes; i++)
+        data[i] = random_next();
+
+    char param[32];
+    snprintf(param, sizeof(param), "%dx%d", image.w, image.h);
+    bench_run("upload", param, bench_upload, &image, bytes / 1e6, "MB/s");
+
+    free(image.data);
+}
+
+typedef struct FirstFrameArgs {
+    const char* path;
+    bool threaded;
+} FirstFrameArgs;
+
+/* Open an image like `main' does, until the first frame with the whole image
+ * has been uploaded and drawn. The image is either decoded before creating the
+ * window, or on another thread while the window is created and the decoded
+ * rows are uploaded. Needs the video subsystem of SDL, see `main'. */
+static void bench_first_frame(void* arg) {
+    const FirstFrameArgs* args = arg;
+
+    ImageLoader* loader = image_loader_new(args->path);
+    if (loader == NULL)
+        DIE("Failed to open \"%s\".", args->path);
+
+    while (loader->image == NULL && image_loader_step(loader))
+        ;
+
+    if (args->threaded) {
+        if (!image_loader_start_thread(loader))
+            DIE("Failed to start the decoding thread.");
+    } else {
+        while (image_loader_step(loader))
+            ;
+    }
+
+    SDL_Window* old_window     = g_window;
+    SDL_Renderer* old_renderer = g_renderer;
+
+    g_window = SDL_CreateWindow("hl-png-bench", SDL_WINDOWPOS_UNDEFINED,
+                                SDL_WINDOWPOS_UNDEFINED, BENCH_WINDOW_W,
+                                BENCH_WINDOW_H, SDL_WINDOW_HIDDEN);
+    if (g_window == NULL)
+        DIE("Error creating SDL window: %s", SDL_GetError());
+
+    g_renderer = SDL_CreateRenderer(g_window, -1, SDL_RENDERER_SOFTWARE);
+    if (g_renderer == NULL)
+        DIE("Error creating SDL renderer: %s", SDL_GetError());
+
+    TiledImage* tiled = tiles_new(loader->image);
+    if (tiled == NULL)
+        DIE("Failed to allocate the tiles.");
+    tiles_set_ready_rows(tiled, image_loader_ready_rows(loader));
+
+    /* Like the main loop, draw the new rows every millisecond, which uploads
+     * them while the rest are decoded */
+    const SDL_Rect dst = { 0, 0, BENCH_WINDOW_W, BENCH_WINDOW_H };
+    while (!image_loader_finished(loader)) {
+        if (tiles_set_ready_rows(tiled, image_loader_ready_rows(loader))) {
+            SDL_RenderClear(g_renderer);
+            tiles_render(tiled, &dst);
+            SDL_RenderPresent(g_renderer);
+        }
+        SDL_Delay(1);
+    }
+
+    if (!loader->done)
+        DIE("Failed to decode \"%s\".", args->path);
+
+    /* The whole image is uploaded, not only the part inside the window */
+    tiles_set_ready_rows(tiled, loader->image->h);
+    if (!tiles_upload_all(tiled))
+        DIE("Failed to upload the tiles.");
+
+    SDL_RenderClear(g_renderer);
+    tiles_render(tiled, &dst);
+    SDL_RenderPresent(g_renderer);
+
+    tiles_free(tiled);
+    SDL_DestroyRenderer(g_renderer);
+    SDL_DestroyWindow(g_window);
+    image_loader_free(loader);
+
+    g_window   = old_window;
+    g_renderer = old_renderer;
+}
+
+/* Measure the time until the first frame with the whole image, when decoding
+ * before creating the window and when doing both at the same time */
+static void run_first_frame(const char* dir, int size) {
+    static const BenchCase bench_case = { "rgba8", PNG_COLOR_TYPE_RGBA, 8,
+                                          false, false };
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/first-frame.png", dir);
+    if (!write_case(path, &bench_case, size))
+        DIE("Failed to write \"%s\".", path);
+
+    FirstFrameArgs args = { .path = path, .threaded = false };
+    bench_run("first-frame", "serial", bench_first_frame, &args,
+              (double)size * size / 1e6, "Mpx/s");
+
+    args.threaded = true;
+    bench_run("first-frame", "threaded", bench_first_frame, &args,
+              (double)size * size / 1e6, "Mpx/s");
+
+    unlink(path);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Push POINTS points to the drawing, in random walks of BENCH_LINE_POINTS
+ * points inside of the window. */
+static void push_lines(Drawing* drawing, int points) {
+    DrawingPoint point = { 0 };
+    for (int i = 0; i < points; i++) {
+        if (i % BENCH_LINE_POINTS == 0) {
+            if (i > 0)
+                drawing_end_line(drawing);
+
+            const uint32_t r = random_next();
+            point.x          = r % BENCH_WINDOW_W;
+            point.y          = (r >> 16) % BENCH_WINDOW_H;
+            point.col        = C(0xFF000080 | (r & 0x00FFFF00));
+            point.width      = (i / BENCH_LINE_POINTS % 2 == 0) ? 1 : 5;
+        } else {
+            const uint32_t r = random_next();
+            point.x += (int)(r % 13) - 6;
+            point.y += (int)((r >> 8) % 13) - 6;
+            if (point.x < 0 || point.x >= BENCH_WINDOW_W)
+                point.x = BENCH_WINDOW_W / 2;
+            if (point.y < 0 || point.y >= BENCH_WINDOW_H)
+                point.y = BENCH_WINDOW_H / 2;
+        }
+
+        drawing_push(drawing, point);
+    }
+
+    drawing_end_line(drawing);
+}
+
+static void bench_push(void* arg) {
+    (void)arg;
+
+    Drawing* drawing = drawing_new();
+    push_lines(drawing, BENCH_PUSH_POINTS);
+    drawing_free(drawing);
+}
+
+typedef struct RenderArgs {
+    StrokeCache* cache;
+    Drawing* drawing;
+    View view;
+} RenderArgs;
+
+/* Draw all the lines again, like after zooming or panning */
+static void bench_render_bake(void* arg) {
+    RenderArgs* args = arg;
+    strokes_invalidate(args->cache);
+    strokes_render(args->cache, args->drawing, &args->view);
+}
+
+/* Draw a frame without changes, which only copies the cached texture */
+static void bench_render_cached(void* arg) {
+    RenderArgs* args = arg;
+    strokes_render(args->cache, args->drawing, &args->view);
+}
+
+/* Measure the cost of rendering drawings of different sizes */
+static void run_render(void) {
+    RenderArgs args = {
+        .cache = strokes_new(),
+        .view  = {
+            .x    = BENCH_WINDOW_W / 2.0,
+            .y    = BENCH_WINDOW_H / 2.0,
+            .zoom = 1.0,
+        },
+    };
+
+    const int count = sizeof(g_render_points) / sizeof(g_render_points[0]);
+    for (int i = 0; i < count; i++) {
+        const int points = g_render_points[i];
+
+        /* Keep all the points, so the drawing has exactly that many */
+        args.drawing               = drawing_new();
+        args.drawing->tolerance    = 0.0;
+        args.drawing->min_distance = 0.0;
+        push_lines(args.drawing, points);
+
+        char param[32];
+        snprintf(param, sizeof(param), "%d", points);
+        bench_run("render-bake", param, bench_render_bake, &args,
+                  points / 1e6, "Mpoints/s");
+        bench_run("render-cached", param, bench_render_cached, &args,
+                  points / 1e6, "Mpoints/s");
+
+        drawing_free(args.drawing);
+    }
+
+    strokes_free(args.cache);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Compare the pixels of two images, printing the first row that differs.
+ * Returns true if they are identical. */
+static bool same_pixels(const char* path, const char* variant,
+                        const Image* image, Image* expected) {
+    if (image->w != expected->w || image->h != expected->h ||
+        image->color_type != expected->color_type ||
+        image->bit_depth != expected->bit_depth) {
+        printf("FAIL %s (%s): different layout\n", path, variant);
+        return false;
+    }
+
+    const size_t row_bytes =
+      (size_t)image->w * image_pixel_bits(expected) / 8;
+    for (int y = 0; y < image->h; y++) {
+        const uint8_t* row = (const uint8_t*)image->data +
+                             (size_t)y * image->byte_pitch;
+        const uint8_t* expected_row = (const uint8_t*)expected->data +
+                                      (size_t)y * expected->byte_pitch;
+        if (memcmp(row, expected_row, row_bytes) != 0) {
+            printf("FAIL %s (%s): row %d differs\n", path, variant, y);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Decode a file with each of the decoders, and compare them with libpng and
+ * its transformations: `convert_row', and `fastpng_decode' with the portable
+ * and the vectorized unfiltering, in the calling thread and with pipelines of
+ * several sizes. Returns false if any of them differs. */
+static bool check_file(const char* path) {
+    g_image_convert = false;
+    g_image_fastpng = false;
+    Image* expected = image_read_file(path);
+    g_image_convert = true;
+
+    if (expected == NULL) {
+        g_image_fastpng = true;
+        printf("FAIL %s: libpng can't decode it\n", path);
+        return false;
+    }
+
+    bool result = true;
+
+    /* Only with libpng and `convert_row' */
+    Image* image = image_read_file(path);
+    if (image == NULL || !same_pixels(path, "convert", image, expected))
+        result = false;
+    if (image != NULL)
+        image_free(image);
+    g_image_fastpng = true;
+
+    /* Images that are not supported are not compared again */
+    const int thread_counts =
+      sizeof(g_check_threads) / sizeof(g_check_threads[0]);
+    int decoded = 0;
+    for (int simd = 0; simd <= 1; simd++) {
+        for (int i = 0; i < thread_counts; i++) {
+            g_fastpng_simd    = simd;
+            g_fastpng_threads = g_check_threads[i];
+            image             = fastpng_read_file(path);
+            if (image == NULL)
+                continue;
+
+            char variant[64];
+            snprintf(variant, sizeof(variant), "fastpng, %s, %d threads",
+                     simd ? "simd" : "scalar", g_fastpng_threads);
+            if (!same_pixels(path, variant, image, expected))
+                result = false;
+
+            image_free(image);
+            decoded++;
+        }
+    }
+    g_fastpng_simd    = true;
+    g_fastpng_threads = 0;
+
+    if (result)
+        printf("ok   %s (%dx%d%s)\n", path, expected->w, expected->h,
+               (decoded > 0) ? ", fastpng" : "");
+
+    image_free(expected);
+    return result;
+}
+
+/* Check that the generated images of every color type, and the FILES, are
+ * decoded into the same pixels by every decoder. See `check_file'. Returns
+ * the number of images that differ. */
+static int run_check(const char* dir, int size, char** files, int count) {
+    int failed = 0;
+
+    const int case_count = sizeof(g_cases) / sizeof(g_cases[0]);
+    const int size_count = sizeof(g_check_sizes) / sizeof(g_check_sizes[0]);
+    for (int i = 0; i < case_count; i++) {
+        for (int j = 0; j <= size_count; j++) {
+            const int case_size = (j < size_count) ? g_check_sizes[j] : size;
+
+            char path[1024];
+            snprintf(path, sizeof(path), "%s/%s-%d.png", dir,
+                     g_cases[i].name, case_size);
+            if (!write_case(path, &g_cases[i], case_size))
+                DIE("Failed to write \"%s\".", path);
+
+            if (!check_file(path))
+                failed++;
+            unlink(path);
+        }
+    }
+
+    /* Only the layouts supported by `fastpng_decode' use the pipeline */
+    static const BenchCase large_cases[] = {
+        { "rgb8", PNG_COLOR_TYPE_RGB, 8, false, false },
+        { "rgb8-trns", PNG_COLOR_TYPE_RGB, 8, true, false },
+        { "rgba8", PNG_COLOR_TYPE_RGBA, 8, false, false },
+    };
+
+    const int large_count = sizeof(large_cases) / sizeof(large_cases[0]);
+    for (int i = 0; i < large_count; i++) {
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/large-%s.png", dir,
+                 large_cases[i].name);
+        if (!write_case(path, &large_cases[i], BENCH_CHECK_LARGE_SIZE))
+            DIE("Failed to write \"%s\".", path);
+
+        if (!check_file(path))
+            failed++;
+        unlink(path);
+    }
+
+    for (int i = 0; i < count; i++)
+        if (!check_file(files[i]))
+            failed++;
+
+    printf("%d images differ.\n", failed);
+    return failed;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static void print_json(FILE* fp, int size) {
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"iterations\": %d,\n", g_iterations);
+    fprintf(fp, "  \"image_size\": %d,\n", size);
+    fprintf(fp, "  \"video_driver\": \"%s\",\n",
+            g_window ? SDL_GetCurrentVideoDriver() : "");
+    fprintf(fp, "  \"results\": [\n");
+
+    for (int i = 0; i < g_result_count; i++) {
+        const BenchResult* r = &g_results[i];
+        fprintf(fp,
+                "    { \"name\": \"%s\", \"param\": \"%s\", "
+                "\"iterations\": %d, \"median_ms\": %.4f, \"p90_ms\": %.4f, "
+                "\"p99_ms\": %.4f, \"min_ms\": %.4f, \"max_ms\": %.4f, "
+                "\"throughput\": %.4f, \"unit\": \"%s\" }%s\n",
+                r->name, r->param, r->iterations, r->median, r->p90, r->p99,
+                r->min, r->max, r->throughput, r->unit,
+                (i + 1 < g_result_count) ? "," : "");
+    }
+
+    fprintf(fp, "  ]\n}\n");
+}
+
+static void print_csv(FILE* fp) {
+    fprintf(fp, "name,param,iterations,median_ms,p90_ms,p99_ms,min_ms,max_ms,"
+                "throughput,unit\n");
+
+    for (int i = 0; i < g_result_count; i++) {
+        const BenchResult* r = &g_results[i];
+        fprintf(fp, "%s,%s,%d,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%s\n", r->name,
+                r->param, r->iterations, r->median, r->p90, r->p99, r->min,
+                r->max, r->throughput, r->unit);
+    }
+}
+
+static void print_help(const char* name) {
+    fprintf(stderr,
+            "Usage: %s [OPTION]...\n"
+            "       %s -c [-s SIZE] [FILE.png]...\n"
+            "Options:\n"
+            "  -n N       Number of measured iterations (default %d)\n"
+            "  -s SIZE    Size of the decoded images (default %d)\n"
+            "  -f FORMAT  Output format: json (default) or csv\n"
+            "  -o FILE    Write the results to FILE instead of stdout\n"
+            "  -D         Skip the benchmarks that need a renderer\n"
+            "  -c         Instead of measuring, check that the fast decoders "
+            "produce\n"
+            "             the same pixels as libpng, with generated images "
+            "and FILEs\n"
+            "  -h         Show this help and exit\n"
+            "The video driver is \"dummy\" unless SDL_VIDEODRIVER is set.\n",
+            name, name, BENCH_ITERATIONS, BENCH_IMAGE_SIZE);
+}
+
+int main(int argc, char** argv) {
+    int size                = BENCH_IMAGE_SIZE;
+    bool csv                = false;
+    bool use_renderer       = true;
+    bool check              = false;
+    const char* output_path = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:f:o:Dch")) != -1) {
+        switch (opt) {
+            case 'n':
+                g_iterations = atoi(optarg);
+                break;
+            case 's':
+                size = atoi(optarg);
+                break;
+            case 'f':
+                if (strcmp(optarg, "csv") == 0)
+                    csv = true;
+                else if (strcmp(optarg, "json") != 0)
+                    DIE("Invalid format: \"%s\".", optarg);
+                break;
+            case 'o':
+                output_path = optarg;
+                break;
+            case 'D':
+                use_renderer = false;
+                break;
+            case 'c':
+                check = true;
+                break;
+            case 'h':
+                print_help(argv[0]);
+                return 0;
+            default:
+                print_help(argv[0]);
+                return 1;
+        }
+    }
+
+    if (g_iterations < BENCH_MIN_ITERATIONS || size < 8)
+        DIE("Invalid number of iterations or image size.");
+
+    char dir[] = "/tmp/hl-png-bench.XXXXXX";
+    if (mkdtemp(dir) == NULL)
+        DIE("Failed to create a temporary directory.");
+
+    if (check) {
+        const int failed =
+          run_check(dir, size, &argv[optind], argc - optind);
+        rmdir(dir);
+        return (failed > 0) ? 1 : 0;
+    }
+
+    run_decode(dir, size);
+    run_decode_large(dir);
+    run_input(dir);
+    run_diskcache(dir);
+    run_swizzle();
+
+    if (use_renderer) {
+        /* Measure the software renderer without opening a window, unless
+         * other driver was specified. */
+        SDL_SetHint(SDL_HINT_VIDEODRIVER, "dummy");
+        if (SDL_Init(SDL_INIT_VIDEO) != 0)
+            DIE("Unable to start SDL: %s", SDL_GetError());
+
+        g_window = SDL_CreateWindow("hl-png-bench", SDL_WINDOWPOS_UNDEFINED,
+                                    SDL_WINDOWPOS_UNDEFINED, BENCH_WINDOW_W,
+                                    BENCH_WINDOW_H, SDL_WINDOW_HIDDEN);
+        if (g_window == NULL)
+            DIE("Error creating SDL window: %s", SDL_GetError());
+
+        g_renderer = SDL_CreateRenderer(g_window, -1, SDL_RENDERER_SOFTWARE);
+        if (g_renderer == NULL)
+            DIE("Error creating SDL renderer: %s", SDL_GetError());
+
+        run_upload();
+        run_first_frame(dir, 2 * size);
+    }
+
+    rmdir(dir);
+
+    bench_run("push", "1000000", bench_push, NULL, BENCH_PUSH_POINTS / 1e6,
+              "Mpoints/s");
+
+    if (use_renderer)
+        run_render();
+
+    FILE* fp = stdout;
+    if (output_path != NULL) {
+        fp = fopen(output_path, "w");
+        if (fp == NULL)
+            DIE("Failed to open \"%s\".", output_path);
+    }
+
+    if (csv)
+        print_csv(fp);
+    else
+        print_json(fp, size);
+
+    if (fp != stdout)
+        fclose(fp);
+
+    if (use_renderer) {
+        SDL_DestroyRenderer(g_renderer);
+        SDL_DestroyWindow(g_window);
+        SDL_Quit();
+    }
+
+    return 0;
+}
@@ -0,0 +1,332 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "include/util.h"
+#include "include/image.h"
+#include "include/drawing.h"
+#include "include/composite.h"
+#include "include/export.h"
+#include "include/batch.h"
+
+/*
+ * Range of images [start, end) of `Batch.inputs' owned by a thread. The thread
+ * takes images from the start, and other threads steal them from the end once
+ * their own range is empty.
+ */
+typedef struct Queue {
+    pthread_mutex_t lock;
+    int start, end;
+} Queue;
+
+/* State shared by all the threads */
+typedef struct Batch {
+    const Drawing* drawing;
+    char* const* inputs;
+    const BatchOptions* options;
+
+    /* Options of each export, see `BatchOptions.export' */
+    ExportOptions export;
+
+    /* One queue for each thread */
+    Queue* queues;
+    int queue_count;
+
+    /* Estimated memory used by the images being processed, see
+     * `BatchOptions.memory_limit'. */
+    pthread_mutex_t memory_lock;
+    pthread_cond_t memory_cond;
+    size_t memory_used;
+
+    /* Updated atomically by the threads */
+    BatchStats stats;
+} Batch;
+
+/* Path where an input image is written, see `find_collisions' */
+typedef struct Output {
+    char* path;
+    int input;
+} Output;
+
+/* Arguments of each thread */
+typedef struct Worker {
+    pthread_t thread;
+    Batch* batch;
+    int id;
+} Worker;
+
+/*----------------------------------------------------------------------------*/
+/* Work stealing */
+
+/* Take the next image from the queue of a thread, or steal half of the
+ * remaining images of another thread. Returns -1 if there are no images
+ * left. */
+static int take_image(Batch* batch, int id) {
+    Queue* own = &batch->queues[id];
+
+    pthread_mutex_lock(&own->lock);
+    if (own->start < own->end) {
+        const int image = own->start++;
+        pthread_mutex_unlock(&own->lock);
+        return image;
+    }
+    pthread_mutex_unlock(&own->lock);
+
+    /* Start with the next thread, so the threads don't all steal from the
+     * same one. */
+    for (int i = 1; i < batch->queue_count; i++) {
+        Queue* victim = &batch->queues[(id + i) % batch->queue_count];
+
+        pthread_mutex_lock(&victim->lock);
+        const int left = victim->end - victim->start;
+        if (left <= 0) {
+            pthread_mutex_unlock(&victim->lock);
+            continue;
+        }
+
+        const int stolen = (left + 1) / 2;
+        const int end    = victim->end;
+        victim->end -= stolen;
+        pthread_mutex_unlock(&victim->lock);
+
+        /* Process the first stolen image now, and keep the rest */
+        const int start = end - stolen;
+
+        pthread_mutex_lock(&own->lock);
+        own->start = start + 1;
+        own->end   = end;
+        pthread_mutex_unlock(&own->lock);
+
+        return start;
+    }
+
+    return -1;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Memory limit */
+
+static void memory_acquire(Batch* batch, size_t bytes) {
+    pthread_mutex_lock(&batch->memory_lock);
+
+    while (batch->memory_used > 0 &&
+           batch->memory_used + bytes > batch->options->memory_limit)
+        pthread_cond_wait(&batch->memory_cond, &batch->memory_lock);
+
+    batch->memory_used += bytes;
+    pthread_mutex_unlock(&batch->memory_lock);
+}
+
+static void memory_release(Batch* batch, size_t bytes) {
+    pthread_mutex_lock(&batch->memory_lock);
+    batch->memory_used -= bytes;
+    pthread_cond_broadcast(&batch->memory_cond);
+    pthread_mutex_unlock(&batch->memory_lock);
+}
+
+/*----------------------------------------------------------------------------*/
+
+static size_t file_size(const char* filename) {
+    struct stat st;
+    if (stat(filename, &st) != 0)
+        return 0;
+
+    return st.st_size;
+}
+
+/* Decode an image, draw the lines into it and write it. Returns false on
+ * error, after printing it. */
+static bool process_image(Batch* batch, const char* input) {
+    int w, h;
+    if (!image_read_size(input, &w, &h)) {
+        fprintf(stderr, "hl-png: batch: Could not read PNG header of: %s\n",
+                input);
+        return false;
+    }
+
+    /* Wait until there is enough memory for the image, or until no other
+     * image is being processed. */
+    const size_t bytes = (size_t)w * h * BATCH_BYTES_PER_PIXEL;
+    memory_acquire(batch, bytes);
+
+    bool result  = false;
+    char* output = NULL;
+
+    Image* image = image_read_file(input);
+    if (!image) {
+        fprintf(stderr, "hl-png: batch: Could not decode: %s\n", input);
+        goto done;
+    }
+
+    if (!composite_drawing(image, batch->drawing)) {
+        fprintf(stderr, "hl-png: batch: Could not draw the lines into: %s\n",
+                input);
+        goto done;
+    }
+
+    output = util_derived_path(input, batch->options->output_dir, "-hl.png");
+    if (!output || !export_png(output, image, &batch->export)) {
+        fprintf(stderr, "hl-png: batch: Could not write the output of: %s\n",
+                input);
+        goto done;
+    }
+
+    __atomic_add_fetch(&batch->stats.bytes_read, file_size(input),
+                       __ATOMIC_RELAXED);
+    __atomic_add_fetch(&batch->stats.bytes_written, file_size(output),
+                       __ATOMIC_RELAXED);
+
+    if (batch->options->verbose)
+        fprintf(stderr, "hl-png: batch: %s\n", output);
+
+    result = true;
+
+done:
+    if (image != NULL)
+        image_free(image);
+    free(output);
+    memory_release(batch, bytes);
+    return result;
+}
+
+static int compare_outputs(const void* a, const void* b) {
+    const Output* output_a = a;
+    const Output* output_b = b;
+    return strcmp(output_a->path, output_b->path);
+}
+
+/* Check if several images would be written to the same path, e.g. images with
+ * the same name in different directories when they all go to the output
+ * directory, and print them. */
+static bool find_collisions(char* const* inputs, int count,
+                            const char* output_dir) {
+    Output* outputs = malloc(count * sizeof(Output));
+    if (outputs == NULL)
+        DIE("Error allocating the output paths.");
+
+    for (int i = 0; i < count; i++) {
+        outputs[i].path  = util_derived_path(inputs[i], output_dir, "-hl.png");
+        outputs[i].input = i;
+        if (outputs[i].path == NULL)
+            DIE("Error allocating the output paths.");
+    }
+
+    qsort(outputs, count, sizeof(Output), compare_outputs);
+
+    bool found = false;
+    for (int i = 1; i < count; i++) {
+        if (strcmp(outputs[i - 1].path, outputs[i].path) != 0)
+            continue;
+
+        fprintf(stderr,
+                "hl-png: batch: \"%s\" and \"%s\" would both be written to: "
+                "%s\n",
+                inputs[outputs[i - 1].input], inputs[outputs[i].input],
+                outputs[i].path);
+        found = true;
+    }
+
+    for (int i = 0; i < count; i++)
+        free(outputs[i].path);
+    free(outputs);
+    return found;
+}
+
+static void* worker_thread(void* arg) {
+    Worker* worker = arg;
+    Batch* batch   = worker->batch;
+
+    for (;;) {
+        const int image = take_image(batch, worker->id);
+        if (image < 0)
+            break;
+
+        if (process_image(batch, batch->inputs[image]))
+            __atomic_add_fetch(&batch->stats.done, 1, __ATOMIC_RELAXED);
+        else
+            __atomic_add_fetch(&batch->stats.failed, 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+BatchStats batch_run(const Drawing* drawing, char* const* inputs, int count,
+                     const BatchOptions* options) {
+    const double start_time = util_wall_time();
+
+    long threads = options->threads;
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1)
+        threads = 1;
+    if (threads > BATCH_MAX_THREADS)
+        threads = BATCH_MAX_THREADS;
+    if (threads > count)
+        threads = count;
+
+    Batch batch = {
+        .drawing     = drawing,
+        .inputs      = inputs,
+        .options     = options,
+        .export      = options->export,
+        .queue_count = threads,
+        .memory_used = 0,
+    };
+    batch.export.threads = 1;
+
+    if (count <= 0)
+        return batch.stats;
+
+    /* Nothing is written if any of the images would overwrite another one */
+    if (find_collisions(inputs, count, options->output_dir)) {
+        batch.stats.failed = count;
+        return batch.stats;
+    }
+
+    Queue queues[BATCH_MAX_THREADS];
+    Worker workers[BATCH_MAX_THREADS];
+    batch.queues = queues;
+
+    pthread_mutex_init(&batch.memory_lock, NULL);
+    pthread_cond_init(&batch.memory_cond, NULL);
+
+    /* Split the images evenly between the threads. The ones that finish
+     * first will steal from the rest. */
+    for (int i = 0; i < threads; i++) {
+        pthread_mutex_init(&queues[i].lock, NULL);
+        queues[i].start = (int)((long)count * i / threads);
+        queues[i].end   = (int)((long)count * (i + 1) / threads);
+
+        workers[i].batch = &batch;
+        workers[i].id    = i;
+    }
+
+    /* The calling thread is the first worker. If a thread can't be created,
+     * its images are stolen by the others. */
+    int started = 0;
+    for (int i = 1; i < threads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_thread,
+                           &workers[i]) != 0)
+            break;
+
+        started = i;
+    }
+
+    worker_thread(&workers[0]);
+
+    for (int i = 1; i <= started; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    for (int i = 0; i < threads; i++)
+        pthread_mutex_destroy(&queues[i].lock);
+    pthread_cond_destroy(&batch.memory_cond);
+    pthread_mutex_destroy(&batch.memory_lock);
+
+    batch.stats.seconds = util_wall_time() - start_time;
+    return batch.stats;
+}
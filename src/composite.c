@@ -0,0 +1,448 @@
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* SSE2 is only part of the baseline of x86-64 */
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define COMPOSITE_X86 1
+#endif
+
+#include "include/image.h"
+#include "include/drawing.h"
+#include "include/composite.h"
+
+/*
+ * Lines are drawn as a series of capsules, one for each segment: the pixels
+ * closer than half the width of the line to the segment are covered. The
+ * coverage of the pixels of a line is accumulated in a mask with the maximum
+ * of all its segments, so the joints are not blended twice, and then the
+ * color of the line is blended into the image through the mask.
+ *
+ * Positions are in image pixels, where the point (X, Y) is the center of the
+ * pixel (X, Y), like in `strokes_render'.
+ */
+typedef struct Segment {
+    /* First point, and vector to the second point */
+    float ax, ay;
+    float dx, dy;
+
+    /* Inverse of the squared length of the segment, or 0 if both points are
+     * the same. */
+    float inv_len2;
+
+    /* Half of the width of the line, plus half a pixel for anti-aliasing.
+     * Pixels at this distance or further are not covered. */
+    float radius;
+} Segment;
+
+/*
+ * Function used for calculating the coverage of a segment over `count'
+ * consecutive pixels of a row, starting at position (X, Y). The values in
+ * `cov' are replaced with the coverage of the segment if it's bigger, from 0
+ * (not covered) to 255.
+ */
+typedef void (*coverage_func_t)(const Segment* seg, float x, float y,
+                                uint8_t* cov, int count);
+
+/*
+ * Function used for blending `count' RGBA pixels of `dst' with the specified
+ * color, using the values of `cov' as the opacity of each pixel.
+ */
+typedef void (*blend_func_t)(uint8_t* dst, const uint8_t* cov, Color col,
+                             int count);
+
+/* Divide a value in the [0, 255*255] range by 255, rounding to the nearest
+ * integer. */
+static inline int div255(int x) {
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Coverage */
+
+/* Portable version, used as a fallback and for the remaining pixels of the
+ * vectorized versions. */
+static void coverage_scalar(const Segment* seg, float x, float y, uint8_t* cov,
+                            int count) {
+    const float py = y - seg->ay;
+
+    for (int i = 0; i < count; i++) {
+        const float px = x + i - seg->ax;
+
+        /* Position of the closest point of the segment, from 0 to 1 */
+        float t = (px * seg->dx + py * seg->dy) * seg->inv_len2;
+        if (t < 0.f)
+            t = 0.f;
+        if (t > 1.f)
+            t = 1.f;
+
+        const float ex = px - t * seg->dx;
+        const float ey = py - t * seg->dy;
+
+        float c = seg->radius - sqrtf(ex * ex + ey * ey);
+        if (c <= 0.f)
+            continue;
+        if (c > 1.f)
+            c = 1.f;
+
+        const uint8_t value = (uint8_t)(c * 255.f + 0.5f);
+        if (value > cov[i])
+            cov[i] = value;
+    }
+}
+
+#ifdef COMPOSITE_X86
+/* Process 4 pixels at a time */
+static void coverage_sse2(const Segment* seg, float x, float y, uint8_t* cov,
+                          int count) {
+    const __m128 zero   = _mm_setzero_ps();
+    const __m128 one    = _mm_set1_ps(1.f);
+    const __m128 steps  = _mm_setr_ps(0.f, 1.f, 2.f, 3.f);
+    const __m128 dx     = _mm_set1_ps(seg->dx);
+    const __m128 dy     = _mm_set1_ps(seg->dy);
+    const __m128 inv    = _mm_set1_ps(seg->inv_len2);
+    const __m128 radius = _mm_set1_ps(seg->radius);
+    const __m128 scale  = _mm_set1_ps(255.f);
+    const __m128 half   = _mm_set1_ps(0.5f);
+
+    /* The vertical distance is the same for the whole row */
+    const __m128 py   = _mm_set1_ps(y - seg->ay);
+    const __m128 pydy = _mm_mul_ps(py, dy);
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const __m128 px = _mm_add_ps(_mm_set1_ps(x + i - seg->ax), steps);
+
+        __m128 t = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(px, dx), pydy), inv);
+        t        = _mm_min_ps(_mm_max_ps(t, zero), one);
+
+        const __m128 ex = _mm_sub_ps(px, _mm_mul_ps(t, dx));
+        const __m128 ey = _mm_sub_ps(py, _mm_mul_ps(t, dy));
+        const __m128 d =
+          _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(ex, ex), _mm_mul_ps(ey, ey)));
+
+        __m128 c = _mm_min_ps(_mm_max_ps(_mm_sub_ps(radius, d), zero), one);
+        c        = _mm_add_ps(_mm_mul_ps(c, scale), half);
+
+        /* Convert to 8 bits, leaving the 4 values in the low 32 bits */
+        __m128i value = _mm_cvttps_epi32(c);
+        value         = _mm_packs_epi32(value, value);
+        value         = _mm_packus_epi16(value, value);
+
+        uint32_t old;
+        memcpy(&old, &cov[i], sizeof(old));
+        value = _mm_max_epu8(value, _mm_cvtsi32_si128((int)old));
+
+        const uint32_t result = (uint32_t)_mm_cvtsi128_si32(value);
+        memcpy(&cov[i], &result, sizeof(result));
+    }
+
+    coverage_scalar(seg, x + i, y, &cov[i], count - i);
+}
+
+/* Process 8 pixels at a time */
+__attribute__((target("avx2"))) static void
+coverage_avx2(const Segment* seg, float x, float y, uint8_t* cov, int count) {
+    const __m256 zero   = _mm256_setzero_ps();
+    const __m256 one    = _mm256_set1_ps(1.f);
+    const __m256 steps  = _mm256_setr_ps(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f);
+    const __m256 dx     = _mm256_set1_ps(seg->dx);
+    const __m256 dy     = _mm256_set1_ps(seg->dy);
+    const __m256 inv    = _mm256_set1_ps(seg->inv_len2);
+    const __m256 radius = _mm256_set1_ps(seg->radius);
+    const __m256 scale  = _mm256_set1_ps(255.f);
+    const __m256 half   = _mm256_set1_ps(0.5f);
+
+    const __m256 py   = _mm256_set1_ps(y - seg->ay);
+    const __m256 pydy = _mm256_mul_ps(py, dy);
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m256 px = _mm256_add_ps(_mm256_set1_ps(x + i - seg->ax), steps);
+
+        __m256 t =
+          _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(px, dx), pydy), inv);
+        t = _mm256_min_ps(_mm256_max_ps(t, zero), one);
+
+        const __m256 ex = _mm256_sub_ps(px, _mm256_mul_ps(t, dx));
+        const __m256 ey = _mm256_sub_ps(py, _mm256_mul_ps(t, dy));
+        const __m256 d  = _mm256_sqrt_ps(
+          _mm256_add_ps(_mm256_mul_ps(ex, ex), _mm256_mul_ps(ey, ey)));
+
+        __m256 c =
+          _mm256_min_ps(_mm256_max_ps(_mm256_sub_ps(radius, d), zero), one);
+        c = _mm256_add_ps(_mm256_mul_ps(c, scale), half);
+
+        /* Convert to 8 bits, leaving the 8 values in the low 64 bits. The
+         * packs work on each 128-bit lane separately, so join the lanes
+         * first. */
+        const __m256i value32 = _mm256_cvttps_epi32(c);
+        __m128i value = _mm_packs_epi32(_mm256_castsi256_si128(value32),
+                                        _mm256_extracti128_si256(value32, 1));
+        value         = _mm_packus_epi16(value, value);
+
+        const __m128i old = _mm_loadl_epi64((const __m128i*)&cov[i]);
+        _mm_storel_epi64((__m128i*)&cov[i], _mm_max_epu8(value, old));
+    }
+
+    coverage_sse2(seg, x + i, y, &cov[i], count - i);
+}
+#endif /* COMPOSITE_X86 */
+
+/*----------------------------------------------------------------------------*/
+/* Blending */
+
+static void blend_scalar(uint8_t* dst, const uint8_t* cov, Color col,
+                         int count) {
+    for (int i = 0; i < count; i++) {
+        if (cov[i] == 0)
+            continue;
+
+        const int a   = div255(cov[i] * col.a);
+        const int inv = 255 - a;
+
+        uint8_t* px = &dst[i * 4];
+        px[0]       = div255(px[0] * inv + col.r * a);
+        px[1]       = div255(px[1] * inv + col.g * a);
+        px[2]       = div255(px[2] * inv + col.b * a);
+        px[3]       = div255(px[3] * inv + 255 * a);
+    }
+}
+
+#ifdef COMPOSITE_X86
+/* Same as `div255', for 8 values of 16 bits */
+static inline __m128i div255_epi16(__m128i x) {
+    x = _mm_add_epi16(x, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+/* Blend 2 pixels, with their channels widened to 16 bits, using the alpha of
+ * each pixel repeated in its 4 channels. */
+static inline __m128i blend_pixels_sse2(__m128i px, __m128i alpha,
+                                        __m128i color) {
+    const __m128i inv = _mm_sub_epi16(_mm_set1_epi16(255), alpha);
+    return div255_epi16(
+      _mm_add_epi16(_mm_mullo_epi16(px, inv), _mm_mullo_epi16(color, alpha)));
+}
+
+/* Process 4 pixels at a time */
+static void blend_sse2(uint8_t* dst, const uint8_t* cov, Color col,
+                       int count) {
+    const __m128i zero  = _mm_setzero_si128();
+    const __m128i col_a = _mm_set1_epi16(col.a);
+
+    /* The alpha channel is blended like the others, with a value of 255 */
+    const __m128i color =
+      _mm_setr_epi16(col.r, col.g, col.b, 255, col.r, col.g, col.b, 255);
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        uint32_t cov4;
+        memcpy(&cov4, &cov[i], sizeof(cov4));
+
+        /* Most of the pixels of the mask are usually empty */
+        if (cov4 == 0)
+            continue;
+
+        /* Opacity of each pixel, in the low 4 values of 16 bits */
+        __m128i alpha =
+          _mm_unpacklo_epi8(_mm_cvtsi32_si128((int)cov4), zero);
+        alpha = div255_epi16(_mm_mullo_epi16(alpha, col_a));
+
+        /* Repeat the opacity of each pixel for its 4 channels */
+        alpha                  = _mm_unpacklo_epi16(alpha, alpha);
+        const __m128i alpha_lo = _mm_unpacklo_epi32(alpha, alpha);
+        const __m128i alpha_hi = _mm_unpackhi_epi32(alpha, alpha);
+
+        const __m128i px = _mm_loadu_si128((const __m128i*)&dst[i * 4]);
+        const __m128i lo =
+          blend_pixels_sse2(_mm_unpacklo_epi8(px, zero), alpha_lo, color);
+        const __m128i hi =
+          blend_pixels_sse2(_mm_unpackhi_epi8(px, zero), alpha_hi, color);
+
+        _mm_storeu_si128((__m128i*)&dst[i * 4], _mm_packus_epi16(lo, hi));
+    }
+
+    blend_scalar(&dst[i * 4], &cov[i], col, count - i);
+}
+#endif /* COMPOSITE_X86 */
+
+/*----------------------------------------------------------------------------*/
+
+/* Get the fastest versions supported by the CPU */
+static coverage_func_t get_coverage_func(void) {
+#ifdef COMPOSITE_X86
+    if (__builtin_cpu_supports("avx2"))
+        return coverage_avx2;
+
+    return coverage_sse2;
+#else
+    return coverage_scalar;
+#endif
+}
+
+static blend_func_t get_blend_func(void) {
+#ifdef COMPOSITE_X86
+    return blend_sse2;
+#else
+    return blend_scalar;
+#endif
+}
+
+/* Add the coverage of a segment to the mask of a line. The mask covers the
+ * area of the image from (MASK_X, MASK_Y), with MASK_W columns and MASK_H
+ * rows. */
+static void rasterize_segment(const Segment* seg, uint8_t* mask, int mask_x,
+                              int mask_y, int mask_w, int mask_h,
+                              coverage_func_t coverage) {
+    const float r  = seg->radius;
+    const float bx = seg->ax + seg->dx;
+    const float by = seg->ay + seg->dy;
+
+    int y0 = (int)ceilf(fminf(seg->ay, by) - r);
+    int y1 = (int)floorf(fmaxf(seg->ay, by) + r);
+    if (y0 < mask_y)
+        y0 = mask_y;
+    if (y1 > mask_y + mask_h - 1)
+        y1 = mask_y + mask_h - 1;
+
+    for (int y = y0; y <= y1; y++) {
+        /* Only the part of the segment that is vertically closer than the
+         * radius to the row can cover it. Limiting the columns to that part
+         * avoids going through the whole bounding box of diagonal
+         * segments. */
+        float xa = seg->ax, xb = bx;
+        if (seg->dy != 0.f) {
+            float t0 = (y - r - seg->ay) / seg->dy;
+            float t1 = (y + r - seg->ay) / seg->dy;
+            if (t0 > t1) {
+                const float tmp = t0;
+                t0              = t1;
+                t1              = tmp;
+            }
+
+            t0 = fmaxf(t0, 0.f);
+            t1 = fminf(t1, 1.f);
+
+            xa = seg->ax + t0 * seg->dx;
+            xb = seg->ax + t1 * seg->dx;
+        }
+
+        int x0 = (int)ceilf(fminf(xa, xb) - r);
+        int x1 = (int)floorf(fmaxf(xa, xb) + r);
+        if (x0 < mask_x)
+            x0 = mask_x;
+        if (x1 > mask_x + mask_w - 1)
+            x1 = mask_x + mask_w - 1;
+        if (x0 > x1)
+            continue;
+
+        uint8_t* row = &mask[(size_t)(y - mask_y) * mask_w];
+        coverage(seg, x0, y, &row[x0 - mask_x], x1 - x0 + 1);
+    }
+}
+
+bool composite_drawing(Image* image, const Drawing* drawing) {
+    /* Not cached in static variables, since this can be called from several
+     * threads. Checking the CPU is cheap compared to drawing. */
+    const coverage_func_t coverage = get_coverage_func();
+    const blend_func_t blend       = get_blend_func();
+
+    if (image->data == NULL || image->color_type != PNG_COLOR_TYPE_RGB_ALPHA ||
+        image->bit_depth != 8)
+        return false;
+
+    /* Coverage mask of the current line, reused for all of them. It has the
+     * size of the bounding box of the line. */
+    uint8_t* mask    = NULL;
+    size_t mask_size = 0;
+
+    for (int i = drawing->first_visible; i < drawing->line_count; i++) {
+        const DrawingLine* line = &drawing->lines[i];
+        if (line->erased || line->count <= 0)
+            continue;
+
+        const float radius = line->width / 2.f + 0.5f;
+
+        /* Bounding box of the line, limited to the image */
+        int min_x = line->origin_x, max_x = line->origin_x;
+        int min_y = line->origin_y, max_y = line->origin_y;
+        for (int j = 1; j < line->count; j++) {
+            const int x = drawing_point_x(drawing, line, j);
+            const int y = drawing_point_y(drawing, line, j);
+            if (x < min_x)
+                min_x = x;
+            if (x > max_x)
+                max_x = x;
+            if (y < min_y)
+                min_y = y;
+            if (y > max_y)
+                max_y = y;
+        }
+
+        const int margin = (int)ceilf(radius);
+        int mask_x0      = min_x - margin;
+        int mask_y0      = min_y - margin;
+        int mask_x1      = max_x + margin;
+        int mask_y1      = max_y + margin;
+        if (mask_x0 < 0)
+            mask_x0 = 0;
+        if (mask_y0 < 0)
+            mask_y0 = 0;
+        if (mask_x1 > image->w - 1)
+            mask_x1 = image->w - 1;
+        if (mask_y1 > image->h - 1)
+            mask_y1 = image->h - 1;
+        if (mask_x0 > mask_x1 || mask_y0 > mask_y1)
+            continue;
+
+        const int mask_w = mask_x1 - mask_x0 + 1;
+        const int mask_h = mask_y1 - mask_y0 + 1;
+
+        const size_t needed = (size_t)mask_w * mask_h;
+        if (needed > mask_size) {
+            uint8_t* new_mask = realloc(mask, needed);
+            if (!new_mask) {
+                free(mask);
+                return false;
+            }
+
+            mask      = new_mask;
+            mask_size = needed;
+        }
+        memset(mask, 0, needed);
+
+        /* Lines with a single point are drawn as a dot */
+        const int segments = (line->count > 1) ? line->count - 1 : 1;
+        for (int j = 0; j < segments; j++) {
+            const int k = (line->count > 1) ? j + 1 : j;
+
+            Segment seg;
+            seg.ax = drawing_point_x(drawing, line, j);
+            seg.ay = drawing_point_y(drawing, line, j);
+            seg.dx = drawing_point_x(drawing, line, k) - seg.ax;
+            seg.dy = drawing_point_y(drawing, line, k) - seg.ay;
+
+            const float len2 = seg.dx * seg.dx + seg.dy * seg.dy;
+            seg.inv_len2     = (len2 > 0.f) ? 1.f / len2 : 0.f;
+            seg.radius       = radius;
+
+            rasterize_segment(&seg, mask, mask_x0, mask_y0, mask_w, mask_h,
+                              coverage);
+        }
+
+        uint8_t* data = image->data;
+        for (int y = 0; y < mask_h; y++) {
+            uint8_t* dst = &data[(size_t)(mask_y0 + y) * image->byte_pitch +
+                                 (size_t)mask_x0 * 4];
+            blend(dst, &mask[(size_t)y * mask_w], line->col, mask_w);
+        }
+    }
+
+    free(mask);
+    return true;
+}
@@ -0,0 +1,495 @@
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <png.h>
+
+/* SSE2 is only part of the baseline of x86-64. The other extensions are
+ * checked at run time. */
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CONVERT_X86 1
+#endif
+
+#include "include/convert.h"
+
+/* Function used for swapping the red and blue channels, see
+ * `convert_swap_rb' */
+typedef void (*swap_func_t)(const uint8_t* src, uint8_t* dst, int count);
+
+/*----------------------------------------------------------------------------*/
+/* Portable versions, used as a fallback and for the remaining pixels of the
+ * vectorized versions. */
+
+static inline void store_pixel(uint8_t* dst, uint8_t r, uint8_t g, uint8_t b,
+                               uint8_t a) {
+    dst[0] = r;
+    dst[1] = g;
+    dst[2] = b;
+    dst[3] = a;
+}
+
+/* Grayscale samples of 1, 2 or 4 bits, packed from the most significant bit */
+static void convert_gray_packed(const RowConverter* conv, const uint8_t* src,
+                                uint8_t* dst, int count) {
+    const int depth = conv->bit_depth;
+    const int mask  = (1 << depth) - 1;
+    const int scale = 255 / mask;
+
+    for (int x = 0; x < count; x++) {
+        const int bit   = x * depth;
+        const int shift = 8 - depth - (bit & 7);
+        const int value = (src[bit >> 3] >> shift) & mask;
+
+        const uint8_t gray  = value * scale;
+        const uint8_t alpha = (conv->has_trns && value == conv->trns[0]) ? 0
+                                                                          : 255;
+        store_pixel(&dst[x * 4], gray, gray, gray, alpha);
+    }
+}
+
+static void convert_gray8_scalar(const RowConverter* conv, const uint8_t* src,
+                                 uint8_t* dst, int count) {
+    for (int x = 0; x < count; x++) {
+        const uint8_t alpha =
+          (conv->has_trns && src[x] == conv->trns[0]) ? 0 : 255;
+        store_pixel(&dst[x * 4], src[x], src[x], src[x], alpha);
+    }
+}
+
+/* Samples of 16 bits are big-endian, and only their high byte is kept, like
+ * `png_set_strip_16'. The tRNS chunk is compared with the whole sample. */
+static void convert_gray16_scalar(const RowConverter* conv, const uint8_t* src,
+                                  uint8_t* dst, int count) {
+    for (int x = 0; x < count; x++) {
+        const uint16_t value = (src[x * 2] << 8) | src[x * 2 + 1];
+        const uint8_t alpha =
+          (conv->has_trns && value == conv->trns[0]) ? 0 : 255;
+        store_pixel(&dst[x * 4], src[x * 2], src[x * 2], src[x * 2], alpha);
+    }
+}
+
+static void convert_gray_alpha8_scalar(const RowConverter* conv,
+                                       const uint8_t* src, uint8_t* dst,
+                                       int count) {
+    (void)conv;
+    for (int x = 0; x < count; x++)
+        store_pixel(&dst[x * 4], src[x * 2], src[x * 2], src[x * 2],
+                    src[x * 2 + 1]);
+}
+
+static void convert_gray_alpha16_scalar(const RowConverter* conv,
+                                        const uint8_t* src, uint8_t* dst,
+                                        int count) {
+    (void)conv;
+    for (int x = 0; x < count; x++)
+        store_pixel(&dst[x * 4], src[x * 4], src[x * 4], src[x * 4],
+                    src[x * 4 + 2]);
+}
+
+static void convert_rgb8_scalar(const RowConverter* conv, const uint8_t* src,
+                                uint8_t* dst, int count) {
+    for (int x = 0; x < count; x++) {
+        const uint8_t* px = &src[x * 3];
+        const bool transparent = conv->has_trns && px[0] == conv->trns[0] &&
+                                 px[1] == conv->trns[1] &&
+                                 px[2] == conv->trns[2];
+        store_pixel(&dst[x * 4], px[0], px[1], px[2], transparent ? 0 : 255);
+    }
+}
+
+static void convert_rgb16_scalar(const RowConverter* conv, const uint8_t* src,
+                                 uint8_t* dst, int count) {
+    for (int x = 0; x < count; x++) {
+        const uint8_t* px = &src[x * 6];
+
+        bool transparent = conv->has_trns;
+        for (int c = 0; c < 3 && transparent; c++)
+            transparent = ((px[c * 2] << 8) | px[c * 2 + 1]) == conv->trns[c];
+
+        store_pixel(&dst[x * 4], px[0], px[2], px[4], transparent ? 0 : 255);
+    }
+}
+
+static void convert_rgba8(const RowConverter* conv, const uint8_t* src,
+                          uint8_t* dst, int count) {
+    (void)conv;
+    memcpy(dst, src, (size_t)count * 4);
+}
+
+static void convert_rgba16_scalar(const RowConverter* conv,
+                                  const uint8_t* src, uint8_t* dst,
+                                  int count) {
+    (void)conv;
+    for (int i = 0; i < count * 4; i++)
+        dst[i] = src[i * 2];
+}
+
+/* Palette indexes of 1, 2, 4 or 8 bits, packed from the most significant
+ * bit */
+static void convert_palette(const RowConverter* conv, const uint8_t* src,
+                            uint8_t* dst, int count) {
+    const int depth = conv->bit_depth;
+
+    if (depth == 8) {
+        for (int x = 0; x < count; x++)
+            memcpy(&dst[x * 4], conv->palette[src[x]], 4);
+        return;
+    }
+
+    const int mask = (1 << depth) - 1;
+    for (int x = 0; x < count; x++) {
+        const int bit   = x * depth;
+        const int shift = 8 - depth - (bit & 7);
+        memcpy(&dst[x * 4], conv->palette[(src[bit >> 3] >> shift) & mask], 4);
+    }
+}
+
+static void swap_rb_scalar(const uint8_t* src, uint8_t* dst, int count) {
+    for (int x = 0; x < count; x++) {
+        const uint8_t r = src[x * 4];
+        dst[x * 4]      = src[x * 4 + 2];
+        dst[x * 4 + 1]  = src[x * 4 + 1];
+        dst[x * 4 + 2]  = r;
+        dst[x * 4 + 3]  = src[x * 4 + 3];
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/* Vectorized versions */
+
+#ifdef CONVERT_X86
+/* Expand 16 grayscale values and their alpha into 16 RGBA pixels */
+static inline void store_gray_sse2(uint8_t* dst, __m128i gray, __m128i alpha) {
+    const __m128i gg_lo = _mm_unpacklo_epi8(gray, gray);
+    const __m128i gg_hi = _mm_unpackhi_epi8(gray, gray);
+    const __m128i ga_lo = _mm_unpacklo_epi8(gray, alpha);
+    const __m128i ga_hi = _mm_unpackhi_epi8(gray, alpha);
+
+    _mm_storeu_si128((__m128i*)&dst[0], _mm_unpacklo_epi16(gg_lo, ga_lo));
+    _mm_storeu_si128((__m128i*)&dst[16], _mm_unpackhi_epi16(gg_lo, ga_lo));
+    _mm_storeu_si128((__m128i*)&dst[32], _mm_unpacklo_epi16(gg_hi, ga_hi));
+    _mm_storeu_si128((__m128i*)&dst[48], _mm_unpackhi_epi16(gg_hi, ga_hi));
+}
+
+/* Process 16 pixels at a time */
+static void convert_gray8_sse2(const RowConverter* conv, const uint8_t* src,
+                               uint8_t* dst, int count) {
+    const __m128i opaque = _mm_set1_epi8((char)0xFF);
+    const __m128i trns   = _mm_set1_epi8((char)conv->trns[0]);
+
+    int x = 0;
+    for (; x + 16 <= count; x += 16) {
+        const __m128i gray = _mm_loadu_si128((const __m128i*)&src[x]);
+
+        /* Pixels with the color of the tRNS chunk are transparent */
+        const __m128i alpha =
+          conv->has_trns ? _mm_andnot_si128(_mm_cmpeq_epi8(gray, trns), opaque)
+                         : opaque;
+
+        store_gray_sse2(&dst[x * 4], gray, alpha);
+    }
+
+    convert_gray8_scalar(conv, &src[x], &dst[x * 4], count - x);
+}
+
+/* Process 16 pixels at a time. Only used without a tRNS chunk. */
+static void convert_gray16_sse2(const RowConverter* conv, const uint8_t* src,
+                                uint8_t* dst, int count) {
+    const __m128i opaque = _mm_set1_epi8((char)0xFF);
+    const __m128i high   = _mm_set1_epi16(0x00FF);
+
+    int x = 0;
+    for (; x + 16 <= count; x += 16) {
+        /* The high byte of each big-endian sample is the low byte of each
+         * 16-bit lane */
+        const __m128i a = _mm_loadu_si128((const __m128i*)&src[x * 2]);
+        const __m128i b = _mm_loadu_si128((const __m128i*)&src[x * 2 + 16]);
+        const __m128i gray =
+          _mm_packus_epi16(_mm_and_si128(a, high), _mm_and_si128(b, high));
+
+        store_gray_sse2(&dst[x * 4], gray, opaque);
+    }
+
+    convert_gray16_scalar(conv, &src[x * 2], &dst[x * 4], count - x);
+}
+
+/* Process 8 pixels at a time */
+static void convert_gray_alpha8_sse2(const RowConverter* conv,
+                                     const uint8_t* src, uint8_t* dst,
+                                     int count) {
+    const __m128i low = _mm_set1_epi16(0x00FF);
+
+    int x = 0;
+    for (; x + 8 <= count; x += 8) {
+        /* Each 16-bit lane has the gray value in its low byte, and the alpha
+         * in its high byte */
+        const __m128i ga = _mm_loadu_si128((const __m128i*)&src[x * 2]);
+        const __m128i g  = _mm_and_si128(ga, low);
+        const __m128i gg = _mm_or_si128(g, _mm_slli_epi16(g, 8));
+
+        _mm_storeu_si128((__m128i*)&dst[x * 4], _mm_unpacklo_epi16(gg, ga));
+        _mm_storeu_si128((__m128i*)&dst[x * 4 + 16],
+                         _mm_unpackhi_epi16(gg, ga));
+    }
+
+    convert_gray_alpha8_scalar(conv, &src[x * 2], &dst[x * 4], count - x);
+}
+
+/* Process 8 pixels (32 bytes of samples) at a time */
+static void convert_rgba16_sse2(const RowConverter* conv, const uint8_t* src,
+                                uint8_t* dst, int count) {
+    const __m128i high = _mm_set1_epi16(0x00FF);
+
+    int x = 0;
+    for (; x + 8 <= count; x += 8) {
+        for (int i = 0; i < 2; i++) {
+            const uint8_t* p = &src[(x + i * 4) * 8];
+            const __m128i a  = _mm_loadu_si128((const __m128i*)&p[0]);
+            const __m128i b  = _mm_loadu_si128((const __m128i*)&p[16]);
+
+            _mm_storeu_si128((__m128i*)&dst[(x + i * 4) * 4],
+                             _mm_packus_epi16(_mm_and_si128(a, high),
+                                              _mm_and_si128(b, high)));
+        }
+    }
+
+    convert_rgba16_scalar(conv, &src[x * 8], &dst[x * 4], count - x);
+}
+
+/* Process 4 pixels at a time. Each iteration loads 16 bytes but only uses
+ * 12, so it stops while there are at least 6 pixels left. Only used without
+ * a tRNS chunk. */
+__attribute__((target("ssse3"))) static void
+convert_rgb8_ssse3(const RowConverter* conv, const uint8_t* src, uint8_t* dst,
+                   int count) {
+    const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8,
+                                          -1, 9, 10, 11, -1);
+    const __m128i opaque  = _mm_set1_epi32((int)0xFF000000);
+
+    int x = 0;
+    for (; x + 6 <= count; x += 4) {
+        const __m128i rgb = _mm_loadu_si128((const __m128i*)&src[x * 3]);
+        _mm_storeu_si128((__m128i*)&dst[x * 4],
+                         _mm_or_si128(_mm_shuffle_epi8(rgb, shuffle), opaque));
+    }
+
+    convert_rgb8_scalar(conv, &src[x * 3], &dst[x * 4], count - x);
+}
+
+/* Process 8 pixels at a time, 4 on each 128-bit lane. Each iteration reads 28
+ * bytes, so it stops while there are at least 10 pixels left. */
+__attribute__((target("avx2"))) static void
+convert_rgb8_avx2(const RowConverter* conv, const uint8_t* src, uint8_t* dst,
+                  int count) {
+    const __m256i shuffle = _mm256_setr_epi8(
+      0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1, 0, 1, 2, -1, 3, 4,
+      5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m256i opaque = _mm256_set1_epi32((int)0xFF000000);
+
+    int x = 0;
+    for (; x + 10 <= count; x += 8) {
+        const __m256i rgb = _mm256_inserti128_si256(
+          _mm256_castsi128_si256(
+            _mm_loadu_si128((const __m128i*)&src[x * 3])),
+          _mm_loadu_si128((const __m128i*)&src[x * 3 + 12]), 1);
+
+        _mm256_storeu_si256(
+          (__m256i*)&dst[x * 4],
+          _mm256_or_si256(_mm256_shuffle_epi8(rgb, shuffle), opaque));
+    }
+
+    convert_rgb8_ssse3(conv, &src[x * 3], &dst[x * 4], count - x);
+}
+
+/* Process 4 pixels at a time */
+static void swap_rb_sse2(const uint8_t* src, uint8_t* dst, int count) {
+    const __m128i green_alpha = _mm_set1_epi32((int)0xFF00FF00);
+    const __m128i low         = _mm_set1_epi32(0x000000FF);
+
+    int x = 0;
+    for (; x + 4 <= count; x += 4) {
+        const __m128i px = _mm_loadu_si128((const __m128i*)&src[x * 4]);
+
+        /* Move the first byte of each pixel to the third, and the other way
+         * around */
+        const __m128i first =
+          _mm_slli_epi32(_mm_and_si128(px, low), 16);
+        const __m128i third = _mm_and_si128(_mm_srli_epi32(px, 16), low);
+        const __m128i result =
+          _mm_or_si128(_mm_and_si128(px, green_alpha),
+                       _mm_or_si128(first, third));
+
+        _mm_storeu_si128((__m128i*)&dst[x * 4], result);
+    }
+
+    swap_rb_scalar(&src[x * 4], &dst[x * 4], count - x);
+}
+
+/* Process 8 pixels at a time */
+__attribute__((target("avx2"))) static void
+swap_rb_avx2(const uint8_t* src, uint8_t* dst, int count) {
+    const __m256i shuffle = _mm256_setr_epi8(
+      2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15, 2, 1, 0, 3, 6, 5, 4,
+      7, 10, 9, 8, 11, 14, 13, 12, 15);
+
+    int x = 0;
+    for (; x + 8 <= count; x += 8) {
+        const __m256i px = _mm256_loadu_si256((const __m256i*)&src[x * 4]);
+        _mm256_storeu_si256((__m256i*)&dst[x * 4],
+                            _mm256_shuffle_epi8(px, shuffle));
+    }
+
+    swap_rb_sse2(&src[x * 4], &dst[x * 4], count - x);
+}
+#endif /* CONVERT_X86 */
+
+/*----------------------------------------------------------------------------*/
+
+/* Get the fastest function supported by the CPU for the layout of the
+ * converter */
+static convert_func_t get_convert_func(const RowConverter* conv) {
+    switch (conv->color_type) {
+        case PNG_COLOR_TYPE_PALETTE:
+            return convert_palette;
+
+        case PNG_COLOR_TYPE_GRAY:
+            if (conv->bit_depth < 8)
+                return convert_gray_packed;
+#ifdef CONVERT_X86
+            if (conv->bit_depth == 8)
+                return convert_gray8_sse2;
+            return conv->has_trns ? convert_gray16_scalar : convert_gray16_sse2;
+#else
+            return (conv->bit_depth == 8) ? convert_gray8_scalar
+                                          : convert_gray16_scalar;
+#endif
+
+        case PNG_COLOR_TYPE_GRAY_ALPHA:
+#ifdef CONVERT_X86
+            if (conv->bit_depth == 8)
+                return convert_gray_alpha8_sse2;
+#endif
+            return (conv->bit_depth == 8) ? convert_gray_alpha8_scalar
+                                          : convert_gray_alpha16_scalar;
+
+        case PNG_COLOR_TYPE_RGB:
+            if (conv->bit_depth == 16)
+                return convert_rgb16_scalar;
+#ifdef CONVERT_X86
+            if (!conv->has_trns && __builtin_cpu_supports("avx2"))
+                return convert_rgb8_avx2;
+            if (!conv->has_trns && __builtin_cpu_supports("ssse3"))
+                return convert_rgb8_ssse3;
+#endif
+            return convert_rgb8_scalar;
+
+        case PNG_COLOR_TYPE_RGB_ALPHA:
+            if (conv->bit_depth == 8)
+                return convert_rgba8;
+#ifdef CONVERT_X86
+            return convert_rgba16_sse2;
+#else
+            return convert_rgba16_scalar;
+#endif
+
+        default:
+            return NULL;
+    }
+}
+
+/* Get the fastest version of `convert_swap_rb' supported by the CPU */
+static swap_func_t get_swap_func(void) {
+#ifdef CONVERT_X86
+    if (__builtin_cpu_supports("avx2"))
+        return swap_rb_avx2;
+
+    return swap_rb_sse2;
+#else
+    return swap_rb_scalar;
+#endif
+}
+
+bool convert_init_layout(RowConverter* converter, int color_type,
+                         int bit_depth, const uint16_t* trns) {
+    if (color_type == PNG_COLOR_TYPE_PALETTE)
+        return false;
+
+    converter->color_type = color_type;
+    converter->bit_depth  = bit_depth;
+
+    /* Only grayscale and RGB images can have a transparent color. Like
+     * libpng, only the bits of the bit depth are compared. */
+    converter->has_trns = trns != NULL && (color_type == PNG_COLOR_TYPE_GRAY ||
+                                           color_type == PNG_COLOR_TYPE_RGB);
+    if (converter->has_trns)
+        for (int i = 0; i < 3; i++)
+            converter->trns[i] = trns[i] & ((1 << bit_depth) - 1);
+
+    converter->func = get_convert_func(converter);
+    return converter->func != NULL;
+}
+
+bool convert_init(RowConverter* converter, png_structp png, png_infop info) {
+    if (png_get_interlace_type(png, info) != PNG_INTERLACE_NONE)
+        return false;
+
+    const int color_type = png_get_color_type(png, info);
+    const int bit_depth  = png_get_bit_depth(png, info);
+
+    png_bytep trans_alpha     = NULL;
+    int num_trans             = 0;
+    png_color_16p trans_color = NULL;
+    if (png_get_valid(png, info, PNG_INFO_tRNS))
+        png_get_tRNS(png, info, &trans_alpha, &num_trans, &trans_color);
+
+    if (color_type != PNG_COLOR_TYPE_PALETTE) {
+        uint16_t trns[3] = { 0 };
+        if (trans_color != NULL) {
+            if (color_type == PNG_COLOR_TYPE_GRAY) {
+                trns[0] = trans_color->gray;
+            } else {
+                trns[0] = trans_color->red;
+                trns[1] = trans_color->green;
+                trns[2] = trans_color->blue;
+            }
+        }
+
+        return convert_init_layout(converter, color_type, bit_depth,
+                                   (trans_color != NULL) ? trns : NULL);
+    }
+
+    png_colorp palette = NULL;
+    int num_palette    = 0;
+    if (!png_get_PLTE(png, info, &palette, &num_palette))
+        return false;
+
+    converter->color_type = color_type;
+    converter->bit_depth  = bit_depth;
+    converter->has_trns   = false;
+
+    /* Like libpng, indexes outside of the palette are opaque black, and the
+     * ones without an entry in the tRNS chunk are opaque */
+    memset(converter->palette, 0, sizeof(converter->palette));
+    for (int i = 0; i < 256; i++) {
+        if (i < num_palette) {
+            converter->palette[i][0] = palette[i].red;
+            converter->palette[i][1] = palette[i].green;
+            converter->palette[i][2] = palette[i].blue;
+        }
+
+        converter->palette[i][3] =
+          (trans_alpha != NULL && i < num_trans) ? trans_alpha[i] : 255;
+    }
+
+    converter->func = get_convert_func(converter);
+    return converter->func != NULL;
+}
+
+void convert_swap_rb(const uint8_t* src, uint8_t* dst, int count) {
+    static swap_func_t swap = NULL;
+    if (swap == NULL)
+        swap = get_swap_func();
+
+    swap(src, dst, count);
+}
@@ -0,0 +1,642 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "include/diskcache.h"
+#include "include/image.h"
+#include "include/source.h"
+#include "include/trace.h"
+
+/* Size of the header, see `diskcache.h' */
+#define HEADER_SIZE 64
+
+/* Offsets of the fields of the header */
+#define HEADER_MAGIC        0
+#define HEADER_VERSION      8
+#define HEADER_WIDTH        12
+#define HEADER_HEIGHT       16
+#define HEADER_COLOR_TYPE   20
+#define HEADER_BIT_DEPTH    24
+#define HEADER_PITCH        28
+#define HEADER_PATH_HASH    32
+#define HEADER_FILE_SIZE    40
+#define HEADER_MTIME        48
+#define HEADER_CONTENT_HASH 56
+
+/* Constants of the hash, the same as the ones of xxHash */
+#define PRIME1 UINT64_C(0x9E3779B185EBCA87)
+#define PRIME2 UINT64_C(0xC2B2AE3D27D4EB4F)
+#define PRIME3 UINT64_C(0x165667B19E3779F9)
+
+/* Maximum number of images waiting to be stored by the worker thread. Each
+ * one keeps its pixels in memory, so more are dropped. */
+#define STORE_QUEUE_SIZE 2
+
+/* Maximum number of bytes written at once, so the worker thread can stop
+ * between them */
+#define WRITE_CHUNK_SIZE (8 * 1024 * 1024)
+
+/* File in the cache directory, while trimming it */
+typedef struct CacheFile {
+    char* name;
+    uint64_t size;
+    int64_t mtime_ns;
+} CacheFile;
+
+/* Directory of the cache, or NULL if it's disabled, and its maximum size in
+ * bytes. They are only written by `diskcache_init'. */
+static char* g_dir        = NULL;
+static size_t g_max_bytes = 0;
+
+/* Image waiting to be stored by the worker thread. The Image holds its own
+ * reference to the pixels, see `image_share_pixels'. */
+typedef struct StoreJob {
+    char* path;
+    DiskCacheKey key;
+    Image image;
+} StoreJob;
+
+/* Queue of the worker thread, started by the first `diskcache_store_async'.
+ * Everything is protected by `g_store_lock', except `g_store_stopping', which
+ * is also read atomically while writing. */
+static pthread_mutex_t g_store_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_store_cond  = PTHREAD_COND_INITIALIZER;
+static StoreJob g_store_jobs[STORE_QUEUE_SIZE];
+static int g_store_pending    = 0;
+static bool g_store_started   = false;
+static bool g_store_stopping  = false;
+static pthread_t g_store_thread;
+
+/*----------------------------------------------------------------------------*/
+/* Encoding */
+
+static inline void put_u32(uint8_t* dst, uint32_t value) {
+    for (int i = 0; i < 4; i++)
+        dst[i] = (value >> (i * 8)) & 0xFF;
+}
+
+static inline void put_u64(uint8_t* dst, uint64_t value) {
+    for (int i = 0; i < 8; i++)
+        dst[i] = (value >> (i * 8)) & 0xFF;
+}
+
+static inline uint32_t get_u32(const uint8_t* src) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++)
+        value |= (uint32_t)src[i] << (i * 8);
+    return value;
+}
+
+static inline uint64_t get_u64(const uint8_t* src) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++)
+        value |= (uint64_t)src[i] << (i * 8);
+    return value;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Hashing */
+
+static inline uint64_t rotl64(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t word) {
+    return rotl64(acc + word * PRIME2, 31) * PRIME1;
+}
+
+/* Hash SIZE bytes. The bulk of the data is hashed in four independent lanes
+ * of 8 bytes, so it runs at several GB/s and reading the file dominates. */
+static uint64_t hash_bytes(const uint8_t* data, size_t size) {
+    uint64_t lanes[4] = { PRIME1 + PRIME2, PRIME2, 0, -PRIME1 };
+
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        for (int j = 0; j < 4; j++) {
+            uint64_t word;
+            memcpy(&word, &data[i + j * 8], sizeof(word));
+            lanes[j] = hash_round(lanes[j], word);
+        }
+    }
+
+    uint64_t hash = rotl64(lanes[0], 1) + rotl64(lanes[1], 7) +
+                    rotl64(lanes[2], 12) + rotl64(lanes[3], 18);
+    for (int j = 0; j < 4; j++)
+        hash = (hash ^ hash_round(0, lanes[j])) * PRIME1 + PRIME3;
+
+    hash += size;
+    for (; i < size; i++)
+        hash = rotl64(hash ^ (data[i] * PRIME3), 11) * PRIME1;
+
+    /* Mix the bits of the result */
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
+    hash *= PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Files */
+
+static inline int64_t mtime_ns(const struct stat* st) {
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+/* Create a directory and its parents, like `mkdir -p' */
+static bool make_dirs(char* path) {
+    for (char* p = &path[1]; *p != '\0'; p++) {
+        if (*p != '/')
+            continue;
+
+        *p            = '\0';
+        const bool ok = mkdir(path, 0700) == 0 || errno == EEXIST;
+        *p            = '/';
+        if (!ok)
+            return false;
+    }
+
+    return mkdir(path, 0700) == 0 || errno == EEXIST;
+}
+
+/* Get the path of a file inside of the cache directory. Must be freed by the
+ * caller. */
+static char* cache_path(const char* name) {
+    char* path = malloc(strlen(g_dir) + strlen(name) + 2);
+    if (path != NULL)
+        sprintf(path, "%s/%s", g_dir, name);
+
+    return path;
+}
+
+/* Get the path of the entry of a file, from the hash of its path */
+static char* entry_path(uint64_t path_hash) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016" PRIx64 ".px", path_hash);
+    return cache_path(name);
+}
+
+/* Write the whole buffer to a file descriptor. Fails if `diskcache_finish' is
+ * called in the meantime. */
+static bool write_all(int fd, const uint8_t* data, size_t size) {
+    while (size > 0) {
+        if (__atomic_load_n(&g_store_stopping, __ATOMIC_RELAXED))
+            return false;
+
+        const size_t chunk =
+          (size < WRITE_CHUNK_SIZE) ? size : WRITE_CHUNK_SIZE;
+        const ssize_t written = write(fd, data, chunk);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return false;
+        }
+
+        data += written;
+        size -= written;
+    }
+
+    return true;
+}
+
+static int compare_files(const void* a, const void* b) {
+    const CacheFile* file_a = a;
+    const CacheFile* file_b = b;
+    return (file_a->mtime_ns > file_b->mtime_ns) -
+           (file_a->mtime_ns < file_b->mtime_ns);
+}
+
+/* Remove the least recently used entries until the cache fits in its size,
+ * along with the temporary files that were abandoned. The processes trim the
+ * cache one at a time, holding a lock on the "lock" file. Other processes can
+ * keep using the entries that are removed if they mapped them already. */
+static void trim(void) {
+    char* lock_path = cache_path("lock");
+    if (lock_path == NULL)
+        return;
+
+    const int lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    free(lock_path);
+    if (lock_fd < 0)
+        return;
+
+    if (flock(lock_fd, LOCK_EX) != 0) {
+        close(lock_fd);
+        return;
+    }
+
+    DIR* dp = opendir(g_dir);
+    if (dp == NULL) {
+        close(lock_fd);
+        return;
+    }
+
+    CacheFile* files = NULL;
+    int count = 0, size = 0;
+    uint64_t total_bytes = 0;
+
+    const time_t now = time(NULL);
+
+    struct dirent* ent;
+    while ((ent = readdir(dp)) != NULL) {
+        struct stat st;
+        if (ent->d_name[0] == '.' ||
+            fstatat(dirfd(dp), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+            !S_ISREG(st.st_mode))
+            continue;
+
+        /* Temporary files end in ".px.XXXXXX", see `diskcache_store' */
+        const size_t name_len = strlen(ent->d_name);
+        if (name_len < 3 || strcmp(&ent->d_name[name_len - 3], ".px") != 0) {
+            if (strstr(ent->d_name, ".px.") != NULL &&
+                now - st.st_mtime > DISKCACHE_STALE_SECONDS)
+                unlinkat(dirfd(dp), ent->d_name, 0);
+
+            continue;
+        }
+
+        if (count >= size) {
+            const int new_size   = (size == 0) ? 64 : size * 2;
+            CacheFile* new_files = realloc(files, new_size * sizeof(CacheFile));
+            if (new_files == NULL)
+                break;
+
+            files = new_files;
+            size  = new_size;
+        }
+
+        char* name = strdup(ent->d_name);
+        if (name == NULL)
+            break;
+
+        files[count++] = (CacheFile){
+            .name     = name,
+            .size     = st.st_size,
+            .mtime_ns = mtime_ns(&st),
+        };
+        total_bytes += st.st_size;
+    }
+
+    /* Entries are touched when they are used, see `diskcache_load' */
+    if (total_bytes > g_max_bytes) {
+        qsort(files, count, sizeof(CacheFile), compare_files);
+
+        for (int i = 0; i < count && total_bytes > g_max_bytes; i++)
+            if (unlinkat(dirfd(dp), files[i].name, 0) == 0)
+                total_bytes -= files[i].size;
+    }
+
+    for (int i = 0; i < count; i++)
+        free(files[i].name);
+    free(files);
+
+    closedir(dp);
+
+    /* Releases the lock */
+    close(lock_fd);
+}
+
+/* Check if the header of an entry is valid, and belongs to the file of the
+ * key. The hash of the contents is checked separately, since it needs reading
+ * the whole file. */
+static bool header_matches(const uint8_t* header, const DiskCacheKey* key) {
+    return memcmp(&header[HEADER_MAGIC], DISKCACHE_MAGIC, 8) == 0 &&
+           get_u32(&header[HEADER_VERSION]) == DISKCACHE_VERSION &&
+           get_u64(&header[HEADER_PATH_HASH]) == key->path_hash &&
+           get_u64(&header[HEADER_FILE_SIZE]) == key->size &&
+           (int64_t)get_u64(&header[HEADER_MTIME]) == key->mtime_ns;
+}
+
+/* Hash the contents of the file at PATH, which must still have the size of the
+ * key. Returns false if it can't be read. */
+static bool hash_contents(const char* path, const DiskCacheKey* key,
+                          uint64_t* hash) {
+    Source* source = source_open(path);
+    if (source == NULL)
+        return false;
+
+    size_t size;
+    const uint8_t* data = source_contents(source, &size);
+    const bool result   = data != NULL && size == key->size;
+    if (result)
+        *hash = hash_bytes(data, size);
+
+    source_close(source);
+    return result;
+}
+
+/*----------------------------------------------------------------------------*/
+
+bool diskcache_init(size_t max_bytes) {
+    if (max_bytes == 0) {
+        const char* env = getenv(DISKCACHE_ENV);
+        const long mib  = (env != NULL) ? strtol(env, NULL, 10) : 0;
+        if (mib > 0 && mib <= 1024 * 1024)
+            max_bytes = (size_t)mib * 1024 * 1024;
+    }
+
+    if (max_bytes == 0)
+        return false;
+
+    /* Relative paths in XDG_CACHE_HOME are invalid, and ignored */
+    const char* base   = getenv("XDG_CACHE_HOME");
+    const char* suffix = "/hl-png";
+    if (base == NULL || base[0] != '/') {
+        base   = getenv("HOME");
+        suffix = "/.cache/hl-png";
+        if (base == NULL || base[0] == '\0')
+            return false;
+    }
+
+    char* dir = malloc(strlen(base) + strlen(suffix) + 1);
+    if (dir == NULL)
+        return false;
+
+    sprintf(dir, "%s%s", base, suffix);
+    if (!make_dirs(dir)) {
+        free(dir);
+        return false;
+    }
+
+    free(g_dir);
+    g_dir       = dir;
+    g_max_bytes = max_bytes;
+    return true;
+}
+
+bool diskcache_enabled(void) {
+    return g_dir != NULL;
+}
+
+bool diskcache_key(const char* path, DiskCacheKey* key) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+        return false;
+
+    /* The same file can be opened with different relative paths */
+    char* absolute = realpath(path, NULL);
+    if (absolute == NULL)
+        return false;
+
+    key->path_hash = hash_bytes((const uint8_t*)absolute, strlen(absolute));
+    key->size      = st.st_size;
+    key->mtime_ns  = mtime_ns(&st);
+    free(absolute);
+
+    return true;
+}
+
+Image* diskcache_load(const char* path, const DiskCacheKey* key) {
+    if (g_dir == NULL)
+        return NULL;
+
+    char* entry = entry_path(key->path_hash);
+    if (entry == NULL)
+        return NULL;
+
+    const int fd = open(entry, O_RDONLY | O_CLOEXEC);
+    free(entry);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    uint8_t header[HEADER_SIZE];
+    if (fstat(fd, &st) != 0 ||
+        pread(fd, header, HEADER_SIZE, 0) != HEADER_SIZE ||
+        !header_matches(header, key)) {
+        close(fd);
+        return NULL;
+    }
+
+    /* Only the layout produced by the decoders is stored, see
+     * `diskcache_store' */
+    const uint32_t w     = get_u32(&header[HEADER_WIDTH]);
+    const uint32_t h     = get_u32(&header[HEADER_HEIGHT]);
+    const uint32_t pitch = get_u32(&header[HEADER_PITCH]);
+    if (get_u32(&header[HEADER_COLOR_TYPE]) != PNG_COLOR_TYPE_RGB_ALPHA ||
+        get_u32(&header[HEADER_BIT_DEPTH]) != 8 || w == 0 || h == 0 ||
+        w > INT32_MAX / 4 || h > INT32_MAX || pitch < w * 4 ||
+        pitch > INT32_MAX ||
+        (uint64_t)st.st_size !=
+          DISKCACHE_DATA_OFFSET + (uint64_t)h * pitch) {
+        close(fd);
+        return NULL;
+    }
+
+    /* The modification time is not enough, since it can be set by other
+     * programs, e.g. when extracting archives. The file is only hashed once
+     * everything else matches, so misses don't read it. */
+    uint64_t content_hash;
+    if (!hash_contents(path, key, &content_hash) ||
+        get_u64(&header[HEADER_CONTENT_HASH]) != content_hash) {
+        close(fd);
+        return NULL;
+    }
+
+    /* Entries are never modified once they are renamed into place, so the
+     * mapping can't be truncated under us. The pixels are read ahead while
+     * the caller sets up the tiles. */
+    const size_t map_size = st.st_size;
+    void* map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    madvise(map, map_size, MADV_WILLNEED);
+
+    /* Mark the entry as recently used, see `trim' */
+    futimens(fd, NULL);
+    close(fd);
+
+    Image* image = malloc(sizeof(Image));
+    if (image == NULL) {
+        munmap(map, map_size);
+        return NULL;
+    }
+
+    image->data         = (uint8_t*)map + DISKCACHE_DATA_OFFSET;
+    image->mapping      = map;
+    image->mapping_size = map_size;
+    image->shared       = NULL;
+    image->w            = w;
+    image->h            = h;
+    image->color_type   = PNG_COLOR_TYPE_RGB_ALPHA;
+    image->bit_depth    = 8;
+    image->byte_pitch   = pitch;
+    return image;
+}
+
+void diskcache_store(const char* path, const DiskCacheKey* key,
+                     const Image* image) {
+    if (g_dir == NULL || image->data == NULL || image->mapping != NULL ||
+        image->color_type != PNG_COLOR_TYPE_RGB_ALPHA ||
+        image->bit_depth != 8 ||
+        (uint64_t)image->w * image->h < DISKCACHE_MIN_PIXELS)
+        return;
+
+    const size_t data_size = (size_t)image->h * image->byte_pitch;
+    if (DISKCACHE_DATA_OFFSET + data_size > g_max_bytes)
+        return;
+
+    /* The pixels might not match the key if the file changed while they were
+     * being decoded. The contents are hashed here, after decoding them, and
+     * only for images that are big enough. */
+    struct stat st;
+    uint64_t content_hash;
+    if (stat(path, &st) != 0 || (uint64_t)st.st_size != key->size ||
+        mtime_ns(&st) != key->mtime_ns ||
+        !hash_contents(path, key, &content_hash) ||
+        __atomic_load_n(&g_store_stopping, __ATOMIC_RELAXED))
+        return;
+
+    /* The rest of the header is padding */
+    uint8_t header[DISKCACHE_DATA_OFFSET] = { 0 };
+    memcpy(&header[HEADER_MAGIC], DISKCACHE_MAGIC, 8);
+    put_u32(&header[HEADER_VERSION], DISKCACHE_VERSION);
+    put_u32(&header[HEADER_WIDTH], image->w);
+    put_u32(&header[HEADER_HEIGHT], image->h);
+    put_u32(&header[HEADER_COLOR_TYPE], image->color_type);
+    put_u32(&header[HEADER_BIT_DEPTH], image->bit_depth);
+    put_u32(&header[HEADER_PITCH], image->byte_pitch);
+    put_u64(&header[HEADER_PATH_HASH], key->path_hash);
+    put_u64(&header[HEADER_FILE_SIZE], key->size);
+    put_u64(&header[HEADER_MTIME], key->mtime_ns);
+    put_u64(&header[HEADER_CONTENT_HASH], content_hash);
+
+    char* entry = entry_path(key->path_hash);
+    if (entry == NULL)
+        return;
+
+    /* Write to a temporary file, and rename it once it's complete, so other
+     * processes either see the old entry or the new one. */
+    const char suffix[] = ".XXXXXX";
+    const size_t len    = strlen(entry);
+    char* tmp_path      = malloc(len + sizeof(suffix));
+    if (tmp_path == NULL) {
+        free(entry);
+        return;
+    }
+    memcpy(tmp_path, entry, len);
+    memcpy(&tmp_path[len], suffix, sizeof(suffix));
+
+    bool stored  = false;
+    const int fd = mkstemp(tmp_path);
+    if (fd >= 0) {
+        const bool written =
+          write_all(fd, header, sizeof(header)) &&
+          write_all(fd, image->data, data_size) && fsync(fd) == 0;
+        const bool closed = close(fd) == 0;
+
+        if (written && closed && rename(tmp_path, entry) == 0)
+            stored = true;
+        else
+            unlink(tmp_path);
+    }
+
+    free(tmp_path);
+    free(entry);
+
+    if (stored && !__atomic_load_n(&g_store_stopping, __ATOMIC_RELAXED))
+        trim();
+}
+
+/* Store the queued images, one at a time, until `diskcache_finish' */
+static void* store_thread(void* arg) {
+    (void)arg;
+    trace_thread_name("diskcache");
+
+    pthread_mutex_lock(&g_store_lock);
+    for (;;) {
+        while (g_store_pending == 0 && !g_store_stopping)
+            pthread_cond_wait(&g_store_cond, &g_store_lock);
+        if (g_store_stopping)
+            break;
+
+        StoreJob job = g_store_jobs[0];
+        g_store_pending--;
+        memmove(&g_store_jobs[0], &g_store_jobs[1],
+                g_store_pending * sizeof(StoreJob));
+        pthread_mutex_unlock(&g_store_lock);
+
+        const uint64_t span = trace_begin();
+        diskcache_store(job.path, &job.key, &job.image);
+        trace_end("diskcache_store", span);
+
+        image_free_data(&job.image);
+        free(job.path);
+
+        pthread_mutex_lock(&g_store_lock);
+    }
+    pthread_mutex_unlock(&g_store_lock);
+
+    return NULL;
+}
+
+void diskcache_store_async(const char* path, const DiskCacheKey* key,
+                           Image* image) {
+    /* Same checks as `diskcache_store', before sharing the pixels */
+    if (g_dir == NULL || image->data == NULL || image->mapping != NULL ||
+        image->color_type != PNG_COLOR_TYPE_RGB_ALPHA ||
+        image->bit_depth != 8 ||
+        (uint64_t)image->w * image->h < DISKCACHE_MIN_PIXELS)
+        return;
+
+    pthread_mutex_lock(&g_store_lock);
+
+    if (!g_store_started && !g_store_stopping) {
+        g_store_started =
+          pthread_create(&g_store_thread, NULL, store_thread, NULL) == 0;
+    }
+
+    StoreJob job = { .path = NULL, .key = *key, .image = *image };
+    if (!g_store_started || g_store_stopping ||
+        g_store_pending >= STORE_QUEUE_SIZE ||
+        (job.path = strdup(path)) == NULL) {
+        pthread_mutex_unlock(&g_store_lock);
+        return;
+    }
+
+    job.image.shared = image_share_pixels(image);
+    if (job.image.shared == NULL) {
+        pthread_mutex_unlock(&g_store_lock);
+        free(job.path);
+        return;
+    }
+
+    g_store_jobs[g_store_pending++] = job;
+    pthread_cond_signal(&g_store_cond);
+    pthread_mutex_unlock(&g_store_lock);
+}
+
+void diskcache_finish(void) {
+    pthread_mutex_lock(&g_store_lock);
+    __atomic_store_n(&g_store_stopping, true, __ATOMIC_RELAXED);
+    pthread_cond_signal(&g_store_cond);
+    const bool started = g_store_started;
+    pthread_mutex_unlock(&g_store_lock);
+
+    if (started)
+        pthread_join(g_store_thread, NULL);
+
+    /* The thread is gone, and nothing else is queued after stopping */
+    for (int i = 0; i < g_store_pending; i++) {
+        image_free_data(&g_store_jobs[i].image);
+        free(g_store_jobs[i].path);
+    }
+    g_store_pending = 0;
+    g_store_started = false;
+}
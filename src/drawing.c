@@ -1,130 +1,985 @@
 
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
-#include "include/main.h"
 #include "include/util.h"
+#include "include/view.h"
+#include "include/spatial.h"
 #include "include/drawing.h"
 
 Drawing* drawing_new(void) {
     Drawing* drawing = malloc(sizeof(Drawing));
+    if (!drawing)
+        return NULL;
 
     drawing->points_sz = DRAWING_POINTS_SIZE;
-    drawing->points    = calloc(drawing->points_sz, sizeof(DrawingPoint));
+    drawing->xs        = malloc(drawing->points_sz * sizeof(int16_t));
+    drawing->ys        = malloc(drawing->points_sz * sizeof(int16_t));
     drawing->points_i  = 0;
 
-    drawing->line_ends_sz = DRAWING_LINES_SIZE;
-    drawing->line_ends    = calloc(drawing->line_ends_sz, sizeof(int));
-    drawing->line_count   = 0;
+    drawing->lines_sz    = DRAWING_LINES_SIZE;
+    drawing->lines       = malloc(drawing->lines_sz * sizeof(DrawingLine));
+    drawing->line_count    = 0;
+    drawing->first_visible = 0;
+    drawing->in_progress   = false;
+
+    drawing->index         = spatial_new();
+    drawing->indexed_lines = 0;
+
+    drawing->ops_sz      = DRAWING_LINES_SIZE;
+    drawing->ops         = malloc(drawing->ops_sz * sizeof(DrawingOp));
+    drawing->ops_count   = 0;
+    drawing->ops_total   = 0;
+    drawing->next_serial = 1;
+    drawing->base_serial = 0;
+    drawing->erase_open  = false;
+
+    drawing->erased_sz = DRAWING_LINES_SIZE;
+    drawing->erased    = malloc(drawing->erased_sz * sizeof(int));
+    drawing->erased_i  = 0;
+
+    if (!drawing->xs || !drawing->ys || !drawing->lines || !drawing->index ||
+        !drawing->ops || !drawing->erased) {
+        drawing_free(drawing);
+        return NULL;
+    }
+
+    drawing->tolerance    = DRAWING_TOLERANCE;
+    drawing->min_distance = DRAWING_MIN_DISTANCE;
+    drawing->sector_valid = false;
+
+    drawing->stats_received = 0;
+    drawing->stats_removed  = 0;
 
     return drawing;
 }
 
 void drawing_free(Drawing* drawing) {
-    free(drawing->points);
-    free(drawing->line_ends);
+    free(drawing->xs);
+    free(drawing->ys);
+    free(drawing->lines);
+    if (drawing->index != NULL)
+        spatial_free(drawing->index);
+    free(drawing->ops);
+    free(drawing->erased);
     free(drawing);
 }
 
-void drawing_push(Drawing* drawing, DrawingPoint point) {
-    /* If there is no space left, reallocate */
-    if (drawing->points_i >= drawing->points_sz) {
-        drawing->points_sz += DRAWING_POINTS_SIZE;
-        drawing->points =
-          realloc(drawing->points, drawing->points_sz * sizeof(DrawingPoint));
+Drawing* drawing_copy_visible(const Drawing* drawing) {
+    int lines  = 0;
+    int points = 0;
+    for (int i = drawing->first_visible; i < drawing->line_count; i++) {
+        if (!drawing->lines[i].erased) {
+            lines++;
+            points += drawing->lines[i].count;
+        }
     }
 
-    /*
-     * Push to the DrawingPoint stack.
-     *
-     * NOTE: We could avoid using `Drawing.points_i', by using the
-     * `Drawing.line_ends' array along with `Drawing.line_count' directly.
-     * However, it was harder to understand, and I don't think it's worth it.
-     */
-    drawing->points[drawing->points_i++] = point;
+    Drawing* copy = drawing_new();
+    if (!copy)
+        return NULL;
+
+    if (!drawing_reserve(copy, lines, points)) {
+        drawing_free(copy);
+        return NULL;
+    }
+
+    for (int i = drawing->first_visible; i < drawing->line_count; i++) {
+        const DrawingLine* line = &drawing->lines[i];
+        if (line->erased)
+            continue;
+
+        memcpy(&copy->xs[copy->points_i], &drawing->xs[line->start],
+               line->count * sizeof(int16_t));
+        memcpy(&copy->ys[copy->points_i], &drawing->ys[line->start],
+               line->count * sizeof(int16_t));
+        drawing_add_finished_line(copy, *line);
+    }
+
+    return copy;
 }
 
-bool drawing_in_progress(Drawing* drawing) {
-    const int last_line_end = drawing->line_ends[drawing->line_count];
-    return drawing->points_i > last_line_end + 1;
+/*----------------------------------------------------------------------------*/
+/* Storage */
+
+/* Make sure there is space for one more point. The array doubles its size, so
+ * the total cost of copying stays linear with the number of points. */
+static void reserve_point(Drawing* drawing) {
+    if (drawing->points_i < drawing->points_sz)
+        return;
+
+    drawing->points_sz *= 2;
+    drawing->xs = realloc(drawing->xs, drawing->points_sz * sizeof(int16_t));
+    drawing->ys = realloc(drawing->ys, drawing->points_sz * sizeof(int16_t));
+    if (!drawing->xs || !drawing->ys)
+        DIE("Error reallocating the points of the drawing.");
 }
 
-void drawing_end_line(Drawing* drawing) {
-    /* Should never happen */
-    if (drawing->points_i <= 0)
+/* Make sure there is space for the line `lines[line_count]' */
+static void reserve_line(Drawing* drawing) {
+    if (drawing->line_count < drawing->lines_sz)
+        return;
+
+    drawing->lines_sz *= 2;
+    drawing->lines =
+      realloc(drawing->lines, drawing->lines_sz * sizeof(DrawingLine));
+    if (!drawing->lines)
+        DIE("Error reallocating the lines of the drawing.");
+}
+
+/* Get the point I of a line, with the color and width of the line */
+static inline DrawingPoint get_point(const Drawing* drawing,
+                                     const DrawingLine* line, int i) {
+    const DrawingPoint point = {
+        .x     = drawing_point_x(drawing, line, i),
+        .y     = drawing_point_y(drawing, line, i),
+        .col   = line->col,
+        .width = line->width,
+    };
+    return point;
+}
+
+/* Return true if POINT can be stored relative to the origin of LINE */
+static inline bool fits_in_line(const DrawingLine* line, DrawingPoint point) {
+    const int64_t dx = (int64_t)point.x - line->origin_x;
+    const int64_t dy = (int64_t)point.y - line->origin_y;
+    return dx >= INT16_MIN && dx <= INT16_MAX && dy >= INT16_MIN &&
+           dy <= INT16_MAX;
+}
+
+/* Store POINT at index I of LINE. The index must be inside the reserved space,
+ * and the point must fit in the line. */
+static inline void set_point(Drawing* drawing, const DrawingLine* line, int i,
+                             DrawingPoint point) {
+    drawing->xs[line->start + i] = (int16_t)(point.x - line->origin_x);
+    drawing->ys[line->start + i] = (int16_t)(point.y - line->origin_y);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Line simplification */
+
+static inline double point_distance(DrawingPoint a, DrawingPoint b) {
+    return hypot(b.x - a.x, b.y - a.y);
+}
+
+/* Distance from (X, Y) to the segment from A to B */
+static double segment_distance(double x, double y, DrawingPoint a,
+                               DrawingPoint b) {
+    const double dx     = b.x - a.x;
+    const double dy     = b.y - a.y;
+    const double len_sq = dx * dx + dy * dy;
+    if (len_sq == 0)
+        return hypot(x - a.x, y - a.y);
+
+    double t = ((x - a.x) * dx + (y - a.y) * dy) / len_sq;
+    if (t < 0)
+        t = 0;
+    if (t > 1)
+        t = 1;
+
+    return hypot(x - (a.x + t * dx), y - (a.y + t * dy));
+}
+
+/* Direction from A to B, in the same turn as `center' */
+static double direction_near(DrawingPoint a, DrawingPoint b, double center) {
+    double angle = atan2(b.y - a.y, b.x - a.x);
+    while (angle - center > M_PI)
+        angle -= 2 * M_PI;
+    while (angle - center < -M_PI)
+        angle += 2 * M_PI;
+    return angle;
+}
+
+/* Return true if a line from ANCHOR to P would pass close enough to all the
+ * points in the current sector. See `Drawing.sector_lo'. */
+static bool sector_contains(const Drawing* drawing, DrawingPoint anchor,
+                            DrawingPoint p) {
+    if (!drawing->sector_valid)
+        return true;
+
+    const double center = (drawing->sector_lo + drawing->sector_hi) / 2;
+    const double angle  = direction_near(anchor, p, center);
+    return angle >= drawing->sector_lo && angle <= drawing->sector_hi;
+}
+
+/* Narrow the current sector to the directions from ANCHOR that pass close
+ * enough to P. */
+static void sector_add(Drawing* drawing, DrawingPoint anchor, DrawingPoint p) {
+    /* Half of the tolerance is used here, and the other half when the line
+     * ends, in `simplify_line'. */
+    const double tolerance = drawing->tolerance / 2;
+    const double dist      = point_distance(anchor, p);
+    if (dist <= tolerance)
+        return;
+
+    const double half_width = asin(tolerance / dist);
+
+    if (!drawing->sector_valid) {
+        const double angle    = direction_near(anchor, p, 0);
+        drawing->sector_lo    = angle - half_width;
+        drawing->sector_hi    = angle + half_width;
+        drawing->sector_valid = true;
+        return;
+    }
+
+    const double center = (drawing->sector_lo + drawing->sector_hi) / 2;
+    const double angle  = direction_near(anchor, p, center);
+    if (angle - half_width > drawing->sector_lo)
+        drawing->sector_lo = angle - half_width;
+    if (angle + half_width < drawing->sector_hi)
+        drawing->sector_hi = angle + half_width;
+}
+
+/* Simplify the points of a line with the Ramer-Douglas-Peucker algorithm,
+ * moving the points that are kept to the start of the line. Updates
+ * `DrawingLine.count'. */
+static void simplify_line(Drawing* drawing, DrawingLine* line) {
+    const int count = line->count;
+    if (count <= 2)
+        return;
+
+    /* Pairs of indexes that still have to be checked, to avoid recursion */
+    bool* keep = calloc(count, sizeof(bool));
+    int* stack = malloc(count * 2 * sizeof(int));
+    if (!keep || !stack) {
+        free(keep);
+        free(stack);
+        return;
+    }
+
+    keep[0]         = true;
+    keep[count - 1] = true;
+
+    int stack_i      = 0;
+    stack[stack_i++] = 0;
+    stack[stack_i++] = count - 1;
+
+    while (stack_i > 0) {
+        const int end   = stack[--stack_i];
+        const int start = stack[--stack_i];
+
+        const DrawingPoint a = get_point(drawing, line, start);
+        const DrawingPoint b = get_point(drawing, line, end);
+
+        /* Find the point that is furthest from the segment */
+        int furthest    = -1;
+        double max_dist = drawing->tolerance / 2;
+        for (int i = start + 1; i < end; i++) {
+            const DrawingPoint p = get_point(drawing, line, i);
+            const double dist    = segment_distance(p.x, p.y, a, b);
+            if (dist > max_dist) {
+                max_dist = dist;
+                furthest = i;
+            }
+        }
+
+        /* All the points are close enough to the segment, remove them */
+        if (furthest < 0)
+            continue;
+
+        keep[furthest]   = true;
+        stack[stack_i++] = start;
+        stack[stack_i++] = furthest;
+        stack[stack_i++] = furthest;
+        stack[stack_i++] = end;
+    }
+
+    /* The points keep the same origin, so they can be moved directly */
+    int kept = 0;
+    for (int i = 0; i < count; i++) {
+        if (!keep[i])
+            continue;
+
+        drawing->xs[line->start + kept] = drawing->xs[line->start + i];
+        drawing->ys[line->start + kept] = drawing->ys[line->start + i];
+        kept++;
+    }
+
+    drawing->stats_removed += count - kept;
+    line->count = kept;
+
+    free(keep);
+    free(stack);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Spatial index */
+
+/* Add the segments of a finished line to `Drawing.index'. Lines with a single
+ * point are added as a segment of length zero, so they can be erased too. */
+static void index_line(Drawing* drawing, int line_idx) {
+    const DrawingLine* line = &drawing->lines[line_idx];
+    const double margin     = line->width / 2.0;
+
+    const int segments = (line->count > 1) ? line->count - 1 : 1;
+    for (int i = 0; i < segments; i++) {
+        const int next       = (line->count > 1) ? i + 1 : i;
+        const DrawingPoint a = get_point(drawing, line, i);
+        const DrawingPoint b = get_point(drawing, line, next);
+
+        /* Lines are drawn through the center of the pixels */
+        spatial_insert(drawing->index, line_idx, i, a.x + 0.5, a.y + 0.5,
+                       b.x + 0.5, b.y + 0.5, margin);
+    }
+}
+
+/* Add the finished lines that are not in the index yet. Loaded lines are only
+ * added once the index is used, see `drawing_add_finished_line'. */
+static void update_index(Drawing* drawing) {
+    for (int i = drawing->indexed_lines; i < drawing->line_count; i++)
+        index_line(drawing, i);
+
+    if (drawing->indexed_lines < drawing->line_count)
+        drawing->indexed_lines = drawing->line_count;
+}
+
+/* Return true if the entry belongs to a line that is currently drawn. The
+ * index might also have entries of lines that were undone, or replaced after
+ * undoing. */
+static bool entry_visible(const Drawing* drawing, const SpatialEntry* entry) {
+    if (entry->line < drawing->first_visible ||
+        entry->line >= drawing->line_count)
+        return false;
+
+    const DrawingLine* line = &drawing->lines[entry->line];
+    const int segments      = (line->count > 1) ? line->count - 1 : 1;
+    return !line->erased && entry->segment < segments;
+}
+
+/* Distance from the image position (X, Y) to the edge of the segment of an
+ * entry. Negative if the position is inside of the line. */
+static double entry_distance(const Drawing* drawing,
+                             const SpatialEntry* entry, double x, double y) {
+    const DrawingLine* line = &drawing->lines[entry->line];
+    const int next = (line->count > 1) ? entry->segment + 1 : entry->segment;
+
+    const DrawingPoint a = get_point(drawing, line, entry->segment);
+    const DrawingPoint b = get_point(drawing, line, next);
+
+    /* The lines are drawn through the center of the pixels */
+    return segment_distance(x - 0.5, y - 0.5, a, b) - line->width / 2.0;
+}
+
+/*----------------------------------------------------------------------------*/
+/* History */
+
+/* Number of lines that are stored, including the ones that can be redone and
+ * the one that is being drawn. */
+static int stored_lines(const Drawing* drawing) {
+    int count = drawing->line_count;
+    for (int i = drawing->ops_count; i < drawing->ops_total; i++)
+        if (drawing->ops[i].type == DRAWING_OP_ADD)
+            count++;
+
+    if (drawing->in_progress)
+        count++;
+
+    return count;
+}
+
+/* Index of the first point of line I, or the end of the points if I is past
+ * the stored lines. */
+static int line_start(const Drawing* drawing, int i) {
+    return (i < stored_lines(drawing)) ? drawing->lines[i].start
+                                       : drawing->points_i;
+}
+
+/* Forget the operations that can be redone, and the lines they used */
+static void history_truncate(Drawing* drawing) {
+    if (drawing->ops_total == drawing->ops_count)
+        return;
+
+    /* The lines of the undone operations are always at the end. There can't
+     * be a line in progress, since starting it would have truncated the
+     * history. */
+    drawing->points_i  = line_start(drawing, drawing->line_count);
+    drawing->ops_total = drawing->ops_count;
+
+    /* The lines after `line_count' will be replaced, index them again */
+    if (drawing->indexed_lines > drawing->line_count)
+        drawing->indexed_lines = drawing->line_count;
+
+    drawing->erased_i = 0;
+    for (int i = drawing->ops_count - 1; i >= 0; i--) {
+        const DrawingOp* op = &drawing->ops[i];
+        if (op->type == DRAWING_OP_ERASE) {
+            drawing->erased_i = op->erased_start + op->erased_count;
+            break;
+        }
+    }
+}
+
+/* Free the lines before FIRST. They must not be used by any operation in the
+ * history anymore. The spatial index is generated again when it's needed. */
+static void forget_lines(Drawing* drawing, int first) {
+    if (first <= 0)
+        return;
+
+    const int total = stored_lines(drawing);
+    const int shift = line_start(drawing, first);
+
+    memmove(drawing->xs, &drawing->xs[shift],
+            (drawing->points_i - shift) * sizeof(int16_t));
+    memmove(drawing->ys, &drawing->ys[shift],
+            (drawing->points_i - shift) * sizeof(int16_t));
+    drawing->points_i -= shift;
+
+    memmove(drawing->lines, &drawing->lines[first],
+            (total - first) * sizeof(DrawingLine));
+    for (int i = 0; i < total - first; i++)
+        drawing->lines[i].start -= shift;
+
+    drawing->line_count -= first;
+    drawing->first_visible -= first;
+
+    /* Update the line indexes of the history */
+    for (int i = 0; i < drawing->ops_total; i++) {
+        DrawingOp* op = &drawing->ops[i];
+        if (op->type == DRAWING_OP_ADD || op->type == DRAWING_OP_CLEAR) {
+            op->line -= first;
+            op->prev_line -= first;
+        }
+    }
+    for (int i = 0; i < drawing->erased_i; i++)
+        drawing->erased[i] -= first;
+
+    spatial_clear(drawing->index);
+    drawing->indexed_lines = 0;
+}
+
+static int compare_ints(const void* a, const void* b) {
+    const int int_a = *(const int*)a;
+    const int int_b = *(const int*)b;
+    return (int_a > int_b) - (int_a < int_b);
+}
+
+/* Get the new index of a line, or position between lines, after removing the
+ * sorted lines in REMOVED. See `remove_lines'. */
+static int remap_line(const int* removed, int count, int line) {
+    /* Number of removed lines before LINE */
+    int lo = 0, hi = count;
+    while (lo < hi) {
+        const int mid = lo + (hi - lo) / 2;
+        if (removed[mid] < line)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return line - lo;
+}
+
+/* Free the lines in REMOVED, sorted by index and without duplicates. They
+ * must not be used by any operation in the history anymore. The lines and
+ * points after them are moved back, and the line indexes are updated like in
+ * `forget_lines'. */
+static void remove_lines(Drawing* drawing, const int* removed, int count) {
+    if (count <= 0)
+        return;
+
+    const int total = stored_lines(drawing);
+
+    /* Nothing moves before the first removed line */
+    int dst_line  = removed[0];
+    int dst_point = drawing->lines[dst_line].start;
+    int next      = 0;
+    for (int i = removed[0]; i < total; i++) {
+        if (next < count && removed[next] == i) {
+            next++;
+            continue;
+        }
+
+        DrawingLine line = drawing->lines[i];
+        memmove(&drawing->xs[dst_point], &drawing->xs[line.start],
+                line.count * sizeof(int16_t));
+        memmove(&drawing->ys[dst_point], &drawing->ys[line.start],
+                line.count * sizeof(int16_t));
+
+        line.start = dst_point;
+        dst_point += line.count;
+        drawing->lines[dst_line++] = line;
+    }
+    drawing->points_i = dst_point;
+
+    drawing->line_count = remap_line(removed, count, drawing->line_count);
+    drawing->first_visible =
+      remap_line(removed, count, drawing->first_visible);
+
+    /* Update the line indexes of the history */
+    for (int i = 0; i < drawing->ops_total; i++) {
+        DrawingOp* op = &drawing->ops[i];
+        if (op->type == DRAWING_OP_ADD || op->type == DRAWING_OP_CLEAR) {
+            op->line      = remap_line(removed, count, op->line);
+            op->prev_line = remap_line(removed, count, op->prev_line);
+        }
+    }
+    for (int i = 0; i < drawing->erased_i; i++)
+        drawing->erased[i] = remap_line(removed, count, drawing->erased[i]);
+
+    spatial_clear(drawing->index);
+    drawing->indexed_lines = 0;
+}
+
+/* Free the lines erased by the oldest operation, which is being dropped from
+ * the history, so they can't be restored anymore. */
+static void forget_erased(Drawing* drawing, const DrawingOp* op) {
+    int* removed = malloc(op->erased_count * sizeof(int));
+    if (!removed)
+        return;
+
+    int count = 0;
+    for (int i = 0; i < op->erased_count; i++)
+        removed[count++] = drawing->erased[op->erased_start + i];
+
+    qsort(removed, count, sizeof(int), compare_ints);
+
+    /* The same line could be erased twice by an extended erase */
+    int unique = 0;
+    for (int i = 0; i < count; i++)
+        if (unique == 0 || removed[unique - 1] != removed[i])
+            removed[unique++] = removed[i];
+
+    remove_lines(drawing, removed, unique);
+    free(removed);
+}
+
+/* Remove the oldest operation from the history. Its changes can't be undone
+ * anymore. */
+static void history_drop_oldest(Drawing* drawing) {
+    const DrawingOp op = drawing->ops[0];
+
+    memmove(drawing->ops, &drawing->ops[1],
+            (drawing->ops_total - 1) * sizeof(DrawingOp));
+    drawing->ops_total--;
+    drawing->ops_count--;
+    drawing->base_serial = op.serial;
+
+    if (drawing->ops_count == 0)
+        drawing->erase_open = false;
+
+    switch (op.type) {
+        case DRAWING_OP_ADD:
+            break;
+
+        case DRAWING_OP_ERASE: {
+            /* The erased lines are not used by any other operation. Older
+             * operations were dropped already, and newer ones can't have
+             * erased them again. */
+            forget_erased(drawing, &op);
+
+            /* It's the oldest erase, so its lines are at the start */
+            memmove(drawing->erased, &drawing->erased[op.erased_count],
+                    (drawing->erased_i - op.erased_count) * sizeof(int));
+            drawing->erased_i -= op.erased_count;
+
+            for (int i = 0; i < drawing->ops_total; i++)
+                if (drawing->ops[i].type == DRAWING_OP_ERASE)
+                    drawing->ops[i].erased_start -= op.erased_count;
+        } break;
+
+        case DRAWING_OP_CLEAR: {
+            /* The hidden lines can't be shown again */
+            forget_lines(drawing, op.line);
+        } break;
+    }
+}
+
+/* Number of points that are only stored for undoing: the ones of the lines
+ * hidden by a clear, and of the visible lines that were erased. */
+static int history_points(const Drawing* drawing) {
+    int points = line_start(drawing, drawing->first_visible);
+
+    for (int i = 0; i < drawing->ops_count; i++) {
+        const DrawingOp* op = &drawing->ops[i];
+        if (op->type != DRAWING_OP_ERASE)
+            continue;
+
+        for (int j = 0; j < op->erased_count; j++) {
+            const int line = drawing->erased[op->erased_start + j];
+            if (line >= drawing->first_visible)
+                points += drawing->lines[line].count;
+        }
+    }
+
+    return points;
+}
+
+/* Forget the oldest operations while the history is over its limits. See
+ * `DRAWING_HISTORY_SIZE' and `DRAWING_HISTORY_POINTS'. */
+static void history_trim(Drawing* drawing) {
+    while (drawing->ops_count > 0) {
+        const bool too_many = drawing->ops_total > DRAWING_HISTORY_SIZE;
+        const bool too_big  = history_points(drawing) > DRAWING_HISTORY_POINTS;
+        if (!too_many && !too_big)
+            break;
+
+        history_drop_oldest(drawing);
+    }
+}
+
+/* Make sure there is space for one more item in `Drawing.erased' */
+static void reserve_erased(Drawing* drawing) {
+    if (drawing->erased_i < drawing->erased_sz)
+        return;
+
+    drawing->erased_sz *= 2;
+    drawing->erased =
+      realloc(drawing->erased, drawing->erased_sz * sizeof(int));
+    if (!drawing->erased)
+        DIE("Error reallocating the erased lines of the drawing.");
+}
+
+/* Add a new operation to the history, forgetting the ones that could be
+ * redone. Returns a pointer to the operation, which is only valid until the
+ * history changes again. */
+static DrawingOp* history_record(Drawing* drawing, DrawingOpType type) {
+    history_truncate(drawing);
+    drawing->erase_open = false;
+
+    if (drawing->ops_total >= drawing->ops_sz) {
+        drawing->ops_sz *= 2;
+        drawing->ops =
+          realloc(drawing->ops, drawing->ops_sz * sizeof(DrawingOp));
+        if (!drawing->ops)
+            DIE("Error reallocating the history of the drawing.");
+    }
+
+    DrawingOp* op    = &drawing->ops[drawing->ops_total++];
+    op->type         = type;
+    op->serial       = drawing->next_serial++;
+    op->line         = 0;
+    op->prev_line    = 0;
+    op->erased_start = 0;
+    op->erased_count = 0;
+
+    drawing->ops_count = drawing->ops_total;
+    return op;
+}
+
+/* Start a new line in `lines[line_count]', with POINT as its first point */
+static void start_line(Drawing* drawing, DrawingPoint point) {
+    /* The lines that could be redone are overwritten */
+    history_truncate(drawing);
+
+    reserve_line(drawing);
+    reserve_point(drawing);
+
+    DrawingLine* line = &drawing->lines[drawing->line_count];
+    line->col         = point.col;
+    line->width       = point.width;
+    line->origin_x    = point.x;
+    line->origin_y    = point.y;
+    line->start       = drawing->points_i;
+    line->count       = 1;
+    line->erased      = false;
+
+    set_point(drawing, line, 0, point);
+    drawing->points_i++;
+
+    drawing->in_progress  = true;
+    drawing->sector_valid = false;
+}
+
+/* Add a point to the current line. See `drawing_push'. */
+static void push_point(Drawing* drawing, DrawingPoint point) {
+    if (!drawing->in_progress) {
+        start_line(drawing, point);
         return;
+    }
+
+    DrawingLine* line       = &drawing->lines[drawing->line_count];
+    const DrawingPoint last = get_point(drawing, line, line->count - 1);
+
+    /* Too close to the last point, probably jitter */
+    if (point_distance(last, point) < drawing->min_distance) {
+        drawing->stats_removed++;
+        return;
+    }
+
+    /* The point is too far from the origin of the line to be stored. End the
+     * line and continue it in a new one, starting from the last point. If the
+     * point is too far even from there, add the point in the middle first. */
+    if (!fits_in_line(line, point)) {
+        drawing_end_line(drawing);
+        start_line(drawing, last);
+
+        line = &drawing->lines[drawing->line_count];
+        if (!fits_in_line(line, point)) {
+            DrawingPoint middle = point;
+            middle.x            = last.x + (point.x - last.x) / 2;
+            middle.y            = last.y + (point.y - last.y) / 2;
+            push_point(drawing, middle);
+            push_point(drawing, point);
+            return;
+        }
+    }
+
+    /* If the line from the second to last point to the new one passes close
+     * enough to the last point, and to the ones it replaced before, replace
+     * it. Don't go backwards, or we would lose the points that are further
+     * away. */
+    if (line->count > 1) {
+        const DrawingPoint anchor = get_point(drawing, line, line->count - 2);
+        if (point_distance(anchor, point) >= point_distance(anchor, last) &&
+            sector_contains(drawing, anchor, point)) {
+            sector_add(drawing, anchor, point);
+            set_point(drawing, line, line->count - 1, point);
+            drawing->stats_removed++;
+            return;
+        }
+    }
+
+    /* The points of the current line are always at the end of the arrays */
+    reserve_point(drawing);
+    set_point(drawing, line, line->count, point);
+    line->count++;
+    drawing->points_i++;
+
+    /* The previous point is fixed now, start a new sector from it */
+    drawing->sector_valid = false;
+    sector_add(drawing, last, point);
+}
+
+bool drawing_reserve(Drawing* drawing, int lines, int points) {
+    /* One more line for the one that might be drawn after these */
+    const int lines_sz  = drawing->line_count + lines + 1;
+    const int points_sz = drawing->points_i + points;
+
+    if (lines_sz > drawing->lines_sz) {
+        DrawingLine* new_lines =
+          realloc(drawing->lines, lines_sz * sizeof(DrawingLine));
+        if (!new_lines)
+            return false;
+
+        drawing->lines    = new_lines;
+        drawing->lines_sz = lines_sz;
+    }
+
+    if (points_sz > drawing->points_sz) {
+        int16_t* new_xs = realloc(drawing->xs, points_sz * sizeof(int16_t));
+        if (!new_xs)
+            return false;
+        drawing->xs = new_xs;
+
+        int16_t* new_ys = realloc(drawing->ys, points_sz * sizeof(int16_t));
+        if (!new_ys)
+            return false;
+        drawing->ys = new_ys;
+
+        drawing->points_sz = points_sz;
+    }
+
+    return true;
+}
+
+void drawing_add_finished_line(Drawing* drawing, DrawingLine line) {
+    reserve_line(drawing);
 
+    line.start                          = drawing->points_i;
+    line.erased                         = false;
+    drawing->lines[drawing->line_count] = line;
+    drawing->points_i += line.count;
+
+    /* Indexing all the lines of a big file takes longer than loading them,
+     * so it's delayed until the index is used. */
+    drawing->line_count++;
+}
+
+void drawing_push(Drawing* drawing, DrawingPoint point) {
+    drawing->stats_received++;
+    push_point(drawing, point);
+}
+
+bool drawing_in_progress(Drawing* drawing) {
+    return drawing->in_progress;
+}
+
+void drawing_end_line(Drawing* drawing) {
     /* We are not drawing, there is no line to end */
     if (!drawing_in_progress(drawing))
         return;
 
-    /* If the `Drawing.line_ends' array is not big enough to hold the next line,
-     * reallocate */
-    if (drawing->line_count >= drawing->line_ends_sz) {
-        drawing->line_ends_sz += DRAWING_LINES_SIZE;
-        drawing->line_ends =
-          realloc(drawing->line_ends, drawing->line_ends_sz * sizeof(int));
-    }
-
-    /*
-     * The drawing starts like this:
-     *
-     *     line_ends: [0, ...]
-     *     line_count: 0
-     *
-     * After the first call to `drawing_end_line', the count increases and the
-     * array stores the last point.
-     *
-     *     line_ends: [0, 15, ...]
-     *     line_count: 1
-     *
-     * Now we have a line from 0 to 15. The first item should always be zero,
-     * and indicates the start of a line. They update in the next call:
-     *
-     *     line_ends: [0, 15, 21, ...]
-     *     line_count: 2
-     *
-     * Now we have a line from 0 to 15, and a line from 16 to 21. The 15th and
-     * 16th point won't be connected when rendering.
-     */
+    /* Remove the points that don't change the shape of the whole line, and
+     * release their space for the next line. */
+    DrawingLine* line = &drawing->lines[drawing->line_count];
+    simplify_line(drawing, line);
+    drawing->points_i = line->start + line->count;
+
+    /* The line won't change anymore, it can be found by the eraser now. If
+     * there are older lines missing from the index, it will be updated when
+     * it's used. */
+    if (drawing->indexed_lines == drawing->line_count) {
+        index_line(drawing, drawing->line_count);
+        drawing->indexed_lines++;
+    }
 
     /* Increase the number of lines we have drawn */
     drawing->line_count++;
+    drawing->in_progress  = false;
+    drawing->sector_valid = false;
+
+    DrawingOp* op = history_record(drawing, DRAWING_OP_ADD);
+    op->line      = drawing->line_count - 1;
+    history_trim(drawing);
+}
+
+uint32_t drawing_state(const Drawing* drawing) {
+    return (drawing->ops_count > 0)
+             ? drawing->ops[drawing->ops_count - 1].serial
+             : drawing->base_serial;
+}
+
+bool drawing_undo(Drawing* drawing) {
+    drawing_end_line(drawing);
+    drawing->erase_open = false;
+
+    if (drawing->ops_count <= 0)
+        return false;
+
+    const DrawingOp* op = &drawing->ops[--drawing->ops_count];
+    switch (op->type) {
+        case DRAWING_OP_ADD: {
+            /* The line is always the last one, keep its points for redoing */
+            drawing->line_count--;
+        } break;
+
+        case DRAWING_OP_ERASE: {
+            for (int i = 0; i < op->erased_count; i++)
+                drawing->lines[drawing->erased[op->erased_start + i]].erased =
+                  false;
+        } break;
+
+        case DRAWING_OP_CLEAR: {
+            drawing->first_visible = op->prev_line;
+        } break;
+    }
 
-    /* Store the last index of `Drawing.points' where the last line ended. Keep
-     * in mind that `Drawing.points_i' points to the index for the next
-     * insertion, not the index of the last one. */
-    drawing->line_ends[drawing->line_count] = drawing->points_i - 1;
-}
-
-void drawing_store_from_center(Drawing* drawing, int x, int y, Color col) {
-    int win_w, win_h;
-    SDL_GetWindowSize(g_window, &win_w, &win_h);
-
-    /*
-     * Divide window into 4 regions, get position relative to center:
-     *
-     *         |
-     *   x-,y- | x+,y-
-     *   ------+-------
-     *   x-,y+ | x+,y+
-     *         |
-     *
-     */
-    const int win_center_x = win_w / 2;
-    const int win_center_y = win_h / 2;
-    const int win_rel_x    = x - win_center_x;
-    const int win_rel_y    = y - win_center_y;
+    return true;
+}
+
+bool drawing_redo(Drawing* drawing) {
+    /* Starting a line forgets the operations that could be redone */
+    if (drawing->in_progress || drawing->ops_count >= drawing->ops_total)
+        return false;
+
+    drawing->erase_open = false;
+
+    const DrawingOp* op = &drawing->ops[drawing->ops_count++];
+    switch (op->type) {
+        case DRAWING_OP_ADD: {
+            drawing->line_count++;
+        } break;
+
+        case DRAWING_OP_ERASE: {
+            for (int i = 0; i < op->erased_count; i++)
+                drawing->lines[drawing->erased[op->erased_start + i]].erased =
+                  true;
+        } break;
+
+        case DRAWING_OP_CLEAR: {
+            drawing->first_visible = op->line;
+        } break;
+    }
+
+    return true;
+}
+
+void drawing_store_from_view(Drawing* drawing, const View* view, int x, int y,
+                             Color col, uint8_t width) {
+    /* Convert from window to image coordinates, and store the image pixel
+     * that was clicked. */
+    double img_x, img_y;
+    view_to_image(view, x, y, &img_x, &img_y);
+
+    /* The simplifier works in image pixels, but the error should not be
+     * visible at the current zoom. */
+    drawing->tolerance    = DRAWING_TOLERANCE / view->zoom;
+    drawing->min_distance = DRAWING_MIN_DISTANCE / view->zoom;
 
     DrawingPoint point = {
-        .x   = win_rel_x,
-        .y   = win_rel_y,
-        .col = col,
+        .x     = (int)floor(img_x),
+        .y     = (int)floor(img_y),
+        .col   = col,
+        .width = width,
     };
 
     drawing_push(drawing, point);
 }
 
+bool drawing_erase(Drawing* drawing, double x, double y, double radius) {
+    update_index(drawing);
+
+    bool erased = false;
+
+    /* The entries are in all the cells that their line touches, so it's
+     * enough to look at the cells around the position. */
+    const int32_t first_col = SPATIAL_CELL(x - radius);
+    const int32_t last_col  = SPATIAL_CELL(x + radius);
+    const int32_t first_row = SPATIAL_CELL(y - radius);
+    const int32_t last_row  = SPATIAL_CELL(y + radius);
+    for (int32_t cy = first_row; cy <= last_row; cy++) {
+        for (int32_t cx = first_col; cx <= last_col; cx++) {
+            int i = spatial_find(drawing->index, cx, cy);
+            for (; i >= 0; i = drawing->index->entries[i].next) {
+                const SpatialEntry* entry = &drawing->index->entries[i];
+                if (!entry_visible(drawing, entry) ||
+                    entry_distance(drawing, entry, x, y) > radius)
+                    continue;
+
+                /* Continue the erase operation of the previous calls, if
+                 * any. */
+                if (!drawing->erase_open) {
+                    DrawingOp* op =
+                      history_record(drawing, DRAWING_OP_ERASE);
+                    op->erased_start    = drawing->erased_i;
+                    drawing->erase_open = true;
+                }
+
+                reserve_erased(drawing);
+                drawing->erased[drawing->erased_i++] = entry->line;
+                drawing->ops[drawing->ops_count - 1].erased_count++;
+
+                drawing->lines[entry->line].erased = true;
+                erased = true;
+            }
+        }
+    }
+
+    /* The state of the Drawing changed, even if the operation is the same */
+    if (erased) {
+        drawing->ops[drawing->ops_count - 1].serial = drawing->next_serial++;
+        history_trim(drawing);
+    }
+
+    return erased;
+}
+
+void drawing_end_erase(Drawing* drawing) {
+    drawing->erase_open = false;
+}
+
+bool drawing_erase_from_view(Drawing* drawing, const View* view, int x, int y,
+                             double radius) {
+    double img_x, img_y;
+    view_to_image(view, x, y, &img_x, &img_y);
+
+    return drawing_erase(drawing, img_x, img_y, radius / view->zoom);
+}
+
 void drawing_clear(Drawing* drawing) {
-    drawing->points_i   = 0;
-    drawing->line_count = 0;
+    drawing_end_line(drawing);
+
+    /* Nothing to hide */
+    if (drawing->first_visible == drawing->line_count)
+        return;
+
+    DrawingOp* op = history_record(drawing, DRAWING_OP_CLEAR);
+    op->line      = drawing->line_count;
+    op->prev_line = drawing->first_visible;
+
+    drawing->first_visible = drawing->line_count;
+    history_trim(drawing);
 }
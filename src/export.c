@@ -0,0 +1,494 @@
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <png.h>
+#include <zlib.h>
+
+#include "include/image.h"
+#include "include/export.h"
+
+/* Bytes of the previous band used as the dictionary of each band, so matches
+ * can go across bands. It's the size of the window of deflate. */
+#define DICTIONARY_SIZE (32 * 1024)
+
+/* Only RGBA images with 8-bit samples are exported */
+#define BYTES_PER_PIXEL 4
+
+static const char* filter_names[] = {
+    [EXPORT_FILTER_NONE] = "none",   [EXPORT_FILTER_SUB] = "sub",
+    [EXPORT_FILTER_UP] = "up",       [EXPORT_FILTER_AVG] = "avg",
+    [EXPORT_FILTER_PAETH] = "paeth", [EXPORT_FILTER_ADAPTIVE] = "adaptive",
+};
+
+/* Range of rows compressed by a single job, and the result */
+typedef struct Band {
+    int row_start, row_end;
+
+    /* Raw deflate data, without the zlib header and trailer. The band ends
+     * in a byte boundary, so all of them can be joined. */
+    uint8_t* out;
+    size_t out_len;
+
+    /* Checksum of the filtered rows of this band alone */
+    uLong adler;
+} Band;
+
+/* State shared by the threads while exporting an image */
+typedef struct Exporter {
+    const Image* image;
+    const ExportOptions* options;
+
+    /* Filtered rows of the whole image. Each row starts with the type of
+     * filter, followed by the filtered bytes. */
+    uint8_t* filtered;
+    size_t row_size;
+
+    /* Row of zeros, used as the row above the first one */
+    uint8_t* zero_row;
+
+    Band* bands;
+    int band_count;
+
+    /* Index of the next band that has to be processed. Threads take bands
+     * from it until there are none left. */
+    int next_band;
+
+    /* Set by any thread if there was an error */
+    bool failed;
+
+    /* Function called by the threads for each band */
+    void (*func)(struct Exporter* exporter, int band);
+} Exporter;
+
+/*----------------------------------------------------------------------------*/
+/* Filtering */
+
+/* See https://www.w3.org/TR/png/#9Filter-type-4-Paeth */
+static inline uint8_t paeth(int a, int b, int c) {
+    const int p  = a + b - c;
+    const int pa = abs(p - a);
+    const int pb = abs(p - b);
+    const int pc = abs(p - c);
+
+    if (pa <= pb && pa <= pc)
+        return a;
+    if (pb <= pc)
+        return b;
+    return c;
+}
+
+/* Apply a filter to a row of LEN bytes, with the unfiltered row above it in
+ * PREV. The result is written to `out', without the filter type. */
+static void filter_row(ExportFilter filter, const uint8_t* row,
+                       const uint8_t* prev, uint8_t* out, size_t len) {
+    const size_t bpp = BYTES_PER_PIXEL;
+
+    switch (filter) {
+        case EXPORT_FILTER_NONE:
+        case EXPORT_FILTER_ADAPTIVE: {
+            memcpy(out, row, len);
+        } break;
+
+        case EXPORT_FILTER_SUB: {
+            for (size_t i = 0; i < bpp; i++)
+                out[i] = row[i];
+            for (size_t i = bpp; i < len; i++)
+                out[i] = row[i] - row[i - bpp];
+        } break;
+
+        case EXPORT_FILTER_UP: {
+            for (size_t i = 0; i < len; i++)
+                out[i] = row[i] - prev[i];
+        } break;
+
+        case EXPORT_FILTER_AVG: {
+            for (size_t i = 0; i < bpp; i++)
+                out[i] = row[i] - (prev[i] >> 1);
+            for (size_t i = bpp; i < len; i++)
+                out[i] = row[i] - ((row[i - bpp] + prev[i]) >> 1);
+        } break;
+
+        case EXPORT_FILTER_PAETH: {
+            for (size_t i = 0; i < bpp; i++)
+                out[i] = row[i] - paeth(0, prev[i], 0);
+            for (size_t i = bpp; i < len; i++)
+                out[i] =
+                  row[i] - paeth(row[i - bpp], prev[i], prev[i - bpp]);
+        } break;
+    }
+}
+
+/* Sum of the filtered bytes as signed values. Rows with a smaller sum usually
+ * compress better; this is the heuristic used by libpng. */
+static unsigned long filter_cost(const uint8_t* out, size_t len) {
+    unsigned long sum = 0;
+    for (size_t i = 0; i < len; i++)
+        sum += abs((int8_t)out[i]);
+
+    return sum;
+}
+
+/* Filter the rows of a band into `Exporter.filtered' */
+static void filter_band(Exporter* exporter, int band_idx) {
+    const Band* band   = &exporter->bands[band_idx];
+    const Image* image = exporter->image;
+    const size_t len   = image->byte_pitch;
+    const uint8_t* data = image->data;
+
+    /* For the adaptive filter, each row is filtered with all the filters into
+     * this buffer, and the best one is kept. */
+    uint8_t* scratch = NULL;
+    if (exporter->options->filter == EXPORT_FILTER_ADAPTIVE) {
+        scratch = malloc(len);
+        if (!scratch) {
+            __atomic_store_n(&exporter->failed, true, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    for (int y = band->row_start; y < band->row_end; y++) {
+        const uint8_t* row  = &data[(size_t)y * len];
+        const uint8_t* prev = (y > 0) ? row - len : exporter->zero_row;
+        uint8_t* out        = &exporter->filtered[(size_t)y * exporter->row_size];
+
+        if (exporter->options->filter != EXPORT_FILTER_ADAPTIVE) {
+            out[0] = exporter->options->filter;
+            filter_row(exporter->options->filter, row, prev, &out[1], len);
+            continue;
+        }
+
+        unsigned long best_cost = (unsigned long)-1;
+        for (int filter = EXPORT_FILTER_NONE; filter <= EXPORT_FILTER_PAETH;
+             filter++) {
+            filter_row(filter, row, prev, scratch, len);
+
+            const unsigned long cost = filter_cost(scratch, len);
+            if (cost < best_cost) {
+                best_cost = cost;
+                out[0]    = filter;
+                memcpy(&out[1], scratch, len);
+            }
+        }
+    }
+
+    free(scratch);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Compression */
+
+/* Compress the filtered rows of a band into `Band.out'. The last band ends the
+ * deflate stream, and the rest end with an empty block that aligns them to a
+ * byte boundary. */
+static void deflate_band(Exporter* exporter, int band_idx) {
+    Band* band      = &exporter->bands[band_idx];
+    const bool last = (band_idx == exporter->band_count - 1);
+
+    const size_t start = (size_t)band->row_start * exporter->row_size;
+    const size_t len =
+      (size_t)(band->row_end - band->row_start) * exporter->row_size;
+    const uint8_t* in = &exporter->filtered[start];
+
+    band->adler = adler32(adler32(0L, Z_NULL, 0), in, len);
+
+    z_stream strm = { 0 };
+    const int strategy = (exporter->options->filter == EXPORT_FILTER_NONE)
+                           ? Z_DEFAULT_STRATEGY
+                           : Z_FILTERED;
+
+    /* Negative window bits for a raw stream, without header and trailer */
+    if (deflateInit2(&strm, exporter->options->level, Z_DEFLATED, -15, 8,
+                     strategy) != Z_OK) {
+        __atomic_store_n(&exporter->failed, true, __ATOMIC_RELAXED);
+        return;
+    }
+
+    /* The filtered rows of the previous bands are already available, so use
+     * them as the dictionary. This keeps most of the compression ratio of a
+     * single stream. */
+    if (start > 0) {
+        const size_t dict_len = (start < DICTIONARY_SIZE) ? start
+                                                          : DICTIONARY_SIZE;
+        deflateSetDictionary(&strm, in - dict_len, dict_len);
+    }
+
+    /* Add some space for the empty block of Z_SYNC_FLUSH */
+    const size_t out_size = deflateBound(&strm, len) + 16;
+    band->out             = malloc(out_size);
+    if (!band->out) {
+        deflateEnd(&strm);
+        __atomic_store_n(&exporter->failed, true, __ATOMIC_RELAXED);
+        return;
+    }
+
+    strm.next_in   = (Bytef*)in;
+    strm.avail_in  = len;
+    strm.next_out  = band->out;
+    strm.avail_out = out_size;
+
+    const int ret = deflate(&strm, last ? Z_FINISH : Z_SYNC_FLUSH);
+    const bool ok = last ? (ret == Z_STREAM_END)
+                         : (ret == Z_OK && strm.avail_in == 0 &&
+                            strm.avail_out > 0);
+    if (!ok)
+        __atomic_store_n(&exporter->failed, true, __ATOMIC_RELAXED);
+
+    band->out_len = out_size - strm.avail_out;
+    deflateEnd(&strm);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Threads */
+
+static void* worker_thread(void* arg) {
+    Exporter* exporter = arg;
+
+    for (;;) {
+        const int band =
+          __atomic_fetch_add(&exporter->next_band, 1, __ATOMIC_RELAXED);
+        if (band >= exporter->band_count)
+            break;
+
+        exporter->func(exporter, band);
+    }
+
+    return NULL;
+}
+
+/* Call a function for all the bands, from THREADS threads, including the
+ * calling one. Returns when all the bands are done. */
+static void run_parallel(Exporter* exporter, int threads,
+                         void (*func)(Exporter* exporter, int band)) {
+    exporter->func      = func;
+    exporter->next_band = 0;
+
+    pthread_t thread_ids[EXPORT_MAX_THREADS];
+    int started = 0;
+    for (int i = 1; i < threads; i++) {
+        if (pthread_create(&thread_ids[started], NULL, worker_thread,
+                           exporter) != 0)
+            break;
+
+        started++;
+    }
+
+    /* If some threads could not be created, the rest do their work */
+    worker_thread(exporter);
+
+    for (int i = 0; i < started; i++)
+        pthread_join(thread_ids[i], NULL);
+}
+
+static int thread_count(const ExportOptions* options, int band_count) {
+    long threads = options->threads;
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (threads < 1)
+        threads = 1;
+    if (threads > EXPORT_MAX_THREADS)
+        threads = EXPORT_MAX_THREADS;
+    if (threads > band_count)
+        threads = band_count;
+
+    return threads;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Writing */
+
+/* Writes a stream of bytes as IDAT chunks of up to EXPORT_IDAT_SIZE bytes */
+typedef struct IdatWriter {
+    png_structp png;
+
+    /* Bytes left in the current chunk, and in the whole stream */
+    size_t chunk_left, total_left;
+} IdatWriter;
+
+static void idat_write(IdatWriter* writer, const uint8_t* data, size_t len) {
+    static const png_byte idat[5] = "IDAT";
+
+    while (len > 0) {
+        if (writer->chunk_left == 0) {
+            writer->chunk_left = (writer->total_left < EXPORT_IDAT_SIZE)
+                                   ? writer->total_left
+                                   : EXPORT_IDAT_SIZE;
+            png_write_chunk_start(writer->png, idat, writer->chunk_left);
+        }
+
+        const size_t n = (len < writer->chunk_left) ? len : writer->chunk_left;
+        png_write_chunk_data(writer->png, data, n);
+
+        writer->chunk_left -= n;
+        writer->total_left -= n;
+        if (writer->chunk_left == 0)
+            png_write_chunk_end(writer->png);
+
+        data += n;
+        len -= n;
+    }
+}
+
+/* Write the PNG file with the compressed bands. Libpng writes the header and
+ * the chunks, but the image data is already compressed, so the IDAT chunks
+ * are written directly. */
+static bool write_png(const char* filename, const Exporter* exporter) {
+    const Image* image = exporter->image;
+
+    /* The zlib header has the compression level, and a checksum for the
+     * header itself. See RFC 1950. */
+    const int level  = exporter->options->level;
+    const int flevel = (level < 2) ? 0 : (level < 6) ? 1 : (level == 6) ? 2 : 3;
+    unsigned header  = (0x78 << 8) | (flevel << 6);
+    if (header % 31 != 0)
+        header += 31 - header % 31;
+
+    /* Join the checksums of all the bands */
+    uLong adler = adler32(0L, Z_NULL, 0);
+    size_t total = 2 + 4;
+    for (int i = 0; i < exporter->band_count; i++) {
+        const Band* band = &exporter->bands[i];
+        const size_t len =
+          (size_t)(band->row_end - band->row_start) * exporter->row_size;
+
+        adler = adler32_combine(adler, band->adler, len);
+        total += band->out_len;
+    }
+
+    const uint8_t zlib_header[2]  = { header >> 8, header & 0xFF };
+    const uint8_t zlib_trailer[4] = { (adler >> 24) & 0xFF,
+                                      (adler >> 16) & 0xFF,
+                                      (adler >> 8) & 0xFF, adler & 0xFF };
+
+    FILE* fp = fopen(filename, "wb");
+    if (!fp)
+        return false;
+
+    png_structp png =
+      png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png) {
+        fclose(fp);
+        return false;
+    }
+
+    png_infop info = png_create_info_struct(png);
+    if (!info) {
+        png_destroy_write_struct(&png, NULL);
+        fclose(fp);
+        return false;
+    }
+
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_write_struct(&png, &info);
+        fclose(fp);
+        return false;
+    }
+
+    png_init_io(png, fp);
+    png_set_IHDR(png, info, image->w, image->h, 8, PNG_COLOR_TYPE_RGB_ALPHA,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                 PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+
+    IdatWriter writer = {
+        .png        = png,
+        .chunk_left = 0,
+        .total_left = total,
+    };
+
+    idat_write(&writer, zlib_header, sizeof(zlib_header));
+    for (int i = 0; i < exporter->band_count; i++)
+        idat_write(&writer, exporter->bands[i].out,
+                   exporter->bands[i].out_len);
+    idat_write(&writer, zlib_trailer, sizeof(zlib_trailer));
+
+    /* We didn't write the image through libpng, so `png_write_end' would
+     * complain that there are no IDAT chunks. */
+    static const png_byte iend[5] = "IEND";
+    png_write_chunk(png, iend, NULL, 0);
+
+    png_destroy_write_struct(&png, &info);
+    return fclose(fp) == 0;
+}
+
+/*----------------------------------------------------------------------------*/
+
+ExportOptions export_default_options(void) {
+    const ExportOptions options = {
+        .level   = EXPORT_LEVEL_DEFAULT,
+        .filter  = EXPORT_FILTER_ADAPTIVE,
+        .threads = 0,
+    };
+
+    return options;
+}
+
+bool export_parse_filter(const char* name, ExportFilter* filter) {
+    for (size_t i = 0; i < sizeof(filter_names) / sizeof(*filter_names); i++) {
+        if (strcmp(name, filter_names[i]) == 0) {
+            *filter = i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool export_png(const char* filename, const Image* image,
+                const ExportOptions* options) {
+    if (image->data == NULL || image->color_type != PNG_COLOR_TYPE_RGB_ALPHA ||
+        image->bit_depth != 8 || image->w <= 0 || image->h <= 0)
+        return false;
+
+    Exporter exporter = {
+        .image    = image,
+        .options  = options,
+        .row_size = 1 + (size_t)image->byte_pitch,
+        .failed   = false,
+    };
+
+    /* Split the image in bands of whole rows, of about EXPORT_BAND_SIZE
+     * bytes */
+    int band_rows = EXPORT_BAND_SIZE / exporter.row_size;
+    if (band_rows < 1)
+        band_rows = 1;
+
+    exporter.band_count = (image->h + band_rows - 1) / band_rows;
+    exporter.bands      = calloc(exporter.band_count, sizeof(Band));
+    exporter.filtered   = malloc((size_t)image->h * exporter.row_size);
+    exporter.zero_row   = calloc(1, image->byte_pitch);
+
+    bool result = false;
+    if (!exporter.bands || !exporter.filtered || !exporter.zero_row)
+        goto done;
+
+    for (int i = 0; i < exporter.band_count; i++) {
+        exporter.bands[i].row_start = i * band_rows;
+        exporter.bands[i].row_end   = (i + 1) * band_rows;
+        if (exporter.bands[i].row_end > image->h)
+            exporter.bands[i].row_end = image->h;
+    }
+
+    /* All the rows are filtered before compressing, since each band uses the
+     * end of the previous one as its dictionary. */
+    const int threads = thread_count(options, exporter.band_count);
+    run_parallel(&exporter, threads, filter_band);
+    if (!exporter.failed)
+        run_parallel(&exporter, threads, deflate_band);
+
+    if (!exporter.failed)
+        result = write_png(filename, &exporter);
+
+done:
+    if (exporter.bands != NULL)
+        for (int i = 0; i < exporter.band_count; i++)
+            free(exporter.bands[i].out);
+    free(exporter.bands);
+    free(exporter.filtered);
+    free(exporter.zero_row);
+    return result;
+}
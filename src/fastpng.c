@@ -0,0 +1,835 @@
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <png.h>
+
+/* SSE2 is only part of the baseline of x86-64 */
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define FASTPNG_X86 1
+#endif
+
+#include "include/image.h"
+#include "include/convert.h"
+#include "include/source.h"
+#include "include/trace.h"
+#include "include/fastpng.h"
+
+int g_fastpng_threads = 0;
+bool g_fastpng_simd    = true;
+
+/* Size of the PNG signature, and of the IHDR chunk, including its length,
+ * type and CRC */
+#define SIGNATURE_SIZE  8
+#define IHDR_CHUNK_SIZE (12 + 13)
+
+#define CHUNK_TYPE(a, b, c, d)                                                 \
+    (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) |    \
+     (uint32_t)(d))
+
+#define CHUNK_IHDR CHUNK_TYPE('I', 'H', 'D', 'R')
+#define CHUNK_PLTE CHUNK_TYPE('P', 'L', 'T', 'E')
+#define CHUNK_IDAT CHUNK_TYPE('I', 'D', 'A', 'T')
+#define CHUNK_IEND CHUNK_TYPE('I', 'E', 'N', 'D')
+#define CHUNK_tRNS CHUNK_TYPE('t', 'R', 'N', 'S')
+
+/* Chunks whose type starts with an uppercase letter are critical, and the
+ * image can't be decoded without understanding them */
+#define CHUNK_IS_CRITICAL(type) (((type) & 0x20000000) == 0)
+
+/* Filter types of each row, see the PNG specification */
+enum PngFilter {
+    FILTER_NONE,
+    FILTER_SUB,
+    FILTER_UP,
+    FILTER_AVG,
+    FILTER_PAETH,
+    FILTER_COUNT,
+};
+
+/*
+ * Function used for reconstructing a row of `stride' bytes, with pixels of
+ * `bpp' bytes. It receives the filtered bytes `raw', without the filter type,
+ * and the previous reconstructed row `prior', which is all zeros for the first
+ * row. The result is written into `dst', which can be the same as `raw'.
+ */
+typedef void (*unfilter_func_t)(uint8_t* dst, const uint8_t* raw,
+                                const uint8_t* prior, size_t stride, int bpp);
+
+typedef struct PngHeader {
+    int w, h;
+    int color_type;
+
+    /* Bytes of each pixel and of each row, without the filter type */
+    int bpp;
+    size_t stride;
+} PngHeader;
+
+/* Position in the chunks of the file */
+typedef struct ChunkReader {
+    const uint8_t* data;
+    size_t size, pos;
+} ChunkReader;
+
+/* Stage of a band of rows in the ring of the pipeline */
+typedef enum BandState {
+    BAND_EMPTY,
+    BAND_INFLATED,
+    BAND_UNFILTERED,
+} BandState;
+
+/* State of the decoding of an image, shared by the threads of the pipeline */
+typedef struct Decoder {
+    PngHeader header;
+    ChunkReader reader;
+    z_stream zs;
+
+    /* RGBA rows are reconstructed directly in the Image. The rest are
+     * unfiltered in place, and converted with `converter'. */
+    bool is_rgba;
+    RowConverter converter;
+
+    unfilter_func_t unfilter[FILTER_COUNT];
+    Image* image;
+
+    /* Bytes of each row, including its filter type, and rows of each band */
+    size_t filtered_stride;
+    int band_rows, band_count;
+
+    /* Unfiltered row above the next band, for RGB images. All zeros before
+     * the first band, for any image. */
+    uint8_t* prior_row;
+
+    /* Buffers of the pipeline, and the stage of the band in each of them. The
+     * lock protects the states, `next_convert' and `failed'. */
+    uint8_t* ring[FASTPNG_RING_BANDS];
+    BandState states[FASTPNG_RING_BANDS];
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /* Number of convert threads, and next band taken by any of them */
+    int convert_threads;
+    int next_convert;
+
+    /* Set by any thread if there was an error */
+    bool failed;
+} Decoder;
+
+/*----------------------------------------------------------------------------*/
+/* Chunks */
+
+static inline uint32_t read_u32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+/* Read the signature and the IHDR chunk. Returns false if the image is not
+ * supported. The CRC of the chunk is checked later, by `next_chunk'. */
+static bool parse_header(const uint8_t* data, size_t size, PngHeader* header) {
+    if (size < SIGNATURE_SIZE + IHDR_CHUNK_SIZE ||
+        png_sig_cmp(data, 0, SIGNATURE_SIZE) != 0)
+        return false;
+
+    const uint8_t* chunk = &data[SIGNATURE_SIZE];
+    if (read_u32(chunk) != 13 || read_u32(&chunk[4]) != CHUNK_IHDR)
+        return false;
+
+    const uint8_t* body   = &chunk[8];
+    const uint32_t w      = read_u32(&body[0]);
+    const uint32_t h      = read_u32(&body[4]);
+    const int bit_depth   = body[8];
+    const int color_type  = body[9];
+    const int compression = body[10];
+    const int filter      = body[11];
+    const int interlace   = body[12];
+
+    if (w == 0 || h == 0 || w > FASTPNG_MAX_SIZE || h > FASTPNG_MAX_SIZE)
+        return false;
+
+    if (bit_depth != 8 ||
+        (color_type != PNG_COLOR_TYPE_RGB &&
+         color_type != PNG_COLOR_TYPE_RGB_ALPHA) ||
+        compression != 0 || filter != 0 || interlace != 0)
+        return false;
+
+    header->w          = w;
+    header->h          = h;
+    header->color_type = color_type;
+    header->bpp        = (color_type == PNG_COLOR_TYPE_RGB) ? 3 : 4;
+    header->stride     = (size_t)w * header->bpp;
+    return true;
+}
+
+/* Read the next chunk, and check its CRC. Returns false if the file ended, or
+ * if the chunk is corrupt. */
+static bool next_chunk(ChunkReader* reader, uint32_t* type,
+                       const uint8_t** body, uint32_t* length) {
+    if (reader->size - reader->pos < 12)
+        return false;
+
+    const uint8_t* chunk = &reader->data[reader->pos];
+    const uint32_t len   = read_u32(chunk);
+    if (len > 0x7FFFFFFF || len > reader->size - reader->pos - 12)
+        return false;
+
+    /* The CRC covers the type and the body */
+    if (crc32(crc32(0, Z_NULL, 0), &chunk[4], len + 4) !=
+        read_u32(&chunk[8 + len]))
+        return false;
+
+    *type   = read_u32(&chunk[4]);
+    *body   = &chunk[8];
+    *length = len;
+
+    reader->pos += 12 + len;
+    return true;
+}
+
+/* Inflate exactly SIZE bytes into OUT, feeding the next IDAT chunks to zlib
+ * as needed. Returns false if the image data ends early, or if it's
+ * corrupt. */
+static bool inflate_band(z_stream* zs, ChunkReader* reader, uint8_t* out,
+                         size_t size) {
+    zs->next_out  = out;
+    zs->avail_out = size;
+
+    while (zs->avail_out > 0) {
+        if (zs->avail_in == 0) {
+            uint32_t type, length;
+            const uint8_t* body;
+            if (!next_chunk(reader, &type, &body, &length) ||
+                type != CHUNK_IDAT)
+                return false;
+
+            zs->next_in  = (Bytef*)body;
+            zs->avail_in = length;
+            continue;
+        }
+
+        const int ret = inflate(zs, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END)
+            return zs->avail_out == 0;
+        if (ret != Z_OK)
+            return false;
+    }
+
+    return true;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Portable unfiltering, used as a fallback */
+
+static void unfilter_none(uint8_t* dst, const uint8_t* raw,
+                          const uint8_t* prior, size_t stride, int bpp) {
+    (void)prior;
+    (void)bpp;
+    if (dst != raw)
+        memcpy(dst, raw, stride);
+}
+
+static void unfilter_up_scalar(uint8_t* dst, const uint8_t* raw,
+                               const uint8_t* prior, size_t stride, int bpp) {
+    (void)bpp;
+    for (size_t i = 0; i < stride; i++)
+        dst[i] = raw[i] + prior[i];
+}
+
+static inline uint8_t paeth_predictor(int a, int b, int c) {
+    const int pa = abs(b - c);
+    const int pb = abs(a - c);
+    const int pc = abs(a + b - 2 * c);
+
+    if (pa <= pb && pa <= pc)
+        return a;
+    if (pb <= pc)
+        return b;
+    return c;
+}
+
+static void unfilter_sub_scalar(uint8_t* dst, const uint8_t* raw,
+                                const uint8_t* prior, size_t stride, int bpp) {
+    (void)prior;
+    for (size_t i = 0; i < stride; i++)
+        dst[i] = raw[i] + ((i >= (size_t)bpp) ? dst[i - bpp] : 0);
+}
+
+static void unfilter_avg_scalar(uint8_t* dst, const uint8_t* raw,
+                                const uint8_t* prior, size_t stride, int bpp) {
+    for (size_t i = 0; i < stride; i++) {
+        const int a = (i >= (size_t)bpp) ? dst[i - bpp] : 0;
+        dst[i]      = raw[i] + ((a + prior[i]) >> 1);
+    }
+}
+
+static void unfilter_paeth_scalar(uint8_t* dst, const uint8_t* raw,
+                                  const uint8_t* prior, size_t stride,
+                                  int bpp) {
+    for (size_t i = 0; i < stride; i++) {
+        const bool first = i < (size_t)bpp;
+        dst[i]           = raw[i] + paeth_predictor(first ? 0 : dst[i - bpp],
+                                                    prior[i],
+                                                    first ? 0 : prior[i - bpp]);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/* Vectorized unfiltering */
+
+#ifdef FASTPNG_X86
+/* Load and store a single pixel of 3 or 4 bytes in the low bytes of a
+ * register */
+static inline __m128i load_pixel(const uint8_t* p, int bpp) {
+    uint32_t value = 0;
+    memcpy(&value, p, bpp);
+    return _mm_cvtsi32_si128((int)value);
+}
+
+static inline void store_pixel(uint8_t* p, __m128i pixel, int bpp) {
+    const uint32_t value = (uint32_t)_mm_cvtsi128_si32(pixel);
+    memcpy(p, &value, bpp);
+}
+
+/* Each pixel depends on the previous one, so they are processed one by one,
+ * except for 4-byte pixels, where the sums of 4 pixels are calculated at
+ * once */
+static inline void sub_pixels_sse2(uint8_t* dst, const uint8_t* raw,
+                                   size_t stride, int bpp) {
+    __m128i a = _mm_setzero_si128();
+    size_t i  = 0;
+
+    if (bpp == 4) {
+        for (; i + 16 <= stride; i += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i*)&raw[i]);
+            x         = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+            x         = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+            x         = _mm_add_epi8(x, a);
+            _mm_storeu_si128((__m128i*)&dst[i], x);
+
+            /* The last pixel is added to the next ones */
+            a = _mm_shuffle_epi32(x, 0xFF);
+        }
+    }
+
+    for (; i < stride; i += bpp) {
+        a = _mm_add_epi8(load_pixel(&raw[i], bpp), a);
+        store_pixel(&dst[i], a, bpp);
+    }
+}
+
+static void unfilter_sub_sse2(uint8_t* dst, const uint8_t* raw,
+                              const uint8_t* prior, size_t stride, int bpp) {
+    (void)prior;
+    if (bpp == 4)
+        sub_pixels_sse2(dst, raw, stride, 4);
+    else
+        sub_pixels_sse2(dst, raw, stride, 3);
+}
+
+/* The bytes don't depend on each other, so process 16 at a time */
+static void unfilter_up_sse2(uint8_t* dst, const uint8_t* raw,
+                             const uint8_t* prior, size_t stride, int bpp) {
+    size_t i = 0;
+    for (; i + 16 <= stride; i += 16) {
+        const __m128i x = _mm_loadu_si128((const __m128i*)&raw[i]);
+        const __m128i b = _mm_loadu_si128((const __m128i*)&prior[i]);
+        _mm_storeu_si128((__m128i*)&dst[i], _mm_add_epi8(x, b));
+    }
+
+    unfilter_up_scalar(&dst[i], &raw[i], &prior[i], stride - i, bpp);
+}
+
+__attribute__((target("avx2"))) static void
+unfilter_up_avx2(uint8_t* dst, const uint8_t* raw, const uint8_t* prior,
+                 size_t stride, int bpp) {
+    size_t i = 0;
+    for (; i + 32 <= stride; i += 32) {
+        const __m256i x = _mm256_loadu_si256((const __m256i*)&raw[i]);
+        const __m256i b = _mm256_loadu_si256((const __m256i*)&prior[i]);
+        _mm256_storeu_si256((__m256i*)&dst[i], _mm256_add_epi8(x, b));
+    }
+
+    unfilter_up_sse2(&dst[i], &raw[i], &prior[i], stride - i, bpp);
+}
+
+static inline void avg_pixels_sse2(uint8_t* dst, const uint8_t* raw,
+                                   const uint8_t* prior, size_t stride,
+                                   int bpp) {
+    const __m128i one = _mm_set1_epi8(1);
+    __m128i a         = _mm_setzero_si128();
+
+    for (size_t i = 0; i < stride; i += bpp) {
+        const __m128i b = load_pixel(&prior[i], bpp);
+
+        /* `_mm_avg_epu8' rounds up, but the filter rounds down */
+        __m128i avg = _mm_avg_epu8(a, b);
+        avg = _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b), one));
+
+        a = _mm_add_epi8(load_pixel(&raw[i], bpp), avg);
+        store_pixel(&dst[i], a, bpp);
+    }
+}
+
+static void unfilter_avg_sse2(uint8_t* dst, const uint8_t* raw,
+                              const uint8_t* prior, size_t stride, int bpp) {
+    if (bpp == 4)
+        avg_pixels_sse2(dst, raw, prior, stride, 4);
+    else
+        avg_pixels_sse2(dst, raw, prior, stride, 3);
+}
+
+static inline __m128i abs_epi16_sse2(__m128i x) {
+    return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+static inline __m128i select_sse2(__m128i mask, __m128i a, __m128i b) {
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+/* The predictor is calculated with 16 bits for each byte of the pixel, for
+ * the sums not to overflow. See the PNG specification. */
+static inline void paeth_pixels_sse2(uint8_t* dst, const uint8_t* raw,
+                                     const uint8_t* prior, size_t stride,
+                                     int bpp) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a          = zero;
+    __m128i c          = zero;
+
+    for (size_t i = 0; i < stride; i += bpp) {
+        const __m128i b =
+          _mm_unpacklo_epi8(load_pixel(&prior[i], bpp), zero);
+
+        const __m128i b_c = _mm_sub_epi16(b, c);
+        const __m128i a_c = _mm_sub_epi16(a, c);
+        const __m128i pa  = abs_epi16_sse2(b_c);
+        const __m128i pb  = abs_epi16_sse2(a_c);
+        const __m128i pc  = abs_epi16_sse2(_mm_add_epi16(b_c, a_c));
+
+        /* On ties, `a' is preferred over `b', and `b' over `c' */
+        const __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+        const __m128i nearest =
+          select_sse2(_mm_cmpeq_epi16(pa, smallest), a,
+                      select_sse2(_mm_cmpeq_epi16(pb, smallest), b, c));
+
+        const __m128i x = _mm_add_epi8(load_pixel(&raw[i], bpp),
+                                       _mm_packus_epi16(nearest, nearest));
+        store_pixel(&dst[i], x, bpp);
+
+        a = _mm_unpacklo_epi8(x, zero);
+        c = b;
+    }
+}
+
+static void unfilter_paeth_sse2(uint8_t* dst, const uint8_t* raw,
+                                const uint8_t* prior, size_t stride, int bpp) {
+    if (bpp == 4)
+        paeth_pixels_sse2(dst, raw, prior, stride, 4);
+    else
+        paeth_pixels_sse2(dst, raw, prior, stride, 3);
+}
+#endif /* FASTPNG_X86 */
+
+/* Get the fastest functions supported by the CPU for each filter type, or the
+ * portable ones if `g_fastpng_simd' is false */
+static void get_unfilter_funcs(unfilter_func_t funcs[FILTER_COUNT]) {
+    funcs[FILTER_NONE]  = unfilter_none;
+    funcs[FILTER_SUB]   = unfilter_sub_scalar;
+    funcs[FILTER_UP]    = unfilter_up_scalar;
+    funcs[FILTER_AVG]   = unfilter_avg_scalar;
+    funcs[FILTER_PAETH] = unfilter_paeth_scalar;
+
+#ifdef FASTPNG_X86
+    if (!g_fastpng_simd)
+        return;
+
+    funcs[FILTER_SUB]   = unfilter_sub_sse2;
+    funcs[FILTER_UP]    = __builtin_cpu_supports("avx2") ? unfilter_up_avx2
+                                                         : unfilter_up_sse2;
+    funcs[FILTER_AVG]   = unfilter_avg_sse2;
+    funcs[FILTER_PAETH] = unfilter_paeth_sse2;
+#endif
+}
+
+/*----------------------------------------------------------------------------*/
+/* Bands */
+
+/* Unfilter the COUNT rows of a band, starting at ROW_START. The rows of RGBA
+ * images are written into the Image, and the rest in place, to be converted
+ * by `convert_band'. Returns false if the filter type of a row is not
+ * valid. */
+static bool unfilter_band(Decoder* dec, uint8_t* band, int row_start,
+                          int count) {
+    const size_t stride = dec->header.stride;
+    uint8_t* pixels     = dec->image->data;
+
+    for (int i = 0; i < count; i++) {
+        const int row     = row_start + i;
+        uint8_t* filtered = &band[(size_t)i * dec->filtered_stride];
+        if (filtered[0] >= FILTER_COUNT)
+            return false;
+
+        uint8_t* dst;
+        const uint8_t* prior;
+        if (dec->is_rgba) {
+            dst   = &pixels[(size_t)row * dec->image->byte_pitch];
+            prior = (row == 0)
+                      ? dec->prior_row
+                      : &pixels[(size_t)(row - 1) * dec->image->byte_pitch];
+        } else {
+            dst   = &filtered[1];
+            prior = (i == 0) ? dec->prior_row
+                             : &filtered[1] - dec->filtered_stride;
+        }
+
+        dec->unfilter[filtered[0]](dst, &filtered[1], prior, stride,
+                                   dec->header.bpp);
+    }
+
+    /* The band might be reused before the next one is unfiltered */
+    if (!dec->is_rgba)
+        memcpy(dec->prior_row,
+               &band[(size_t)(count - 1) * dec->filtered_stride + 1], stride);
+
+    return true;
+}
+
+/* Convert the COUNT rows of a band that were unfiltered in place, starting at
+ * ROW_START, into the Image */
+static void convert_band(const Decoder* dec, const uint8_t* band,
+                         int row_start, int count) {
+    uint8_t* pixels = dec->image->data;
+
+    for (int i = 0; i < count; i++)
+        convert_row(&dec->converter,
+                    &band[(size_t)i * dec->filtered_stride + 1],
+                    &pixels[(size_t)(row_start + i) * dec->image->byte_pitch],
+                    dec->header.w);
+}
+
+/* Number of rows of a band */
+static inline int band_rows(const Decoder* dec, int band) {
+    const int row_start = band * dec->band_rows;
+    return (dec->header.h - row_start < dec->band_rows)
+             ? dec->header.h - row_start
+             : dec->band_rows;
+}
+
+/* Decode all the bands in the calling thread, reusing a single buffer */
+static bool decode_serial(Decoder* dec) {
+    uint8_t* band = malloc((size_t)dec->band_rows * dec->filtered_stride);
+    if (!band)
+        return false;
+
+    bool ok = true;
+    for (int i = 0; ok && i < dec->band_count; i++) {
+        const int row_start = i * dec->band_rows;
+        const int count     = band_rows(dec, i);
+
+        ok = inflate_band(&dec->zs, &dec->reader, band,
+                          (size_t)count * dec->filtered_stride) &&
+             unfilter_band(dec, band, row_start, count);
+
+        if (ok && !dec->is_rgba)
+            convert_band(dec, band, row_start, count);
+    }
+
+    free(band);
+    return ok;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Pipeline */
+
+/* Mark the decoding as failed, and wake up the threads waiting for a band */
+static void pipeline_fail(Decoder* dec) {
+    pthread_mutex_lock(&dec->lock);
+    dec->failed = true;
+    pthread_cond_broadcast(&dec->cond);
+    pthread_mutex_unlock(&dec->lock);
+}
+
+/* Wait until BAND is in STATE, in its buffer of the ring. Returns false if
+ * another thread failed. Must be called with the lock held. */
+static bool pipeline_wait(Decoder* dec, int band, BandState state) {
+    while (!dec->failed && dec->states[band % FASTPNG_RING_BANDS] != state)
+        pthread_cond_wait(&dec->cond, &dec->lock);
+
+    return !dec->failed;
+}
+
+static void pipeline_set(Decoder* dec, int band, BandState state) {
+    pthread_mutex_lock(&dec->lock);
+    dec->states[band % FASTPNG_RING_BANDS] = state;
+    pthread_cond_broadcast(&dec->cond);
+    pthread_mutex_unlock(&dec->lock);
+}
+
+/* Unfilter the bands in order, since each row depends on the previous one.
+ * If there are no convert threads, it also converts them. */
+static void* unfilter_thread(void* arg) {
+    Decoder* dec = arg;
+    trace_thread_name("fastpng-unfilter");
+
+    const uint64_t span = trace_begin();
+    for (int i = 0; i < dec->band_count; i++) {
+        pthread_mutex_lock(&dec->lock);
+        const bool ok = pipeline_wait(dec, i, BAND_INFLATED);
+        pthread_mutex_unlock(&dec->lock);
+        if (!ok)
+            break;
+
+        uint8_t* band       = dec->ring[i % FASTPNG_RING_BANDS];
+        const int row_start = i * dec->band_rows;
+        const int count     = band_rows(dec, i);
+        if (!unfilter_band(dec, band, row_start, count)) {
+            pipeline_fail(dec);
+            break;
+        }
+
+        if (!dec->is_rgba && dec->convert_threads == 0)
+            convert_band(dec, band, row_start, count);
+
+        pipeline_set(dec, i,
+                     (dec->is_rgba || dec->convert_threads == 0)
+                       ? BAND_EMPTY
+                       : BAND_UNFILTERED);
+    }
+    trace_end("fastpng_unfilter", span);
+
+    return NULL;
+}
+
+/* Take the unfiltered bands in order, and convert them into the Image. The
+ * bands don't depend on each other, so there can be several of these
+ * threads. */
+static void* convert_thread(void* arg) {
+    Decoder* dec = arg;
+    trace_thread_name("fastpng-convert");
+
+    for (;;) {
+        pthread_mutex_lock(&dec->lock);
+        while (!dec->failed && dec->next_convert < dec->band_count &&
+               dec->states[dec->next_convert % FASTPNG_RING_BANDS] !=
+                 BAND_UNFILTERED)
+            pthread_cond_wait(&dec->cond, &dec->lock);
+
+        if (dec->failed || dec->next_convert >= dec->band_count) {
+            pthread_mutex_unlock(&dec->lock);
+            break;
+        }
+
+        const int i = dec->next_convert++;
+        pthread_mutex_unlock(&dec->lock);
+
+        convert_band(dec, dec->ring[i % FASTPNG_RING_BANDS],
+                     i * dec->band_rows, band_rows(dec, i));
+        pipeline_set(dec, i, BAND_EMPTY);
+    }
+
+    return NULL;
+}
+
+/* Decode the bands with a pipeline of threads: the calling one inflates them
+ * into a ring of buffers, another one unfilters them, and the rest convert
+ * them. When the ring is full, the inflating thread waits for a buffer to be
+ * emptied, so the memory is bounded. THREADS is the total number of threads,
+ * including the calling one. */
+static bool decode_pipelined(Decoder* dec, int threads) {
+    const size_t band_size = (size_t)dec->band_rows * dec->filtered_stride;
+
+    bool ok = true;
+    for (int i = 0; i < FASTPNG_RING_BANDS; i++) {
+        dec->ring[i]   = malloc(band_size);
+        dec->states[i] = BAND_EMPTY;
+        ok             = ok && dec->ring[i] != NULL;
+    }
+
+    pthread_mutex_init(&dec->lock, NULL);
+    pthread_cond_init(&dec->cond, NULL);
+    dec->next_convert = 0;
+    dec->failed       = !ok;
+
+    /* The convert threads are started first, so the unfilter thread knows if
+     * it has to convert the bands itself */
+    pthread_t convert_ids[FASTPNG_MAX_THREADS];
+    dec->convert_threads = 0;
+    for (int i = 2; ok && !dec->is_rgba && i < threads; i++) {
+        if (pthread_create(&convert_ids[dec->convert_threads], NULL,
+                           convert_thread, dec) != 0)
+            break;
+
+        dec->convert_threads++;
+    }
+
+    pthread_t unfilter_id;
+    const bool unfilter_started =
+      ok && pthread_create(&unfilter_id, NULL, unfilter_thread, dec) == 0;
+    if (!unfilter_started)
+        pipeline_fail(dec);
+
+    for (int i = 0; unfilter_started && i < dec->band_count; i++) {
+        pthread_mutex_lock(&dec->lock);
+        const bool empty = pipeline_wait(dec, i, BAND_EMPTY);
+        pthread_mutex_unlock(&dec->lock);
+        if (!empty)
+            break;
+
+        if (!inflate_band(&dec->zs, &dec->reader,
+                          dec->ring[i % FASTPNG_RING_BANDS],
+                          (size_t)band_rows(dec, i) * dec->filtered_stride)) {
+            pipeline_fail(dec);
+            break;
+        }
+
+        pipeline_set(dec, i, BAND_INFLATED);
+    }
+
+    if (unfilter_started)
+        pthread_join(unfilter_id, NULL);
+    for (int i = 0; i < dec->convert_threads; i++)
+        pthread_join(convert_ids[i], NULL);
+
+    pthread_cond_destroy(&dec->cond);
+    pthread_mutex_destroy(&dec->lock);
+
+    for (int i = 0; i < FASTPNG_RING_BANDS; i++)
+        free(dec->ring[i]);
+
+    return !dec->failed;
+}
+
+/* Get the number of threads used for decoding an image, including the calling
+ * one. See `g_fastpng_threads'. */
+static int thread_count(const PngHeader* header) {
+    if ((int64_t)header->w * header->h < FASTPNG_PIPELINE_PIXELS)
+        return 1;
+
+    long threads = g_fastpng_threads;
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (threads < 1)
+        threads = 1;
+    if (threads > FASTPNG_MAX_THREADS)
+        threads = FASTPNG_MAX_THREADS;
+
+    return threads;
+}
+
+/*----------------------------------------------------------------------------*/
+
+Image* fastpng_decode(const uint8_t* data, size_t size) {
+    Decoder dec;
+    if (!parse_header(data, size, &dec.header))
+        return NULL;
+
+    const uint64_t span = trace_begin();
+
+    /* Read the chunks before the image data. Ancillary chunks don't change
+     * the pixels decoded by `image_read_file', except for tRNS. */
+    dec.reader = (ChunkReader){ data, size, SIGNATURE_SIZE };
+    uint32_t type, length;
+    const uint8_t* body;
+    uint16_t trns[3];
+    bool has_trns = false;
+
+    for (;;) {
+        if (!next_chunk(&dec.reader, &type, &body, &length))
+            return NULL;
+
+        if (type == CHUNK_IDAT)
+            break;
+
+        if (type == CHUNK_tRNS) {
+            /* Not valid for images with an alpha channel, libpng ignores
+             * it */
+            if (dec.header.color_type != PNG_COLOR_TYPE_RGB)
+                continue;
+            if (length != 6)
+                return NULL;
+
+            for (int i = 0; i < 3; i++)
+                trns[i] = (body[i * 2] << 8) | body[i * 2 + 1];
+            has_trns = true;
+        } else if (CHUNK_IS_CRITICAL(type) && type != CHUNK_IHDR &&
+                   type != CHUNK_PLTE) {
+            /* Including IEND before any image data */
+            return NULL;
+        }
+    }
+
+    /* RGBA rows are reconstructed directly in the Image */
+    dec.is_rgba = dec.header.color_type == PNG_COLOR_TYPE_RGB_ALPHA;
+    if (!dec.is_rgba &&
+        !convert_init_layout(&dec.converter, dec.header.color_type, 8,
+                             has_trns ? trns : NULL))
+        return NULL;
+
+    get_unfilter_funcs(dec.unfilter);
+
+    Image* image = malloc(sizeof(Image));
+    if (!image)
+        return NULL;
+
+    image->mapping      = NULL;
+    image->mapping_size = 0;
+    image->shared       = NULL;
+    image->w            = dec.header.w;
+    image->h            = dec.header.h;
+    image->color_type   = PNG_COLOR_TYPE_RGB_ALPHA;
+    image->bit_depth    = 8;
+    image->byte_pitch   = dec.header.w * 4;
+    image->data         = malloc((size_t)image->h * image->byte_pitch);
+    dec.image           = image;
+
+    /* The rows are inflated in bands, each with its filter type */
+    dec.filtered_stride = dec.header.stride + 1;
+    dec.band_rows       = FASTPNG_BAND_BYTES / dec.filtered_stride;
+    if (dec.band_rows < 1)
+        dec.band_rows = 1;
+    dec.band_count = (dec.header.h + dec.band_rows - 1) / dec.band_rows;
+
+    dec.prior_row = calloc(dec.header.stride, 1);
+
+    dec.zs = (z_stream){ 0 };
+    const bool alloced =
+      image->data && dec.prior_row && inflateInit(&dec.zs) == Z_OK;
+
+    dec.zs.next_in  = (Bytef*)body;
+    dec.zs.avail_in = length;
+
+    bool ok = false;
+    if (alloced) {
+        const int threads = thread_count(&dec.header);
+        ok = (threads > 1) ? decode_pipelined(&dec, threads)
+                           : decode_serial(&dec);
+        inflateEnd(&dec.zs);
+    }
+
+    free(dec.prior_row);
+
+    if (!ok) {
+        image_free(image);
+        return NULL;
+    }
+
+    trace_end("fastpng_decode", span);
+    return image;
+}
+
+Image* fastpng_read_file(const char* filename) {
+    Source* source = source_open(filename);
+    if (!source)
+        return NULL;
+
+    size_t size;
+    const uint8_t* contents = source_contents(source, &size);
+    Image* image = contents ? fastpng_decode(contents, size) : NULL;
+
+    source_close(source);
+    return image;
+}
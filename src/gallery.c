@@ -0,0 +1,669 @@
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <SDL2/SDL.h>
+
+#include "include/util.h"
+#include "include/image.h"
+#include "include/fastpng.h"
+#include "include/source.h"
+#include "include/diskcache.h"
+#include "include/mipmap.h"
+#include "include/tiles.h"
+#include "include/drawing.h"
+#include "include/trace.h"
+#include "include/gallery.h"
+
+/* Growing list of paths, used while expanding the directories */
+typedef struct PathList {
+    char** paths;
+    int count, size;
+} PathList;
+
+static bool path_list_push(PathList* list, char* path) {
+    if (path == NULL)
+        return false;
+
+    if (list->count >= list->size) {
+        const int new_size = (list->size == 0) ? 16 : list->size * 2;
+        char** new_paths =
+          realloc(list->paths, new_size * sizeof(char*));
+        if (new_paths == NULL) {
+            free(path);
+            return false;
+        }
+
+        list->paths = new_paths;
+        list->size  = new_size;
+    }
+
+    list->paths[list->count++] = path;
+    return true;
+}
+
+static int compare_paths(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/* Add the PNG files inside of DIR to the list, sorted by name. Returns false
+ * if there is not enough memory. */
+static bool push_directory(PathList* list, const char* dir) {
+    DIR* dp = opendir(dir);
+    if (dp == NULL) {
+        fprintf(stderr, "hl-png: Could not open directory: %s\n", dir);
+        return true;
+    }
+
+    const int first      = list->count;
+    const size_t dir_len = strlen(dir);
+
+    struct dirent* ent;
+    while ((ent = readdir(dp)) != NULL) {
+        const size_t name_len = strlen(ent->d_name);
+        if (name_len < 4 ||
+            strcasecmp(&ent->d_name[name_len - 4], ".png") != 0)
+            continue;
+
+        /* Skip the images exported by us, see `gallery_new' */
+        if (name_len >= 7 &&
+            strcasecmp(&ent->d_name[name_len - 7], "-hl.png") == 0)
+            continue;
+
+        char* path = malloc(dir_len + name_len + 2);
+        if (path != NULL)
+            sprintf(path, "%s/%s", dir, ent->d_name);
+
+        if (!path_list_push(list, path)) {
+            closedir(dp);
+            return false;
+        }
+    }
+
+    closedir(dp);
+
+    qsort(&list->paths[first], list->count - first, sizeof(char*),
+          compare_paths);
+    return true;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Estimate the bytes of an RGBA image of W*H pixels and its mip levels, which
+ * add a third of its size */
+static size_t estimate_bytes(int w, int h) {
+    const size_t bytes = (size_t)w * h * 4;
+    return bytes + bytes / 3;
+}
+
+/* Get the bytes of pixels of an image in CPU memory, including its mip
+ * levels. While it's being prefetched, it's estimated from its size. */
+static size_t entry_cpu_bytes(const GalleryImage* entry) {
+    if (entry->prefetching)
+        return entry->prefetch_cancel ? 0 : estimate_bytes(entry->w, entry->h);
+
+    size_t bytes = 0;
+    if (entry->image != NULL && entry->image->data != NULL)
+        bytes += (size_t)entry->image->h * entry->image->byte_pitch;
+
+    if (entry->mipmap != NULL) {
+        for (int i = 1; i < entry->mipmap->count; i++) {
+            const Image* level = entry->mipmap->levels[i];
+            if (level->data != NULL)
+                bytes += (size_t)level->h * level->byte_pitch;
+        }
+    }
+
+    return bytes;
+}
+
+/* Get the bytes of the textures of an image */
+static size_t entry_gpu_bytes(const GalleryImage* entry) {
+    size_t bytes = 0;
+    for (int i = 0; i < MIPMAP_MAX_LEVELS; i++)
+        if (entry->level_tiles[i] != NULL)
+            bytes += tiles_resident_bytes(entry->level_tiles[i]);
+
+    return bytes;
+}
+
+/* Free the tiles of all the levels of an image, and their textures */
+static void entry_free_tiles(GalleryImage* entry) {
+    for (int i = 0; i < MIPMAP_MAX_LEVELS; i++) {
+        if (entry->level_tiles[i] != NULL) {
+            tiles_free(entry->level_tiles[i]);
+            entry->level_tiles[i] = NULL;
+        }
+    }
+}
+
+/* Create the tiles of the levels of an image that don't have them yet. Like
+ * the mip levels themselves, they are always filtered linearly. */
+static bool entry_create_tiles(GalleryImage* entry) {
+    bool created = false;
+
+    if (entry->level_tiles[0] == NULL) {
+        entry->level_tiles[0] = tiles_new(entry->image);
+        if (entry->level_tiles[0] == NULL)
+            DIE("Error allocating the tiles for the image.");
+        created = true;
+
+        /* The rest of the rows are still being decoded */
+        if (entry->loader != NULL)
+            tiles_set_ready_rows(entry->level_tiles[0],
+                                 image_loader_ready_rows(entry->loader));
+    }
+
+    if (entry->mipmap == NULL)
+        return created;
+
+    for (int i = 1; i < entry->mipmap->count; i++) {
+        if (entry->level_tiles[i] != NULL)
+            continue;
+
+        entry->level_tiles[i] = tiles_new(entry->mipmap->levels[i]);
+        if (entry->level_tiles[i] == NULL)
+            DIE("Error allocating the tiles for a mip level.");
+
+        entry->level_tiles[i]->linear = true;
+        created                       = true;
+    }
+
+    return created;
+}
+
+/* Free the pixels and textures of an image, keeping its drawing and view. If
+ * it's being prefetched, the thread is stopped and the results are freed by
+ * `gallery_update'. */
+static void entry_evict(GalleryImage* entry) {
+    if (entry->prefetching) {
+        __atomic_store_n(&entry->prefetch_cancel, true, __ATOMIC_RELAXED);
+        return;
+    }
+
+    entry_free_tiles(entry);
+
+    if (entry->mipmap != NULL) {
+        mipmap_free(entry->mipmap);
+        entry->mipmap = NULL;
+    }
+
+    /* The loader owns the image until it's complete */
+    if (entry->loader != NULL) {
+        image_loader_free(entry->loader);
+        entry->loader = NULL;
+    } else if (entry->image != NULL) {
+        image_free(entry->image);
+    }
+    entry->image = NULL;
+}
+
+/* Wait for the prefetch thread of an image, and take its results. Returns
+ * false if they were discarded. */
+static bool entry_join_prefetch(GalleryImage* entry) {
+    pthread_join(entry->prefetch_thread, NULL);
+    entry->prefetching   = false;
+    entry->prefetch_done = false;
+
+    if (entry->prefetch_cancel) {
+        entry->prefetch_cancel = false;
+        entry_evict(entry);
+        return false;
+    }
+
+    if (entry->image == NULL) {
+        entry->failed = true;
+        return false;
+    }
+
+    return true;
+}
+
+/* Decode an image and generate its mip levels, without showing it */
+static void* prefetch_thread(void* arg) {
+    GalleryImage* entry = arg;
+    trace_thread_name("prefetch");
+
+    const uint64_t span = trace_begin();
+
+    /* Decoded by an earlier run, see `diskcache_load' */
+    DiskCacheKey key;
+    const bool cached =
+      diskcache_enabled() && diskcache_key(entry->path, &key);
+    Image* image = cached ? diskcache_load(entry->path, &key) : NULL;
+
+    /* Nothing is shown until the whole image is decoded, so the fast decoder
+     * can be used instead of the progressive one, if the image supports it */
+    if (image == NULL && g_image_fastpng)
+        image = fastpng_read_file(entry->path);
+
+    if (image != NULL) {
+        if (!__atomic_load_n(&entry->prefetch_cancel, __ATOMIC_RELAXED)) {
+            if (cached)
+                diskcache_store_async(entry->path, &key, image);
+
+            entry->image  = image;
+            entry->mipmap = mipmap_new(entry->image);
+        } else {
+            image_free(image);
+        }
+    }
+
+    ImageLoader* loader =
+      (image == NULL) ? image_loader_new(entry->path) : NULL;
+    if (loader != NULL) {
+        while (!__atomic_load_n(&entry->prefetch_cancel, __ATOMIC_RELAXED) &&
+               image_loader_step(loader))
+            ;
+
+        /* If it failed, the rows that were decoded are shown */
+        if (loader->image != NULL &&
+            !__atomic_load_n(&entry->prefetch_cancel, __ATOMIC_RELAXED)) {
+            if (loader->failed)
+                fprintf(stderr,
+                        "hl-png: Could not decode the whole image: %s\n",
+                        entry->path);
+            else if (cached)
+                diskcache_store_async(entry->path, &key, loader->image);
+
+            entry->image  = image_loader_take_image(loader);
+            entry->mipmap = mipmap_new(entry->image);
+        }
+
+        image_loader_free(loader);
+    }
+    trace_end("prefetch", span);
+
+    __atomic_store_n(&entry->prefetch_done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* Start decoding an image ahead of time, if it's not cached yet */
+static void prefetch(Gallery* gallery, GalleryImage* entry) {
+    /* It's going to be used soon, so it's not the first to be evicted */
+    entry->last_used = ++gallery->tick;
+
+    if (entry->stream || entry->prefetching || entry->failed ||
+        entry->image != NULL || entry->loader != NULL)
+        return;
+
+    if (entry->w == 0 && !image_read_size(entry->path, &entry->w, &entry->h)) {
+        entry->failed = true;
+        return;
+    }
+
+    /* Images that don't fit in the budget would be evicted right away */
+    if (estimate_bytes(entry->w, entry->h) > gallery->cpu_budget)
+        return;
+
+    entry->prefetching     = true;
+    entry->prefetch_done   = false;
+    entry->prefetch_cancel = false;
+    if (pthread_create(&entry->prefetch_thread, NULL, prefetch_thread,
+                       entry) != 0)
+        entry->prefetching = false;
+}
+
+/* Get the least recently used image, other than the current one, whose
+ * memory of the specified type is not zero. Returns NULL if there is none. */
+static GalleryImage* least_recently_used(Gallery* gallery, bool gpu) {
+    GalleryImage* result = NULL;
+
+    for (int i = 0; i < gallery->count; i++) {
+        GalleryImage* entry = &gallery->images[i];
+        if (i == gallery->current)
+            continue;
+
+        /* The pixels of streams can't be decoded again, only the textures
+         * can be freed */
+        if (entry->stream && !gpu)
+            continue;
+
+        const size_t bytes =
+          gpu ? entry_gpu_bytes(entry) : entry_cpu_bytes(entry);
+        if (bytes == 0)
+            continue;
+
+        if (result == NULL ||
+            (int32_t)(entry->last_used - result->last_used) < 0)
+            result = entry;
+    }
+
+    return result;
+}
+
+/* Evict the least recently used images until the cached ones fit in the
+ * budgets */
+static void trim(Gallery* gallery) {
+    for (;;) {
+        size_t cpu_bytes, gpu_bytes;
+        gallery_cached_bytes(gallery, &cpu_bytes, &gpu_bytes);
+
+        if (cpu_bytes > gallery->cpu_budget) {
+            GalleryImage* entry = least_recently_used(gallery, false);
+            if (entry == NULL)
+                break;
+
+            entry_evict(entry);
+        } else if (gpu_bytes > gallery->gpu_budget) {
+            GalleryImage* entry = least_recently_used(gallery, true);
+            if (entry == NULL)
+                break;
+
+            /* The textures can be created again from the pixels, unless
+             * they were freed */
+            entry_free_tiles(entry);
+            if (entry->image != NULL && entry->image->data == NULL)
+                entry_evict(entry);
+        } else {
+            break;
+        }
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+
+Gallery* gallery_new(char* const* paths, int count) {
+    PathList list = { 0 };
+
+    for (int i = 0; i < count; i++) {
+        struct stat st;
+        const bool ok = (stat(paths[i], &st) == 0 && S_ISDIR(st.st_mode))
+                          ? push_directory(&list, paths[i])
+                          : path_list_push(&list, strdup(paths[i]));
+        if (!ok)
+            goto fail;
+    }
+
+    if (list.count == 0)
+        goto fail;
+
+    Gallery* gallery = calloc(1, sizeof(Gallery));
+    if (gallery == NULL)
+        goto fail;
+
+    gallery->images = calloc(list.count, sizeof(GalleryImage));
+    if (gallery->images == NULL) {
+        free(gallery);
+        goto fail;
+    }
+
+    gallery->count      = list.count;
+    gallery->cpu_budget = (size_t)GALLERY_CPU_BUDGET_DEFAULT * 1024 * 1024;
+    gallery->gpu_budget = (size_t)GALLERY_GPU_BUDGET_DEFAULT * 1024 * 1024;
+
+    for (int i = 0; i < list.count; i++) {
+        GalleryImage* entry = &gallery->images[i];
+        entry->path         = list.paths[i];
+        entry->stream       = source_is_stdin(entry->path);
+
+        /* The files of the standard input are created in the current
+         * directory */
+        const char* stem    = entry->stream ? "stdin" : entry->path;
+        entry->export_path  = util_derived_path(stem, NULL, "-hl.png");
+        entry->strokes_path = util_derived_path(stem, NULL, "-hl.strokes");
+        entry->session_path = util_derived_path(stem, NULL, "-hl.session");
+    }
+
+    /* The paths are owned by the images now */
+    free(list.paths);
+
+    for (int i = 0; i < gallery->count; i++) {
+        const GalleryImage* entry = &gallery->images[i];
+        if (!entry->export_path || !entry->strokes_path ||
+            !entry->session_path) {
+            gallery_free(gallery);
+            return NULL;
+        }
+    }
+
+    return gallery;
+
+fail:
+    for (int i = 0; i < list.count; i++)
+        free(list.paths[i]);
+    free(list.paths);
+    return NULL;
+}
+
+void gallery_free(Gallery* gallery) {
+    for (int i = 0; i < gallery->count; i++) {
+        GalleryImage* entry = &gallery->images[i];
+
+        if (entry->prefetching) {
+            __atomic_store_n(&entry->prefetch_cancel, true, __ATOMIC_RELAXED);
+            entry_join_prefetch(entry);
+        }
+
+        entry_evict(entry);
+
+        if (entry->drawing != NULL)
+            drawing_free(entry->drawing);
+
+        free(entry->path);
+        free(entry->export_path);
+        free(entry->strokes_path);
+        free(entry->session_path);
+    }
+
+    free(gallery->images);
+    free(gallery);
+}
+
+bool gallery_show(Gallery* gallery, int index) {
+    GalleryImage* entry = &gallery->images[index];
+
+    gallery->current          = index;
+    gallery->prefetch_pending = true;
+    entry->last_used          = ++gallery->tick;
+
+    /* If it was being evicted, the results will be discarded, so start
+     * again */
+    if (entry->prefetching && entry->prefetch_cancel)
+        entry_join_prefetch(entry);
+
+    if (entry->failed)
+        return false;
+
+    /* Being decoded, or already cached. The image is only complete if it
+     * has no loader. */
+    if (entry->prefetching || entry->loader != NULL)
+        return true;
+
+    if (entry->image != NULL) {
+        gallery->announce_loaded = true;
+        return true;
+    }
+
+    /* Images in the disk cache are mapped, so they are complete right
+     * away */
+    DiskCacheKey key;
+    const bool cached = !entry->stream && diskcache_enabled() &&
+                        diskcache_key(entry->path, &key);
+    if (cached) {
+        const uint64_t span = trace_begin();
+        Image* image        = diskcache_load(entry->path, &key);
+        if (image != NULL) {
+            entry->image  = image;
+            entry->w      = image->w;
+            entry->h      = image->h;
+            entry->mipmap = mipmap_new(image);
+            if (entry->mipmap == NULL)
+                DIE("Error generating the mip levels of the image.");
+            trace_end("diskcache_load", span);
+
+            gallery->announce_loaded = true;
+            return true;
+        }
+    }
+
+    /* Only the header is read here, the rest is decoded on a thread. See
+     * `gallery_update'. */
+    const uint64_t span = trace_begin();
+    ImageLoader* loader = image_loader_new(entry->path);
+    if (loader == NULL) {
+        entry->failed = true;
+        return false;
+    }
+
+    while (loader->image == NULL && image_loader_step(loader))
+        ;
+
+    if (loader->image == NULL) {
+        image_loader_free(loader);
+        entry->failed = true;
+        return false;
+    }
+    trace_end("png_read_info", span);
+
+    entry->loader     = loader;
+    entry->image      = loader->image;
+    entry->w          = loader->image->w;
+    entry->h          = loader->image->h;
+    entry->load_start = trace_begin();
+
+    /* Stored by the thread once the image is complete */
+    if (cached) {
+        loader->cache_path = strdup(entry->path);
+        loader->cache_key  = key;
+    }
+
+    /* If the thread can't be created, the image is decoded from
+     * `gallery_update' instead */
+    if (!image_loader_start_thread(loader))
+        fprintf(stderr, "hl-png: Could not start the decoding thread.\n");
+
+    return true;
+}
+
+int gallery_update(Gallery* gallery) {
+    GalleryImage* current = gallery_current(gallery);
+    int flags             = 0;
+
+    if (gallery->announce_loaded) {
+        gallery->announce_loaded = false;
+        flags |= GALLERY_CHANGED | GALLERY_LOADED;
+    }
+
+    for (int i = 0; i < gallery->count; i++) {
+        GalleryImage* entry = &gallery->images[i];
+
+        /* Take the results of the prefetch threads that finished */
+        if (entry->prefetching &&
+            __atomic_load_n(&entry->prefetch_done, __ATOMIC_ACQUIRE) &&
+            entry_join_prefetch(entry) && entry == current)
+            flags |= GALLERY_CHANGED | GALLERY_LOADED;
+
+        ImageLoader* loader = entry->loader;
+        if (loader == NULL)
+            continue;
+
+        /* Without a thread, only the current image is decoded. The others
+         * would never finish, so they are freed, and decoded again if they
+         * are shown. */
+        if (!loader->threaded && entry != current) {
+            entry_evict(entry);
+            continue;
+        }
+
+        /* Without a thread, decode the next part of the current image */
+        if (!loader->threaded) {
+            const uint32_t start_ticks = SDL_GetTicks();
+            const uint64_t span        = trace_begin();
+            while (SDL_GetTicks() - start_ticks < GALLERY_LOAD_BUDGET_MS &&
+                   image_loader_step(loader))
+                ;
+            trace_end("png_decode", span);
+        }
+
+        /* Only the rows that the decoding thread is done with are uploaded */
+        if (entry->level_tiles[0] != NULL &&
+            tiles_set_ready_rows(entry->level_tiles[0],
+                                 image_loader_ready_rows(loader)) &&
+            entry == current)
+            flags |= GALLERY_CHANGED;
+
+        if (!image_loader_finished(loader))
+            continue;
+
+        if (loader->failed)
+            fprintf(stderr,
+                    "hl-png: Could not decode the whole image, showing the "
+                    "decoded part: %s\n",
+                    entry->path);
+
+        entry->image = image_loader_take_image(loader);
+        image_loader_free(loader);
+        entry->loader = NULL;
+        trace_end("png_read_image", entry->load_start);
+
+        /* If it failed, the rows that were not decoded are transparent */
+        if (entry->level_tiles[0] != NULL)
+            tiles_set_ready_rows(entry->level_tiles[0], entry->image->h);
+
+        /* Generate the smaller versions of the image used when zooming out */
+        const uint64_t span = trace_begin();
+        entry->mipmap       = mipmap_new(entry->image);
+        if (entry->mipmap == NULL)
+            DIE("Error generating the mip levels of the image.");
+        trace_end("mipmap_new", span);
+
+        if (entry == current)
+            flags |= GALLERY_CHANGED | GALLERY_LOADED;
+    }
+
+    /* The tiles are created once the pixels are available, so we don't need
+     * to keep track of which ones were uploaded */
+    if (!current->prefetching && current->image != NULL &&
+        entry_create_tiles(current))
+        flags |= GALLERY_CHANGED;
+
+    /* Decode the neighbours once the current image doesn't need the
+     * processor anymore. The closest ones are the last to be evicted. */
+    if (gallery->prefetch_pending && current->loader == NULL &&
+        !current->prefetching) {
+        gallery->prefetch_pending = false;
+
+        for (int distance = GALLERY_PREFETCH; distance > 0; distance--) {
+            for (int sign = -1; sign <= 1; sign += 2) {
+                const int index =
+                  ((gallery->current + sign * distance) % gallery->count +
+                   gallery->count) %
+                  gallery->count;
+                if (index != gallery->current)
+                    prefetch(gallery, &gallery->images[index]);
+            }
+        }
+    }
+
+    trim(gallery);
+    return flags;
+}
+
+bool gallery_loading(const Gallery* gallery) {
+    for (int i = 0; i < gallery->count; i++)
+        if (gallery->images[i].prefetching || gallery->images[i].loader != NULL)
+            return true;
+
+    return false;
+}
+
+void gallery_cached_bytes(Gallery* gallery, size_t* cpu_bytes,
+                          size_t* gpu_bytes) {
+    *cpu_bytes = 0;
+    *gpu_bytes = 0;
+
+    for (int i = 0; i < gallery->count; i++) {
+        if (i == gallery->current)
+            continue;
+
+        *cpu_bytes += entry_cpu_bytes(&gallery->images[i]);
+        *gpu_bytes += entry_gpu_bytes(&gallery->images[i]);
+    }
+}
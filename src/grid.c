@@ -0,0 +1,133 @@
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+
+#include "include/main.h"
+#include "include/grid.h"
+
+/* Store the 0xRRGGBB color in a pixel of a `SDL_PIXELFORMAT_RGBA32' texture */
+static inline void put_pixel(uint8_t* dst, uint32_t col) {
+    dst[0] = (col >> 16) & 0xFF;
+    dst[1] = (col >> 8) & 0xFF;
+    dst[2] = (col >> 0) & 0xFF;
+    dst[3] = 0xFF;
+}
+
+static inline bool is_line(const Grid* grid, int pos) {
+    return pos >= grid->step && (pos - grid->step) % (grid->step + 1) == 0;
+}
+
+/* Create the texture with the size of the window, and draw the grid in it.
+ * Returns false on error. */
+static bool grid_update_texture(Grid* grid) {
+    int win_w, win_h;
+    SDL_GetWindowSize(g_window, &win_w, &win_h);
+    if (win_w <= 0 || win_h <= 0)
+        return false;
+
+    if (grid->texture == NULL || grid->w != win_w || grid->h != win_h) {
+        if (grid->texture != NULL)
+            SDL_DestroyTexture(grid->texture);
+
+        grid->texture =
+          SDL_CreateTexture(g_renderer, SDL_PIXELFORMAT_RGBA32,
+                            SDL_TEXTUREACCESS_STATIC, win_w, win_h);
+        if (grid->texture == NULL)
+            return false;
+
+        grid->w = win_w;
+        grid->h = win_h;
+    }
+
+    /* There are only two different rows: the ones on a horizontal line, and
+     * the ones that only cross the vertical lines. Build them once and copy
+     * them to the rest of the buffer. */
+    const int pitch = win_w * 4;
+    uint8_t* pixels = malloc((size_t)pitch * (win_h + 2));
+    if (pixels == NULL)
+        return false;
+
+    uint8_t* row_line  = pixels + (size_t)pitch * win_h;
+    uint8_t* row_space = row_line + pitch;
+    for (int x = 0; x < win_w; x++) {
+        put_pixel(&row_line[x * 4], grid->col_line);
+        put_pixel(&row_space[x * 4],
+                  is_line(grid, x) ? grid->col_line : grid->col_bg);
+    }
+
+    for (int y = 0; y < win_h; y++)
+        memcpy(pixels + (size_t)y * pitch,
+               is_line(grid, y) ? row_line : row_space, pitch);
+
+    const bool success =
+      SDL_UpdateTexture(grid->texture, NULL, pixels, pitch) == 0;
+    free(pixels);
+    return success;
+}
+
+/* Draw the lines one by one, used if the texture can't be created */
+static void render_lines(Grid* grid) {
+    int win_w, win_h;
+    SDL_GetWindowSize(g_window, &win_w, &win_h);
+
+    const uint8_t r = (grid->col_line >> 16) & 0xFF;
+    const uint8_t g = (grid->col_line >> 8) & 0xFF;
+    const uint8_t b = (grid->col_line >> 0) & 0xFF;
+    SDL_SetRenderDrawColor(g_renderer, r, g, b, 255);
+
+    const int step = grid->step + 1;
+    for (int y = grid->step; y < win_h; y += step) {
+        SDL_RenderDrawLine(g_renderer, 0, y, win_w, y);
+        g_draw_calls++;
+    }
+
+    for (int x = grid->step; x < win_w; x += step) {
+        SDL_RenderDrawLine(g_renderer, x, 0, x, win_h);
+        g_draw_calls++;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+
+Grid* grid_new(int step, uint32_t col_bg, uint32_t col_line) {
+    Grid* grid = calloc(1, sizeof(Grid));
+    if (!grid)
+        return NULL;
+
+    grid->texture  = NULL;
+    grid->step     = step;
+    grid->col_bg   = col_bg;
+    grid->col_line = col_line;
+    grid->valid    = false;
+
+    return grid;
+}
+
+void grid_free(Grid* grid) {
+    if (grid->texture != NULL)
+        SDL_DestroyTexture(grid->texture);
+
+    free(grid);
+}
+
+void grid_invalidate(Grid* grid) {
+    grid->valid = false;
+}
+
+void grid_render(Grid* grid) {
+    if (!grid->valid)
+        grid->valid = grid_update_texture(grid);
+
+    if (grid->valid) {
+        SDL_RenderCopy(g_renderer, grid->texture, NULL, NULL);
+        g_draw_calls++;
+        return;
+    }
+
+    /* The texture is not available, the window was already cleared with the
+     * background color. */
+    render_lines(grid);
+}
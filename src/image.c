@@ -2,51 +2,38 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <png.h>
 
 #include "include/image.h"
 #include "include/util.h"
+#include "include/trace.h"
+#include "include/convert.h"
+#include "include/fastpng.h"
+#include "include/source.h"
+#include "include/diskcache.h"
+
+bool g_image_convert = true;
+bool g_image_fastpng = true;
+
+/* Allocate a new Image structure from the information in the PNG header. If
+ * CONVERTER is not NULL and the layout of the image is supported, it's
+ * initialized for converting the rows to RGBA with `convert_row'. Otherwise,
+ * its `func' is set to NULL, and the libpng transformations needed for
+ * converting them are set up. The `data' member is not allocated. */
+static Image* image_from_png_info(png_structp png, png_infop info,
+                                  RowConverter* converter) {
+    const uint64_t span = trace_begin();
 
-Image* image_read_file(const char* filename) {
-    /* Open the PNG image as "Read bytes" */
-    FILE* fp = fopen(filename, "rb");
-    if (!fp)
-        return NULL;
-
-    /* Create the PNG read and info structs */
-    png_structp png =
-      png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png) {
-        fclose(fp);
-        return NULL;
-    }
-
-    png_infop info = png_create_info_struct(png);
-    if (!info) {
-        fclose(fp);
-        return NULL;
-    }
-
-    /*
-     * This is the first time I see setjmp() being used. See:
-     * https://github.com/8dcc/scratch/blob/64e432982b04af77746152d62d97f3ba640e0f7a/C/testing/setjmp.c
-     */
-    if (setjmp(png_jmpbuf(png))) {
-        png_destroy_read_struct(&png, &info, NULL);
-        fclose(fp);
-        return NULL;
-    }
-
-    png_init_io(png, fp);
-    png_read_info(png, info);
-
-    /* Allocate the Image structure we will be returning. Has to be freed by
-     * the caller with image_free(). */
     Image* image = malloc(sizeof(Image));
-    if (!image) {
-        fclose(fp);
+    if (!image)
         return NULL;
-    }
+
+    image->data         = NULL;
+    image->mapping      = NULL;
+    image->mapping_size = 0;
+    image->shared       = NULL;
 
     image->w          = png_get_image_width(png, info);
     image->h          = png_get_image_height(png, info);
@@ -55,6 +42,28 @@ Image* image_read_file(const char* filename) {
     /* Size in bits of each sample, not pixel. See `image_pixel_bits'. */
     image->bit_depth = png_get_bit_depth(png, info);
 
+    /* Expanding and converting the rows in a single pass is faster than the
+     * transformations of libpng, which process each row once per
+     * transformation. Images that are already RGBA don't need either, and are
+     * decoded directly into `data'. */
+    const bool is_rgba8 = image->color_type == PNG_COLOR_TYPE_RGB_ALPHA &&
+                          image->bit_depth == 8;
+    if (converter != NULL) {
+        if (g_image_convert && !is_rgba8 &&
+            convert_init(converter, png, info)) {
+            png_read_update_info(png, info);
+
+            image->color_type = PNG_COLOR_TYPE_RGB_ALPHA;
+            image->bit_depth  = 8;
+            image->byte_pitch = image->w * 4;
+
+            trace_end("png_transforms", span);
+            return image;
+        }
+
+        converter->func = NULL;
+    }
+
     /*------------------------------------------------------------------------*/
     /* See http://www.libpng.org/pub/png/libpng-1.2.5-manual.html#section-3.7 */
 
@@ -87,14 +96,26 @@ Image* image_read_file(const char* filename) {
      * function is defined below. */
     image_add_alpha(image, png);
 
-    /* Represent grayscale image as RGB */
+    /* Represent grayscale image as RGB. At this point, the image should
+     * already have an alpha channel. */
     if (image->color_type == PNG_COLOR_TYPE_GRAY ||
-        image->color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+        image->color_type == PNG_COLOR_TYPE_GRAY_ALPHA) {
         png_set_gray_to_rgb(png);
+        image->color_type = PNG_COLOR_TYPE_RGB_ALPHA;
+    }
+
+    /* Let libpng combine the passes of interlaced images for us */
+    png_set_interlace_handling(png);
 
     /* Update the png_info structure to reflect the transformations */
     png_read_update_info(png, info);
 
+    /* Some transformations (e.g. `png_set_strip_16' or `png_set_packing')
+     * change the bit depth without updating our structure, so read the final
+     * value from libpng. It's used to calculate the size of the buffer we
+     * decode into. */
+    image->bit_depth = png_get_bit_depth(png, info);
+
     /*------------------------------------------------------------------------*/
 
     /* Assumes the number of pixel bits (image->bit_depth) is aligned to 8 */
@@ -104,33 +125,113 @@ Image* image_read_file(const char* filename) {
      * `png_get_rowbytes'. */
     image->byte_pitch = image->w * bytes_per_pixel;
 
-    /* This is a double pointer. Whoever decided to typedef a pointer should be
-     * shot. */
-    png_bytep* rows = malloc(image->h * sizeof(png_bytep));
-    for (int y = 0; y < image->h; y++)
-        rows[y] = malloc(image->byte_pitch);
+    trace_end("png_transforms", span);
+    return image;
+}
+
+Image* image_read_file(const char* filename) {
+    Source* source = source_open(filename);
+    if (!source)
+        return NULL;
+
+    Image* image = image_read_source(source);
+    source_close(source);
+    return image;
+}
+
+Image* image_read_source(Source* source) {
+    /* The most common images can be decoded without libpng, directly from
+     * the mapped file. If not, or if there is any error, libpng handles it
+     * below, reading the same bytes. */
+    if (g_image_fastpng) {
+        size_t size;
+        const uint8_t* contents = source_contents(source, &size);
+        Image* image = contents ? fastpng_decode(contents, size) : NULL;
+        if (image)
+            return image;
+    }
+
+    /* Create the PNG read and info structs */
+    png_structp png =
+      png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png)
+        return NULL;
+
+    png_infop info = png_create_info_struct(png);
+    if (!info)
+        return NULL;
 
-    /* Read the PNG image into the rows array */
-    png_read_image(png, rows);
+    /*
+     * This is the first time I see setjmp() being used. See:
+     * https://github.com/8dcc/scratch/blob/64e432982b04af77746152d62d97f3ba640e0f7a/C/testing/setjmp.c
+     */
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_read_struct(&png, &info, NULL);
+        return NULL;
+    }
+
+    uint64_t span = trace_begin();
+    source_set_png(source, png);
+    png_read_info(png, info);
+    trace_end("png_read_info", span);
+
+    /* Allocate the Image structure we will be returning, and set up the
+     * conversion of the rows. Has to be freed by the caller with
+     * image_free(). */
+    RowConverter converter;
+    Image* image = image_from_png_info(png, info, &converter);
+    if (!image) {
+        png_destroy_read_struct(&png, &info, NULL);
+        return NULL;
+    }
 
-    /* Allocate the one-dimensional byte array for the Image structure */
-    size_t total_bytes = image->h * image->byte_pitch;
+    /* Allocate the one-dimensional byte array for the Image structure. Libpng
+     * will decode directly into it, so we don't need a separate buffer for
+     * each row. */
+    size_t total_bytes = (size_t)image->h * image->byte_pitch;
     image->data        = malloc(total_bytes);
 
-    /* Iterate rows (y), pixels of row (x) and bytes of the pixel (e.g. RGBA) */
+    /* This is a double pointer. Whoever decided to typedef a pointer should be
+     * shot. Each element points to the start of a row inside `image->data'. */
+    png_bytep* rows = malloc(image->h * sizeof(png_bytep));
+    if (!image->data || !rows) {
+        free(rows);
+        image_free(image);
+        png_destroy_read_struct(&png, &info, NULL);
+        return NULL;
+    }
+
     uint8_t* data = (uint8_t*)image->data;
     for (int y = 0; y < image->h; y++)
-        for (int x = 0; x < image->byte_pitch; x++)
-            *(data++) = rows[y][x];
+        rows[y] = &data[(size_t)y * image->byte_pitch];
+
+    span = trace_begin();
+    if (converter.func != NULL) {
+        /* Read each row in the layout of the file, and convert it into
+         * `image->data' */
+        png_bytep src = malloc(png_get_rowbytes(png, info));
+        if (!src) {
+            free(rows);
+            image_free(image);
+            png_destroy_read_struct(&png, &info, NULL);
+            return NULL;
+        }
+
+        for (int y = 0; y < image->h; y++) {
+            png_read_row(png, src, NULL);
+            convert_row(&converter, src, rows[y], image->w);
+        }
+
+        free(src);
+    } else {
+        /* Read the PNG image into `image->data', through the rows array */
+        png_read_image(png, rows);
+    }
+    trace_end("png_read_image", span);
 
-    /* Free the libpng rows */
-    for (int y = 0; y < image->h; y++)
-        free(rows[y]);
+    /* Free the row pointers, not the rows themselves */
     free(rows);
 
-    /* Close the file descriptor */
-    fclose(fp);
-
     /* Free all memory allocated by libpng */
     png_destroy_read_struct(&png, &info, NULL);
 
@@ -138,11 +239,337 @@ Image* image_read_file(const char* filename) {
     return image;
 }
 
+bool image_read_size(const char* filename, int* w, int* h) {
+    Source* source = source_open(filename);
+    if (!source)
+        return false;
+
+    png_structp png =
+      png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png) {
+        source_close(source);
+        return false;
+    }
+
+    png_infop info = png_create_info_struct(png);
+    if (!info) {
+        png_destroy_read_struct(&png, NULL, NULL);
+        source_close(source);
+        return false;
+    }
+
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_read_struct(&png, &info, NULL);
+        source_close(source);
+        return false;
+    }
+
+    /* Only the chunks before the image data are read */
+    source_set_png(source, png);
+    png_read_info(png, info);
+
+    *w = png_get_image_width(png, info);
+    *h = png_get_image_height(png, info);
+
+    png_destroy_read_struct(&png, &info, NULL);
+    source_close(source);
+    return true;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Progressive reading */
+
+/* Called by libpng once the PNG header has been read */
+static void loader_info_callback(png_structp png, png_infop info) {
+    ImageLoader* loader = png_get_progressive_ptr(png);
+
+    loader->image = image_from_png_info(png, info, &loader->converter);
+    if (!loader->image)
+        png_error(png, "Could not allocate Image structure.");
+
+    /* Rows that have not been decoded yet will be fully transparent */
+    const size_t total_bytes =
+      (size_t)loader->image->h * loader->image->byte_pitch;
+    loader->image->data = calloc(total_bytes, 1);
+    if (!loader->image->data)
+        png_error(png, "Could not allocate image data.");
+}
+
+/* Publish the rows before ROWS as complete, see `image_loader_ready_rows' */
+static void set_ready_rows(ImageLoader* loader, int rows) {
+    if (loader->threaded)
+        pthread_mutex_lock(&loader->lock);
+
+    if (rows > loader->ready_rows)
+        loader->ready_rows = rows;
+
+    if (loader->threaded)
+        pthread_mutex_unlock(&loader->lock);
+}
+
+/* Called by libpng for each decoded row. For interlaced images, it's called
+ * once per row on each pass. */
+static void loader_row_callback(png_structp png, png_bytep new_row,
+                                png_uint_32 row_num, int pass) {
+    /* The row didn't change on this pass */
+    if (new_row == NULL)
+        return;
+
+    ImageLoader* loader = png_get_progressive_ptr(png);
+    Image* image        = loader->image;
+
+    /* Convert the row to RGBA, or let libpng combine the new pixels with the
+     * ones of the previous passes. For non-interlaced images, this is just a
+     * copy. */
+    uint8_t* data = (uint8_t*)image->data;
+    uint8_t* row  = &data[(size_t)row_num * image->byte_pitch];
+    if (loader->converter.func != NULL)
+        convert_row(&loader->converter, new_row, row, image->w);
+    else
+        png_progressive_combine_row(png, row, new_row);
+
+    /* The rows of interlaced images are written again on each pass. On the
+     * last one, the rows arrive in order, and the ones before them are
+     * complete. */
+    if (pass != 6 &&
+        png_get_interlace_type(png, loader->info) != PNG_INTERLACE_NONE)
+        return;
+
+    set_ready_rows(loader, row_num + 1);
+}
+
+/* Called by libpng after the last row */
+static void loader_end_callback(png_structp png, png_infop info) {
+    (void)info;
+    ImageLoader* loader = png_get_progressive_ptr(png);
+    loader->done        = true;
+
+    set_ready_rows(loader, loader->image->h);
+}
+
+ImageLoader* image_loader_new(const char* filename) {
+    ImageLoader* loader = calloc(1, sizeof(ImageLoader));
+    if (!loader)
+        return NULL;
+
+    loader->source = source_open(filename);
+    if (!loader->source) {
+        free(loader);
+        return NULL;
+    }
+
+    loader->png =
+      png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (loader->png)
+        loader->info = png_create_info_struct(loader->png);
+
+    if (!loader->png || !loader->info) {
+        image_loader_free(loader);
+        return NULL;
+    }
+
+    png_set_progressive_read_fn(loader->png, loader, loader_info_callback,
+                                loader_row_callback, loader_end_callback);
+
+    return loader;
+}
+
+void image_loader_free(ImageLoader* loader) {
+    if (loader->threaded) {
+        __atomic_store_n(&loader->cancel, true, __ATOMIC_RELAXED);
+        pthread_join(loader->thread, NULL);
+        pthread_mutex_destroy(&loader->lock);
+    }
+
+    if (loader->png)
+        png_destroy_read_struct(&loader->png,
+                                loader->info ? &loader->info : NULL, NULL);
+
+    if (loader->image)
+        image_free(loader->image);
+
+    if (loader->source)
+        source_close(loader->source);
+
+    free(loader->cache_path);
+    free(loader);
+}
+
+bool image_loader_step(ImageLoader* loader) {
+    if (loader->done || loader->failed)
+        return false;
+
+    /* Mapped files are decoded in place, without copying them */
+    const uint8_t* data;
+    const size_t read_bytes =
+      source_next(loader->source, IMAGE_LOADER_CHUNK_SIZE, &data);
+    if (read_bytes == 0) {
+        /* The file ended before the IEND chunk */
+        loader->failed = true;
+        return false;
+    }
+
+    /* Errors inside `png_process_data' (and our callbacks) jump here */
+    if (setjmp(png_jmpbuf(loader->png))) {
+        loader->failed = true;
+        return false;
+    }
+
+    png_process_data(loader->png, loader->info, (png_bytep)data, read_bytes);
+
+    return !loader->done;
+}
+
+/* Decode the image until it's complete, there is an error, or the loader is
+ * freed. */
+static void* loader_thread(void* arg) {
+    ImageLoader* loader = arg;
+    trace_thread_name("decoder");
+
+    /* The state of the loader is only written by this thread until it
+     * finishes, so `image_loader_step' doesn't need the lock. */
+    const uint64_t span = trace_begin();
+    while (!__atomic_load_n(&loader->cancel, __ATOMIC_RELAXED) &&
+           image_loader_step(loader))
+        ;
+    trace_end("png_decode", span);
+
+    /* Before it's finished, since the Image can be taken afterwards. It's only
+     * queued, so the image is shown without waiting for the disk. */
+    if (loader->cache_path != NULL && loader->done && !loader->failed &&
+        !__atomic_load_n(&loader->cancel, __ATOMIC_RELAXED))
+        diskcache_store_async(loader->cache_path, &loader->cache_key,
+                              loader->image);
+
+    pthread_mutex_lock(&loader->lock);
+    loader->finished = true;
+    pthread_mutex_unlock(&loader->lock);
+
+    return NULL;
+}
+
+bool image_loader_start_thread(ImageLoader* loader) {
+    if (pthread_mutex_init(&loader->lock, NULL) != 0)
+        return false;
+
+    loader->threaded = true;
+    if (pthread_create(&loader->thread, NULL, loader_thread, loader) != 0) {
+        loader->threaded = false;
+        pthread_mutex_destroy(&loader->lock);
+        return false;
+    }
+
+    return true;
+}
+
+bool image_loader_finished(ImageLoader* loader) {
+    if (!loader->threaded)
+        return loader->done || loader->failed;
+
+    pthread_mutex_lock(&loader->lock);
+    const bool finished = loader->finished;
+    pthread_mutex_unlock(&loader->lock);
+
+    /* The thread already stopped, and the loader can be used again from this
+     * thread without locking. */
+    if (finished) {
+        pthread_join(loader->thread, NULL);
+        pthread_mutex_destroy(&loader->lock);
+        loader->threaded = false;
+    }
+
+    return finished;
+}
+
+int image_loader_ready_rows(ImageLoader* loader) {
+    if (loader->threaded)
+        pthread_mutex_lock(&loader->lock);
+
+    const int rows = loader->ready_rows;
+
+    if (loader->threaded)
+        pthread_mutex_unlock(&loader->lock);
+
+    return rows;
+}
+
+Image* image_loader_take_image(ImageLoader* loader) {
+    Image* image  = loader->image;
+    loader->image = NULL;
+    return image;
+}
+
+/*----------------------------------------------------------------------------*/
+
 void image_free(Image* image) {
-    free(image->data);
+    image_free_data(image);
     free(image);
 }
 
+Image* image_copy(const Image* image) {
+    if (image->data == NULL)
+        return NULL;
+
+    Image* copy = malloc(sizeof(Image));
+    if (!copy)
+        return NULL;
+
+    *copy              = *image;
+    copy->mapping      = NULL;
+    copy->mapping_size = 0;
+    copy->shared       = NULL;
+
+    const size_t total_bytes = (size_t)image->h * image->byte_pitch;
+    copy->data               = malloc(total_bytes);
+    if (!copy->data) {
+        free(copy);
+        return NULL;
+    }
+
+    memcpy(copy->data, image->data, total_bytes);
+    return copy;
+}
+
+void image_free_data(Image* image) {
+    if (image->mapping != NULL)
+        munmap(image->mapping, image->mapping_size);
+    else if (image->shared != NULL)
+        image_pixels_release(image->shared);
+    else
+        free(image->data);
+
+    image->data         = NULL;
+    image->mapping      = NULL;
+    image->mapping_size = 0;
+    image->shared       = NULL;
+}
+
+ImagePixels* image_share_pixels(Image* image) {
+    if (image->data == NULL || image->mapping != NULL)
+        return NULL;
+
+    /* The first time, the reference of the Image is created too */
+    if (image->shared == NULL) {
+        image->shared = malloc(sizeof(ImagePixels));
+        if (image->shared == NULL)
+            return NULL;
+
+        image->shared->data = image->data;
+        image->shared->refs = 1;
+    }
+
+    __atomic_add_fetch(&image->shared->refs, 1, __ATOMIC_RELAXED);
+    return image->shared;
+}
+
+void image_pixels_release(ImagePixels* pixels) {
+    if (__atomic_sub_fetch(&pixels->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    free(pixels->data);
+    free(pixels);
+}
+
 void image_add_alpha(Image* image, png_structp png) {
     switch (image->color_type) {
         case PNG_COLOR_TYPE_RGB: {
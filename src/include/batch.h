@@ -0,0 +1,66 @@
+
+#ifndef BATCH_H_
+#define BATCH_H_ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "drawing.h"
+#include "export.h"
+
+/* Default limit for the memory used by the images that are being processed at
+ * the same time, in MiB. See `BatchOptions.memory_limit'. */
+#define BATCH_MEMORY_DEFAULT 1024
+
+/* Estimated number of bytes used for each pixel of an image while it's being
+ * processed: the decoded image, its filtered rows, the compressed data and the
+ * coverage mask of the compositor. */
+#define BATCH_BYTES_PER_PIXEL 13
+
+/* Maximum number of threads processing images */
+#define BATCH_MAX_THREADS 64
+
+typedef struct BatchOptions {
+    /* Directory of the output images. If NULL, each one is written next to
+     * its input. */
+    const char* output_dir;
+
+    /* Options of the output images. Each image is compressed by a single
+     * thread, since there are already several images in parallel. */
+    ExportOptions export;
+
+    /* Number of threads. If zero, one for each processor. */
+    int threads;
+
+    /* Maximum estimated memory, in bytes, of the images being processed at
+     * the same time. Threads wait before decoding an image that would go
+     * over the limit. An image that is bigger than the limit is processed
+     * alone. */
+    size_t memory_limit;
+
+    /* Print the path of each image after writing it */
+    bool verbose;
+} BatchOptions;
+
+typedef struct BatchStats {
+    /* Number of images that were written, and that failed */
+    int done, failed;
+
+    /* Sizes of the input and output files, in bytes */
+    size_t bytes_read, bytes_written;
+
+    /* Time spent processing all the images */
+    double seconds;
+} BatchStats;
+
+/*----------------------------------------------------------------------------*/
+
+/* Draw the lines of a Drawing into each of the specified PNG images, and write
+ * them as new images ending in "-hl.png". It doesn't need a window. The images
+ * are distributed between the threads, which take images from each other
+ * when they run out. If two images would be written to the same path, nothing
+ * is written, and all of them are counted as failed. */
+BatchStats batch_run(const Drawing* drawing, char* const* inputs, int count,
+                     const BatchOptions* options);
+
+#endif /* BATCH_H_ */
@@ -0,0 +1,19 @@
+
+#ifndef COMPOSITE_H_
+#define COMPOSITE_H_ 1
+
+#include <stdbool.h>
+
+#include "image.h"
+#include "drawing.h"
+
+/*----------------------------------------------------------------------------*/
+
+/* Draw the visible lines of a Drawing into an RGBA image with 8-bit samples, at
+ * the resolution of the image. Lines are anti-aliased and blended with the
+ * alpha of their color, like they are drawn in the window. The line that is
+ * being drawn, if any, is not included. Returns false if there was not enough
+ * memory. */
+bool composite_drawing(Image* image, const Drawing* drawing);
+
+#endif /* COMPOSITE_H_ */
@@ -0,0 +1,60 @@
+
+#ifndef CONVERT_H_
+#define CONVERT_H_ 1
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <png.h>
+
+struct RowConverter;
+
+/*
+ * Function used for converting a row of `count' pixels, in the layout stored
+ * in the PNG file, into `dst' as 8-bit RGBA. The source row is the one
+ * returned by libpng without any transformations.
+ */
+typedef void (*convert_func_t)(const struct RowConverter* converter,
+                               const uint8_t* src, uint8_t* dst, int count);
+
+typedef struct RowConverter {
+    /* Color type and bit depth of the rows, as stored in the PNG */
+    int color_type, bit_depth;
+
+    /* RGBA color of each index of the palette, with the alpha of the tRNS
+     * chunk. Only used for PNG_COLOR_TYPE_PALETTE. */
+    uint8_t palette[256][4];
+
+    /* Transparent color of the tRNS chunk, for grayscale and RGB images, in
+     * the bit depth of the image. Grayscale images only use `trns[0]'. Only
+     * valid if `has_trns' is true. */
+    uint16_t trns[3];
+    bool has_trns;
+
+    /* Fastest function for this layout supported by the CPU */
+    convert_func_t func;
+} RowConverter;
+
+/*----------------------------------------------------------------------------*/
+
+/* Initialize a RowConverter for the image described by the PNG header in
+ * INFO. Returns false if the layout is not supported; interlaced images are
+ * not, since libpng has to combine their passes in the final layout. */
+bool convert_init(RowConverter* converter, png_structp png, png_infop info);
+
+/* Initialize a RowConverter for rows of COLOR_TYPE and BIT_DEPTH, which can't
+ * be palette indexes. TRNS is the transparent color of the tRNS chunk, or
+ * NULL. Returns false if the layout is not supported. */
+bool convert_init_layout(RowConverter* converter, int color_type,
+                         int bit_depth, const uint16_t* trns);
+
+/* Convert a row of COUNT pixels into 8-bit RGBA. See `convert_func_t'. */
+static inline void convert_row(const RowConverter* converter,
+                               const uint8_t* src, uint8_t* dst, int count) {
+    converter->func(converter, src, dst, count);
+}
+
+/* Swap the red and blue channels of COUNT pixels, converting RGBA into BGRA
+ * or the other way around. SRC and DST can be the same. */
+void convert_swap_rb(const uint8_t* src, uint8_t* dst, int count);
+
+#endif /* CONVERT_H_ */
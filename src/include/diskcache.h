@@ -0,0 +1,99 @@
+
+#ifndef DISKCACHE_H_
+#define DISKCACHE_H_ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Environment variable with the size of the disk cache in MiB, like the `-d'
+ * argument */
+#define DISKCACHE_ENV "HLPNG_DISK_CACHE"
+
+/* First bytes of a cache entry, and version of the format */
+#define DISKCACHE_MAGIC   "HLPNGPIX"
+#define DISKCACHE_VERSION 1
+
+/* Offset of the pixels inside of an entry. It's a multiple of the page size,
+ * so they can be mapped with the right alignment for the uploads. */
+#define DISKCACHE_DATA_OFFSET 4096
+
+/* Images with fewer pixels are decoded quickly enough, and are not stored */
+#define DISKCACHE_MIN_PIXELS (1000 * 1000)
+
+/* Temporary files older than this, in seconds, were left by processes that
+ * died while writing them, and are removed when the cache is trimmed */
+#define DISKCACHE_STALE_SECONDS (60 * 60)
+
+/*
+ * Opt-in cache of decoded images, in the "hl-png" directory of
+ * XDG_CACHE_HOME (or of ~/.cache). Each PNG file has an entry, named after
+ * the hash of its absolute path, with two parts:
+ *
+ *   1. Header (64 bytes, little-endian, padded up to DISKCACHE_DATA_OFFSET):
+ *      the magic, the version, the width, height, color type, bit depth and
+ *      byte pitch of the Image, the DiskCacheKey of the PNG file, and a hash
+ *      of its contents.
+ *   2. The rows of the Image, exactly as they are in memory, always RGBA with
+ *      8-bit samples.
+ *
+ * Entries are written to a temporary file and renamed, so other processes
+ * never see them half-written, and they are never modified once they exist.
+ * Entries used recently have a recent modification time; the oldest ones are
+ * removed when the cache exceeds its size.
+ */
+
+/* Identity of a PNG file, read without reading the file itself. If any of the
+ * fields changed, the entry of the file is outdated. */
+typedef struct DiskCacheKey {
+    uint64_t path_hash; /* Hash of the absolute path */
+    uint64_t size;      /* Size of the file, in bytes */
+    int64_t mtime_ns;   /* Modification time, in nanoseconds */
+} DiskCacheKey;
+
+/* Avoid including "image.h", which includes this file */
+struct Image;
+
+/*----------------------------------------------------------------------------*/
+
+/* Enable the cache, with a maximum size of MAX_BYTES. If it's zero, the size in
+ * MiB is read from the DISKCACHE_ENV environment variable, and if that's not
+ * set either, the cache stays disabled. Returns false if it's disabled, or if
+ * the directory can't be created. */
+bool diskcache_init(size_t max_bytes);
+
+/* Check if the cache was enabled with `diskcache_init' */
+bool diskcache_enabled(void);
+
+/* Get the key of a regular file, from its path and its metadata. Returns false
+ * if it can't be read, or if it's not a regular file. */
+bool diskcache_key(const char* path, DiskCacheKey* key);
+
+/* Get the cached Image of the file at PATH, with its pixels mapped directly
+ * from the entry, read-only. Returns NULL if there is no entry, or if it's
+ * outdated. The whole file is read for checking the hash of its contents, but
+ * only if the rest of the key matches the entry. The returned Image must be
+ * freed with `image_free'. */
+struct Image* diskcache_load(const char* path, const DiskCacheKey* key);
+
+/* Store a complete Image decoded from the file at PATH, whose key was read
+ * before decoding it, and remove the oldest entries if the cache exceeds its
+ * size. The file is read again for hashing its contents. Nothing is stored if
+ * the file changed since the key was read, if the image is small, or if it was
+ * loaded from the cache. Errors are ignored. */
+void diskcache_store(const char* path, const DiskCacheKey* key,
+                     const struct Image* image);
+
+/* Same as `diskcache_store', but from a worker thread, so the caller doesn't
+ * wait for hashing and writing the entry. The worker keeps its own reference
+ * to the pixels, so the Image can be freed right away, but they must not be
+ * modified anymore. If too many images are waiting already, nothing is
+ * stored. */
+void diskcache_store_async(const char* path, const DiskCacheKey* key,
+                           struct Image* image);
+
+/* Stop the worker thread of `diskcache_store_async', interrupting the entry it
+ * was writing and dropping the rest. Nothing else is stored afterwards. */
+void diskcache_finish(void);
+
+#endif /* DISKCACHE_H_ */
@@ -5,13 +5,32 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-/* Initial value for `Drawing.points_sz', will also be used for resizing
- * `Drawing.points' when needed. */
-#define DRAWING_POINTS_SIZE 200
+#include "view.h"
+#include "spatial.h"
 
-/* Initial value for `Drawing.line_ends_sz', will also be used for resizing
- * `Drawing.line_ends' when needed. */
-#define DRAWING_LINES_SIZE 20
+/* Initial value for `Drawing.points_sz'. The arrays grow geometrically when
+ * they are full. */
+#define DRAWING_POINTS_SIZE 256
+
+/* Initial value for `Drawing.lines_sz' */
+#define DRAWING_LINES_SIZE 32
+
+/* Maximum distance, in window pixels, between the stored lines and the points
+ * that were removed from them when simplifying. */
+#define DRAWING_TOLERANCE 1.0
+
+/* Points closer than this to the last stored point, in window pixels, are
+ * ignored. Removes the jitter of high-resolution mice. */
+#define DRAWING_MIN_DISTANCE 1.0
+
+/* Maximum number of operations kept in the undo history. When it's full, the
+ * oldest operations can't be undone anymore. */
+#define DRAWING_HISTORY_SIZE 1024
+
+/* Maximum number of points in lines that are hidden by a clear or erased, and
+ * only kept for undoing. When there are more, the oldest operations are
+ * forgotten until the points can be freed. */
+#define DRAWING_HISTORY_POINTS (1 << 20)
 
 #define C(RGBA)                           \
     ((Color){ .r = ((RGBA) >> 24) & 0xFF, \
@@ -23,36 +42,141 @@ typedef struct Color {
     uint8_t r, g, b, a;
 } Color;
 
+/* Point passed to `drawing_push'. Inside of the Drawing, the points are stored
+ * in a more compact format; see `DrawingLine'. */
 typedef struct DrawingPoint {
-    /* Point position relative to the center of the window */
+    /* Point position in image coordinates, so it stays in the same place of
+     * the image when zooming or panning. */
     int x, y;
 
-    /* Color of the point.
-     * TODO: Store color of line instead of point to save memory? */
+    /* Color and width of the line, in image pixels. Only the values of the
+     * first point of each line are used. */
     Color col;
+    uint8_t width;
 } DrawingPoint;
 
+typedef struct DrawingLine {
+    /* Color of the line, and width in image pixels */
+    Color col;
+    uint8_t width;
+
+    /* Position of the first point, in image coordinates. The positions in
+     * `Drawing.xs' and `Drawing.ys' are relative to it. */
+    int32_t origin_x, origin_y;
+
+    /* Index of the first point of the line in `Drawing.xs' and `Drawing.ys',
+     * and number of points. */
+    int start, count;
+
+    /* The line was removed with the eraser. It's not drawn, but its points
+     * are kept until the erase can't be undone anymore. */
+    bool erased;
+} DrawingLine;
+
+typedef enum DrawingOpType {
+    DRAWING_OP_ADD,   /* A line was finished */
+    DRAWING_OP_ERASE, /* Some lines were erased */
+    DRAWING_OP_CLEAR, /* All the lines were hidden */
+} DrawingOpType;
+
+/* Operation in the undo history of a Drawing */
+typedef struct DrawingOp {
+    DrawingOpType type;
+
+    /* Unique identifier of the state of the Drawing after this operation.
+     * Changes if the operation is extended; see `drawing_erase'. */
+    uint32_t serial;
+
+    /* For DRAWING_OP_ADD, the index of the line. For DRAWING_OP_CLEAR, the
+     * value of `Drawing.first_visible' after clearing, and before. */
+    int line, prev_line;
+
+    /* For DRAWING_OP_ERASE, range of `Drawing.erased' with the indexes of the
+     * lines that were erased. */
+    int erased_start, erased_count;
+} DrawingOp;
+
 typedef struct Drawing {
-    /* Stack of points */
-    DrawingPoint* points;
+    /* Positions of the points of all the lines, relative to the origin of
+     * their line. Lines with points that don't fit in an int16_t are split;
+     * see `drawing_push'. */
+    int16_t* xs;
+    int16_t* ys;
 
-    /* Number of elements that the `points' array can hold */
+    /* Number of elements that the `xs' and `ys' arrays can hold */
     int points_sz;
 
-    /* Current position inside the `points' array */
+    /* Number of points stored in `xs' and `ys' */
     int points_i;
 
-    /* Each element in the `line_ends' array contains the index inside `points'
-     * where a line started. See `drawing_end_line' function. */
-    int* line_ends;
+    /* Array of lines, in the order they were drawn */
+    DrawingLine* lines;
 
-    /* Number of elements that the `line_ends' array can hold */
-    int line_ends_sz;
+    /* Number of elements that the `lines' array can hold */
+    int lines_sz;
 
-    /* Number of lines we have drawn */
+    /* Number of lines we have finished drawing. The lines after them are the
+     * ones that can be redone, or the line that is being drawn. */
     int line_count;
+
+    /* Lines before this one were hidden by `drawing_clear' */
+    int first_visible;
+
+    /* If true, `lines[line_count]' is the line that is currently being drawn,
+     * and it has at least one point. */
+    bool in_progress;
+
+    /* Index with the segments of the finished lines, for finding the lines
+     * near a position. Lines are added to it when they end, or when it's
+     * used if there are older lines missing. */
+    SpatialIndex* index;
+
+    /* Number of lines, from the start of `lines', that are in `index' */
+    int indexed_lines;
+
+    /* Values of `DRAWING_TOLERANCE' and `DRAWING_MIN_DISTANCE' in image
+     * pixels, for the zoom that was used when storing the last point. */
+    double tolerance, min_distance;
+
+    /* Range of directions, in radians, from the second to last point of the
+     * current line, that keep all the points removed since then within
+     * `tolerance'. The last point can be replaced with a new one in this
+     * range. Not used if `sector_valid' is false. */
+    double sector_lo, sector_hi;
+    bool sector_valid;
+
+    /* Undo history. The first `ops_count' operations are applied, and the
+     * rest, up to `ops_total', can be redone. */
+    DrawingOp* ops;
+    int ops_sz, ops_count, ops_total;
+
+    /* Value for `DrawingOp.serial' of the next operation, and serial of the
+     * state before the first operation in `ops'. */
+    uint32_t next_serial, base_serial;
+
+    /* The last operation is an erase that is still being extended */
+    bool erase_open;
+
+    /* Indexes of the lines erased by each DRAWING_OP_ERASE */
+    int* erased;
+    int erased_sz, erased_i;
+
+    /* Number of points received by `drawing_push', and how many of them were
+     * removed by the simplifier. Not reset by `drawing_clear'. */
+    unsigned long stats_received, stats_removed;
 } Drawing;
 
+/* Get the position of the point I of a line, in image coordinates */
+static inline int drawing_point_x(const Drawing* drawing,
+                                  const DrawingLine* line, int i) {
+    return line->origin_x + drawing->xs[line->start + i];
+}
+
+static inline int drawing_point_y(const Drawing* drawing,
+                                  const DrawingLine* line, int i) {
+    return line->origin_y + drawing->ys[line->start + i];
+}
+
 /*----------------------------------------------------------------------------*/
 
 /* Allocate a new Drawing. It must be freed by the caller with `drawing_free' */
@@ -61,23 +185,68 @@ Drawing* drawing_new(void);
 /* Free a Drawing structure */
 void drawing_free(Drawing* drawing);
 
-/* Push a point to the `drawing->points' stack */
+/* Allocate a new Drawing with the finished lines that are currently drawn,
+ * without their history, e.g. for exporting them on another thread. Returns
+ * NULL if there is not enough memory. */
+Drawing* drawing_copy_visible(const Drawing* drawing);
+
+/* Add a point to the current line, or start a new line with it. Points that
+ * don't change the shape of the current line by more than `Drawing.tolerance'
+ * are not stored, or replace the last point of the line. */
 void drawing_push(Drawing* drawing, DrawingPoint point);
 
-/* Return true if the last point in the `Drawing.points' stack is not within an
- * ended line. Checks against the `Drawing.line_ends' array. */
+/* Make sure there is space for LINES more lines and POINTS more points, without
+ * growing the arrays one step at a time. Returns false if there is not enough
+ * memory. */
+bool drawing_reserve(Drawing* drawing, int lines, int points);
+
+/* Add a finished line, whose `count' points were already written to `xs' and
+ * `ys' starting at index `points_i', relative to the origin of the line. The
+ * `start' of the line is set by this function. The line is not added to the
+ * history, so it can only be used on a Drawing without operations and without
+ * a line in progress, e.g. when loading it from a file. */
+void drawing_add_finished_line(Drawing* drawing, DrawingLine line);
+
+/* Return true if a line is being drawn, i.e. `drawing_end_line' was not called
+ * after the last point. */
 bool drawing_in_progress(Drawing* drawing);
 
 /* Store that the current line in the drawing has ended. The next points will
- * belong to a different line. */
+ * belong to a different line. The line is simplified once more as a whole
+ * with the Ramer-Douglas-Peucker algorithm. */
 void drawing_end_line(Drawing* drawing);
 
-/* Store the user click in absolute position (X,Y) into the specified Drawing,
- * relative to the center of the window. */
-void drawing_store_from_center(Drawing* drawing, int x, int y, Color col);
-
-/* Clear the specified drawing by resetting the point and line stack positions
- * to zero. */
+/* Store the user click in window position (X,Y) into the specified Drawing,
+ * converted to image coordinates with the specified View. The zoom of the View
+ * is also used for simplifying the line; see `drawing_push'. */
+void drawing_store_from_view(Drawing* drawing, const View* view, int x, int y,
+                             Color col, uint8_t width);
+
+/* Get the identifier of the current state of the finished lines. It changes
+ * with every operation, undo and redo. See `DrawingOp.serial'. */
+uint32_t drawing_state(const Drawing* drawing);
+
+/* Undo or redo the last operation. Returns false if there was nothing to undo
+ * or redo. The line that is being drawn, if any, is ended first. */
+bool drawing_undo(Drawing* drawing);
+bool drawing_redo(Drawing* drawing);
+
+/* Erase all the finished lines that pass closer than RADIUS image pixels to
+ * the image position (X, Y). Returns true if any line was erased. Consecutive
+ * calls are joined into a single operation of the history, until
+ * `drawing_end_erase' is called. */
+bool drawing_erase(Drawing* drawing, double x, double y, double radius);
+
+/* Stop joining the calls to `drawing_erase' into the same operation */
+void drawing_end_erase(Drawing* drawing);
+
+/* Same as `drawing_erase', but with a window position and a RADIUS in window
+ * pixels, converted with the specified View. */
+bool drawing_erase_from_view(Drawing* drawing, const View* view, int x, int y,
+                             double radius);
+
+/* Hide all the lines of the specified drawing. It can be undone, so the lines
+ * are only freed once the operation leaves the history. */
 void drawing_clear(Drawing* drawing);
 
 #endif /* DRAWING_H_ */
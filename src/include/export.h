@@ -0,0 +1,60 @@
+
+#ifndef EXPORT_H_
+#define EXPORT_H_ 1
+
+#include <stdbool.h>
+
+#include "image.h"
+
+/* Default zlib compression level of the exported images, from 0 to 9 */
+#define EXPORT_LEVEL_DEFAULT 6
+
+/* Number of bytes of filtered rows compressed by each job. The jobs are
+ * compressed in parallel, and each of them ends in a byte boundary of the
+ * stream, which costs a few bytes. */
+#define EXPORT_BAND_SIZE (512 * 1024)
+
+/* Maximum number of threads used for compressing */
+#define EXPORT_MAX_THREADS 64
+
+/* Maximum size of each IDAT chunk of the exported images */
+#define EXPORT_IDAT_SIZE (1024 * 1024)
+
+/* Filters applied to the rows before compressing them. The adaptive filter
+ * chooses the best one for each row, like libpng does by default. */
+typedef enum ExportFilter {
+    EXPORT_FILTER_NONE  = 0,
+    EXPORT_FILTER_SUB   = 1,
+    EXPORT_FILTER_UP    = 2,
+    EXPORT_FILTER_AVG   = 3,
+    EXPORT_FILTER_PAETH = 4,
+    EXPORT_FILTER_ADAPTIVE,
+} ExportFilter;
+
+typedef struct ExportOptions {
+    /* Compression level, from 0 (none) to 9 (best) */
+    int level;
+
+    ExportFilter filter;
+
+    /* Number of threads used for compressing. If zero, one for each
+     * processor. */
+    int threads;
+} ExportOptions;
+
+/*----------------------------------------------------------------------------*/
+
+/* Get the default export options */
+ExportOptions export_default_options(void);
+
+/* Parse the name of a filter, as shown by `-h'. Returns false if it's not
+ * valid. */
+bool export_parse_filter(const char* name, ExportFilter* filter);
+
+/* Write an RGBA image with 8-bit samples to a PNG file. Bands of rows are
+ * compressed in parallel into a single zlib stream, like pigz does. Returns
+ * false on error, and the file might be incomplete. */
+bool export_png(const char* filename, const Image* image,
+                const ExportOptions* options);
+
+#endif /* EXPORT_H_ */
@@ -0,0 +1,57 @@
+
+#ifndef FASTPNG_H_
+#define FASTPNG_H_ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "image.h"
+
+/* Maximum width and height of the decoded images, like the default limits of
+ * libpng. Bigger images are left to libpng, which rejects them. */
+#define FASTPNG_MAX_SIZE 1000000
+
+/* Approximate size of the buffer where the compressed rows are inflated
+ * before unfiltering them. Small enough for the rows to stay in the cache. */
+#define FASTPNG_BAND_BYTES (256 * 1024)
+
+/* Images with at least this many pixels are decoded by a pipeline of
+ * threads: one inflates the bands of rows, another unfilters them, and the
+ * rest convert them to RGBA. Smaller ones are decoded in the calling
+ * thread. */
+#define FASTPNG_PIPELINE_PIXELS (8 * 1000 * 1000)
+
+/* Number of bands between the stages of the pipeline. When all of them are
+ * full, inflating waits, which bounds the memory used. */
+#define FASTPNG_RING_BANDS 8
+
+/* Maximum number of threads of the pipeline */
+#define FASTPNG_MAX_THREADS 16
+
+/* Number of threads used for decoding big images, including the calling one.
+ * If zero, one for each processor. If one, the pipeline is not used. */
+extern int g_fastpng_threads;
+
+/* If false, the rows are unfiltered with the portable functions instead of the
+ * vectorized ones. Used by the check of the benchmarks for comparing them. */
+extern bool g_fastpng_simd;
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * Decode a PNG image from memory, without libpng. Only the most common layout
+ * of screenshots is supported: 8-bit RGB or RGBA, not interlaced. Returns NULL
+ * if the image is not supported, or if there is any error (e.g. a corrupt
+ * chunk); in both cases, it should be decoded with libpng instead, which
+ * knows how to handle them. The pixels are identical to the ones of
+ * `image_read_file'.
+ */
+Image* fastpng_decode(const uint8_t* data, size_t size);
+
+/* Read a PNG file with `source_open', and decode it with `fastpng_decode'.
+ * Regular files are mapped, so only the pages that are used are read if the
+ * image is not supported. */
+Image* fastpng_read_file(const char* filename);
+
+#endif /* FASTPNG_H_ */
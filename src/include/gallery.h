@@ -0,0 +1,159 @@
+
+#ifndef GALLERY_H_
+#define GALLERY_H_ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "image.h"
+#include "mipmap.h"
+#include "tiles.h"
+#include "view.h"
+#include "drawing.h"
+
+/* Number of images before and after the current one that are decoded ahead of
+ * time, once the current one is complete. */
+#define GALLERY_PREFETCH 2
+
+/* Maximum time spent decoding the current image on each call to
+ * `gallery_update', if it can't be decoded on a separate thread */
+#define GALLERY_LOAD_BUDGET_MS 12
+
+/* Default limits, in MiB, of the memory used by the images that are not
+ * shown. The pixels in CPU memory and the textures are limited separately.
+ * When they are exceeded, the least recently shown images are evicted. */
+#define GALLERY_CPU_BUDGET_DEFAULT 1024
+#define GALLERY_GPU_BUDGET_DEFAULT 512
+
+/* Flags returned by `gallery_update' */
+enum GalleryUpdate {
+    GALLERY_CHANGED = (1 << 0), /* The current image has new pixels */
+    GALLERY_LOADED  = (1 << 1), /* The current image was completed */
+};
+
+typedef struct GalleryImage {
+    /* Path of the PNG file, or "-" for the standard input */
+    char* path;
+
+    /* The image is read from the standard input, so it can only be decoded
+     * once. It's never prefetched or evicted. */
+    bool stream;
+
+    /* Paths of the files generated from it. See `util_derived_path'. */
+    char* export_path;
+    char* strokes_path;
+    char* session_path;
+
+    /* Dimensions of the image, read from its header. Zero until the image is
+     * shown or prefetched for the first time. */
+    int w, h;
+
+    /* Lines drawn on the image. Created by the caller when the image is first
+     * shown, and kept until the Gallery is freed, even if the image is
+     * evicted. */
+    Drawing* drawing;
+
+    /* Zoom and position of the last time it was shown. Only valid if
+     * `has_view' is true. */
+    View view;
+    bool has_view;
+
+    /* Loader decoding the image progressively on a thread. Only used if the
+     * image was not prefetched when it was shown. While it's not NULL, the
+     * loader owns `image'. */
+    ImageLoader* loader;
+
+    /* Start of the decoding, for the trace. See `trace_begin'. */
+    uint64_t load_start;
+
+    /* Thread decoding the image and generating its mip levels, without
+     * showing it. While `prefetching' is true, only the thread writes to
+     * `image' and `mipmap', and it sets `prefetch_done' atomically once
+     * they are ready. */
+    pthread_t prefetch_thread;
+    bool prefetching, prefetch_done;
+
+    /* Set by the Gallery for stopping the prefetch thread early, e.g. when
+     * the image is evicted. */
+    bool prefetch_cancel;
+
+    /* Decoded image and its mip levels, and the tiles of each level. They are
+     * NULL if the image is not cached. The mipmap is only generated once the
+     * image is complete. */
+    Image* image;
+    Mipmap* mipmap;
+    TiledImage* level_tiles[MIPMAP_MAX_LEVELS];
+
+    /* The image couldn't be opened, or decoding it failed */
+    bool failed;
+
+    /* Value of `Gallery.tick' when the image was last shown or prefetched */
+    uint32_t last_used;
+} GalleryImage;
+
+typedef struct Gallery {
+    /* All the images, in the order they were specified */
+    GalleryImage* images;
+    int count;
+
+    /* Index of the image that is shown */
+    int current;
+
+    /* Limits of the memory used by the images that are not shown, in bytes.
+     * See GALLERY_CPU_BUDGET_DEFAULT. */
+    size_t cpu_budget, gpu_budget;
+
+    /* The neighbours of the current image have to be prefetched once it's
+     * complete */
+    bool prefetch_pending;
+
+    /* The current image was already complete when it was shown, so the next
+     * call to `gallery_update' reports it as loaded */
+    bool announce_loaded;
+
+    /* Incremented each time an image is shown or prefetched */
+    uint32_t tick;
+} Gallery;
+
+/*----------------------------------------------------------------------------*/
+
+/* Allocate a new Gallery with the PNG files in PATHS. Directories are replaced
+ * with the PNG files inside of them, sorted by name. Returns NULL if there are
+ * no images, or if there is not enough memory. The returned pointer must be
+ * freed with `gallery_free'. */
+Gallery* gallery_new(char* const* paths, int count);
+
+/* Free a Gallery, along with the images and drawings of its entries. Stops the
+ * threads that are decoding images. */
+void gallery_free(Gallery* gallery);
+
+/* Get the image that is currently shown */
+static inline GalleryImage* gallery_current(Gallery* gallery) {
+    return &gallery->images[gallery->current];
+}
+
+/* Make the image at INDEX the current one. If it's not cached, start decoding
+ * it on a thread; its header is read before returning, so its dimensions are
+ * known. Returns false if it can't be opened, and marks it as failed. The
+ * tiles are created by `gallery_update', so the renderer is not needed
+ * yet. */
+bool gallery_show(Gallery* gallery, int index);
+
+/* Collect the images decoded by the threads, create the tiles of the current
+ * image, prefetch the neighbours of the current image once it's complete, and
+ * evict the images that don't fit in the budgets. Must be called from the
+ * main loop. Returns a combination of `GalleryUpdate' flags. */
+int gallery_update(Gallery* gallery);
+
+/* Check if any image is being decoded, in which case `gallery_update' has to
+ * be called periodically, even if there are no events. */
+bool gallery_loading(const Gallery* gallery);
+
+/* Get the memory used by the images that are not shown: bytes of pixels in
+ * CPU memory, and bytes of textures. */
+void gallery_cached_bytes(Gallery* gallery, size_t* cpu_bytes,
+                          size_t* gpu_bytes);
+
+#endif /* GALLERY_H_ */
@@ -0,0 +1,45 @@
+
+#ifndef GRID_H_
+#define GRID_H_ 1
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <SDL2/SDL.h>
+
+typedef struct Grid {
+    /* Texture with the background and the grid lines, with the size of the
+     * window. NULL if it has not been created yet, or if it couldn't be
+     * created; in that case the lines are drawn one by one. */
+    SDL_Texture* texture;
+
+    /* Size of `texture' */
+    int w, h;
+
+    /* Space between the lines, in window pixels */
+    int step;
+
+    /* Colors of the background and the lines, in 0xRRGGBB format */
+    uint32_t col_bg, col_line;
+
+    /* False if the texture has to be generated again */
+    bool valid;
+} Grid;
+
+/*----------------------------------------------------------------------------*/
+
+/* Allocate a new Grid for the global renderer. The texture is created when
+ * rendering. The returned pointer must be freed with `grid_free'. */
+Grid* grid_new(int step, uint32_t col_bg, uint32_t col_line);
+
+/* Free a Grid and its texture */
+void grid_free(Grid* grid);
+
+/* Make the grid generate its texture again on the next call to `grid_render'.
+ * Should be called when the window is resized, when the settings of the Grid
+ * change, or when the contents of the texture are lost. */
+void grid_invalidate(Grid* grid);
+
+/* Fill the whole window with the background and the grid lines */
+void grid_render(Grid* grid);
+
+#endif /* GRID_H_ */
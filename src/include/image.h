@@ -2,25 +2,169 @@
 #ifndef IMAGE_H_
 #define IMAGE_H_ 1
 
+#include <stdbool.h>
+#include <stdio.h>
+#include <pthread.h>
 #include <png.h>
 
+#include "convert.h"
+#include "source.h"
+#include "diskcache.h"
+
+/* Maximum number of bytes decoded on each call to `image_loader_step' */
+#define IMAGE_LOADER_CHUNK_SIZE (64 * 1024)
+
+/* Pixels of an Image that are also used by another thread, and that are freed
+ * along with their last reference. See `image_share_pixels'. */
+typedef struct ImagePixels {
+    void* data;
+    int refs;
+} ImagePixels;
+
 typedef struct Image {
     void* data;
+
+    /* If not NULL, `data' points inside of this read-only mapping of
+     * `mapping_size' bytes, which is unmapped instead of freed. See
+     * `diskcache_load'. */
+    void* mapping;
+    size_t mapping_size;
+
+    /* If not NULL, `data' is shared with other threads, and the Image only
+     * owns one of its references. */
+    ImagePixels* shared;
+
     int w, h;
     int color_type;
     int bit_depth;
     int byte_pitch;
 } Image;
 
+typedef struct ImageLoader {
+    Source* source;
+    png_structp png;
+    png_infop info;
+
+    /* Image being decoded. It's NULL until the PNG header has been read, and
+     * its `data' is filled as rows arrive. */
+    Image* image;
+
+    /* Number of rows at the top of the image that are complete, and that are
+     * not written anymore. See `image_loader_ready_rows'. */
+    int ready_rows;
+
+    /* True once the whole image has been decoded */
+    bool done;
+
+    /* True if libpng reported an error. The rows decoded so far are kept. */
+    bool failed;
+
+    /* Used for converting the decoded rows to RGBA, unless its `func' is
+     * NULL. See `g_image_convert'. */
+    RowConverter converter;
+
+    /* Thread decoding the image, see `image_loader_start_thread'. While it's
+     * running, `lock' protects `ready_rows' and `finished'. */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    bool threaded;
+
+    /* Set by the thread once it stops decoding */
+    bool finished;
+
+    /* Set by `image_loader_free' for stopping the thread early */
+    bool cancel;
+
+    /* If not NULL, the thread stores the image in the disk cache once it's
+     * complete, with the key read before decoding it. Freed with the
+     * loader. See `diskcache_store'. */
+    char* cache_path;
+    DiskCacheKey cache_key;
+} ImageLoader;
+
+/* If false, the rows are always converted to RGBA with the transformations of
+ * libpng, instead of `convert_row'. Used by the benchmarks for comparing
+ * them. */
+extern bool g_image_convert;
+
+/* If false, `image_read_file' always decodes with libpng, instead of trying
+ * `fastpng_read_file' first. Used by the benchmarks for comparing them. */
+extern bool g_image_fastpng;
+
 /*----------------------------------------------------------------------------*/
 
 /* Read a PNG file, and return a Image structure. Returned structure must be
- * freed by the caller. */
+ * freed by the caller. If FILENAME is "-", the image is read from the standard
+ * input. See `source_open'. */
 Image* image_read_file(const char* filename);
 
+/* Read a PNG image from the current position of a Source. Like
+ * `image_read_file'. */
+Image* image_read_source(Source* source);
+
+/* Read the dimensions of a PNG image from its header, without decoding it.
+ * Returns false if the file can't be read. */
+bool image_read_size(const char* filename, int* w, int* h);
+
+/* Start decoding a PNG file progressively, or the standard input if FILENAME
+ * is "-". Returns NULL if the file can't be opened. The returned loader must
+ * be freed with `image_loader_free'. */
+ImageLoader* image_loader_new(const char* filename);
+
+/* Free an ImageLoader, along with its Image unless it has been taken with
+ * `image_loader_take_image'. */
+void image_loader_free(ImageLoader* loader);
+
+/* Read the next chunk of the file and decode it. Returns false if there is
+ * nothing left to do, either because the image is complete or because of an
+ * error; see `ImageLoader.done' and `ImageLoader.failed'. */
+bool image_loader_step(ImageLoader* loader);
+
+/* Decode the rest of the image on a new thread, after the header has been read
+ * with `image_loader_step'. Afterwards, only `image_loader_ready_rows' and
+ * `image_loader_finished' can be used until the thread finishes. Returns false
+ * if the thread can't be created. */
+bool image_loader_start_thread(ImageLoader* loader);
+
+/* Check if the image stopped decoding, either because it's complete or because
+ * of an error; see `ImageLoader.done' and `ImageLoader.failed'. If it was
+ * decoded on a thread, the thread is joined when this returns true, and they
+ * can be read. */
+bool image_loader_finished(ImageLoader* loader);
+
+/* Get the number of rows at the top of the image that are complete. Only those
+ * can be read while the image is decoded on a thread, since the thread might
+ * be writing the rest. Rows are complete once they are decoded, except in
+ * interlaced images, where they are only complete on the last pass. */
+int image_loader_ready_rows(ImageLoader* loader);
+
+/* Take ownership of the Image from the loader. It must be freed by the caller
+ * with `image_free'. */
+Image* image_loader_take_image(ImageLoader* loader);
+
 /* Free an Image structure */
 void image_free(Image* image);
 
+/* Return a new Image with a copy of the pixel data of the specified one.
+ * Returns NULL if its data was freed, or if there is not enough memory. */
+Image* image_copy(const Image* image);
+
+/* Free the pixel data of an Image, but not the structure itself. The `data'
+ * member is set to NULL, but the rest of the metadata is kept. If the pixels
+ * are shared, only the reference of the Image is released. */
+void image_free_data(Image* image);
+
+/* Get a new reference to the pixels of an Image, so another thread can keep
+ * reading them after the Image is freed. They must not be modified anymore.
+ * Returns NULL if the pixels are mapped or were freed, or if there is not
+ * enough memory. The reference must be released with
+ * `image_pixels_release'. */
+ImagePixels* image_share_pixels(Image* image);
+
+/* Release a reference returned by `image_share_pixels', freeing the pixels
+ * if it was the last one. */
+void image_pixels_release(ImagePixels* pixels);
+
 /* Add an alpha channel for color types that don't have it, and update the color
  * type. */
 void image_add_alpha(Image* image, png_structp png);
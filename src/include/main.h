@@ -7,4 +7,8 @@
 extern SDL_Window* g_window;
 extern SDL_Renderer* g_renderer;
 
+/* Number of draw calls sent to the renderer in the current frame. Reset by the
+ * main loop before drawing each frame. */
+extern int g_draw_calls;
+
 #endif /* MAIN_H_ */
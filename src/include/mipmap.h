@@ -0,0 +1,44 @@
+
+#ifndef MIPMAP_H_
+#define MIPMAP_H_ 1
+
+#include "image.h"
+
+/* Maximum number of levels in a Mipmap, including the original image */
+#define MIPMAP_MAX_LEVELS 16
+
+/* Stop generating levels once both sides of the image are this small */
+#define MIPMAP_MIN_SIZE 64
+
+typedef struct Mipmap {
+    /* Number of levels, including the original image */
+    int count;
+
+    /* Each level is half the size of the previous one, rounding up. The first
+     * level is the original image, and it's not owned by the Mipmap. */
+    Image* levels[MIPMAP_MAX_LEVELS];
+} Mipmap;
+
+/*----------------------------------------------------------------------------*/
+
+/* Generate the mip levels of an RGBA image with 8-bit samples. The original
+ * image must outlive the Mipmap. The returned pointer must be freed with
+ * `mipmap_free'. */
+Mipmap* mipmap_new(Image* image);
+
+/* Free a Mipmap and all its levels, except the original image */
+void mipmap_free(Mipmap* mipmap);
+
+/* Free the pixel data of all the levels, including the original image, but
+ * keep their metadata. */
+void mipmap_free_data(Mipmap* mipmap);
+
+/* Get the smallest level that still has at least one pixel for each window
+ * pixel, when drawn with the specified zoom. */
+int mipmap_level_for_zoom(const Mipmap* mipmap, double zoom);
+
+/* Return a new Image with half the width and height of the specified one,
+ * rounding up. Each pixel is the average of a 2x2 block of the source. */
+Image* mipmap_downsample(const Image* image);
+
+#endif /* MIPMAP_H_ */
@@ -0,0 +1,87 @@
+
+#ifndef PROFILE_H_
+#define PROFILE_H_ 1
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Environment variable that enables the profiler, like the `-P' argument */
+#define PROFILE_ENV "HLPNG_PROFILE"
+
+/* Values below this are counted in their own bucket. Bigger values share
+ * buckets with the ones in the same eighth of a power of two, so the
+ * percentiles are within 12.5% of the real value. */
+#define PROFILE_LINEAR_BUCKETS 16
+#define PROFILE_SUB_BUCKETS    8
+
+/* Number of buckets of each histogram. With nanoseconds, the last bucket
+ * starts at about 15 seconds, and bigger values are counted in it. */
+#define PROFILE_BUCKETS 256
+
+/* Scale of the bitmap font of the overlay, in window pixels */
+#define PROFILE_FONT_SCALE 2
+
+/* Metrics recorded by the profiler. All of them are durations in nanoseconds,
+ * except PROFILE_DRAW_CALLS. */
+typedef enum ProfileMetric {
+    PROFILE_EVENTS,  /* Handling the events of each iteration */
+    PROFILE_LOAD,    /* Decoding and uploading rows while loading */
+    PROFILE_GRID,    /* Drawing the background grid */
+    PROFILE_IMAGE,   /* Drawing the tiles of the image */
+    PROFILE_DRAWING, /* Drawing the lines */
+    PROFILE_PRESENT, /* Presenting the frame, maybe waiting for VSync */
+    PROFILE_FRAME,   /* All of the above, for iterations that draw a frame */
+
+    PROFILE_DRAW_CALLS, /* Number of draw calls of each frame */
+
+    PROFILE_METRICS,
+} ProfileMetric;
+
+/* Histogram of the values of a metric. It's updated with atomic operations, so
+ * it can be read and written from different threads without locks. */
+typedef struct ProfileHistogram {
+    uint32_t buckets[PROFILE_BUCKETS];
+    uint64_t count, total, max;
+} ProfileHistogram;
+
+/* True if the profiler is enabled. Read it with `profile_start', which
+ * doesn't read the clock when it's false. */
+extern bool g_profile_enabled;
+
+/*----------------------------------------------------------------------------*/
+
+/* Enable the profiler if ENABLED is true, or if the PROFILE_ENV environment
+ * variable is set to something other than "0". Returns `g_profile_enabled'. */
+bool profile_init(bool enabled);
+
+/* Get the current time of a monotonic clock, in nanoseconds */
+uint64_t profile_now(void);
+
+/* Add a value to the histogram of a metric */
+void profile_record(ProfileMetric metric, uint64_t value);
+
+/* Get the current time for measuring a metric with `profile_end', or zero if
+ * the profiler is disabled. */
+static inline uint64_t profile_start(void) {
+    return g_profile_enabled ? profile_now() : 0;
+}
+
+/* Record the time elapsed since START, returned by `profile_start' */
+static inline void profile_end(ProfileMetric metric, uint64_t start) {
+    if (g_profile_enabled)
+        profile_record(metric, profile_now() - start);
+}
+
+/* Get an approximation of the percentile P, from 0 to 100, of the values of a
+ * metric. Returns zero if it has no values. */
+uint64_t profile_percentile(ProfileMetric metric, double p);
+
+/* Draw the percentiles of the metrics in the top-left corner of the window,
+ * with the global renderer. */
+void profile_render_overlay(void);
+
+/* Print a summary of all the metrics to FP */
+void profile_print_summary(FILE* fp);
+
+#endif /* PROFILE_H_ */
@@ -0,0 +1,40 @@
+
+#ifndef SESSION_H_
+#define SESSION_H_ 1
+
+#include <stdbool.h>
+
+#include "drawing.h"
+
+/* First bytes of a session file, and version of the format */
+#define SESSION_MAGIC   "HLPNGSES"
+#define SESSION_VERSION 1
+
+/*
+ * Session files store the visible lines of a Drawing. All the values are
+ * little-endian, and the file has three parts:
+ *
+ *   1. Header (40 bytes): the magic, the version, the number of lines, the
+ *      total number of points, the size of the point data, and the CRC-32 of
+ *      the rest of the file.
+ *   2. Index (32 bytes per line): color, width, origin, number of points and
+ *      offset of the points of the line inside of the point data.
+ *   3. Point data: for each line, the difference between each point and the
+ *      previous one, starting with the origin, as zigzag varints.
+ */
+
+/*----------------------------------------------------------------------------*/
+
+/* Save the visible lines of a Drawing to a session file. The file is written
+ * to a temporary file in the same directory first, and then renamed, so it's
+ * never left half-written. The line that is being drawn, if any, is not
+ * included. Returns false on error. */
+bool session_save(const char* filename, const Drawing* drawing);
+
+/* Load a Drawing from a session file, mapping the file in memory. The lines
+ * can't be undone. Returns NULL if the file can't be read, or if it's not a
+ * valid session file. The returned Drawing must be freed with
+ * `drawing_free'. */
+Drawing* session_load(const char* filename);
+
+#endif /* SESSION_H_ */
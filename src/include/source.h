@@ -0,0 +1,71 @@
+
+#ifndef SOURCE_H_
+#define SOURCE_H_ 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <png.h>
+
+/* Number of bytes requested on each read from pipes, and from files that can't
+ * be mapped. Big reads keep the number of system calls low. */
+#define SOURCE_READ_SIZE (1024 * 1024)
+
+/*
+ * Input of the PNG decoders. Regular files are mapped in memory, so reading
+ * them doesn't need any system calls or copies. The standard input, and any
+ * file that can't be mapped (e.g. a named pipe), is read as a stream, in
+ * blocks of SOURCE_READ_SIZE bytes.
+ */
+typedef struct Source {
+    /* File descriptor of a stream, or -1 if the whole file is in `data'. It's
+     * only closed if `owns_fd' is true. */
+    int fd;
+    bool owns_fd;
+
+    /* Whole file, and position of the next byte. It's either mapped, or read
+     * from a stream by `source_contents'. */
+    const uint8_t* data;
+    size_t size, pos;
+    bool mapped;
+
+    /* Buffer of a stream, with the bytes that were not consumed yet in the
+     * range [buf_pos, buf_len) */
+    uint8_t* buf;
+    size_t buf_pos, buf_len;
+} Source;
+
+/*----------------------------------------------------------------------------*/
+
+/* Check if a path refers to the standard input */
+static inline bool source_is_stdin(const char* path) {
+    return strcmp(path, "-") == 0;
+}
+
+/* Open a file for reading, or the standard input if PATH is "-". Returns NULL
+ * on error. Must be closed with `source_close'. */
+Source* source_open(const char* path);
+
+/* Read a stream from an open file descriptor, e.g. a pipe. The descriptor is
+ * not closed by `source_close'. */
+Source* source_open_fd(int fd);
+
+void source_close(Source* source);
+
+/* Get the next bytes of the source, up to MAX, without copying them if
+ * possible. Returns the number of bytes in DATA, which is zero at the end of
+ * the file or on error. They are valid until the next call. */
+size_t source_next(Source* source, size_t max, const uint8_t** data);
+
+/* Read exactly LEN bytes into DST. Returns false if the file ended before. */
+bool source_read(Source* source, uint8_t* dst, size_t len);
+
+/* Get the rest of the file, contiguous in memory, without consuming it.
+ * Streams are read until the end. Returns NULL on error. */
+const uint8_t* source_contents(Source* source, size_t* size);
+
+/* Make libpng read from the source, with `png_set_read_fn' */
+void source_set_png(Source* source, png_structp png);
+
+#endif /* SOURCE_H_ */
@@ -0,0 +1,76 @@
+
+#ifndef SPATIAL_H_
+#define SPATIAL_H_ 1
+
+#include <math.h>
+#include <stdint.h>
+
+/* Width and height of the cells of the index, in image pixels */
+#define SPATIAL_CELL_SIZE 64
+
+/* Initial number of slots in `SpatialIndex.cells', must be a power of two */
+#define SPATIAL_CELLS_SIZE 256
+
+/* Get the cell that contains the image coordinate V */
+#define SPATIAL_CELL(V) ((int32_t)floor((double)(V) / SPATIAL_CELL_SIZE))
+
+typedef struct SpatialEntry {
+    /* Line of the Drawing, and index of the segment inside of it. Segment I
+     * goes from point I to point I+1. */
+    int line, segment;
+
+    /* Next entry of the same cell, or -1 */
+    int next;
+} SpatialEntry;
+
+typedef struct SpatialCell {
+    /* Position of the cell, in units of `SPATIAL_CELL_SIZE' */
+    int32_t cx, cy;
+
+    /* First entry of the cell in `SpatialIndex.entries', or -1 if the slot of
+     * the hash table is empty. */
+    int head;
+} SpatialCell;
+
+/*
+ * Uniform grid over the image, where each cell has a list of the segments that
+ * pass through it. Only the cells that have any segments are stored, in a hash
+ * table, so the drawing can be anywhere around the image. Finding the segments
+ * near a point only needs to look at the cells around it, so the cost doesn't
+ * depend on the size of the drawing.
+ */
+typedef struct SpatialIndex {
+    /* Hash table of cells, with linear probing */
+    SpatialCell* cells;
+
+    /* Number of slots in `cells', always a power of two, and number of slots
+     * that are used. */
+    int cells_sz, cells_used;
+
+    /* Entries of all the cells. They are never removed individually. */
+    SpatialEntry* entries;
+    int entries_sz, entries_i;
+} SpatialIndex;
+
+/*----------------------------------------------------------------------------*/
+
+/* Allocate a new, empty SpatialIndex. The returned pointer must be freed with
+ * `spatial_free'. */
+SpatialIndex* spatial_new(void);
+
+/* Free a SpatialIndex */
+void spatial_free(SpatialIndex* index);
+
+/* Remove all the entries of the index, keeping the allocated memory */
+void spatial_clear(SpatialIndex* index);
+
+/* Add the segment from (X0, Y0) to (X1, Y1) to all the cells that are closer
+ * than MARGIN to it. */
+void spatial_insert(SpatialIndex* index, int line, int segment, double x0,
+                    double y0, double x1, double y1, double margin);
+
+/* Get the first entry of the cell (CX, CY), or -1 if it has no entries. The
+ * rest are linked with `SpatialEntry.next'. */
+int spatial_find(const SpatialIndex* index, int32_t cx, int32_t cy);
+
+#endif /* SPATIAL_H_ */
@@ -0,0 +1,31 @@
+
+#ifndef STROKEFILE_H_
+#define STROKEFILE_H_ 1
+
+#include <stdbool.h>
+
+#include "drawing.h"
+
+/*
+ * Stroke files are text files with the visible lines of a Drawing, one per
+ * line of the file. Each line has its color in RRGGBBAA format, its width in
+ * image pixels and the positions of its points:
+ *
+ *   FF0000FF 3 10,20 15,22 40,30
+ *
+ * Empty lines and lines that start with '#' are ignored.
+ */
+
+/*----------------------------------------------------------------------------*/
+
+/* Write the visible lines of a Drawing to a stroke file. The line that is being
+ * drawn, if any, is not included. Returns false on error. */
+bool strokefile_write(const char* filename, const Drawing* drawing);
+
+/* Read the lines of a stroke file and add them to a Drawing, as if they were
+ * drawn. The points are stored as they are, without simplifying them. Returns
+ * false if the file can't be read or it has invalid lines; the lines before the
+ * invalid one are kept. */
+bool strokefile_read(const char* filename, Drawing* drawing);
+
+#endif /* STROKEFILE_H_ */
@@ -0,0 +1,113 @@
+
+#ifndef STROKES_H_
+#define STROKES_H_ 1
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <SDL2/SDL.h>
+
+#include "drawing.h"
+#include "view.h"
+
+/* Lines that are thinner than this, in window pixels, are drawn with
+ * `SDL_RenderDrawLines'. Thicker lines are drawn as anti-aliased triangles with
+ * `SDL_RenderGeometry'. */
+#define STROKES_THIN_WIDTH 1.5f
+
+/* Maximum length of the corners of thick lines, relative to their width.
+ * Sharper corners are cut. */
+#define STROKES_MITER_LIMIT 2.0f
+
+/* Number of vertices around the dots of thick lines with a single point */
+#define STROKES_DOT_SEGMENTS 16
+
+/* Maximum number of copies of the texture kept for undoing, and number of
+ * added lines after which a new copy is made. Undoing only has to draw the
+ * lines since the last copy. See `StrokeCheckpoint'. */
+#define STROKES_CHECKPOINTS         8
+#define STROKES_CHECKPOINT_INTERVAL 32
+
+/* Copy of the texture of a StrokeCache at some point of the history of the
+ * Drawing. Checkpoints are also made before adding lines after an erase or a
+ * clear, since the lines can't be removed from the texture without drawing
+ * everything again. */
+typedef struct StrokeCheckpoint {
+    /* Render target with the size of `StrokeCache.texture', or NULL */
+    SDL_Texture* texture;
+
+    /* The texture has the lines of this state of the Drawing. See
+     * `drawing_state'. */
+    uint32_t state;
+
+    /* False if the texture is not used */
+    bool valid;
+
+    /* Value of `StrokeCache.tick' when it was last made or restored */
+    uint32_t last_used;
+} StrokeCheckpoint;
+
+typedef struct StrokeCache {
+    /* Render target with the finished lines of the drawing, with the size of
+     * the window. NULL if it has not been created yet, or if the renderer
+     * doesn't support render targets. */
+    SDL_Texture* texture;
+
+    /* Size of `texture' */
+    int w, h;
+
+    /* View that was used for drawing the lines in the texture. If it changes,
+     * the texture has to be drawn again. */
+    View view;
+
+    /* State of the Drawing whose finished lines are drawn in the texture. See
+     * `drawing_state'. */
+    uint32_t state;
+
+    /* Number of lines drawn in the texture since it was last copied from or
+     * to a checkpoint. */
+    int since_checkpoint;
+
+    /* Copies of the texture for undoing, and counter used for finding the
+     * least recently used one. They are only valid for the current `view'. */
+    StrokeCheckpoint checkpoints[STROKES_CHECKPOINTS];
+    uint32_t tick;
+
+    /* False if the texture has to be cleared and drawn again */
+    bool valid;
+
+    /* Buffers used for building the draw calls, reused across frames. The
+     * vertices of consecutive thick lines are accumulated and sent together
+     * in a single draw call. */
+    SDL_Point* points;
+    SDL_FPoint* fpoints;
+    int points_sz;
+
+    SDL_Vertex* vertices;
+    int vertices_sz, vertices_i;
+
+    int* indices;
+    int indices_sz, indices_i;
+} StrokeCache;
+
+/*----------------------------------------------------------------------------*/
+
+/* Allocate a new StrokeCache for the global renderer. The texture is created
+ * when rendering. The returned pointer must be freed with `strokes_free'. */
+StrokeCache* strokes_new(void);
+
+/* Free a StrokeCache and its texture */
+void strokes_free(StrokeCache* cache);
+
+/* Make the cache draw all the lines again on the next call to
+ * `strokes_render', and forget the checkpoints. Should be called when the
+ * contents of the textures are lost. Changes to the Drawing are detected with
+ * `drawing_state'. */
+void strokes_invalidate(StrokeCache* cache);
+
+/* Render a drawing on top of the image, with the specified View. The finished
+ * lines that are not in the cache yet are added to it, and the line that is
+ * being drawn is rendered directly. If lines were removed, the texture starts
+ * from the closest checkpoint. */
+void strokes_render(StrokeCache* cache, Drawing* drawing, const View* view);
+
+#endif /* STROKES_H_ */
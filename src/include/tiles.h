@@ -0,0 +1,95 @@
+
+#ifndef TILES_H_
+#define TILES_H_ 1
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <SDL2/SDL.h>
+
+#include "image.h"
+
+/* Default width and height of each tile, in pixels. It will be smaller if the
+ * renderer doesn't support textures this big. */
+#define TILE_SIZE 1024
+
+/* Number of textures that can be kept in GPU memory, relative to the number of
+ * tiles that are currently visible. Tiles that have not been drawn recently are
+ * freed when this limit is exceeded. */
+#define TILES_RESIDENT_FACTOR 2
+
+typedef struct Tile {
+    /* Texture with the pixels of the tile. NULL until the tile is drawn for the
+     * first time, or after it's evicted. */
+    SDL_Texture* texture;
+
+    /* The pixels in `TiledImage.image' changed since the texture was last
+     * updated. */
+    bool dirty;
+
+    /* Value of `TiledImage.frame' when the tile was last drawn */
+    uint32_t last_used;
+} Tile;
+
+typedef struct TiledImage {
+    /* Image with the source pixels of the tiles. Not owned by the TiledImage,
+     * and its `data' might be freed after calling `tiles_upload_all'. */
+    Image* image;
+
+    /* Size of each tile in pixels. Tiles on the right and bottom edges might
+     * be smaller. */
+    int tile_size;
+
+    /* Number of tiles in each row and column */
+    int cols, rows;
+
+    /* Array of cols*rows tiles, in row-major order */
+    Tile* tiles;
+
+    /* Pixel format of the textures. The Image is always RGBA, and its pixels
+     * are converted while uploading them if this is different. */
+    uint32_t format;
+
+    /* Number of rows at the top of the image that can be read. The rest are
+     * still being decoded on another thread, and are drawn as transparent,
+     * like the rows that were not decoded yet. See `tiles_set_ready_rows'. */
+    int ready_rows;
+
+    /* If true, the textures always use linear filtering when scaled. Otherwise
+     * they use the default of SDL_HINT_RENDER_SCALE_QUALITY. */
+    bool linear;
+
+    /* Number of tiles that currently have a texture */
+    int resident;
+
+    /* Incremented on each call to `tiles_render' */
+    uint32_t frame;
+} TiledImage;
+
+/*----------------------------------------------------------------------------*/
+
+/* Allocate a new TiledImage for the specified Image, using the global
+ * renderer. No textures are created until the tiles are drawn. The returned
+ * pointer must be freed with `tiles_free'. See also `TiledImage.linear'. */
+TiledImage* tiles_new(Image* image);
+
+/* Free a TiledImage and all its textures. The Image is not freed. */
+void tiles_free(TiledImage* tiled);
+
+/* Set the number of rows of the Image that can be read, which is all of them
+ * by default. The tiles with rows that changed are marked as dirty, so they
+ * are updated the next time they are drawn. Returns true if any rows
+ * changed. */
+bool tiles_set_ready_rows(TiledImage* tiled, int rows);
+
+/* Create or update the textures of all the tiles. Afterwards, the pixels of
+ * the Image are no longer needed. Returns false on error. */
+bool tiles_upload_all(TiledImage* tiled);
+
+/* Render the image into the `dst' rectangle of the window. Only the tiles that
+ * are inside the window are uploaded and drawn. */
+void tiles_render(TiledImage* tiled, const SDL_Rect* dst);
+
+/* Get the number of bytes used by the textures of the tiles */
+size_t tiles_resident_bytes(TiledImage* tiled);
+
+#endif /* TILES_H_ */
@@ -0,0 +1,70 @@
+
+#ifndef TRACE_H_
+#define TRACE_H_ 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Initial number of events that can be stored before growing the array */
+#define TRACE_EVENTS_SIZE 1024
+
+typedef enum TraceEventType {
+    TRACE_SPAN,        /* Something that took some time */
+    TRACE_INSTANT,     /* Something that happened at some point */
+    TRACE_THREAD_NAME, /* Name of the thread, shown by the viewer */
+} TraceEventType;
+
+typedef struct TraceEvent {
+    TraceEventType type;
+
+    /* Name of the event. Not copied, so it must be a string literal. */
+    const char* name;
+
+    /* Identifier of the thread that recorded it, see `trace_thread_name' */
+    int thread;
+
+    /* Start of the event, and its duration, in nanoseconds since the trace
+     * was opened. */
+    uint64_t start, duration;
+} TraceEvent;
+
+/* True while a trace is being recorded. It's accessed atomically, since other
+ * threads read it while the main thread finishes the trace; read it with
+ * `trace_enabled'. */
+extern bool g_trace_enabled;
+
+/*----------------------------------------------------------------------------*/
+
+/* Start recording events, that will be written to FILENAME by
+ * `trace_finish'. */
+void trace_open(const char* filename);
+
+/* Write the recorded events in the Chrome trace-event JSON format, which can
+ * be opened with Perfetto or chrome://tracing, and stop recording. Does
+ * nothing if the trace was not opened, or if it was already written. Returns
+ * false if the file couldn't be written. */
+bool trace_finish(void);
+
+/* Record a span named NAME, from START, returned by `trace_begin', until
+ * now. Can be called from any thread. */
+void trace_end(const char* name, uint64_t start);
+
+/* Record an event named NAME at the current time */
+void trace_instant(const char* name);
+
+/* Give a name to the calling thread in the trace */
+void trace_thread_name(const char* name);
+
+/* Check if a trace is being recorded */
+static inline bool trace_enabled(void) {
+    return __atomic_load_n(&g_trace_enabled, __ATOMIC_RELAXED);
+}
+
+/* Get the current time for recording a span with `trace_end', or zero if the
+ * trace is not enabled. */
+uint64_t trace_now(void);
+static inline uint64_t trace_begin(void) {
+    return trace_enabled() ? trace_now() : 0;
+}
+
+#endif /* TRACE_H_ */
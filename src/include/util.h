@@ -10,4 +10,24 @@
 /* Print program name, function name and error message; and exit. */
 void die_func(const char* func, const char* fmt, ...);
 
+/* Get the total CPU time (user and system) used by the process, in seconds */
+double util_cpu_time(void);
+
+/* Get the peak resident set size of the process, in KiB. */
+long util_peak_rss(void);
+
+/* Get the current resident set size of the process, in KiB. Returns -1 if it
+ * can't be determined. */
+long util_current_rss(void);
+
+/* Get the time elapsed since some fixed point, in seconds. Only useful for
+ * measuring intervals. */
+double util_wall_time(void);
+
+/* Get the path of a file generated from the INPUT path: its ".png" extension
+ * is replaced with SUFFIX. If DIR is not NULL, the file is placed in that
+ * directory instead of next to the input. Must be freed by the caller. */
+char* util_derived_path(const char* input, const char* dir,
+                        const char* suffix);
+
 #endif /* UTIL_H_ */
@@ -0,0 +1,56 @@
+
+#ifndef VIEW_H_
+#define VIEW_H_ 1
+
+#include <SDL2/SDL.h>
+
+#include "image.h"
+
+/* Limits for `View.zoom' */
+#define VIEW_ZOOM_MIN 0.01
+#define VIEW_ZOOM_MAX 64.0
+
+/* Factor used by each zoom step, e.g. when scrolling the mouse wheel */
+#define VIEW_ZOOM_STEP 1.25
+
+/* Number of window pixels moved by each pan step, e.g. with the arrow keys */
+#define VIEW_PAN_STEP 50
+
+typedef struct View {
+    /* Position in image coordinates that is drawn at the center of the window.
+     * Not necessarily inside of the image. */
+    double x, y;
+
+    /* Number of window pixels for each image pixel */
+    double zoom;
+} View;
+
+/*----------------------------------------------------------------------------*/
+
+/* Center the image in the window. If the image doesn't fit in the window, zoom
+ * out until it does; otherwise use a zoom of 1. */
+void view_fit(View* view, const Image* image);
+
+/* Convert a position in the window to image coordinates */
+void view_to_image(const View* view, int win_x, int win_y, double* img_x,
+                   double* img_y);
+
+/* Convert a position in image coordinates to a position in the window */
+void view_to_window(const View* view, double img_x, double img_y, int* win_x,
+                    int* win_y);
+
+/* Same as `view_to_window', but without rounding to whole window pixels */
+void view_to_window_f(const View* view, double img_x, double img_y,
+                      double* win_x, double* win_y);
+
+/* Get the rectangle of the window where the specified image is drawn */
+SDL_Rect view_image_rect(const View* view, const Image* image);
+
+/* Multiply the zoom by `factor', keeping the image position under the window
+ * position (WIN_X, WIN_Y) in the same place. */
+void view_zoom_at(View* view, double factor, int win_x, int win_y);
+
+/* Move the view by the specified amount of window pixels */
+void view_pan(View* view, int win_dx, int win_dy);
+
+#endif /* VIEW_H_ */
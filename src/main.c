@@ -1,43 +1,72 @@
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <SDL2/SDL.h>
 
 #include "include/main.h"
 #include "include/util.h"
 #include "include/image.h"
+#include "include/mipmap.h"
+#include "include/tiles.h"
+#include "include/view.h"
+#include "include/grid.h"
 #include "include/drawing.h"
+#include "include/strokes.h"
+#include "include/composite.h"
+#include "include/export.h"
+#include "include/strokefile.h"
+#include "include/batch.h"
+#include "include/session.h"
+#include "include/profile.h"
+#include "include/trace.h"
+#include "include/gallery.h"
+#include "include/source.h"
+#include "include/diskcache.h"
+
+/* Maximum time waiting for events while images are being decoded on other
+ * threads, before showing the rows they decoded */
+#define LOAD_POLL_MS 10
+
+/* Space between the lines of the background grid, in window pixels */
+#define GRID_STEP 10
 
-#define FPS 60
+/* Default and maximum width of the lines, in image pixels */
+#define BRUSH_WIDTH_DEFAULT 1
+#define BRUSH_WIDTH_MAX     64
 
-#define GRID_STEP 10
+/* Radius of the eraser, in window pixels */
+#define ERASER_RADIUS 8
 
-#define COLOR_GRID 0x111111
-
-/* RGBA masks change depending on endianness */
-#if SDL_BYTEORDER == SDL_BIG_ENDIAN
-#define MASK_R 0xFF000000
-#define MASK_G 0x00FF0000
-#define MASK_B 0x0000FF00
-#define MASK_A 0x000000FF
-#else
-#define MASK_R 0x000000FF
-#define MASK_G 0x0000FF00
-#define MASK_B 0x00FF0000
-#define MASK_A 0xFF000000
-#endif
+#define COLOR_BACKGROUND 0x000000
+#define COLOR_GRID       0x111111
 
 /*----------------------------------------------------------------------------*/
 /* Globals */
 
 SDL_Window* g_window     = NULL;
 SDL_Renderer* g_renderer = NULL;
+int g_draw_calls         = 0;
 
 static bool g_render_grid = true;
 
 static bool g_drawing          = false; /* Holding LMouse */
 static bool g_on_straight_mode = false; /* Holding Ctrl */
+static bool g_panning          = false; /* Holding MMouse */
+static bool g_erasing          = false; /* Holding RMouse */
+
+/* Zoom and position of the image in the window */
+static View g_view;
+
+/* Width of the new lines, in image pixels */
+static int g_brush_width = BRUSH_WIDTH_DEFAULT;
+
+/* Show the timings of the profiler in the window, if it's enabled */
+static bool g_render_profile = true;
 
 /*----------------------------------------------------------------------------*/
 /* SDL helper functions */
@@ -50,98 +79,437 @@ static inline void set_render_color(SDL_Renderer* rend, uint32_t col) {
     SDL_SetRenderDrawColor(rend, r, g, b, a);
 }
 
-/* Render a subtle grid */
-static void render_grid(void) {
-    if (!g_render_grid)
+/* Render the image with the current zoom and position. If the mip levels are
+ * available, use the one that better matches the zoom. */
+static void render_image(Mipmap* mipmap, TiledImage** level_tiles) {
+    /* The prefetch thread of the image hasn't finished yet */
+    if (level_tiles[0] == NULL)
         return;
 
-    int win_w, win_h;
-    SDL_GetWindowSize(g_window, &win_w, &win_h);
+    const int level =
+      (mipmap == NULL) ? 0 : mipmap_level_for_zoom(mipmap, g_view.zoom);
 
-    const int step = GRID_STEP + 1;
-    for (int y = GRID_STEP; y < win_h; y += step)
-        SDL_RenderDrawLine(g_renderer, 0, y, win_w, y);
+    /* All levels are drawn in the area of the original image */
+    const SDL_Rect dst_rect = view_image_rect(&g_view, level_tiles[0]->image);
 
-    for (int x = GRID_STEP; x < win_w; x += step)
-        SDL_RenderDrawLine(g_renderer, x, 0, x, win_h);
+    tiles_render(level_tiles[level], &dst_rect);
 }
 
-/* Render a texture, centered in the window */
-static void render_image(Image* image, SDL_Texture* texture) {
-    int win_w, win_h;
-    SDL_GetWindowSize(g_window, &win_w, &win_h);
-    const int center_x = win_w / 2;
-    const int center_y = win_h / 2;
-
-    const SDL_Rect src_rect = {
-        0,
-        0,
-        image->w,
-        image->h,
-    };
-    const SDL_Rect dst_rect = {
-        center_x - (image->w / 2),
-        center_y - (image->h / 2),
-        image->w,
-        image->h,
-    };
+/*----------------------------------------------------------------------------*/
+/* Events */
+
+/* Check if an event might change what is drawn in the window. Should be called
+ * before handling the event. */
+static bool event_needs_redraw(const SDL_Event* event) {
+    switch (event->type) {
+        case SDL_KEYDOWN:
+        case SDL_KEYUP:
+        case SDL_MOUSEBUTTONDOWN:
+        case SDL_MOUSEBUTTONUP:
+        case SDL_MOUSEWHEEL:
+        case SDL_RENDER_TARGETS_RESET:
+        case SDL_RENDER_DEVICE_RESET:
+            return true;
+
+        /* Moving the mouse only matters if we are drawing, erasing or moving
+         * the image. */
+        case SDL_MOUSEMOTION:
+            return g_drawing || g_erasing || g_panning;
+
+        case SDL_WINDOWEVENT:
+            switch (event->window.event) {
+                case SDL_WINDOWEVENT_SHOWN:
+                case SDL_WINDOWEVENT_EXPOSED:
+                case SDL_WINDOWEVENT_SIZE_CHANGED:
+                case SDL_WINDOWEVENT_MAXIMIZED:
+                case SDL_WINDOWEVENT_RESTORED:
+                    return true;
 
-    SDL_RenderCopy(g_renderer, texture, &src_rect, &dst_rect);
+                default:
+                    return false;
+            }
+
+        default:
+            return false;
+    }
 }
 
-/* Render a line using `Drawing.points', from `start_idx' to `end_idx'
- * (inclusive). */
-static void render_drawing_line(Drawing* drawing, int start_idx, int end_idx) {
-    int win_w, win_h;
-    SDL_GetWindowSize(g_window, &win_w, &win_h);
-    const int center_x = win_w / 2;
-    const int center_y = win_h / 2;
-
-    for (int i = start_idx + 1; i <= end_idx; i++) {
-        DrawingPoint a = drawing->points[i - 1];
-        DrawingPoint b = drawing->points[i];
-        Color col      = a.col;
-
-        /* Since the points are stored relative to the center of the window,
-         * we convert them to the absolute positions here. */
-        const int src_x = center_x + a.x;
-        const int src_y = center_y + a.y;
-        const int dst_x = center_x + b.x;
-        const int dst_y = center_y + b.y;
-
-        SDL_SetRenderDrawColor(g_renderer, col.r, col.g, col.b, col.a);
-        SDL_RenderDrawLine(g_renderer, src_x, src_y, dst_x, dst_y);
+/* Handle a mouse motion event, along with the ones that are queued right after
+ * it. While panning, their movement is applied at once. While drawing or
+ * erasing, all the positions are used, and the Drawing discards the points
+ * that are not needed. Returns the number of events that were handled. */
+static unsigned long handle_mouse_motion(Drawing* drawing, SDL_Event* event) {
+    unsigned long count = 0;
+    int pan_x = 0, pan_y = 0;
+
+    for (;;) {
+        count++;
+
+        if (g_drawing) {
+            /* The points are converted with the current view, so it can't
+             * wait until the end. */
+            if (g_panning)
+                view_pan(&g_view, event->motion.xrel, event->motion.yrel);
+
+            drawing_store_from_view(drawing, &g_view, event->motion.x,
+                                    event->motion.y, C(0xFF0000FF),
+                                    g_brush_width);
+        } else {
+            pan_x += event->motion.xrel;
+            pan_y += event->motion.yrel;
+        }
+
+        /* Erase along the whole path, not only at the last position */
+        if (g_erasing)
+            drawing_erase_from_view(drawing, &g_view, event->motion.x,
+                                    event->motion.y, ERASER_RADIUS);
+
+        /* Only take the next event if it's also a motion event, so the order
+         * with other events (e.g. releasing the button) is kept. */
+        SDL_Event next;
+        if (SDL_PeepEvents(&next, 1, SDL_PEEKEVENT, SDL_FIRSTEVENT,
+                           SDL_LASTEVENT) != 1 ||
+            next.type != SDL_MOUSEMOTION)
+            break;
+
+        SDL_PeepEvents(event, 1, SDL_GETEVENT, SDL_MOUSEMOTION,
+                       SDL_MOUSEMOTION);
     }
+
+    if (g_panning && (pan_x != 0 || pan_y != 0))
+        view_pan(&g_view, pan_x, pan_y);
+
+    return count;
 }
 
-/* Render a drawing, centered in the window */
-static void render_drawing(Drawing* drawing) {
-    /* Iterate each line in the drawing */
-    for (int line = 1; line <= drawing->line_count; line++) {
-        /* The first line starts at point zero, rest start at the point next to
-         * where the previous line ended. */
-        const int start_idx =
-          (line == 1) ? 0 : drawing->line_ends[line - 1] + 1;
-        const int end_idx = drawing->line_ends[line];
-
-        render_drawing_line(drawing, start_idx, end_idx);
+/*----------------------------------------------------------------------------*/
+/* Image loading */
+
+/* Upload all the mip levels of the image to the GPU, print the memory usage of
+ * the process, and free the CPU-side copy of the levels. Only the metadata
+ * (dimensions, etc.) is kept after this point. */
+static void free_image_data(Mipmap* mipmap, TiledImage** level_tiles) {
+    size_t texture_bytes = 0;
+    for (int i = 0; i < mipmap->count; i++) {
+        if (!tiles_upload_all(level_tiles[i])) {
+            fprintf(stderr, "hl-png: Could not upload the whole image, keeping "
+                            "it in memory.\n");
+            return;
+        }
+
+        texture_bytes += tiles_resident_bytes(level_tiles[i]);
     }
 
-    /* If we are currently drawing a line, it's not stored in
-     * `Drawing.line_ends' yet. */
-    if (drawing_in_progress(drawing)) {
-        const int start_idx = (drawing->line_count == 0)
-                                ? 0
-                                : drawing->line_ends[drawing->line_count] + 1;
-        const int end_idx   = drawing->points_i - 1;
+    const long peak_rss   = util_peak_rss();
+    const long before_rss = util_current_rss();
+    mipmap_free_data(mipmap);
+    const long after_rss = util_current_rss();
 
-        render_drawing_line(drawing, start_idx, end_idx);
+    fprintf(stderr,
+            "hl-png: memory: peak RSS %ld KiB, current RSS %ld KiB before "
+            "freeing the image, %ld KiB after. Textures use %zu KiB.\n",
+            peak_rss, before_rss, after_rss, texture_bytes / 1024);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Exporting */
+
+/* Export started with 'e'. It runs on its own thread, so the window keeps
+ * responding while the image is compressed. */
+typedef struct ExportJob {
+    pthread_t thread;
+
+    /* Paths of the shown image and of the exported one */
+    char* input;
+    char* output;
+
+    /* Reference to the pixels of the shown image, see `image_share_pixels'.
+     * If `data' is NULL, the INPUT file is decoded again. */
+    Image pixels;
+
+    /* Copy of the lines, since the drawing can change during the export */
+    Drawing* drawing;
+
+    ExportOptions options;
+
+    /* Set by the thread when it's done */
+    bool done;
+} ExportJob;
+
+/* Draw the finished lines into IMAGE, at its own resolution, write it to
+ * OUTPUT, and free it. If IMAGE is NULL, the INPUT file is decoded instead.
+ * Returns false on error. */
+static bool export_drawing(const char* input, const char* output,
+                           Image* image, const Drawing* drawing,
+                           const ExportOptions* options) {
+    const double start_time = util_wall_time();
+
+    if (!image)
+        image = image_read_file(input);
+    if (!image) {
+        fprintf(stderr, "hl-png: Could not read the image for exporting.\n");
+        return false;
     }
+
+    bool result = false;
+    if (!composite_drawing(image, drawing))
+        fprintf(stderr, "hl-png: Could not draw the lines into the exported "
+                        "image.\n");
+    else if (!export_png(output, image, options))
+        fprintf(stderr, "hl-png: Could not export the image to: %s\n",
+                output);
+    else
+        result = true;
+
+    if (result)
+        fprintf(stderr, "hl-png: Exported the image to %s in %.1f ms.\n",
+                output, (util_wall_time() - start_time) * 1000.0);
+
+    image_free(image);
+    return result;
+}
+
+static void* export_thread(void* arg) {
+    ExportJob* job = arg;
+    trace_thread_name("export");
+
+    /* The shared pixels can't be modified, so the lines are drawn into a
+     * copy. If there is not enough memory for it, the file is decoded. */
+    Image* copy = NULL;
+    if (job->pixels.data != NULL) {
+        copy = image_copy(&job->pixels);
+        image_free_data(&job->pixels);
+    }
+
+    export_drawing(job->input, job->output, copy, job->drawing,
+                   &job->options);
+
+    __atomic_store_n(&job->done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void export_job_free(ExportJob* job) {
+    image_free_data(&job->pixels);
+    if (job->drawing != NULL)
+        drawing_free(job->drawing);
+    free(job->input);
+    free(job->output);
+    free(job);
+}
+
+/* Start exporting an image with its drawing on another thread. Its pixels are
+ * shared with the thread, unless they were freed (see `free_image_data') or
+ * mapped from the disk cache, in which case the file is decoded again. Returns
+ * NULL if the thread can't be started. */
+static ExportJob* export_start(GalleryImage* entry,
+                               const ExportOptions* options) {
+    ExportJob* job = calloc(1, sizeof(ExportJob));
+    if (!job)
+        return NULL;
+
+    job->input   = strdup(entry->path);
+    job->output  = strdup(entry->export_path);
+    job->drawing = drawing_copy_visible(entry->drawing);
+    job->options = *options;
+
+    /* Only the reference is owned by the job, never the mapping */
+    job->pixels        = *entry->image;
+    job->pixels.shared = image_share_pixels(entry->image);
+    if (job->pixels.shared == NULL) {
+        job->pixels.data         = NULL;
+        job->pixels.mapping      = NULL;
+        job->pixels.mapping_size = 0;
+    }
+
+    if (!job->input || !job->output || !job->drawing ||
+        pthread_create(&job->thread, NULL, export_thread, job) != 0) {
+        export_job_free(job);
+        return NULL;
+    }
+
+    return job;
+}
+
+/* Wait for the thread of an export, and free it. If WAIT is false and it's
+ * still running, returns false without freeing it. */
+static bool export_finish(ExportJob* job, bool wait) {
+    if (!wait && !__atomic_load_n(&job->done, __ATOMIC_ACQUIRE))
+        return false;
+
+    pthread_join(job->thread, NULL);
+    export_job_free(job);
+    return true;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Sessions */
+
+/* Load the Drawing saved in a session file, if it exists. Returns NULL if it
+ * doesn't exist or can't be loaded. */
+static Drawing* load_session(const char* path) {
+    if (access(path, F_OK) != 0)
+        return NULL;
+
+    const double start_time = util_wall_time();
+
+    Drawing* drawing = session_load(path);
+    if (!drawing) {
+        fprintf(stderr, "hl-png: Could not load the session: %s\n", path);
+        return NULL;
+    }
+
+    fprintf(stderr, "hl-png: Loaded %d lines (%d points) from %s in %.1f ms.\n",
+            drawing->line_count, drawing->points_i, path,
+            (util_wall_time() - start_time) * 1000.0);
+    return drawing;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Browsing */
+
+/* Set up the image that was just shown by `gallery_show': restore its view,
+ * load its drawing the first time, and show its path in the window title. */
+static void prepare_image(Gallery* gallery) {
+    GalleryImage* entry = gallery_current(gallery);
+
+    if (entry->has_view) {
+        g_view = entry->view;
+    } else {
+        /* Start with the whole image visible. Only its size is needed. */
+        const Image size = { .w = entry->w, .h = entry->h };
+        view_fit(&g_view, &size);
+    }
+
+    /* If the lines of this image were saved in a previous session, restore
+     * them. The session of the standard input could belong to any other
+     * image, so it's only saved. */
+    if (entry->drawing == NULL) {
+        const uint64_t span = trace_begin();
+        entry->drawing =
+          entry->stream ? NULL : load_session(entry->session_path);
+        if (!entry->drawing)
+            entry->drawing = drawing_new();
+        if (!entry->drawing)
+            DIE("Error allocating the drawing.");
+        trace_end("load_session", span);
+    }
+
+    char title[256];
+    if (gallery->count > 1)
+        snprintf(title, sizeof(title), "hl-png - %s (%d/%d)", entry->path,
+                 gallery->current + 1, gallery->count);
+    else
+        snprintf(title, sizeof(title), "hl-png - %s", entry->path);
+    SDL_SetWindowTitle(g_window, title);
+}
+
+/* Show the image STEP positions after the current one, wrapping around at the
+ * ends. Images that can't be opened are skipped. */
+static void switch_image(Gallery* gallery, int step) {
+    GalleryImage* old = gallery_current(gallery);
+
+    /* Finish what the mouse was doing on the old image */
+    drawing_end_line(old->drawing);
+    drawing_end_erase(old->drawing);
+    g_drawing = false;
+    g_erasing = false;
+
+    old->view     = g_view;
+    old->has_view = true;
+
+    /* If no other image can be opened, we end up in the old one, which is
+     * cached */
+    int index = gallery->current;
+    for (int i = 0; i < gallery->count; i++) {
+        index = ((index + step) % gallery->count + gallery->count) %
+                gallery->count;
+        if (gallery_show(gallery, index))
+            break;
+
+        fprintf(stderr, "hl-png: Could not open image: %s\n",
+                gallery->images[index].path);
+    }
+
+    prepare_image(gallery);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Batch mode */
+
+/* Draw the lines of a stroke file into each of the INPUTS images, without
+ * opening a window, and print the speed. Returns the number of images that
+ * failed. */
+static int run_batch(const char* strokes_path, char** inputs, int count,
+                     const BatchOptions* options) {
+    /* The lines can also come from a session file, see `session_save' */
+    Drawing* drawing = session_load(strokes_path);
+    if (!drawing) {
+        drawing = drawing_new();
+        if (!drawing)
+            DIE("Error allocating the drawing.");
+
+        if (!strokefile_read(strokes_path, drawing))
+            DIE("Could not read stroke file: %s", strokes_path);
+    }
+
+    const BatchStats stats = batch_run(drawing, inputs, count, options);
+
+    const double seconds  = (stats.seconds > 0.0) ? stats.seconds : 1e-9;
+    const double mb_read  = stats.bytes_read / 1e6;
+    const double mb_write = stats.bytes_written / 1e6;
+    fprintf(stderr,
+            "hl-png: batch: %d images in %.2f s (%.1f images/s), read %.1f MB "
+            "(%.1f MB/s), wrote %.1f MB (%.1f MB/s), %d failed.\n",
+            stats.done, stats.seconds, stats.done / seconds, mb_read,
+            mb_read / seconds, mb_write, mb_write / seconds, stats.failed);
+
+    drawing_free(drawing);
+    return stats.failed;
+}
+
+/* Export each image with the lines saved in its session (see `session_save'),
+ * without opening a window. Returns the number of images that failed. */
+static int run_export(Gallery* gallery, const ExportOptions* options) {
+    int failed = 0;
+    for (int i = 0; i < gallery->count; i++) {
+        GalleryImage* entry = &gallery->images[i];
+
+        Drawing* drawing = load_session(entry->session_path);
+        if (!drawing)
+            drawing = drawing_new();
+        if (!drawing)
+            DIE("Error allocating the drawing.");
+
+        if (!export_drawing(entry->path, entry->export_path, NULL, drawing,
+                            options))
+            failed++;
+
+        drawing_free(drawing);
+    }
+
+    return failed;
 }
 
 /*----------------------------------------------------------------------------*/
 /* Main function */
 
+/* Write the trace, if `--trace' was used */
+static void finish_trace(void) {
+    if (!trace_finish())
+        fprintf(stderr, "hl-png: Could not write the trace file.\n");
+}
+
+/* Parse an integer argument in the range [MIN, MAX], or exit */
+static long parse_int_arg(const char* str, long min, long max,
+                          const char* name) {
+    char* end;
+    const long value = strtol(str, &end, 10);
+    if (end == str || *end != '\0' || value < min || value > max)
+        DIE("Invalid %s: %s", name, str);
+
+    return value;
+}
+
 int main(int argc, char** argv) {
     if (argc < 2)
         DIE("Usage: %s [...] file.png", argv[0]);
@@ -149,9 +517,107 @@ int main(int argc, char** argv) {
     /* Parse arguments */
     bool arg_fullscreen = false;
     bool arg_fixed      = false;
-    for (int i = 1; i < argc - 1; i++) {
-        if (argv[i][0] != '-')
+    bool arg_free_image = false;
+    bool arg_verbose    = false;
+    bool arg_profile    = false;
+    bool arg_export     = false;
+    const char* arg_output = NULL;
+    const char* arg_batch  = NULL;
+
+    ExportOptions export_options = export_default_options();
+
+    BatchOptions batch_options = {
+        .threads      = 0,
+        .memory_limit = (size_t)BATCH_MEMORY_DEFAULT * 1024 * 1024,
+    };
+
+    /* Memory limits of the images that are not shown, see `Gallery' */
+    size_t cpu_budget = (size_t)GALLERY_CPU_BUDGET_DEFAULT * 1024 * 1024;
+    size_t gpu_budget = (size_t)GALLERY_GPU_BUDGET_DEFAULT * 1024 * 1024;
+
+    /* Size of the disk cache, which is disabled by default. See
+     * `diskcache_init'. */
+    size_t disk_cache_size = 0;
+
+    /* Arguments that are not options are image paths, or directories with
+     * images. In the window, the first one is shown, and the rest can be
+     * browsed. */
+    char** inputs   = malloc(argc * sizeof(char*));
+    int input_count = 0;
+    if (!inputs)
+        DIE("Error allocating the list of images.");
+
+    for (int i = 1; i < argc; i++) {
+        /* A single dash is the standard input, e.g. `maim | hl-png -' */
+        if (argv[i][0] != '-' || source_is_stdin(argv[i])) {
+            inputs[input_count++] = argv[i];
+            continue;
+        }
+
+        /* Arguments with a value */
+        if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            /* Start as soon as possible, so the trace shows all the
+             * startup */
+            trace_open(argv[++i]);
             continue;
+        }
+
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            arg_output = argv[++i];
+            continue;
+        }
+
+        if (strcmp(argv[i], "-z") == 0 && i + 1 < argc) {
+            export_options.level =
+              parse_int_arg(argv[++i], 0, 9, "compression level");
+            continue;
+        }
+
+        if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            if (!export_parse_filter(argv[++i], &export_options.filter))
+                DIE("Invalid PNG filter: %s", argv[i]);
+
+            continue;
+        }
+
+        if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            arg_batch = argv[++i];
+            continue;
+        }
+
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            batch_options.threads =
+              parse_int_arg(argv[++i], 1, BATCH_MAX_THREADS, "thread count");
+            continue;
+        }
+
+        if (strcmp(argv[i], "-M") == 0 && i + 1 < argc) {
+            batch_options.memory_limit =
+              (size_t)parse_int_arg(argv[++i], 1, 1024 * 1024, "memory limit") *
+              1024 * 1024;
+            continue;
+        }
+
+        if (strcmp(argv[i], "-C") == 0 && i + 1 < argc) {
+            cpu_budget =
+              (size_t)parse_int_arg(argv[++i], 0, 1024 * 1024, "cache size") *
+              1024 * 1024;
+            continue;
+        }
+
+        if (strcmp(argv[i], "-T") == 0 && i + 1 < argc) {
+            gpu_budget = (size_t)parse_int_arg(argv[++i], 0, 1024 * 1024,
+                                               "texture cache size") *
+                         1024 * 1024;
+            continue;
+        }
+
+        if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            disk_cache_size = (size_t)parse_int_arg(argv[++i], 1, 1024 * 1024,
+                                                    "disk cache size") *
+                              1024 * 1024;
+            continue;
+        }
 
         for (int j = 1; argv[i][j] != '\0'; j++) {
             switch (argv[i][j]) {
@@ -163,14 +629,75 @@ int main(int argc, char** argv) {
                     arg_fixed = true;
                 } break;
 
+                case 'm': {
+                    arg_free_image = true;
+                } break;
+
+                case 'v': {
+                    arg_verbose = true;
+                } break;
+
+                case 'P': {
+                    arg_profile = true;
+                } break;
+
+                case 'e': {
+                    arg_export = true;
+                } break;
+
                 case 'h': {
                     printf("Usage:\n"
-                           "  %s [-fF] file.png\n"
+                           "  %s [-fFmvP] [-o FILE] [-z LEVEL] [-p FILTER] "
+                           "[-C MIB] [-T MIB] [-d MIB] [--trace FILE] "
+                           "file.png...\n"
+                           "  %s -e [-o FILE] [-z LEVEL] [-p FILTER] "
+                           "file.png...\n"
+                           "  %s -b STROKES [-v] [-o DIR] [-z LEVEL] "
+                           "[-p FILTER] [-j THREADS] [-M MIB] file.png...\n"
                            "Arguments:\n"
                            "  -f\tLaunch in full-screen mode.\n"
                            "  -F\tLaunch in fixed mode.\n"
-                           "  -h\tPrint this help and exit.\n",
-                           argv[0]);
+                           "  -m\tFree the decoded image after uploading it "
+                           "to the GPU, and print memory usage.\n"
+                           "  -v\tPrint rendering statistics on exit.\n"
+                           "  -P\tTime each phase of the main loop, show "
+                           "the timings with 'p', and print them on exit. "
+                           "Also enabled with " PROFILE_ENV "=1.\n"
+                           "  -o\tPath of the image exported with 'e'. By "
+                           "default, the image path ending in \"-hl.png\". "
+                           "With several images, a directory for them.\n"
+                           "  -z\tCompression level of the exported image, "
+                           "from 0 to 9 (default %d).\n"
+                           "  -p\tFilter of the exported image: none, sub, "
+                           "up, avg, paeth or adaptive (default).\n"
+                           "  -e\tExport the images like 'e', with the lines "
+                           "of their sessions (see 's'), and exit without "
+                           "opening a window.\n"
+                           "  -b\tBatch mode: draw the lines of a stroke file "
+                           "(see 'w') into each image, without a window. The "
+                           "outputs end in \"-hl.png\", and are placed in "
+                           "the -o directory if specified.\n"
+                           "  -j\tNumber of threads in batch mode (default: "
+                           "one per processor).\n"
+                           "  -M\tMemory limit in batch mode, in MiB "
+                           "(default %d).\n"
+                           "  -C\tMemory used by the images that are not "
+                           "shown, in MiB (default %d).\n"
+                           "  -T\tMemory used by the textures of the images "
+                           "that are not shown, in MiB (default %d).\n"
+                           "  -d\tKeep the decoded pixels of big images in "
+                           "a cache of this size in MiB, so they open "
+                           "instantly the next time. Also enabled with "
+                           DISKCACHE_ENV "=MIB.\n"
+                           "  --trace\tWrite the time spent on each step of "
+                           "the startup to FILE, in the Chrome trace-event "
+                           "format.\n"
+                           "  -h\tPrint this help and exit.\n"
+                           "A file named \"-\" is read from the standard "
+                           "input.\n",
+                           argv[0], argv[0], argv[0], EXPORT_LEVEL_DEFAULT,
+                           BATCH_MEMORY_DEFAULT, GALLERY_CPU_BUDGET_DEFAULT,
+                           GALLERY_GPU_BUDGET_DEFAULT);
                     exit(0);
                 } break;
 
@@ -180,14 +707,87 @@ int main(int argc, char** argv) {
         }
     }
 
-    /* Last argument must be the image path */
-    const char* filename = argv[argc - 1];
-    Image* image         = image_read_file(filename);
+    if (arg_batch != NULL) {
+        /* Each image is read twice, see `process_image' */
+        for (int i = 0; i < input_count; i++)
+            if (source_is_stdin(inputs[i]))
+                DIE("The standard input can't be used in batch mode.");
+
+        batch_options.output_dir = arg_output;
+        batch_options.export     = export_options;
+        batch_options.verbose    = arg_verbose;
+
+        const int failed =
+          run_batch(arg_batch, inputs, input_count, &batch_options);
+        free(inputs);
+        finish_trace();
+        return (failed > 0) ? 1 : 0;
+    }
+
+    if (input_count == 0)
+        DIE("Usage: %s [...] file.png", argv[0]);
+
+    /* Its session is never restored, see `prepare_image' */
+    if (arg_export)
+        for (int i = 0; i < input_count; i++)
+            if (source_is_stdin(inputs[i]))
+                DIE("The standard input can't be exported with -e.");
+
+    profile_init(arg_profile);
+    diskcache_init(disk_cache_size);
+
+    /* Directories are replaced with the images inside of them */
+    Gallery* gallery = gallery_new(inputs, input_count);
+    free(inputs);
+    if (!gallery)
+        DIE("No images to open.");
+
+    gallery->cpu_budget = cpu_budget;
+    gallery->gpu_budget = gpu_budget;
+
+    /* Where the images are exported, see `export_drawing'. With several
+     * images, the output is a directory, like in batch mode. */
+    if (arg_output != NULL) {
+        for (int i = 0; i < gallery->count; i++) {
+            GalleryImage* entry = &gallery->images[i];
+
+            free(entry->export_path);
+            entry->export_path =
+              (gallery->count == 1)
+                ? strdup(arg_output)
+                : util_derived_path(entry->stream ? "stdin" : entry->path,
+                                    arg_output, "-hl.png");
+            if (!entry->export_path)
+                DIE("Error allocating the export path.");
+        }
+    }
+
+    if (arg_export) {
+        const int failed = run_export(gallery, &export_options);
+        gallery_free(gallery);
+        finish_trace();
+        return (failed > 0) ? 1 : 0;
+    }
+
+    /* Open the first image that can be read. We only need its header for
+     * creating the window, so the rest of the image is decoded on another
+     * thread while SDL starts, and the main loop shows the rows as they
+     * arrive. */
+    int first = 0;
+    while (first < gallery->count && !gallery_show(gallery, first)) {
+        fprintf(stderr, "hl-png: Could not open image: %s\n",
+                gallery->images[first].path);
+        first++;
+    }
+    if (first >= gallery->count)
+        DIE("Could not open any of the images.");
 
     /*------------------------------------------------------------------------*/
     /* SDL initialization */
-    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) != 0)
+    uint64_t span = trace_begin();
+    if (SDL_Init(SDL_INIT_VIDEO) != 0)
         DIE("Unable to start SDL.");
+    trace_end("SDL_Init", span);
 
     /* Use different window flags depending on arguments */
     int window_flags = 0;
@@ -196,16 +796,29 @@ int main(int argc, char** argv) {
     if (!arg_fixed)
         window_flags |= SDL_WINDOW_RESIZABLE;
 
-    /* Create SDL window */
-    const int window_w = image->w;
-    const int window_h = image->h;
+    /* Create SDL window with the size of the image, but not bigger than the
+     * usable area of the display. */
+    int window_w = gallery_current(gallery)->w;
+    int window_h = gallery_current(gallery)->h;
+
+    SDL_Rect display_bounds;
+    if (SDL_GetDisplayUsableBounds(0, &display_bounds) == 0) {
+        if (window_w > display_bounds.w)
+            window_w = display_bounds.w;
+        if (window_h > display_bounds.h)
+            window_h = display_bounds.h;
+    }
+
+    span = trace_begin();
     g_window =
       SDL_CreateWindow("hl-png", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
                        window_w, window_h, window_flags);
     if (!g_window)
         DIE("Error creating SDL window.");
+    trace_end("SDL_CreateWindow", span);
 
     /* Create SDL renderer */
+    span = trace_begin();
     g_renderer =
       SDL_CreateRenderer(g_window, -1,
                          SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
@@ -213,6 +826,7 @@ int main(int argc, char** argv) {
         SDL_DestroyWindow(g_window);
         DIE("Error creating SDL renderer.");
     }
+    trace_end("SDL_CreateRenderer", span);
 
 #ifdef SCALE_QUALITY
     /* Use the best scaling quality of the texture */
@@ -220,29 +834,86 @@ int main(int argc, char** argv) {
         DIE("Could not set RENDER_SCALE_QUALITY hint.");
 #endif
 
-    /* Create the surface and texture for the image */
-    SDL_Surface* image_surface =
-      SDL_CreateRGBSurfaceFrom(image->data, image->w, image->h,
-                               image_pixel_bits(image), image->byte_pitch,
-                               MASK_R, MASK_G, MASK_B, MASK_A);
-    if (!image_surface)
-        DIE("Error creating RGBA surface from PNG data.");
+    /* Split the image in tiles, each with its own texture. They will be
+     * uploaded as the rows are decoded in the main loop, and only when they
+     * are visible. The mip levels are generated once the image is complete;
+     * until then, only the first level is available. */
+    span = trace_begin();
+    gallery_update(gallery);
+    trace_end("gallery_update", span);
 
-    SDL_Texture* image_texture =
-      SDL_CreateTextureFromSurface(g_renderer, image_surface);
-    if (!image_texture)
-        DIE("Error creating texture from RGBA surface.");
+    prepare_image(gallery);
 
-    /* Allocate the main Drawing structure */
-    Drawing* drawing = drawing_new();
+    /* Texture with the background grid */
+    Grid* grid = grid_new(GRID_STEP, COLOR_BACKGROUND, COLOR_GRID);
+    if (!grid)
+        DIE("Error allocating the background grid.");
+
+    /* Texture with the finished lines of the drawing */
+    StrokeCache* stroke_cache = strokes_new();
+    if (!stroke_cache)
+        DIE("Error allocating the stroke cache.");
 
     /*------------------------------------------------------------------------*/
     /* Main loop */
+
+    /* Statistics printed on exit, see `arg_verbose'. They are reset each time
+     * an image has been loaded, so they show the cost of the viewer alone. */
+    uint32_t stats_ticks  = SDL_GetTicks();
+    double stats_cpu_time = util_cpu_time();
+    unsigned long frames     = 0;
+    unsigned long wakeups    = 0;
+    unsigned long draw_calls = 0;
+
+    /* Mouse motion events, and number of times they were handled. See
+     * `handle_mouse_motion'. */
+    unsigned long motion_events  = 0;
+    unsigned long motion_batches = 0;
+
+    /* The window is only drawn when something changed. This starts as true
+     * for drawing the first frame. */
+    bool redraw = true;
+
+    /* The trace is written once the first frame with the whole image has
+     * been drawn, see `finish_trace'. */
+    bool first_frame   = true;
+    bool trace_pending = false;
+
+    /* Export started with 'e', until another one is started or we quit */
+    ExportJob* export_job = NULL;
+
     bool running = true;
     while (running) {
-        /* Parse SDL events */
+        /* The image shown might change while handling the events */
+        GalleryImage* shown = gallery_current(gallery);
+
+        /*
+         * Wait until there is an event, instead of drawing constantly. While
+         * images are loading, only wait for a short time, so the decoded
+         * rows are shown; or don't wait at all if we have to decode them.
+         */
+        const bool loading = gallery_loading(gallery);
         SDL_Event event;
-        while (SDL_PollEvent(&event)) {
+        int have_event;
+        if (!loading) {
+            /* Otherwise, the loop would keep spinning without waiting */
+            have_event = SDL_WaitEvent(&event);
+            if (!have_event)
+                DIE("Error waiting for SDL events: %s", SDL_GetError());
+        } else if (shown->loader != NULL && !shown->loader->threaded)
+            have_event = SDL_PollEvent(&event);
+        else
+            have_event = SDL_WaitEventTimeout(&event, LOAD_POLL_MS);
+        wakeups++;
+
+        /* The time spent waiting for events is not part of the frame */
+        const uint64_t frame_start = profile_start();
+
+        /* Parse SDL events */
+        for (; have_event; have_event = SDL_PollEvent(&event)) {
+            if (event_needs_redraw(&event))
+                redraw = true;
+
             switch (event.type) {
                 case SDL_QUIT: {
                     running = false;
@@ -264,8 +935,98 @@ int main(int argc, char** argv) {
                             g_render_grid = !g_render_grid;
                         } break;
 
+                        case SDL_SCANCODE_P: {
+                            g_render_profile = !g_render_profile;
+                        } break;
+
                         case SDL_SCANCODE_C: {
-                            drawing_clear(drawing);
+                            drawing_clear(shown->drawing);
+                        } break;
+
+                        case SDL_SCANCODE_E: {
+                            /* The exported image has to be complete */
+                            if (shown->loader != NULL || shown->prefetching) {
+                                fprintf(stderr, "hl-png: The image is still "
+                                                "loading, can't export it "
+                                                "yet.\n");
+                                break;
+                            }
+
+                            /* One at a time, so they don't compete for the
+                             * processors */
+                            if (export_job != NULL &&
+                                !export_finish(export_job, false)) {
+                                fprintf(stderr, "hl-png: The previous export "
+                                                "hasn't finished yet.\n");
+                                break;
+                            }
+
+                            export_job = export_start(shown, &export_options);
+                            if (!export_job)
+                                fprintf(stderr, "hl-png: Could not start "
+                                                "exporting the image.\n");
+                        } break;
+
+                        case SDL_SCANCODE_S: {
+                            if (session_save(shown->session_path,
+                                             shown->drawing))
+                                fprintf(stderr, "hl-png: Saved the session "
+                                                "to %s\n",
+                                        shown->session_path);
+                            else
+                                fprintf(stderr, "hl-png: Could not save the "
+                                                "session to: %s\n",
+                                        shown->session_path);
+                        } break;
+
+                        case SDL_SCANCODE_W: {
+                            if (strokefile_write(shown->strokes_path,
+                                                 shown->drawing))
+                                fprintf(stderr, "hl-png: Saved the lines to "
+                                                "%s\n",
+                                        shown->strokes_path);
+                            else
+                                fprintf(stderr, "hl-png: Could not save the "
+                                                "lines to: %s\n",
+                                        shown->strokes_path);
+                        } break;
+
+                        case SDL_SCANCODE_PAGEDOWN:
+                        case SDL_SCANCODE_N:
+                        case SDL_SCANCODE_PAGEUP:
+                        case SDL_SCANCODE_B: {
+                            if (gallery->count < 2)
+                                break;
+
+                            const bool next =
+                              event.key.keysym.scancode ==
+                                SDL_SCANCODE_PAGEDOWN ||
+                              event.key.keysym.scancode == SDL_SCANCODE_N;
+                            switch_image(gallery, next ? 1 : -1);
+                            shown = gallery_current(gallery);
+
+                            /* The cached lines are the ones of the old
+                             * image */
+                            strokes_invalidate(stroke_cache);
+                        } break;
+
+                        case SDL_SCANCODE_Z: {
+                            /* Ctrl+Z undoes, Ctrl+Shift+Z redoes. Not while
+                             * the mouse is drawing a line. */
+                            const uint16_t mod = event.key.keysym.mod;
+                            if (!(mod & KMOD_CTRL) || g_drawing)
+                                break;
+
+                            if (mod & KMOD_SHIFT)
+                                drawing_redo(shown->drawing);
+                            else
+                                drawing_undo(shown->drawing);
+                        } break;
+
+                        case SDL_SCANCODE_Y: {
+                            if ((event.key.keysym.mod & KMOD_CTRL) &&
+                                !g_drawing)
+                                drawing_redo(shown->drawing);
                         } break;
 
                         case SDL_SCANCODE_F11:
@@ -280,6 +1041,57 @@ int main(int argc, char** argv) {
                             SDL_SetWindowFullscreen(g_window, new_flags);
                         } break;
 
+                        case SDL_SCANCODE_EQUALS:
+                        case SDL_SCANCODE_KP_PLUS:
+                        case SDL_SCANCODE_MINUS:
+                        case SDL_SCANCODE_KP_MINUS: {
+                            /* Zoom around the center of the window */
+                            const bool zoom_in =
+                              event.key.keysym.scancode ==
+                                SDL_SCANCODE_EQUALS ||
+                              event.key.keysym.scancode ==
+                                SDL_SCANCODE_KP_PLUS;
+
+                            int win_w, win_h;
+                            SDL_GetWindowSize(g_window, &win_w, &win_h);
+                            view_zoom_at(&g_view,
+                                         zoom_in ? VIEW_ZOOM_STEP
+                                                 : 1.0 / VIEW_ZOOM_STEP,
+                                         win_w / 2, win_h / 2);
+                        } break;
+
+                        case SDL_SCANCODE_LEFTBRACKET: {
+                            if (g_brush_width > 1)
+                                g_brush_width--;
+                        } break;
+
+                        case SDL_SCANCODE_RIGHTBRACKET: {
+                            if (g_brush_width < BRUSH_WIDTH_MAX)
+                                g_brush_width++;
+                        } break;
+
+                        case SDL_SCANCODE_0: {
+                            const Image size = { .w = shown->w,
+                                                 .h = shown->h };
+                            view_fit(&g_view, &size);
+                        } break;
+
+                        case SDL_SCANCODE_LEFT: {
+                            view_pan(&g_view, VIEW_PAN_STEP, 0);
+                        } break;
+
+                        case SDL_SCANCODE_RIGHT: {
+                            view_pan(&g_view, -VIEW_PAN_STEP, 0);
+                        } break;
+
+                        case SDL_SCANCODE_UP: {
+                            view_pan(&g_view, 0, VIEW_PAN_STEP);
+                        } break;
+
+                        case SDL_SCANCODE_DOWN: {
+                            view_pan(&g_view, 0, -VIEW_PAN_STEP);
+                        } break;
+
                         default:
                             break;
                     }
@@ -291,7 +1103,7 @@ int main(int argc, char** argv) {
                         case SDL_SCANCODE_RCTRL: {
                             /* Try to end the line when releasing Ctrl. The
                              * function checks if there is a line to end. */
-                            drawing_end_line(drawing);
+                            drawing_end_line(shown->drawing);
 
                             g_on_straight_mode = false;
                         } break;
@@ -309,9 +1121,26 @@ int main(int argc, char** argv) {
 
                             /* Store first point of the drawing. Next ones will
                              * be stored in SDL_MOUSEMOTION. */
-                            drawing_store_from_center(drawing, event.motion.x,
-                                                      event.motion.y,
-                                                      C(0xFF0000FF));
+                            drawing_store_from_view(shown->drawing, &g_view,
+                                                    event.button.x,
+                                                    event.button.y,
+                                                    C(0xFF0000FF),
+                                                    g_brush_width);
+                        } break;
+
+                        case SDL_BUTTON_MIDDLE: {
+                            /* Start moving the image with the mouse */
+                            g_panning = true;
+                        } break;
+
+                        case SDL_BUTTON_RIGHT: {
+                            /* Erase the lines under the mouse, until the
+                             * button is released. */
+                            g_erasing = true;
+                            drawing_erase_from_view(shown->drawing, &g_view,
+                                                    event.button.x,
+                                                    event.button.y,
+                                                    ERASER_RADIUS);
                         } break;
 
                         default:
@@ -326,7 +1155,18 @@ int main(int argc, char** argv) {
                             g_drawing = false;
 
                             if (!g_on_straight_mode)
-                                drawing_end_line(drawing);
+                                drawing_end_line(shown->drawing);
+                        } break;
+
+                        case SDL_BUTTON_MIDDLE: {
+                            g_panning = false;
+                        } break;
+
+                        case SDL_BUTTON_RIGHT: {
+                            /* The next erase will be a different operation
+                             * when undoing. */
+                            g_erasing = false;
+                            drawing_end_erase(shown->drawing);
                         } break;
 
                         default:
@@ -335,11 +1175,35 @@ int main(int argc, char** argv) {
                 } break;
 
                 case SDL_MOUSEMOTION: {
-                    if (!g_drawing)
+                    motion_events +=
+                      handle_mouse_motion(shown->drawing, &event);
+                    motion_batches++;
+                } break;
+
+                case SDL_WINDOWEVENT: {
+                    /* The grid texture has the size of the window */
+                    if (event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED)
+                        grid_invalidate(grid);
+                } break;
+
+                case SDL_RENDER_TARGETS_RESET:
+                case SDL_RENDER_DEVICE_RESET: {
+                    /* The contents of the cached textures were lost */
+                    grid_invalidate(grid);
+                    strokes_invalidate(stroke_cache);
+                } break;
+
+                case SDL_MOUSEWHEEL: {
+                    if (event.wheel.y == 0)
                         break;
 
-                    drawing_store_from_center(drawing, event.motion.x,
-                                              event.motion.y, C(0xFF0000FF));
+                    /* Zoom around the mouse position */
+                    int mouse_x, mouse_y;
+                    SDL_GetMouseState(&mouse_x, &mouse_y);
+                    view_zoom_at(&g_view,
+                                 (event.wheel.y > 0) ? VIEW_ZOOM_STEP
+                                                     : 1.0 / VIEW_ZOOM_STEP,
+                                 mouse_x, mouse_y);
                 } break;
 
                 default:
@@ -347,30 +1211,158 @@ int main(int argc, char** argv) {
             }
         }
 
+        profile_end(PROFILE_EVENTS, frame_start);
+
+        /* Show the new rows of the current image, if it's still loading,
+         * and take the images that were decoded ahead of time */
+        if (loading || gallery->prefetch_pending) {
+            const uint64_t load_start = profile_start();
+
+            span              = trace_begin();
+            const int updated = gallery_update(gallery);
+            trace_end("gallery_update", span);
+
+            if (updated & GALLERY_CHANGED)
+                redraw = true;
+
+            if (updated & GALLERY_LOADED) {
+                stats_ticks    = SDL_GetTicks();
+                stats_cpu_time = util_cpu_time();
+                frames         = 0;
+                wakeups        = 0;
+                draw_calls     = 0;
+                motion_events  = 0;
+                motion_batches = 0;
+
+                /* If the user asked for it, free the CPU-side copy of the
+                 * image now that the texture is complete. The standard input
+                 * can't be read again for exporting it, so it's kept. */
+                if (arg_free_image && !shown->stream &&
+                    shown->mipmap != NULL && shown->image->data != NULL)
+                    free_image_data(shown->mipmap, shown->level_tiles);
+
+                trace_pending = true;
+            }
+
+            profile_end(PROFILE_LOAD, load_start);
+        }
+
+        /* Nothing changed since the last frame, don't draw anything */
+        if (!redraw)
+            continue;
+
+        redraw = false;
+        frames++;
+        g_draw_calls = 0;
+
+        const uint64_t frame_span = trace_begin();
+
         /* Clear window */
-        set_render_color(g_renderer, 0x000000);
+        set_render_color(g_renderer, COLOR_BACKGROUND);
         SDL_RenderClear(g_renderer);
 
         /* Draw background grid */
-        set_render_color(g_renderer, COLOR_GRID);
-        render_grid();
+        uint64_t phase_start = profile_start();
+        if (g_render_grid)
+            grid_render(grid);
+        profile_end(PROFILE_GRID, phase_start);
+
+        phase_start = profile_start();
+        render_image(shown->mipmap, shown->level_tiles);
+        profile_end(PROFILE_IMAGE, phase_start);
+
+        phase_start = profile_start();
+        strokes_render(stroke_cache, shown->drawing, &g_view);
+        profile_end(PROFILE_DRAWING, phase_start);
+
+        /* The draw calls of the overlay itself are not counted */
+        draw_calls += g_draw_calls;
+        if (g_profile_enabled) {
+            profile_record(PROFILE_DRAW_CALLS, g_draw_calls);
+            if (g_render_profile)
+                profile_render_overlay();
+        }
 
-        render_image(image, image_texture);
+        /* Send to renderer. With VSync, this waits for the next refresh of
+         * the display, limiting the frame rate. */
+        phase_start = profile_start();
+        SDL_RenderPresent(g_renderer);
+        profile_end(PROFILE_PRESENT, phase_start);
 
-        render_drawing(drawing);
+        profile_end(PROFILE_FRAME, frame_start);
 
-        /* Send to renderer and delay depending on FPS */
-        SDL_RenderPresent(g_renderer);
-        SDL_Delay(1000 / FPS);
+        trace_end("frame", frame_span);
+        if (first_frame) {
+            trace_instant("first_frame");
+            first_frame = false;
+        }
+        if (trace_pending) {
+            trace_instant("image_complete");
+            finish_trace();
+            trace_pending = false;
+        }
+    }
+
+    if (arg_verbose) {
+        /* The points of the lines drawn on all the images */
+        unsigned long points_removed  = 0;
+        unsigned long points_received = 0;
+        for (int i = 0; i < gallery->count; i++) {
+            const Drawing* drawing = gallery->images[i].drawing;
+            if (drawing != NULL) {
+                points_removed += drawing->stats_removed;
+                points_received += drawing->stats_received;
+            }
+        }
+
+        size_t cached_cpu, cached_gpu;
+        gallery_cached_bytes(gallery, &cached_cpu, &cached_gpu);
+
+        const double seconds  = (SDL_GetTicks() - stats_ticks) / 1000.0;
+        const double cpu_time = util_cpu_time() - stats_cpu_time;
+
+        fprintf(stderr,
+                "hl-png: stats: %.1f s since loaded, %lu frames (%.2f per "
+                "second), %lu wake-ups, %.3f s of CPU time (%.2f%% of one "
+                "core), %.1f draw calls per frame.\n",
+                seconds, frames, frames / seconds, wakeups, cpu_time,
+                100.0 * cpu_time / seconds,
+                (frames > 0) ? (double)draw_calls / frames : 0.0);
+        fprintf(stderr,
+                "hl-png: stats: %lu mouse motion events handled in %lu "
+                "batches, %lu of %lu drawn points removed by the simplifier "
+                "(%.1f%%).\n",
+                motion_events, motion_batches, points_removed,
+                points_received,
+                (points_received > 0)
+                  ? 100.0 * points_removed / points_received
+                  : 0.0);
+        fprintf(stderr,
+                "hl-png: stats: %d images, %zu KiB of pixels and %zu KiB of "
+                "textures cached for the ones not shown.\n",
+                gallery->count, cached_cpu / 1024, cached_gpu / 1024);
     }
 
-    SDL_DestroyTexture(image_texture);
-    SDL_FreeSurface(image_surface);
+    if (g_profile_enabled)
+        profile_print_summary(stderr);
+
+    /* In case we quit before the image was loaded */
+    finish_trace();
+
+    /* The image being exported is written completely */
+    if (export_job != NULL)
+        export_finish(export_job, true);
+
+    /* Before the loaders are freed, so they don't queue anything else */
+    diskcache_finish();
+
+    /* The textures have to be freed before the renderer */
+    gallery_free(gallery);
+    strokes_free(stroke_cache);
+    grid_free(grid);
     SDL_DestroyRenderer(g_renderer);
     SDL_DestroyWindow(g_window);
     SDL_Quit();
-    drawing_free(drawing);
-    image_free(image);
 
     return 0;
 }
@@ -0,0 +1,220 @@
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <png.h>
+
+/* SSE2 is only part of the baseline of x86-64 */
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define MIPMAP_X86 1
+#endif
+
+#include "include/image.h"
+#include "include/mipmap.h"
+
+/*
+ * Function used for averaging the 2x2 blocks of two rows. It receives the two
+ * source rows and writes `count' RGBA pixels into `dst', where each pixel is
+ * the average of two pixels of `row0' and the two pixels below them in
+ * `row1'. The source rows must have at least `count * 2' pixels.
+ */
+typedef void (*downsample_func_t)(const uint8_t* row0, const uint8_t* row1,
+                                  uint8_t* dst, int count);
+
+/* Portable version, used as a fallback and for the remaining pixels of the
+ * vectorized versions. */
+static void downsample_scalar(const uint8_t* row0, const uint8_t* row1,
+                              uint8_t* dst, int count) {
+    for (int x = 0; x < count; x++) {
+        for (int c = 0; c < 4; c++) {
+            const int sum = row0[x * 8 + c] + row0[x * 8 + 4 + c] +
+                            row1[x * 8 + c] + row1[x * 8 + 4 + c];
+
+            /* Add 2 for rounding to the nearest integer */
+            dst[x * 4 + c] = (sum + 2) >> 2;
+        }
+    }
+}
+
+#ifdef MIPMAP_X86
+/* Process 2 destination pixels (4 source pixels of each row) at a time */
+static void downsample_sse2(const uint8_t* row0, const uint8_t* row1,
+                            uint8_t* dst, int count) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i two  = _mm_set1_epi16(2);
+
+    int x = 0;
+    for (; x + 2 <= count; x += 2) {
+        const __m128i a = _mm_loadu_si128((const __m128i*)&row0[x * 8]);
+        const __m128i b = _mm_loadu_si128((const __m128i*)&row1[x * 8]);
+
+        /* Widen to 16 bits and add the two rows. Each register contains two
+         * source pixels. */
+        const __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero),
+                                         _mm_unpacklo_epi8(b, zero));
+        const __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero),
+                                         _mm_unpackhi_epi8(b, zero));
+
+        /* Add the two horizontally adjacent pixels, leaving the result in the
+         * low 64 bits of each register. */
+        const __m128i sum_lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+        const __m128i sum_hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+
+        __m128i sum = _mm_unpacklo_epi64(sum_lo, sum_hi);
+        sum         = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+
+        _mm_storel_epi64((__m128i*)&dst[x * 4], _mm_packus_epi16(sum, zero));
+    }
+
+    downsample_scalar(&row0[x * 8], &row1[x * 8], &dst[x * 4], count - x);
+}
+
+/* Process 4 destination pixels (8 source pixels of each row) at a time */
+__attribute__((target("avx2"))) static void
+downsample_avx2(const uint8_t* row0, const uint8_t* row1, uint8_t* dst,
+                int count) {
+    /* Place the same channel of two adjacent pixels next to each other, so
+     * they can be added with `_mm256_maddubs_epi16'. The shuffle works on
+     * each 128-bit lane separately. */
+    const __m256i shuffle = _mm256_setr_epi8(
+      0, 4, 1, 5, 2, 6, 3, 7, 8, 12, 9, 13, 10, 14, 11, 15, 0, 4, 1, 5, 2, 6, 3,
+      7, 8, 12, 9, 13, 10, 14, 11, 15);
+    const __m256i ones = _mm256_set1_epi8(1);
+    const __m256i two  = _mm256_set1_epi16(2);
+
+    int x = 0;
+    for (; x + 4 <= count; x += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)&row0[x * 8]);
+        __m256i b = _mm256_loadu_si256((const __m256i*)&row1[x * 8]);
+
+        a = _mm256_maddubs_epi16(_mm256_shuffle_epi8(a, shuffle), ones);
+        b = _mm256_maddubs_epi16(_mm256_shuffle_epi8(b, shuffle), ones);
+
+        __m256i sum = _mm256_add_epi16(a, b);
+        sum         = _mm256_srli_epi16(_mm256_add_epi16(sum, two), 2);
+
+        /* Each lane now has two pixels in its low 64 bits, join them */
+        sum = _mm256_packus_epi16(sum, sum);
+        sum = _mm256_permute4x64_epi64(sum, 0x08);
+
+        _mm_storeu_si128((__m128i*)&dst[x * 4], _mm256_castsi256_si128(sum));
+    }
+
+    downsample_sse2(&row0[x * 8], &row1[x * 8], &dst[x * 4], count - x);
+}
+#endif /* MIPMAP_X86 */
+
+/* Get the fastest version supported by the CPU */
+static downsample_func_t get_downsample_func(void) {
+#ifdef MIPMAP_X86
+    if (__builtin_cpu_supports("avx2"))
+        return downsample_avx2;
+
+    return downsample_sse2;
+#else
+    return downsample_scalar;
+#endif
+}
+
+/*----------------------------------------------------------------------------*/
+
+Image* mipmap_downsample(const Image* image) {
+    static downsample_func_t downsample = NULL;
+    if (downsample == NULL)
+        downsample = get_downsample_func();
+
+    Image* result = malloc(sizeof(Image));
+    if (!result)
+        return NULL;
+
+    result->mapping      = NULL;
+    result->mapping_size = 0;
+    result->shared       = NULL;
+    result->w            = (image->w + 1) / 2;
+    result->h            = (image->h + 1) / 2;
+    result->color_type   = image->color_type;
+    result->bit_depth    = image->bit_depth;
+    result->byte_pitch   = result->w * 4;
+    result->data         = malloc((size_t)result->h * result->byte_pitch);
+    if (!result->data) {
+        free(result);
+        return NULL;
+    }
+
+    const uint8_t* src = (const uint8_t*)image->data;
+    uint8_t* dst       = (uint8_t*)result->data;
+
+    /* Number of destination pixels with a complete 2x2 block */
+    const int full_pixels = image->w / 2;
+
+    for (int y = 0; y < result->h; y++) {
+        /* If the height is odd, the last row is averaged with itself */
+        const int y0 = y * 2;
+        const int y1 = (y0 + 1 < image->h) ? y0 + 1 : y0;
+
+        const uint8_t* row0 = &src[(size_t)y0 * image->byte_pitch];
+        const uint8_t* row1 = &src[(size_t)y1 * image->byte_pitch];
+        uint8_t* dst_row    = &dst[(size_t)y * result->byte_pitch];
+
+        downsample(row0, row1, dst_row, full_pixels);
+
+        /* If the width is odd, the last column is averaged with itself */
+        if (image->w % 2 != 0) {
+            const int x = image->w - 1;
+            for (int c = 0; c < 4; c++) {
+                const int sum = row0[x * 4 + c] * 2 + row1[x * 4 + c] * 2;
+                dst_row[full_pixels * 4 + c] = (sum + 2) >> 2;
+            }
+        }
+    }
+
+    return result;
+}
+
+Mipmap* mipmap_new(Image* image) {
+    Mipmap* mipmap = malloc(sizeof(Mipmap));
+    if (!mipmap)
+        return NULL;
+
+    mipmap->levels[0] = image;
+    mipmap->count     = 1;
+
+    while (mipmap->count < MIPMAP_MAX_LEVELS) {
+        const Image* prev = mipmap->levels[mipmap->count - 1];
+        if (prev->w <= MIPMAP_MIN_SIZE && prev->h <= MIPMAP_MIN_SIZE)
+            break;
+
+        Image* level = mipmap_downsample(prev);
+        if (!level)
+            break;
+
+        mipmap->levels[mipmap->count++] = level;
+    }
+
+    return mipmap;
+}
+
+void mipmap_free(Mipmap* mipmap) {
+    for (int i = 1; i < mipmap->count; i++)
+        image_free(mipmap->levels[i]);
+
+    free(mipmap);
+}
+
+void mipmap_free_data(Mipmap* mipmap) {
+    for (int i = 0; i < mipmap->count; i++)
+        image_free_data(mipmap->levels[i]);
+}
+
+int mipmap_level_for_zoom(const Mipmap* mipmap, double zoom) {
+    /*
+     * Level N is drawn with a zoom of (2^N * zoom) relative to its own pixels.
+     * Use the highest level where that is still 1 or less, so the texture is
+     * never stretched, and it's shrunk by at most half.
+     */
+    int level = 0;
+    while (level + 1 < mipmap->count && zoom * (1 << (level + 1)) <= 1.0)
+        level++;
+
+    return level;
+}
@@ -0,0 +1,250 @@
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <SDL2/SDL.h>
+
+#include "include/main.h"
+#include "include/profile.h"
+
+/* Number of rectangles sent to the renderer in each draw call of the
+ * overlay */
+#define OVERLAY_RECTS 1024
+
+bool g_profile_enabled = false;
+
+static ProfileHistogram g_histograms[PROFILE_METRICS];
+
+static const char* const g_metric_names[PROFILE_METRICS] = {
+    [PROFILE_EVENTS]     = "events",
+    [PROFILE_LOAD]       = "load",
+    [PROFILE_GRID]       = "grid",
+    [PROFILE_IMAGE]      = "image",
+    [PROFILE_DRAWING]    = "drawing",
+    [PROFILE_PRESENT]    = "present",
+    [PROFILE_FRAME]      = "frame",
+    [PROFILE_DRAW_CALLS] = "draw calls",
+};
+
+/* Glyphs of the overlay font, of 3x5 pixels. Each octal digit is a row, from
+ * top to bottom, and its bits are the pixels, from left to right. Lowercase
+ * letters are drawn as uppercase. */
+static const uint16_t g_font[128] = {
+    ['0'] = 075557, ['1'] = 026227, ['2'] = 071747, ['3'] = 071717,
+    ['4'] = 055711, ['5'] = 074717, ['6'] = 074757, ['7'] = 071111,
+    ['8'] = 075757, ['9'] = 075717, ['A'] = 025755, ['B'] = 065656,
+    ['C'] = 034443, ['D'] = 065556, ['E'] = 074647, ['F'] = 074644,
+    ['G'] = 034553, ['H'] = 055755, ['I'] = 072227, ['J'] = 011152,
+    ['K'] = 055655, ['L'] = 044447, ['M'] = 057755, ['N'] = 065555,
+    ['O'] = 025552, ['P'] = 065644, ['Q'] = 025563, ['R'] = 065655,
+    ['S'] = 034216, ['T'] = 072222, ['U'] = 055557, ['V'] = 055552,
+    ['W'] = 055775, ['X'] = 055255, ['Y'] = 055222, ['Z'] = 071247,
+    ['.'] = 000002, [':'] = 002020, ['/'] = 011244, ['%'] = 051245,
+    ['-'] = 000700,
+};
+
+/*----------------------------------------------------------------------------*/
+
+/* Get the bucket of the histograms that counts VALUE */
+static int bucket_index(uint64_t value) {
+    if (value < PROFILE_LINEAR_BUCKETS)
+        return value;
+
+    /* Position of the highest bit, and the bits right after it */
+    const int exponent = 63 - __builtin_clzll(value);
+    const int sub = (value >> (exponent - 3)) & (PROFILE_SUB_BUCKETS - 1);
+
+    const int index = PROFILE_LINEAR_BUCKETS +
+                      (exponent - 4) * PROFILE_SUB_BUCKETS + sub;
+    return (index < PROFILE_BUCKETS) ? index : PROFILE_BUCKETS - 1;
+}
+
+/* Get the value in the middle of a bucket. Inverse of `bucket_index'. */
+static uint64_t bucket_value(int index) {
+    if (index < PROFILE_LINEAR_BUCKETS)
+        return index;
+
+    index -= PROFILE_LINEAR_BUCKETS;
+    const int exponent = index / PROFILE_SUB_BUCKETS + 4;
+    const int sub      = index % PROFILE_SUB_BUCKETS;
+
+    const uint64_t width = (uint64_t)1 << (exponent - 3);
+    return (PROFILE_SUB_BUCKETS + sub) * width + width / 2;
+}
+
+bool profile_init(bool enabled) {
+    const char* env = getenv(PROFILE_ENV);
+    if (env != NULL && *env != '\0' && strcmp(env, "0") != 0)
+        enabled = true;
+
+    g_profile_enabled = enabled;
+    return enabled;
+}
+
+uint64_t profile_now(void) {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+        return 0;
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void profile_record(ProfileMetric metric, uint64_t value) {
+    ProfileHistogram* histogram = &g_histograms[metric];
+
+    __atomic_add_fetch(&histogram->buckets[bucket_index(value)], 1,
+                       __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->total, value, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    while (value > max &&
+           !__atomic_compare_exchange_n(&histogram->max, &max, value, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+uint64_t profile_percentile(ProfileMetric metric, double p) {
+    const ProfileHistogram* histogram = &g_histograms[metric];
+
+    const uint64_t count =
+      __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+    if (count == 0)
+        return 0;
+
+    /* Nearest rank, like the benchmarks */
+    uint64_t rank = (uint64_t)(p / 100.0 * count + 0.999999);
+    if (rank < 1)
+        rank = 1;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < PROFILE_BUCKETS; i++) {
+        seen += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+        if (seen >= rank) {
+            /* The middle of the bucket might be above the real maximum */
+            const uint64_t value = bucket_value(i);
+            const uint64_t max =
+              __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+            return (value < max) ? value : max;
+        }
+    }
+
+    return __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Add the rectangles of the pixels of a line of text to RECTS, starting at
+ * index *COUNT. They are drawn and *COUNT is reset when RECTS is full. */
+static void overlay_text(SDL_Rect* rects, int* count, int x, int y,
+                         const char* text) {
+    const int scale = PROFILE_FONT_SCALE;
+
+    for (; *text != '\0'; text++, x += 4 * scale) {
+        unsigned char c = *text;
+        if (c >= 'a' && c <= 'z')
+            c -= 'a' - 'A';
+
+        const uint16_t glyph = (c < 128) ? g_font[c] : 0;
+        for (int row = 0; row < 5; row++) {
+            for (int col = 0; col < 3; col++) {
+                const int bit = (4 - row) * 3 + (2 - col);
+                if (!(glyph & (1 << bit)))
+                    continue;
+
+                if (*count >= OVERLAY_RECTS) {
+                    SDL_RenderFillRects(g_renderer, rects, *count);
+                    g_draw_calls++;
+                    *count = 0;
+                }
+
+                rects[(*count)++] = (SDL_Rect){
+                    x + col * scale,
+                    y + row * scale,
+                    scale,
+                    scale,
+                };
+            }
+        }
+    }
+}
+
+void profile_render_overlay(void) {
+    /* One line for each duration, plus the draw calls and frames */
+    char lines[PROFILE_METRICS + 1][64];
+    int line_count = 0;
+
+    for (int i = 0; i < PROFILE_DRAW_CALLS; i++)
+        snprintf(lines[line_count++], sizeof(lines[0]),
+                 "%-8s p50 %7.2f  p99 %7.2f ms", g_metric_names[i],
+                 profile_percentile(i, 50.0) / 1e6,
+                 profile_percentile(i, 99.0) / 1e6);
+
+    snprintf(lines[line_count++], sizeof(lines[0]),
+             "draw calls p50 %lu  p99 %lu",
+             (unsigned long)profile_percentile(PROFILE_DRAW_CALLS, 50.0),
+             (unsigned long)profile_percentile(PROFILE_DRAW_CALLS, 99.0));
+    snprintf(lines[line_count++], sizeof(lines[0]), "frames %lu",
+             (unsigned long)g_histograms[PROFILE_FRAME].count);
+
+    const int scale       = PROFILE_FONT_SCALE;
+    const int line_height = 7 * scale;
+
+    size_t max_len = 0;
+    for (int i = 0; i < line_count; i++)
+        if (strlen(lines[i]) > max_len)
+            max_len = strlen(lines[i]);
+
+    SDL_BlendMode old_mode;
+    SDL_GetRenderDrawBlendMode(g_renderer, &old_mode);
+    SDL_SetRenderDrawBlendMode(g_renderer, SDL_BLENDMODE_BLEND);
+
+    /* Dark background, so the text can be read over any image */
+    const SDL_Rect background = {
+        0,
+        0,
+        ((int)max_len * 4 + 3) * scale,
+        line_count * line_height + 3 * scale,
+    };
+    SDL_SetRenderDrawColor(g_renderer, 0, 0, 0, 192);
+    SDL_RenderFillRect(g_renderer, &background);
+
+    SDL_SetRenderDrawColor(g_renderer, 255, 255, 255, 255);
+
+    SDL_Rect rects[OVERLAY_RECTS];
+    int count = 0;
+    for (int i = 0; i < line_count; i++)
+        overlay_text(rects, &count, 2 * scale, 2 * scale + i * line_height,
+                     lines[i]);
+
+    SDL_RenderFillRects(g_renderer, rects, count);
+    g_draw_calls += 2;
+
+    SDL_SetRenderDrawBlendMode(g_renderer, old_mode);
+}
+
+void profile_print_summary(FILE* fp) {
+    fprintf(fp, "hl-png: profile: %-10s %8s %9s %9s %9s %9s\n", "metric",
+            "count", "mean", "p50", "p99", "max");
+
+    for (int i = 0; i < PROFILE_METRICS; i++) {
+        const ProfileHistogram* histogram = &g_histograms[i];
+        if (histogram->count == 0)
+            continue;
+
+        /* Durations are printed in milliseconds */
+        const double unit = (i == PROFILE_DRAW_CALLS) ? 1.0 : 1e6;
+
+        fprintf(fp,
+                "hl-png: profile: %-10s %8lu %9.3f %9.3f %9.3f %9.3f\n",
+                g_metric_names[i], (unsigned long)histogram->count,
+                (double)histogram->total / histogram->count / unit,
+                profile_percentile(i, 50.0) / unit,
+                profile_percentile(i, 99.0) / unit, histogram->max / unit);
+    }
+
+    fprintf(fp, "hl-png: profile: durations are in milliseconds.\n");
+}
@@ -0,0 +1,358 @@
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "include/drawing.h"
+#include "include/session.h"
+
+/* Sizes of the parts of the file, see `session.h' */
+#define HEADER_SIZE      40
+#define INDEX_ENTRY_SIZE 32
+
+/* Offsets of the fields of the header */
+#define HEADER_MAGIC     0
+#define HEADER_VERSION   8
+#define HEADER_LINES     12
+#define HEADER_POINTS    16
+#define HEADER_DATA_SIZE 24
+#define HEADER_CRC       32
+
+/* Offsets of the fields of each index entry */
+#define ENTRY_COLOR    0
+#define ENTRY_WIDTH    4
+#define ENTRY_ORIGIN_X 8
+#define ENTRY_ORIGIN_Y 12
+#define ENTRY_COUNT    16
+#define ENTRY_OFFSET   24
+
+/* Maximum size of a varint. The differences between the points of a line fit
+ * in 17 bits, so they use at most 3 bytes. */
+#define VARINT_MAX_SIZE 5
+
+/*----------------------------------------------------------------------------*/
+/* Encoding */
+
+static inline void put_u32(uint8_t* dst, uint32_t value) {
+    for (int i = 0; i < 4; i++)
+        dst[i] = (value >> (i * 8)) & 0xFF;
+}
+
+static inline void put_u64(uint8_t* dst, uint64_t value) {
+    for (int i = 0; i < 8; i++)
+        dst[i] = (value >> (i * 8)) & 0xFF;
+}
+
+static inline uint32_t get_u32(const uint8_t* src) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++)
+        value |= (uint32_t)src[i] << (i * 8);
+    return value;
+}
+
+static inline uint64_t get_u64(const uint8_t* src) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++)
+        value |= (uint64_t)src[i] << (i * 8);
+    return value;
+}
+
+/* Write a signed value as a zigzag varint: the sign goes in the lowest bit, so
+ * small negative values are also short. Returns the number of bytes. */
+static inline int put_varint(uint8_t* dst, int32_t value) {
+    uint32_t zigzag = ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+
+    int size = 0;
+    while (zigzag >= 0x80) {
+        dst[size++] = (zigzag & 0x7F) | 0x80;
+        zigzag >>= 7;
+    }
+    dst[size++] = zigzag;
+
+    return size;
+}
+
+/* Read a zigzag varint from [*SRC, END), and advance *SRC. Returns false if it
+ * goes past the end, or if it's too long. */
+static inline bool get_varint(const uint8_t** src, const uint8_t* end,
+                              int32_t* value) {
+    uint32_t zigzag = 0;
+    for (int i = 0; i < VARINT_MAX_SIZE; i++) {
+        if (*src >= end)
+            return false;
+
+        const uint8_t byte = *(*src)++;
+        zigzag |= (uint32_t)(byte & 0x7F) << (i * 7);
+
+        if ((byte & 0x80) == 0) {
+            *value = (int32_t)(zigzag >> 1) ^ -(int32_t)(zigzag & 1);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Saving */
+
+/* Write the whole buffer to a file descriptor */
+static bool write_all(int fd, const uint8_t* data, size_t size) {
+    while (size > 0) {
+        const ssize_t written = write(fd, data, size);
+        if (written < 0)
+            return false;
+
+        data += written;
+        size -= written;
+    }
+
+    return true;
+}
+
+/* Make sure the rename of a file is stored in the disk, by synchronizing its
+ * directory. */
+static void sync_parent_dir(const char* filename) {
+    const char* slash = strrchr(filename, '/');
+
+    char* dir = (slash != NULL) ? strndup(filename, slash - filename + 1)
+                                : strdup(".");
+    if (!dir)
+        return;
+
+    const int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+
+    free(dir);
+}
+
+/* Get the permissions of a new file, which are the ones of the file it
+ * replaces, if it exists, or the default ones of `creat' otherwise. */
+static mode_t new_file_mode(const char* filename) {
+    struct stat st;
+    if (stat(filename, &st) == 0)
+        return st.st_mode & 07777;
+
+    /* The mask can only be read by changing it */
+    const mode_t mask = umask(0);
+    umask(mask);
+    return 0666 & ~mask;
+}
+
+bool session_save(const char* filename, const Drawing* drawing) {
+    /* Count the lines and points that are saved, for the size of the
+     * buffer. */
+    uint32_t line_count  = 0;
+    uint64_t point_count = 0;
+    for (int i = drawing->first_visible; i < drawing->line_count; i++) {
+        if (drawing->lines[i].erased)
+            continue;
+
+        line_count++;
+        point_count += drawing->lines[i].count;
+    }
+
+    const size_t index_size = (size_t)line_count * INDEX_ENTRY_SIZE;
+    const size_t max_size =
+      HEADER_SIZE + index_size + point_count * 2 * VARINT_MAX_SIZE;
+
+    uint8_t* buf = calloc(1, max_size);
+    if (!buf)
+        return false;
+
+    uint8_t* index = &buf[HEADER_SIZE];
+    uint8_t* data  = &index[index_size];
+
+    size_t data_size = 0;
+    uint32_t entry   = 0;
+    for (int i = drawing->first_visible; i < drawing->line_count; i++) {
+        const DrawingLine* line = &drawing->lines[i];
+        if (line->erased)
+            continue;
+
+        uint8_t* dst = &index[(size_t)entry * INDEX_ENTRY_SIZE];
+        entry++;
+
+        dst[ENTRY_COLOR + 0] = line->col.r;
+        dst[ENTRY_COLOR + 1] = line->col.g;
+        dst[ENTRY_COLOR + 2] = line->col.b;
+        dst[ENTRY_COLOR + 3] = line->col.a;
+        dst[ENTRY_WIDTH]     = line->width;
+        put_u32(&dst[ENTRY_ORIGIN_X], (uint32_t)line->origin_x);
+        put_u32(&dst[ENTRY_ORIGIN_Y], (uint32_t)line->origin_y);
+        put_u32(&dst[ENTRY_COUNT], line->count);
+        put_u64(&dst[ENTRY_OFFSET], data_size);
+
+        /* The first point is always the origin, so it's not stored */
+        const int16_t* xs = &drawing->xs[line->start];
+        const int16_t* ys = &drawing->ys[line->start];
+        for (int j = 1; j < line->count; j++) {
+            data_size += put_varint(&data[data_size], xs[j] - xs[j - 1]);
+            data_size += put_varint(&data[data_size], ys[j] - ys[j - 1]);
+        }
+    }
+
+    const size_t total_size = HEADER_SIZE + index_size + data_size;
+
+    memcpy(&buf[HEADER_MAGIC], SESSION_MAGIC, 8);
+    put_u32(&buf[HEADER_VERSION], SESSION_VERSION);
+    put_u32(&buf[HEADER_LINES], line_count);
+    put_u64(&buf[HEADER_POINTS], point_count);
+    put_u64(&buf[HEADER_DATA_SIZE], data_size);
+    put_u32(&buf[HEADER_CRC],
+            crc32_z(crc32(0L, Z_NULL, 0), index, index_size + data_size));
+
+    /* Write to a temporary file, and replace the old file only once the new
+     * one is complete. */
+    const char suffix[] = ".XXXXXX";
+    const size_t len    = strlen(filename);
+    char* tmp_path      = malloc(len + sizeof(suffix));
+    if (!tmp_path) {
+        free(buf);
+        return false;
+    }
+    memcpy(tmp_path, filename, len);
+    memcpy(&tmp_path[len], suffix, sizeof(suffix));
+
+    bool result  = false;
+    const int fd = mkstemp(tmp_path);
+    if (fd >= 0) {
+        /* The permissions of `mkstemp' are too restrictive */
+        fchmod(fd, new_file_mode(filename));
+
+        const bool written = write_all(fd, buf, total_size) && fsync(fd) == 0;
+        const bool closed  = close(fd) == 0;
+
+        if (written && closed && rename(tmp_path, filename) == 0) {
+            sync_parent_dir(filename);
+            result = true;
+        } else {
+            unlink(tmp_path);
+        }
+    }
+
+    free(tmp_path);
+    free(buf);
+    return result;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Loading */
+
+/* Add the lines of a mapped session file to an empty Drawing. Returns false if
+ * the file is not valid. */
+static bool load_lines(Drawing* drawing, const uint8_t* file, size_t size) {
+    if (size < HEADER_SIZE ||
+        memcmp(&file[HEADER_MAGIC], SESSION_MAGIC, 8) != 0 ||
+        get_u32(&file[HEADER_VERSION]) != SESSION_VERSION)
+        return false;
+
+    const uint64_t line_count  = get_u32(&file[HEADER_LINES]);
+    const uint64_t point_count = get_u64(&file[HEADER_POINTS]);
+    const uint64_t data_size   = get_u64(&file[HEADER_DATA_SIZE]);
+
+    /* The in-memory arrays are indexed with an int */
+    if (line_count > INT32_MAX / 2 || point_count > INT32_MAX / 2)
+        return false;
+
+    const uint64_t index_size = line_count * INDEX_ENTRY_SIZE;
+    if (data_size > size || HEADER_SIZE + index_size + data_size != size)
+        return false;
+
+    const uint8_t* index = &file[HEADER_SIZE];
+    const uint8_t* data  = &index[index_size];
+    const uint8_t* end   = &data[data_size];
+
+    if (get_u32(&file[HEADER_CRC]) !=
+        crc32_z(crc32(0L, Z_NULL, 0), index, index_size + data_size))
+        return false;
+
+    /* Allocate everything at once, and decode the points directly into the
+     * arrays of the Drawing. */
+    if (!drawing_reserve(drawing, line_count, point_count))
+        return false;
+
+    uint64_t points_left = point_count;
+    for (uint64_t i = 0; i < line_count; i++) {
+        const uint8_t* entry = &index[i * INDEX_ENTRY_SIZE];
+
+        DrawingLine line = {
+            .col      = { entry[ENTRY_COLOR + 0], entry[ENTRY_COLOR + 1],
+                          entry[ENTRY_COLOR + 2], entry[ENTRY_COLOR + 3] },
+            .width    = entry[ENTRY_WIDTH],
+            .origin_x = (int32_t)get_u32(&entry[ENTRY_ORIGIN_X]),
+            .origin_y = (int32_t)get_u32(&entry[ENTRY_ORIGIN_Y]),
+            .count    = get_u32(&entry[ENTRY_COUNT]),
+        };
+
+        const uint64_t offset = get_u64(&entry[ENTRY_OFFSET]);
+        if (line.count < 1 || (uint64_t)line.count > points_left ||
+            offset > data_size)
+            return false;
+        points_left -= line.count;
+
+        int16_t* xs = &drawing->xs[drawing->points_i];
+        int16_t* ys = &drawing->ys[drawing->points_i];
+        xs[0]       = 0;
+        ys[0]       = 0;
+
+        const uint8_t* src = &data[offset];
+        for (int j = 1; j < line.count; j++) {
+            int32_t dx, dy;
+            if (!get_varint(&src, end, &dx) || !get_varint(&src, end, &dy))
+                return false;
+
+            const int32_t x = xs[j - 1] + dx;
+            const int32_t y = ys[j - 1] + dy;
+            if (x < INT16_MIN || x > INT16_MAX || y < INT16_MIN ||
+                y > INT16_MAX)
+                return false;
+
+            xs[j] = x;
+            ys[j] = y;
+        }
+
+        drawing_add_finished_line(drawing, line);
+    }
+
+    return points_left == 0;
+}
+
+Drawing* session_load(const char* filename) {
+    const int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < HEADER_SIZE) {
+        close(fd);
+        return NULL;
+    }
+
+    const size_t size = st.st_size;
+    void* file        = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED)
+        return NULL;
+
+    /* The file is read once, from start to end */
+    madvise(file, size, MADV_SEQUENTIAL);
+
+    Drawing* drawing = drawing_new();
+    if (drawing != NULL && !load_lines(drawing, file, size)) {
+        drawing_free(drawing);
+        drawing = NULL;
+    }
+
+    munmap(file, size);
+    return drawing;
+}
@@ -0,0 +1,210 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <png.h>
+
+#include "include/source.h"
+
+/* Read up to LEN bytes from FD, retrying if interrupted by a signal. Returns
+ * zero at the end of the file, or a negative value on error. */
+static ssize_t read_fd(int fd, uint8_t* dst, size_t len) {
+    ssize_t result;
+    do {
+        result = read(fd, dst, len);
+    } while (result < 0 && errno == EINTR);
+
+    return result;
+}
+
+/* Read the next block of a stream into its buffer, if it was consumed.
+ * Returns the number of bytes available in the buffer. */
+static size_t fill_buffer(Source* source) {
+    if (source->buf_pos < source->buf_len)
+        return source->buf_len - source->buf_pos;
+
+    if (source->buf == NULL) {
+        source->buf = malloc(SOURCE_READ_SIZE);
+        if (source->buf == NULL)
+            return 0;
+    }
+
+    const ssize_t result = read_fd(source->fd, source->buf, SOURCE_READ_SIZE);
+    source->buf_pos      = 0;
+    source->buf_len      = (result > 0) ? (size_t)result : 0;
+    return source->buf_len;
+}
+
+/* Called by libpng whenever it needs more bytes. See `source_set_png'. */
+static void png_read_callback(png_structp png, png_bytep dst, size_t len) {
+    Source* source = png_get_io_ptr(png);
+    if (!source_read(source, dst, len))
+        png_error(png, "Read Error");
+}
+
+/*----------------------------------------------------------------------------*/
+
+Source* source_open(const char* path) {
+    if (source_is_stdin(path))
+        return source_open_fd(STDIN_FILENO);
+
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    Source* source = source_open_fd(fd);
+    if (source == NULL) {
+        close(fd);
+        return NULL;
+    }
+    source->owns_fd = true;
+
+    /* Map regular files, and tell the kernel that they are read in order so it
+     * reads ahead aggressively. If the file is truncated while it's mapped,
+     * reading it raises SIGBUS, like with any other program that maps its
+     * input. */
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0)
+        return source;
+
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return source;
+
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    close(fd);
+    source->fd      = -1;
+    source->owns_fd = false;
+    source->data    = map;
+    source->size    = st.st_size;
+    source->mapped  = true;
+    return source;
+}
+
+Source* source_open_fd(int fd) {
+    Source* source = calloc(1, sizeof(Source));
+    if (source == NULL)
+        return NULL;
+
+    source->fd = fd;
+    return source;
+}
+
+void source_close(Source* source) {
+    if (source->mapped)
+        munmap((void*)source->data, source->size);
+    else
+        free((void*)source->data);
+
+    if (source->owns_fd)
+        close(source->fd);
+
+    free(source->buf);
+    free(source);
+}
+
+size_t source_next(Source* source, size_t max, const uint8_t** data) {
+    size_t available;
+
+    if (source->fd < 0) {
+        available = source->size - source->pos;
+        if (available > max)
+            available = max;
+
+        *data = &source->data[source->pos];
+        source->pos += available;
+    } else {
+        /* Return whatever a single read gave, so pipes are decoded as the
+         * bytes arrive */
+        available = fill_buffer(source);
+        if (available > max)
+            available = max;
+
+        *data = &source->buf[source->buf_pos];
+        source->buf_pos += available;
+    }
+
+    return available;
+}
+
+bool source_read(Source* source, uint8_t* dst, size_t len) {
+    while (len > 0) {
+        const uint8_t* data;
+        const size_t read_bytes = source_next(source, len, &data);
+        if (read_bytes == 0)
+            return false;
+
+        memcpy(dst, data, read_bytes);
+        dst += read_bytes;
+        len -= read_bytes;
+    }
+
+    return true;
+}
+
+const uint8_t* source_contents(Source* source, size_t* size) {
+    if (source->fd < 0) {
+        *size = source->size - source->pos;
+        return &source->data[source->pos];
+    }
+
+    /* Start with the bytes that were already buffered, and keep reading until
+     * the end of the stream */
+    size_t len      = source->buf_len - source->buf_pos;
+    size_t capacity = len + SOURCE_READ_SIZE;
+    uint8_t* data   = malloc(capacity);
+    if (data == NULL)
+        return NULL;
+
+    if (len > 0)
+        memcpy(data, &source->buf[source->buf_pos], len);
+
+    for (;;) {
+        if (capacity - len < SOURCE_READ_SIZE) {
+            capacity *= 2;
+            uint8_t* new_data = realloc(data, capacity);
+            if (new_data == NULL) {
+                free(data);
+                return NULL;
+            }
+            data = new_data;
+        }
+
+        const ssize_t result = read_fd(source->fd, &data[len],
+                                       SOURCE_READ_SIZE);
+        if (result < 0) {
+            free(data);
+            return NULL;
+        }
+        if (result == 0)
+            break;
+
+        len += result;
+    }
+
+    /* From now on, the source reads from memory */
+    if (source->owns_fd)
+        close(source->fd);
+
+    free(source->buf);
+    source->buf     = NULL;
+    source->buf_pos = source->buf_len = 0;
+    source->fd      = -1;
+    source->owns_fd = false;
+    source->data    = data;
+    source->size    = len;
+    source->pos     = 0;
+
+    *size = len;
+    return data;
+}
+
+void source_set_png(Source* source, png_structp png) {
+    png_set_read_fn(png, source, png_read_callback);
+}
@@ -0,0 +1,181 @@
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "include/util.h"
+#include "include/spatial.h"
+
+/* Get the slot of the hash table for the cell (CX, CY) */
+static inline int cell_hash(const SpatialIndex* index, int32_t cx,
+                            int32_t cy) {
+    const uint32_t hash =
+      ((uint32_t)cx * 0x9E3779B1u) ^ ((uint32_t)cy * 0x85EBCA77u);
+    return (hash ^ (hash >> 16)) & (index->cells_sz - 1);
+}
+
+/* Find the slot of the cell (CX, CY), or the empty slot where it should be
+ * inserted. */
+static int find_slot(const SpatialIndex* index, int32_t cx, int32_t cy) {
+    int slot = cell_hash(index, cx, cy);
+    for (;;) {
+        const SpatialCell* cell = &index->cells[slot];
+        if (cell->head < 0 || (cell->cx == cx && cell->cy == cy))
+            return slot;
+
+        slot = (slot + 1) & (index->cells_sz - 1);
+    }
+}
+
+/* Allocate a hash table with `cells_sz' empty slots */
+static SpatialCell* alloc_cells(int cells_sz) {
+    SpatialCell* cells = malloc(cells_sz * sizeof(SpatialCell));
+    if (!cells)
+        return NULL;
+
+    for (int i = 0; i < cells_sz; i++)
+        cells[i].head = -1;
+
+    return cells;
+}
+
+/* Double the size of the hash table, moving the cells to their new slots. The
+ * entries don't change. */
+static void grow_cells(SpatialIndex* index) {
+    SpatialCell* old_cells = index->cells;
+    const int old_sz       = index->cells_sz;
+
+    index->cells_sz *= 2;
+    index->cells = alloc_cells(index->cells_sz);
+    if (!index->cells)
+        DIE("Error reallocating the cells of the spatial index.");
+
+    for (int i = 0; i < old_sz; i++)
+        if (old_cells[i].head >= 0)
+            index->cells[find_slot(index, old_cells[i].cx, old_cells[i].cy)] =
+              old_cells[i];
+
+    free(old_cells);
+}
+
+/* Add an entry for the segment to the cell (CX, CY) */
+static void insert_entry(SpatialIndex* index, int32_t cx, int32_t cy, int line,
+                         int segment) {
+    /* Keep the hash table at most half full */
+    if ((index->cells_used + 1) * 2 > index->cells_sz)
+        grow_cells(index);
+
+    if (index->entries_i >= index->entries_sz) {
+        index->entries_sz *= 2;
+        index->entries = realloc(index->entries,
+                                 index->entries_sz * sizeof(SpatialEntry));
+        if (!index->entries)
+            DIE("Error reallocating the entries of the spatial index.");
+    }
+
+    SpatialCell* cell = &index->cells[find_slot(index, cx, cy)];
+    if (cell->head < 0) {
+        cell->cx = cx;
+        cell->cy = cy;
+        index->cells_used++;
+    }
+
+    /* Add the entry to the start of the list of the cell */
+    SpatialEntry* entry = &index->entries[index->entries_i];
+    entry->line         = line;
+    entry->segment      = segment;
+    entry->next         = cell->head;
+
+    cell->head = index->entries_i++;
+}
+
+/*----------------------------------------------------------------------------*/
+
+SpatialIndex* spatial_new(void) {
+    SpatialIndex* index = malloc(sizeof(SpatialIndex));
+    if (!index)
+        return NULL;
+
+    index->cells_sz   = SPATIAL_CELLS_SIZE;
+    index->cells      = alloc_cells(index->cells_sz);
+    index->cells_used = 0;
+
+    index->entries_sz = SPATIAL_CELLS_SIZE;
+    index->entries    = malloc(index->entries_sz * sizeof(SpatialEntry));
+    index->entries_i  = 0;
+
+    if (!index->cells || !index->entries) {
+        spatial_free(index);
+        return NULL;
+    }
+
+    return index;
+}
+
+void spatial_free(SpatialIndex* index) {
+    free(index->cells);
+    free(index->entries);
+    free(index);
+}
+
+void spatial_clear(SpatialIndex* index) {
+    for (int i = 0; i < index->cells_sz; i++)
+        index->cells[i].head = -1;
+
+    index->cells_used = 0;
+    index->entries_i  = 0;
+}
+
+void spatial_insert(SpatialIndex* index, int line, int segment, double x0,
+                    double y0, double x1, double y1, double margin) {
+    /* Make the segment go from left to right */
+    if (x1 < x0) {
+        const double tmp_x = x0;
+        const double tmp_y = y0;
+        x0                 = x1;
+        y0                 = y1;
+        x1                 = tmp_x;
+        y1                 = tmp_y;
+    }
+
+    /* Slope of the segment, zero if it's vertical */
+    const double slope = (x1 > x0) ? (y1 - y0) / (x1 - x0) : 0;
+
+    /*
+     * For each column of cells, find the part of the segment that is inside of
+     * it (or closer than `margin'), and add the segment to the rows that part
+     * covers. This only visits the cells along the segment, instead of all the
+     * cells in its bounding box.
+     */
+    const int32_t first_col = SPATIAL_CELL(x0 - margin);
+    const int32_t last_col  = SPATIAL_CELL(x1 + margin);
+    for (int32_t cx = first_col; cx <= last_col; cx++) {
+        double start_x = (double)cx * SPATIAL_CELL_SIZE - margin;
+        double end_x   = (double)(cx + 1) * SPATIAL_CELL_SIZE + margin;
+        if (start_x < x0)
+            start_x = x0;
+        if (end_x > x1)
+            end_x = x1;
+
+        double min_y = y0 + (start_x - x0) * slope;
+        double max_y = y0 + (end_x - x0) * slope;
+        if (x1 == x0) {
+            min_y = y0;
+            max_y = y1;
+        }
+        if (min_y > max_y) {
+            const double tmp = min_y;
+            min_y            = max_y;
+            max_y            = tmp;
+        }
+
+        const int32_t first_row = SPATIAL_CELL(min_y - margin);
+        const int32_t last_row  = SPATIAL_CELL(max_y + margin);
+        for (int32_t cy = first_row; cy <= last_row; cy++)
+            insert_entry(index, cx, cy, line, segment);
+    }
+}
+
+int spatial_find(const SpatialIndex* index, int32_t cx, int32_t cy) {
+    return index->cells[find_slot(index, cx, cy)].head;
+}
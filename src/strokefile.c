@@ -0,0 +1,139 @@
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "include/drawing.h"
+#include "include/strokefile.h"
+
+/* Parse the points of a line of a stroke file, and add them to the Drawing. If
+ * DRAWING is NULL, they are only checked. Returns the number of points, or -1
+ * if they are not valid. */
+static int read_points(Drawing* drawing, const char* str, DrawingPoint point) {
+    char* end;
+    int count = 0;
+    for (;;) {
+        const long x = strtol(str, &end, 10);
+        if (end == str)
+            break;
+        if (*end != ',' || x < INT_MIN || x > INT_MAX)
+            return -1;
+
+        str          = end + 1;
+        const long y = strtol(str, &end, 10);
+        if (end == str || y < INT_MIN || y > INT_MAX)
+            return -1;
+
+        point.x = x;
+        point.y = y;
+        if (drawing != NULL)
+            drawing_push(drawing, point);
+
+        str = end;
+        count++;
+    }
+
+    /* Only whitespace can follow the points */
+    while (*str == ' ' || *str == '\t' || *str == '\r' || *str == '\n')
+        str++;
+
+    return (*str == '\0') ? count : -1;
+}
+
+/* Parse a line of a stroke file, and add it to the Drawing. Returns false if
+ * the line is not valid. */
+static bool read_line(Drawing* drawing, const char* str) {
+    char* end;
+    const unsigned long rgba = strtoul(str, &end, 16);
+    if (end == str || rgba > 0xFFFFFFFF)
+        return false;
+
+    str              = end;
+    const long width = strtol(str, &end, 10);
+    if (end == str || width < 1 || width > UINT8_MAX)
+        return false;
+
+    const DrawingPoint point = {
+        .col   = C(rgba),
+        .width = width,
+    };
+
+    /* Check the whole line before adding anything to the Drawing */
+    if (read_points(NULL, end, point) <= 0)
+        return false;
+
+    read_points(drawing, end, point);
+    drawing_end_line(drawing);
+    return true;
+}
+
+bool strokefile_write(const char* filename, const Drawing* drawing) {
+    FILE* fp = fopen(filename, "w");
+    if (!fp)
+        return false;
+
+    fprintf(fp, "# hl-png strokes: RRGGBBAA WIDTH X,Y X,Y ...\n");
+
+    for (int i = drawing->first_visible; i < drawing->line_count; i++) {
+        const DrawingLine* line = &drawing->lines[i];
+        if (line->erased)
+            continue;
+
+        fprintf(fp, "%02X%02X%02X%02X %d", line->col.r, line->col.g,
+                line->col.b, line->col.a, line->width);
+
+        for (int j = 0; j < line->count; j++)
+            fprintf(fp, " %d,%d", drawing_point_x(drawing, line, j),
+                    drawing_point_y(drawing, line, j));
+
+        putc('\n', fp);
+    }
+
+    const bool failed = ferror(fp);
+    return (fclose(fp) == 0) && !failed;
+}
+
+bool strokefile_read(const char* filename, Drawing* drawing) {
+    FILE* fp = fopen(filename, "r");
+    if (!fp)
+        return false;
+
+    drawing_end_line(drawing);
+
+    /* The points were already simplified when they were drawn */
+    const double old_tolerance    = drawing->tolerance;
+    const double old_min_distance = drawing->min_distance;
+    drawing->tolerance            = 0.0;
+    drawing->min_distance         = 0.0;
+
+    bool result = true;
+
+    char* str      = NULL;
+    size_t str_len = 0;
+    while (getline(&str, &str_len, fp) != -1) {
+        /* Skip whitespace, empty lines and comments */
+        char* start = str;
+        while (*start == ' ' || *start == '\t')
+            start++;
+        if (*start == '#' || *start == '\n' || *start == '\r' ||
+            *start == '\0')
+            continue;
+
+        if (!read_line(drawing, start)) {
+            result = false;
+            break;
+        }
+    }
+
+    if (ferror(fp))
+        result = false;
+
+    free(str);
+    fclose(fp);
+
+    drawing->tolerance    = old_tolerance;
+    drawing->min_distance = old_min_distance;
+    return result;
+}
@@ -0,0 +1,603 @@
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <SDL2/SDL.h>
+
+#include "include/main.h"
+#include "include/drawing.h"
+#include "include/view.h"
+#include "include/strokes.h"
+
+/* Make sure the point buffers can hold `count' elements. Returns false if they
+ * can't be allocated. */
+static bool reserve_points(StrokeCache* cache, int count) {
+    if (count <= cache->points_sz)
+        return true;
+
+    int new_sz = (cache->points_sz == 0) ? 256 : cache->points_sz;
+    while (new_sz < count)
+        new_sz *= 2;
+
+    SDL_Point* points   = realloc(cache->points, new_sz * sizeof(SDL_Point));
+    if (points)
+        cache->points = points;
+    SDL_FPoint* fpoints = realloc(cache->fpoints, new_sz * sizeof(SDL_FPoint));
+    if (fpoints)
+        cache->fpoints = fpoints;
+
+    if (!points || !fpoints)
+        return false;
+
+    cache->points_sz = new_sz;
+    return true;
+}
+
+/* Make sure the geometry buffers can hold `vertices' and `indices' more
+ * elements. Returns false if they can't be allocated. */
+static bool reserve_geometry(StrokeCache* cache, int vertices, int indices) {
+    vertices += cache->vertices_i;
+    indices += cache->indices_i;
+
+    if (vertices > cache->vertices_sz) {
+        int new_sz = (cache->vertices_sz == 0) ? 1024 : cache->vertices_sz;
+        while (new_sz < vertices)
+            new_sz *= 2;
+
+        SDL_Vertex* ptr = realloc(cache->vertices, new_sz * sizeof(SDL_Vertex));
+        if (!ptr)
+            return false;
+
+        cache->vertices    = ptr;
+        cache->vertices_sz = new_sz;
+    }
+
+    if (indices > cache->indices_sz) {
+        int new_sz = (cache->indices_sz == 0) ? 2048 : cache->indices_sz;
+        while (new_sz < indices)
+            new_sz *= 2;
+
+        int* ptr = realloc(cache->indices, new_sz * sizeof(int));
+        if (!ptr)
+            return false;
+
+        cache->indices    = ptr;
+        cache->indices_sz = new_sz;
+    }
+
+    return true;
+}
+
+/* Send the accumulated triangles of the thick lines in a single draw call */
+static void flush_geometry(StrokeCache* cache) {
+    if (cache->indices_i == 0)
+        return;
+
+    SDL_SetRenderDrawBlendMode(g_renderer, SDL_BLENDMODE_BLEND);
+    SDL_RenderGeometry(g_renderer, NULL, cache->vertices, cache->vertices_i,
+                       cache->indices, cache->indices_i);
+    g_draw_calls++;
+
+    cache->vertices_i = 0;
+    cache->indices_i  = 0;
+}
+
+/* Add a vertex to the geometry buffers, which must have enough space */
+static inline void push_vertex(StrokeCache* cache, float x, float y,
+                               Color col, uint8_t alpha) {
+    SDL_Vertex* vertex = &cache->vertices[cache->vertices_i++];
+
+    vertex->position.x  = x;
+    vertex->position.y  = y;
+    vertex->color.r     = col.r;
+    vertex->color.g     = col.g;
+    vertex->color.b     = col.b;
+    vertex->color.a     = alpha;
+    vertex->tex_coord.x = 0.0f;
+    vertex->tex_coord.y = 0.0f;
+}
+
+/* Get the unit normal of the segment from A to B */
+static inline SDL_FPoint segment_normal(SDL_FPoint a, SDL_FPoint b) {
+    const float dx  = b.x - a.x;
+    const float dy  = b.y - a.y;
+    const float len = sqrtf(dx * dx + dy * dy);
+
+    const SDL_FPoint normal = { -dy / len, dx / len };
+    return normal;
+}
+
+/* Add the triangles of a dot of the specified width to the geometry buffers,
+ * for lines with a single point. Like the lines, it has an opaque core and a
+ * 1 pixel band that fades out. */
+static void append_dot(StrokeCache* cache, SDL_FPoint center, float width,
+                       Color col) {
+    if (!reserve_geometry(cache, 1 + STROKES_DOT_SEGMENTS * 2,
+                          STROKES_DOT_SEGMENTS * 9))
+        return;
+
+    const float core  = (width - 1.0f) / 2.0f;
+    const float outer = core + 1.0f;
+
+    const int base = cache->vertices_i;
+    push_vertex(cache, center.x, center.y, col, col.a);
+
+    for (int i = 0; i < STROKES_DOT_SEGMENTS; i++) {
+        const float angle = 2.0f * (float)M_PI * i / STROKES_DOT_SEGMENTS;
+        const float dx    = cosf(angle);
+        const float dy    = sinf(angle);
+
+        push_vertex(cache, center.x + dx * core, center.y + dy * core, col,
+                    col.a);
+        push_vertex(cache, center.x + dx * outer, center.y + dy * outer, col,
+                    0);
+    }
+
+    for (int i = 0; i < STROKES_DOT_SEGMENTS; i++) {
+        const int a = base + 1 + i * 2;
+        const int c = base + 1 + (i + 1) % STROKES_DOT_SEGMENTS * 2;
+
+        /* Core, as a fan around the center */
+        cache->indices[cache->indices_i++] = base;
+        cache->indices[cache->indices_i++] = a;
+        cache->indices[cache->indices_i++] = c;
+
+        /* Band between the core and the outer edge */
+        cache->indices[cache->indices_i++] = a;
+        cache->indices[cache->indices_i++] = a + 1;
+        cache->indices[cache->indices_i++] = c;
+
+        cache->indices[cache->indices_i++] = a + 1;
+        cache->indices[cache->indices_i++] = c + 1;
+        cache->indices[cache->indices_i++] = c;
+    }
+}
+
+/*
+ * Add the triangles of a thick line to the geometry buffers. The points are in
+ * `cache->fpoints', in window coordinates, and there are no consecutive
+ * duplicates.
+ *
+ * Each point gets 4 vertices across the line: the outer left edge, the left
+ * and right edges of the opaque core, and the outer right edge. The outer
+ * vertices are transparent, so the 1 pixel band between them and the core
+ * fades out, smoothing the edges. Consecutive points are joined by 3 quads,
+ * forming a triangle strip along the line. A single point is drawn as a dot,
+ * like `composite_drawing' does.
+ */
+static void append_thick_line(StrokeCache* cache, int count, float width,
+                              Color col) {
+    if (count < 2) {
+        if (count == 1)
+            append_dot(cache, cache->fpoints[0], width, col);
+        return;
+    }
+
+    if (!reserve_geometry(cache, count * 4, (count - 1) * 18))
+        return;
+
+    SDL_FPoint* points = cache->fpoints;
+
+    /* Half of the width of the opaque core, and of the whole line */
+    const float core  = (width - 1.0f) / 2.0f;
+    const float outer = core + 1.0f;
+
+    /* Extend the ends of the line by half of its width. The direction of a
+     * segment is its normal rotated 90 degrees, i.e. (normal.y, -normal.x). */
+    const SDL_FPoint first_normal = segment_normal(points[0], points[1]);
+    points[0].x -= first_normal.y * core;
+    points[0].y += first_normal.x * core;
+
+    const SDL_FPoint last_normal =
+      segment_normal(points[count - 2], points[count - 1]);
+    points[count - 1].x += last_normal.y * core;
+    points[count - 1].y -= last_normal.x * core;
+
+    const int base = cache->vertices_i;
+    for (int i = 0; i < count; i++) {
+        /* At the corners, use the average of the normals of both segments,
+         * scaled so the edges stay parallel to the segments (miter joint). */
+        SDL_FPoint normal;
+        float scale = 1.0f;
+
+        if (i == 0) {
+            normal = first_normal;
+        } else if (i == count - 1) {
+            normal = last_normal;
+        } else {
+            const SDL_FPoint prev = segment_normal(points[i - 1], points[i]);
+            const SDL_FPoint next = segment_normal(points[i], points[i + 1]);
+
+            normal.x        = prev.x + next.x;
+            normal.y        = prev.y + next.y;
+            const float len = sqrtf(normal.x * normal.x + normal.y * normal.y);
+
+            if (len < 0.001f) {
+                /* The line goes back on itself */
+                normal = next;
+            } else {
+                normal.x /= len;
+                normal.y /= len;
+
+                const float cos_half = normal.x * next.x + normal.y * next.y;
+                scale                = 1.0f / cos_half;
+                if (scale > STROKES_MITER_LIMIT)
+                    scale = STROKES_MITER_LIMIT;
+            }
+        }
+
+        const float x      = points[i].x;
+        const float y      = points[i].y;
+        const float core_x = normal.x * core * scale;
+        const float core_y = normal.y * core * scale;
+        const float out_x  = normal.x * outer * scale;
+        const float out_y  = normal.y * outer * scale;
+
+        push_vertex(cache, x + out_x, y + out_y, col, 0);
+        push_vertex(cache, x + core_x, y + core_y, col, col.a);
+        push_vertex(cache, x - core_x, y - core_y, col, col.a);
+        push_vertex(cache, x - out_x, y - out_y, col, 0);
+    }
+
+    for (int i = 0; i < count - 1; i++) {
+        for (int k = 0; k < 3; k++) {
+            const int a = base + i * 4 + k;
+            const int c = a + 4;
+
+            cache->indices[cache->indices_i++] = a;
+            cache->indices[cache->indices_i++] = a + 1;
+            cache->indices[cache->indices_i++] = c;
+
+            cache->indices[cache->indices_i++] = a + 1;
+            cache->indices[cache->indices_i++] = c + 1;
+            cache->indices[cache->indices_i++] = c;
+        }
+    }
+}
+
+/* Render a line of the drawing. Thin lines are drawn immediately with a single
+ * draw call, and thick lines are accumulated until `flush_geometry' is
+ * called. */
+static void render_drawing_line(StrokeCache* cache, const Drawing* drawing,
+                                const DrawingLine* line, const View* view) {
+    const int count = line->count;
+    if (count < 1 || !reserve_points(cache, count))
+        return;
+
+    const Color col   = line->col;
+    const float width = line->width * view->zoom;
+
+    /* The points are stored relative to the origin of the line, in image
+     * coordinates. Convert them to window positions by hand, instead of
+     * calling `view_to_window' for each one. Use the center of each image
+     * pixel. */
+    double origin_x, origin_y;
+    view_to_window_f(view, line->origin_x + 0.5, line->origin_y + 0.5,
+                     &origin_x, &origin_y);
+    const int16_t* xs = &drawing->xs[line->start];
+    const int16_t* ys = &drawing->ys[line->start];
+
+    if (width < STROKES_THIN_WIDTH) {
+        for (int i = 0; i < count; i++) {
+            cache->points[i].x = (int)floor(origin_x + xs[i] * view->zoom);
+            cache->points[i].y = (int)floor(origin_y + ys[i] * view->zoom);
+        }
+
+        /* Keep the order of the lines */
+        flush_geometry(cache);
+
+        /* A single point is a click without moving the mouse */
+        SDL_SetRenderDrawColor(g_renderer, col.r, col.g, col.b, col.a);
+        if (count == 1)
+            SDL_RenderDrawPoints(g_renderer, cache->points, 1);
+        else
+            SDL_RenderDrawLines(g_renderer, cache->points, count);
+        g_draw_calls++;
+        return;
+    }
+
+    /* Same as above, but skipping points at the same window position, since
+     * they would not have a direction. */
+    int unique = 0;
+    for (int i = 0; i < count; i++) {
+        const float x = origin_x + xs[i] * view->zoom;
+        const float y = origin_y + ys[i] * view->zoom;
+
+        if (unique > 0 && cache->fpoints[unique - 1].x == x &&
+            cache->fpoints[unique - 1].y == y)
+            continue;
+
+        cache->fpoints[unique].x = x;
+        cache->fpoints[unique].y = y;
+        unique++;
+    }
+
+    append_thick_line(cache, unique, width, col);
+}
+
+/* Render the finished lines of a drawing in the range [first_line, end_line).
+ * Erased lines are skipped. */
+static void render_finished_lines(StrokeCache* cache, const Drawing* drawing,
+                                  const View* view, int first_line,
+                                  int end_line) {
+    for (int i = first_line; i < end_line; i++)
+        if (!drawing->lines[i].erased)
+            render_drawing_line(cache, drawing, &drawing->lines[i], view);
+
+    flush_geometry(cache);
+}
+
+/* Render the line that is currently being drawn, if any */
+static void render_current_line(StrokeCache* cache, Drawing* drawing,
+                                const View* view) {
+    if (!drawing_in_progress(drawing))
+        return;
+
+    render_drawing_line(cache, drawing, &drawing->lines[drawing->line_count],
+                        view);
+    flush_geometry(cache);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Checkpoints */
+
+/* Find the checkpoint with the specified state of the Drawing, or NULL */
+static StrokeCheckpoint* find_checkpoint(StrokeCache* cache, uint32_t state) {
+    for (int i = 0; i < STROKES_CHECKPOINTS; i++)
+        if (cache->checkpoints[i].valid && cache->checkpoints[i].state == state)
+            return &cache->checkpoints[i];
+
+    return NULL;
+}
+
+/* Forget all the checkpoints. If DESTROY is true, their textures are also
+ * freed, e.g. because the size of the window changed. */
+static void drop_checkpoints(StrokeCache* cache, bool destroy) {
+    for (int i = 0; i < STROKES_CHECKPOINTS; i++) {
+        StrokeCheckpoint* checkpoint = &cache->checkpoints[i];
+        checkpoint->valid            = false;
+
+        if (destroy && checkpoint->texture != NULL) {
+            SDL_DestroyTexture(checkpoint->texture);
+            checkpoint->texture = NULL;
+        }
+    }
+}
+
+/* Copy one texture into another, replacing its contents. The source texture
+ * keeps its blend mode. */
+static void copy_texture(SDL_Texture* src, SDL_Texture* dst) {
+    SDL_BlendMode mode;
+    SDL_GetTextureBlendMode(src, &mode);
+    SDL_SetTextureBlendMode(src, SDL_BLENDMODE_NONE);
+
+    SDL_SetRenderTarget(g_renderer, dst);
+    SDL_RenderCopy(g_renderer, src, NULL, NULL);
+    g_draw_calls++;
+
+    SDL_SetTextureBlendMode(src, mode);
+}
+
+/* Save the texture of the cache, with the lines of the specified state of the
+ * Drawing, in the least recently used checkpoint. The render target is the
+ * texture of the cache afterwards. */
+static void save_checkpoint(StrokeCache* cache, uint32_t state) {
+    StrokeCheckpoint* checkpoint = &cache->checkpoints[0];
+    for (int i = 0; i < STROKES_CHECKPOINTS; i++) {
+        StrokeCheckpoint* cur = &cache->checkpoints[i];
+        if (!cur->valid) {
+            checkpoint = cur;
+            break;
+        }
+
+        if (cur->last_used < checkpoint->last_used)
+            checkpoint = cur;
+    }
+
+    if (checkpoint->texture == NULL) {
+        checkpoint->texture =
+          SDL_CreateTexture(g_renderer, SDL_PIXELFORMAT_RGBA32,
+                            SDL_TEXTUREACCESS_TARGET, cache->w, cache->h);
+        if (checkpoint->texture == NULL)
+            return;
+    }
+
+    copy_texture(cache->texture, checkpoint->texture);
+    SDL_SetRenderTarget(g_renderer, cache->texture);
+
+    checkpoint->state     = state;
+    checkpoint->valid     = true;
+    checkpoint->last_used = ++cache->tick;
+
+    cache->since_checkpoint = 0;
+}
+
+/* Replace the texture of the cache with a checkpoint. The render target is the
+ * texture of the cache afterwards. */
+static void restore_checkpoint(StrokeCache* cache,
+                               StrokeCheckpoint* checkpoint) {
+    copy_texture(checkpoint->texture, cache->texture);
+
+    checkpoint->last_used   = ++cache->tick;
+    cache->since_checkpoint = 0;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Make sure the texture exists and has the size of the window. Returns false
+ * if it can't be used. */
+static bool strokes_update_texture(StrokeCache* cache) {
+    int win_w, win_h;
+    SDL_GetWindowSize(g_window, &win_w, &win_h);
+
+    if (cache->texture != NULL && cache->w == win_w && cache->h == win_h)
+        return true;
+
+    if (cache->texture != NULL)
+        SDL_DestroyTexture(cache->texture);
+
+    cache->texture = SDL_CreateTexture(g_renderer, SDL_PIXELFORMAT_RGBA32,
+                                       SDL_TEXTUREACCESS_TARGET, win_w, win_h);
+    if (cache->texture == NULL)
+        return false;
+
+    SDL_SetTextureBlendMode(cache->texture, SDL_BLENDMODE_BLEND);
+
+    /* The checkpoints must have the same size */
+    drop_checkpoints(cache, true);
+
+    cache->w     = win_w;
+    cache->h     = win_h;
+    cache->valid = false;
+    return true;
+}
+
+/* Update the texture, which must be the current render target, with the
+ * finished lines of the current state of the Drawing. */
+static void strokes_bake(StrokeCache* cache, Drawing* drawing,
+                         const View* view) {
+    /*
+     * Find the most recent state of the history that is already in the
+     * texture, or in a checkpoint. Only go back through added lines, since
+     * they can be drawn on top; erasing or clearing needs to start from
+     * scratch. The state at position I is the one after applying the first I
+     * operations.
+     */
+    int first_op                 = -1;
+    uint32_t first_state         = 0;
+    StrokeCheckpoint* checkpoint = NULL;
+    for (int i = drawing->ops_count; i >= 0; i--) {
+        const uint32_t state =
+          (i > 0) ? drawing->ops[i - 1].serial : drawing->base_serial;
+
+        if (cache->valid && cache->state == state) {
+            first_op    = i;
+            first_state = state;
+            break;
+        }
+
+        checkpoint = find_checkpoint(cache, state);
+        if (checkpoint != NULL) {
+            first_op    = i;
+            first_state = state;
+            break;
+        }
+
+        if (i == 0 || drawing->ops[i - 1].type != DRAWING_OP_ADD)
+            break;
+    }
+
+    if (first_op < 0) {
+        /* Nothing to start from. Draw the lines before the last run of added
+         * lines, so the run can be drawn below with checkpoints. */
+        first_op = drawing->ops_count;
+        while (first_op > 0 &&
+               drawing->ops[first_op - 1].type == DRAWING_OP_ADD)
+            first_op--;
+        first_state = (first_op > 0) ? drawing->ops[first_op - 1].serial
+                                     : drawing->base_serial;
+
+        const int run_start =
+          drawing->line_count - (drawing->ops_count - first_op);
+
+        /* Start again from a transparent texture */
+        SDL_SetRenderDrawColor(g_renderer, 0, 0, 0, 0);
+        SDL_RenderClear(g_renderer);
+
+        render_finished_lines(cache, drawing, view, drawing->first_visible,
+                              run_start);
+        cache->since_checkpoint = run_start - drawing->first_visible;
+    } else if (checkpoint != NULL) {
+        restore_checkpoint(cache, checkpoint);
+    }
+
+    /* Keep the state after an erase or a clear before drawing on top of it,
+     * so undoing the next lines doesn't need to draw everything. */
+    const bool after_erase =
+      first_op == 0 || drawing->ops[first_op - 1].type != DRAWING_OP_ADD;
+    if (after_erase && first_op < drawing->ops_count &&
+        find_checkpoint(cache, first_state) == NULL)
+        save_checkpoint(cache, first_state);
+
+    /* Draw the added lines, making a checkpoint every few of them */
+    for (int i = first_op; i < drawing->ops_count; i++) {
+        const DrawingLine* line = &drawing->lines[drawing->ops[i].line];
+        if (!line->erased)
+            render_drawing_line(cache, drawing, line, view);
+
+        if (++cache->since_checkpoint >= STROKES_CHECKPOINT_INTERVAL) {
+            flush_geometry(cache);
+            save_checkpoint(cache, drawing->ops[i].serial);
+        }
+    }
+    flush_geometry(cache);
+
+    cache->view  = *view;
+    cache->state = drawing_state(drawing);
+    cache->valid = true;
+}
+
+/*----------------------------------------------------------------------------*/
+
+StrokeCache* strokes_new(void) {
+    StrokeCache* cache = calloc(1, sizeof(StrokeCache));
+    if (!cache)
+        return NULL;
+
+    cache->texture = NULL;
+    cache->state   = 0;
+    cache->valid   = false;
+
+    return cache;
+}
+
+void strokes_free(StrokeCache* cache) {
+    if (cache->texture != NULL)
+        SDL_DestroyTexture(cache->texture);
+
+    drop_checkpoints(cache, true);
+
+    free(cache->points);
+    free(cache->fpoints);
+    free(cache->vertices);
+    free(cache->indices);
+
+    free(cache);
+}
+
+void strokes_invalidate(StrokeCache* cache) {
+    cache->valid = false;
+    drop_checkpoints(cache, false);
+}
+
+void strokes_render(StrokeCache* cache, Drawing* drawing, const View* view) {
+    /* If we can't use a render target, draw everything directly */
+    if (!SDL_RenderTargetSupported(g_renderer) ||
+        !strokes_update_texture(cache)) {
+        render_finished_lines(cache, drawing, view, drawing->first_visible,
+                              drawing->line_count);
+        render_current_line(cache, drawing, view);
+        return;
+    }
+
+    /* The positions of the lines in the window changed */
+    if (cache->view.x != view->x || cache->view.y != view->y ||
+        cache->view.zoom != view->zoom) {
+        cache->valid = false;
+        drop_checkpoints(cache, false);
+    }
+
+    if (!cache->valid || cache->state != drawing_state(drawing)) {
+        SDL_SetRenderTarget(g_renderer, cache->texture);
+        strokes_bake(cache, drawing, view);
+        SDL_SetRenderTarget(g_renderer, NULL);
+    }
+
+    SDL_RenderCopy(g_renderer, cache->texture, NULL, NULL);
+    g_draw_calls++;
+
+    /* The line that is being drawn changes on each frame, so it's not worth
+     * storing it in the texture. */
+    render_current_line(cache, drawing, view);
+}
@@ -0,0 +1,300 @@
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+
+#include "include/main.h"
+#include "include/util.h"
+#include "include/image.h"
+#include "include/convert.h"
+#include "include/tiles.h"
+
+/* Get the rectangle of the image covered by the tile at (COL,ROW) */
+static SDL_Rect tile_rect(TiledImage* tiled, int col, int row) {
+    const int x = col * tiled->tile_size;
+    const int y = row * tiled->tile_size;
+
+    SDL_Rect rect = {
+        x,
+        y,
+        tiled->image->w - x,
+        tiled->image->h - y,
+    };
+
+    if (rect.w > tiled->tile_size)
+        rect.w = tiled->tile_size;
+    if (rect.h > tiled->tile_size)
+        rect.h = tiled->tile_size;
+
+    return rect;
+}
+
+/* Create the texture of a tile if needed, and update it if it's dirty. Returns
+ * false if the tile can't be drawn. */
+static bool tile_upload(TiledImage* tiled, int col, int row) {
+    Tile* tile         = &tiled->tiles[row * tiled->cols + col];
+    const Image* image = tiled->image;
+
+    if (tile->texture != NULL && !tile->dirty)
+        return true;
+
+    /* The pixels have been freed, we can't upload anything */
+    if (image->data == NULL)
+        return tile->texture != NULL;
+
+    /* Rows that are still being decoded can't be read. If there are none
+     * yet, the tile is not drawn. */
+    const SDL_Rect rect = tile_rect(tiled, col, row);
+    const int ready_h   = tiled->ready_rows - rect.y;
+    if (ready_h <= 0)
+        return tile->texture != NULL;
+
+    if (tile->texture == NULL) {
+        tile->texture =
+          SDL_CreateTexture(g_renderer, tiled->format,
+                            SDL_TEXTUREACCESS_STREAMING, rect.w, rect.h);
+        if (tile->texture == NULL)
+            return false;
+
+        SDL_SetTextureBlendMode(tile->texture, SDL_BLENDMODE_BLEND);
+        if (tiled->linear)
+            SDL_SetTextureScaleMode(tile->texture, SDL_ScaleModeLinear);
+        tiled->resident++;
+    }
+
+    /* Since the rows of the image are contiguous, we can upload the tile
+     * directly by using the pitch of the whole image. */
+    const uint8_t* data = (const uint8_t*)image->data;
+    const size_t offset =
+      (size_t)rect.y * image->byte_pitch + (size_t)rect.x * 4;
+
+    if (tiled->format == SDL_PIXELFORMAT_RGBA32 && ready_h >= rect.h) {
+        SDL_UpdateTexture(tile->texture, NULL, &data[offset],
+                          image->byte_pitch);
+    } else {
+        /* Swap the channels while writing into the texture, instead of
+         * letting SDL convert the pixels into a temporary buffer first. The
+         * rows that can't be read yet are transparent. */
+        void* pixels;
+        int pitch;
+        if (SDL_LockTexture(tile->texture, NULL, &pixels, &pitch) != 0)
+            return false;
+
+        for (int y = 0; y < rect.h; y++) {
+            const uint8_t* src = &data[offset + (size_t)y * image->byte_pitch];
+            uint8_t* dst       = (uint8_t*)pixels + (size_t)y * pitch;
+
+            if (y >= ready_h)
+                memset(dst, 0, (size_t)rect.w * 4);
+            else if (tiled->format == SDL_PIXELFORMAT_RGBA32)
+                memcpy(dst, src, (size_t)rect.w * 4);
+            else
+                convert_swap_rb(src, dst, rect.w);
+        }
+
+        SDL_UnlockTexture(tile->texture);
+    }
+
+    tile->dirty = false;
+    return true;
+}
+
+/* Choose the format of the textures, from the ones supported natively by the
+ * renderer. The pixels of the Image are RGBA, so that's preferred, followed by
+ * BGRA, which `convert_swap_rb' can convert into. Otherwise, SDL converts the
+ * pixels. */
+static uint32_t choose_format(const SDL_RendererInfo* info) {
+    bool has_bgra = false;
+
+    for (uint32_t i = 0; i < info->num_texture_formats; i++) {
+        if (info->texture_formats[i] == SDL_PIXELFORMAT_RGBA32)
+            return SDL_PIXELFORMAT_RGBA32;
+        if (info->texture_formats[i] == SDL_PIXELFORMAT_BGRA32)
+            has_bgra = true;
+    }
+
+    return has_bgra ? SDL_PIXELFORMAT_BGRA32 : SDL_PIXELFORMAT_RGBA32;
+}
+
+/* Free the textures of the least recently used tiles, until there are at most
+ * `max_resident'. Tiles drawn in the current frame are never freed. */
+static void tiles_evict(TiledImage* tiled, int max_resident) {
+    /* If the pixels were freed, we wouldn't be able to upload them again */
+    if (tiled->image->data == NULL)
+        return;
+
+    while (tiled->resident > max_resident) {
+        Tile* oldest = NULL;
+        for (int i = 0; i < tiled->cols * tiled->rows; i++) {
+            Tile* tile = &tiled->tiles[i];
+            if (tile->texture == NULL || tile->last_used == tiled->frame)
+                continue;
+
+            if (oldest == NULL || tile->last_used < oldest->last_used)
+                oldest = tile;
+        }
+
+        if (oldest == NULL)
+            break;
+
+        SDL_DestroyTexture(oldest->texture);
+        oldest->texture = NULL;
+        tiled->resident--;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+
+TiledImage* tiles_new(Image* image) {
+    TiledImage* tiled = malloc(sizeof(TiledImage));
+    if (!tiled)
+        return NULL;
+
+    /* Don't use tiles bigger than what the renderer supports. A maximum of
+     * zero means that there is no limit. */
+    tiled->tile_size = TILE_SIZE;
+    tiled->format    = SDL_PIXELFORMAT_RGBA32;
+
+    SDL_RendererInfo info;
+    if (SDL_GetRendererInfo(g_renderer, &info) == 0) {
+        tiled->format = choose_format(&info);
+
+        if (info.max_texture_width > 0 &&
+            info.max_texture_width < tiled->tile_size)
+            tiled->tile_size = info.max_texture_width;
+        if (info.max_texture_height > 0 &&
+            info.max_texture_height < tiled->tile_size)
+            tiled->tile_size = info.max_texture_height;
+    }
+
+    tiled->image = image;
+    tiled->cols  = (image->w + tiled->tile_size - 1) / tiled->tile_size;
+    tiled->rows  = (image->h + tiled->tile_size - 1) / tiled->tile_size;
+    tiled->tiles = calloc(tiled->cols * tiled->rows, sizeof(Tile));
+    if (!tiled->tiles) {
+        free(tiled);
+        return NULL;
+    }
+
+    tiled->ready_rows = image->h;
+    tiled->linear     = false;
+    tiled->resident   = 0;
+    tiled->frame      = 0;
+
+    return tiled;
+}
+
+void tiles_free(TiledImage* tiled) {
+    for (int i = 0; i < tiled->cols * tiled->rows; i++)
+        if (tiled->tiles[i].texture != NULL)
+            SDL_DestroyTexture(tiled->tiles[i].texture);
+
+    free(tiled->tiles);
+    free(tiled);
+}
+
+bool tiles_set_ready_rows(TiledImage* tiled, int rows) {
+    if (rows == tiled->ready_rows)
+        return false;
+
+    const int start_row = (rows < tiled->ready_rows) ? rows : tiled->ready_rows;
+    const int end_row   = (rows < tiled->ready_rows) ? tiled->ready_rows : rows;
+    tiled->ready_rows   = rows;
+
+    const int first = start_row / tiled->tile_size;
+    const int last  = (end_row - 1) / tiled->tile_size;
+
+    for (int row = first; row <= last && row < tiled->rows; row++)
+        for (int col = 0; col < tiled->cols; col++)
+            tiled->tiles[row * tiled->cols + col].dirty = true;
+
+    return true;
+}
+
+bool tiles_upload_all(TiledImage* tiled) {
+    for (int row = 0; row < tiled->rows; row++)
+        for (int col = 0; col < tiled->cols; col++)
+            if (!tile_upload(tiled, col, row))
+                return false;
+
+    return true;
+}
+
+void tiles_render(TiledImage* tiled, const SDL_Rect* dst) {
+    const Image* image = tiled->image;
+
+    int win_w, win_h;
+    SDL_GetWindowSize(g_window, &win_w, &win_h);
+
+    tiled->frame++;
+
+    if (dst->w <= 0 || dst->h <= 0)
+        return;
+
+    /* Range of tiles that might be inside of the window, so we don't have to
+     * check all of them. */
+    const int64_t img_x0 = (int64_t)(0 - dst->x) * image->w / dst->w;
+    const int64_t img_y0 = (int64_t)(0 - dst->y) * image->h / dst->h;
+    const int64_t img_x1 = (int64_t)(win_w - dst->x) * image->w / dst->w;
+    const int64_t img_y1 = (int64_t)(win_h - dst->y) * image->h / dst->h;
+
+    const int first_col = (img_x0 < 0) ? 0 : img_x0 / tiled->tile_size;
+    const int first_row = (img_y0 < 0) ? 0 : img_y0 / tiled->tile_size;
+    const int last_col  = (img_x1 < 0) ? -1 : img_x1 / tiled->tile_size;
+    const int last_row  = (img_y1 < 0) ? -1 : img_y1 / tiled->tile_size;
+
+    int visible = 0;
+    for (int row = first_row; row <= last_row && row < tiled->rows; row++) {
+        for (int col = first_col; col <= last_col && col < tiled->cols; col++) {
+            const SDL_Rect src = tile_rect(tiled, col, row);
+
+            /*
+             * Map the edges of the tile from image coordinates to window
+             * coordinates. Calculating each edge separately, instead of the
+             * width and height, makes sure adjacent tiles don't leave gaps
+             * when the image is scaled.
+             */
+            const int x0 = dst->x + (int64_t)src.x * dst->w / image->w;
+            const int y0 = dst->y + (int64_t)src.y * dst->h / image->h;
+            const int x1 =
+              dst->x + (int64_t)(src.x + src.w) * dst->w / image->w;
+            const int y1 =
+              dst->y + (int64_t)(src.y + src.h) * dst->h / image->h;
+
+            /* Outside of the window, don't upload or draw it */
+            if (x1 <= 0 || y1 <= 0 || x0 >= win_w || y0 >= win_h)
+                continue;
+
+            if (!tile_upload(tiled, col, row))
+                continue;
+
+            Tile* tile      = &tiled->tiles[row * tiled->cols + col];
+            tile->last_used = tiled->frame;
+            visible++;
+
+            const SDL_Rect tile_dst = { x0, y0, x1 - x0, y1 - y0 };
+            SDL_RenderCopy(g_renderer, tile->texture, NULL, &tile_dst);
+            g_draw_calls++;
+        }
+    }
+
+    tiles_evict(tiled, visible * TILES_RESIDENT_FACTOR);
+}
+
+size_t tiles_resident_bytes(TiledImage* tiled) {
+    size_t bytes = 0;
+
+    for (int row = 0; row < tiled->rows; row++) {
+        for (int col = 0; col < tiled->cols; col++) {
+            if (tiled->tiles[row * tiled->cols + col].texture == NULL)
+                continue;
+
+            const SDL_Rect rect = tile_rect(tiled, col, row);
+            bytes += (size_t)rect.w * rect.h * 4;
+        }
+    }
+
+    return bytes;
+}
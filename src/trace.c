@@ -0,0 +1,181 @@
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "include/profile.h"
+#include "include/trace.h"
+
+bool g_trace_enabled = false;
+
+/* File where the trace is written, and time when it was opened */
+static const char* g_trace_path = NULL;
+static uint64_t g_trace_origin  = 0;
+
+/* Events recorded so far, protected by `g_trace_lock' */
+static pthread_mutex_t g_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static TraceEvent* g_events         = NULL;
+static int g_events_sz              = 0;
+static int g_events_i               = 0;
+
+/* Identifier of each thread in the trace, assigned when it records its first
+ * event. */
+static int g_next_thread              = 1;
+static __thread int g_current_thread = 0;
+
+/*----------------------------------------------------------------------------*/
+
+static int current_thread(void) {
+    if (g_current_thread == 0)
+        g_current_thread =
+          __atomic_fetch_add(&g_next_thread, 1, __ATOMIC_RELAXED);
+
+    return g_current_thread;
+}
+
+/* Add an event to the list. If there is not enough memory, or if the trace
+ * was finished in the meantime, it's dropped. */
+static void add_event(TraceEvent event) {
+    event.thread = current_thread();
+
+    pthread_mutex_lock(&g_trace_lock);
+
+    if (!trace_enabled()) {
+        pthread_mutex_unlock(&g_trace_lock);
+        return;
+    }
+
+    if (g_events_i >= g_events_sz) {
+        const int new_sz =
+          (g_events_sz == 0) ? TRACE_EVENTS_SIZE : g_events_sz * 2;
+        TraceEvent* new_events =
+          realloc(g_events, new_sz * sizeof(TraceEvent));
+        if (new_events == NULL) {
+            pthread_mutex_unlock(&g_trace_lock);
+            return;
+        }
+
+        g_events    = new_events;
+        g_events_sz = new_sz;
+    }
+
+    g_events[g_events_i++] = event;
+
+    pthread_mutex_unlock(&g_trace_lock);
+}
+
+uint64_t trace_now(void) {
+    return profile_now() - g_trace_origin;
+}
+
+void trace_open(const char* filename) {
+    g_trace_path    = filename;
+    g_trace_origin = profile_now();
+    __atomic_store_n(&g_trace_enabled, true, __ATOMIC_RELAXED);
+
+    trace_thread_name("main");
+}
+
+/* Free the recorded events. Must be called with `g_trace_lock' held. */
+static void free_events(void) {
+    free(g_events);
+    g_events    = NULL;
+    g_events_sz = 0;
+    g_events_i  = 0;
+}
+
+bool trace_finish(void) {
+    if (!__atomic_exchange_n(&g_trace_enabled, false, __ATOMIC_RELAXED))
+        return true;
+
+    /* Other threads might still be adding events, until they see that the
+     * trace is not enabled anymore */
+    pthread_mutex_lock(&g_trace_lock);
+
+    FILE* fp = fopen(g_trace_path, "w");
+    if (fp == NULL) {
+        free_events();
+        pthread_mutex_unlock(&g_trace_lock);
+        return false;
+    }
+
+    /* The times of the format are in microseconds */
+    const int pid = getpid();
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (int i = 0; i < g_events_i; i++) {
+        const TraceEvent* event = &g_events[i];
+        const char* separator   = (i + 1 < g_events_i) ? "," : "";
+
+        switch (event->type) {
+            case TRACE_SPAN:
+                fprintf(fp,
+                        "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+                        "\"dur\":%.3f,\"pid\":%d,\"tid\":%d}%s\n",
+                        event->name, event->start / 1e3,
+                        event->duration / 1e3, pid, event->thread,
+                        separator);
+                break;
+
+            case TRACE_INSTANT:
+                fprintf(fp,
+                        "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"p\","
+                        "\"ts\":%.3f,\"pid\":%d,\"tid\":%d}%s\n",
+                        event->name, event->start / 1e3, pid, event->thread,
+                        separator);
+                break;
+
+            case TRACE_THREAD_NAME:
+                fprintf(fp,
+                        "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                        "\"tid\":%d,\"args\":{\"name\":\"%s\"}}%s\n",
+                        pid, event->thread, event->name, separator);
+                break;
+        }
+    }
+    fprintf(fp, "]}\n");
+
+    free_events();
+
+    pthread_mutex_unlock(&g_trace_lock);
+
+    return fclose(fp) == 0;
+}
+
+void trace_end(const char* name, uint64_t start) {
+    if (!trace_enabled())
+        return;
+
+    const TraceEvent event = {
+        .type     = TRACE_SPAN,
+        .name     = name,
+        .start    = start,
+        .duration = trace_now() - start,
+    };
+    add_event(event);
+}
+
+void trace_instant(const char* name) {
+    if (!trace_enabled())
+        return;
+
+    const TraceEvent event = {
+        .type  = TRACE_INSTANT,
+        .name  = name,
+        .start = trace_now(),
+    };
+    add_event(event);
+}
+
+void trace_thread_name(const char* name) {
+    if (!trace_enabled())
+        return;
+
+    const TraceEvent event = {
+        .type = TRACE_THREAD_NAME,
+        .name = name,
+    };
+    add_event(event);
+}
@@ -1,6 +1,11 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
 
 #include "include/main.h"
 #include "include/util.h"
@@ -20,3 +25,76 @@ void die_func(const char* func, const char* fmt, ...) {
     SDL_Quit();
     exit(1);
 }
+
+double util_cpu_time(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0.0;
+
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+long util_peak_rss(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return -1;
+
+    /* On Linux, `ru_maxrss' is already in KiB */
+    return usage.ru_maxrss;
+}
+
+long util_current_rss(void) {
+    FILE* fp = fopen("/proc/self/statm", "r");
+    if (!fp)
+        return -1;
+
+    /* The second field is the number of resident pages */
+    long total_pages, resident_pages;
+    if (fscanf(fp, "%ld %ld", &total_pages, &resident_pages) != 2)
+        resident_pages = -1;
+    fclose(fp);
+
+    if (resident_pages < 0)
+        return -1;
+
+    return resident_pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+double util_wall_time(void) {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+        return 0.0;
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+char* util_derived_path(const char* input, const char* dir,
+                        const char* suffix) {
+    /* Only keep the file name if the path goes in another directory */
+    if (dir != NULL) {
+        const char* slash = strrchr(input, '/');
+        if (slash != NULL)
+            input = slash + 1;
+    }
+
+    size_t stem_len = strlen(input);
+    if (stem_len >= 4 && strcasecmp(&input[stem_len - 4], ".png") == 0)
+        stem_len -= 4;
+
+    const size_t dir_len    = (dir != NULL) ? strlen(dir) + 1 : 0;
+    const size_t suffix_len = strlen(suffix);
+
+    char* path = malloc(dir_len + stem_len + suffix_len + 1);
+    if (!path)
+        return NULL;
+
+    if (dir != NULL) {
+        memcpy(path, dir, dir_len - 1);
+        path[dir_len - 1] = '/';
+    }
+
+    memcpy(&path[dir_len], input, stem_len);
+    memcpy(&path[dir_len + stem_len], suffix, suffix_len + 1);
+    return path;
+}
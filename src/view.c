@@ -0,0 +1,84 @@
+
+#include <math.h>
+#include <SDL2/SDL.h>
+
+#include "include/main.h"
+#include "include/image.h"
+#include "include/view.h"
+
+void view_fit(View* view, const Image* image) {
+    int win_w, win_h;
+    SDL_GetWindowSize(g_window, &win_w, &win_h);
+
+    view->x    = image->w / 2.0;
+    view->y    = image->h / 2.0;
+    view->zoom = 1.0;
+
+    const double zoom_w = (double)win_w / image->w;
+    const double zoom_h = (double)win_h / image->h;
+    if (zoom_w < view->zoom)
+        view->zoom = zoom_w;
+    if (zoom_h < view->zoom)
+        view->zoom = zoom_h;
+
+    if (view->zoom < VIEW_ZOOM_MIN)
+        view->zoom = VIEW_ZOOM_MIN;
+}
+
+void view_to_image(const View* view, int win_x, int win_y, double* img_x,
+                   double* img_y) {
+    int win_w, win_h;
+    SDL_GetWindowSize(g_window, &win_w, &win_h);
+
+    *img_x = view->x + (win_x - win_w / 2.0) / view->zoom;
+    *img_y = view->y + (win_y - win_h / 2.0) / view->zoom;
+}
+
+void view_to_window(const View* view, double img_x, double img_y, int* win_x,
+                    int* win_y) {
+    double x, y;
+    view_to_window_f(view, img_x, img_y, &x, &y);
+
+    *win_x = (int)floor(x);
+    *win_y = (int)floor(y);
+}
+
+void view_to_window_f(const View* view, double img_x, double img_y,
+                      double* win_x, double* win_y) {
+    int win_w, win_h;
+    SDL_GetWindowSize(g_window, &win_w, &win_h);
+
+    *win_x = win_w / 2.0 + (img_x - view->x) * view->zoom;
+    *win_y = win_h / 2.0 + (img_y - view->y) * view->zoom;
+}
+
+SDL_Rect view_image_rect(const View* view, const Image* image) {
+    int x0, y0, x1, y1;
+    view_to_window(view, 0, 0, &x0, &y0);
+    view_to_window(view, image->w, image->h, &x1, &y1);
+
+    const SDL_Rect rect = { x0, y0, x1 - x0, y1 - y0 };
+    return rect;
+}
+
+void view_zoom_at(View* view, double factor, int win_x, int win_y) {
+    double img_x, img_y;
+    view_to_image(view, win_x, win_y, &img_x, &img_y);
+
+    view->zoom *= factor;
+    if (view->zoom < VIEW_ZOOM_MIN)
+        view->zoom = VIEW_ZOOM_MIN;
+    if (view->zoom > VIEW_ZOOM_MAX)
+        view->zoom = VIEW_ZOOM_MAX;
+
+    /* Move the view so (img_x, img_y) is at (win_x, win_y) again */
+    int win_w, win_h;
+    SDL_GetWindowSize(g_window, &win_w, &win_h);
+    view->x = img_x - (win_x - win_w / 2.0) / view->zoom;
+    view->y = img_y - (win_y - win_h / 2.0) / view->zoom;
+}
+
+void view_pan(View* view, int win_dx, int win_dy) {
+    view->x -= win_dx / view->zoom;
+    view->y -= win_dy / view->zoom;
+}